@@ -0,0 +1,390 @@
+/**
+  * Arduino core, WiFi, IotWebConf and LittleFS for the host build of mqttTamBox
+  */
+#include <sys/stat.h>
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <IotWebConf.h>
+#include <LittleFS.h>
+#include <tamBoxHal.h>
+
+HardwareSerial Serial;
+EspClass ESP;
+ESP8266WiFiClass WiFi;
+FS LittleFS;
+WebServer* hostWebServer;
+
+static uint32_t randomState;                                  // xorshift32, seeded from the thing name
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Core functions
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+#if defined(__GLIBC__) && (__GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38))
+size_t strlcpy(char* dst, const char* src, size_t size) {
+
+  size_t len = strlen(src);
+  if (size) {
+    size_t n = len < size - 1 ? len : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+  }
+  return len;
+}
+#endif
+
+
+unsigned long millis() { return halMillis(); }
+unsigned long micros() { return halMicros(); }
+void delay(unsigned long ms) { halDelay(ms); }
+void yield() {}
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t val) {}
+void tone(uint8_t pin, unsigned int frequency, unsigned long duration) {}
+void noTone(uint8_t pin) {}
+
+
+void randomSeed(unsigned long seed) {
+
+  randomState = seed ? seed : 1;
+}
+
+
+long random(long howbig) {
+
+  if (randomState == 0) {                                     // Like the ESP8266 hardware RNG, every box gets its own sequence
+    uint32_t hash = 2166136261u;
+    for (const char* p = halOps->thingName; *p; p++) { hash = (hash ^ (uint8_t)*p) * 16777619u; }
+    randomSeed(hash);
+  }
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return howbig > 0 ? randomState % howbig : 0;
+}
+
+
+long random(long howsmall, long howbig) {
+
+  return howsmall >= howbig ? howsmall : howsmall + random(howbig - howsmall);
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  String
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+String::String(long value, unsigned char base) {
+
+  char buf[34];
+  if (base == 10) { snprintf(buf, sizeof(buf), "%ld", value); }
+  else { snprintf(buf, sizeof(buf), base == 16 ? "%lx" : "%lo", value); }
+  s = buf;
+}
+
+
+String::String(unsigned long value, unsigned char base) {
+
+  char buf[34];
+  snprintf(buf, sizeof(buf), base == 16 ? "%lx" : base == 8 ? "%lo" : "%lu", value);
+  s = buf;
+}
+
+
+String::String(double value, unsigned char decimalPlaces) {
+
+  char buf[34];
+  snprintf(buf, sizeof(buf), "%.*f", decimalPlaces, value);
+  s = buf;
+}
+
+
+bool String::endsWith(const String& suffix) const {
+
+  return s.size() >= suffix.s.size() && s.compare(s.size() - suffix.s.size(), suffix.s.size(), suffix.s) == 0;
+}
+
+
+int String::indexOf(char c, unsigned int from) const {
+
+  size_t i = s.find(c, from);
+  return i == std::string::npos ? -1 : (int)i;
+}
+
+
+int String::indexOf(const String& str, unsigned int from) const {
+
+  size_t i = s.find(str.s, from);
+  return i == std::string::npos ? -1 : (int)i;
+}
+
+
+int String::lastIndexOf(char c) const {
+
+  size_t i = s.rfind(c);
+  return i == std::string::npos ? -1 : (int)i;
+}
+
+
+String String::substring(unsigned int from, unsigned int to) const {
+
+  if (from > to) { unsigned int t = from; from = to; to = t; }
+  if (from >= s.size()) { return String(); }
+  if (to > s.size()) { to = s.size(); }
+  return String(s.substr(from, to - from).c_str());
+}
+
+
+void String::toCharArray(char* buf, unsigned int bufsize, unsigned int index) const {
+
+  if (bufsize == 0) { return; }
+  unsigned int n = index < s.size() ? s.size() - index : 0;
+  if (n > bufsize - 1) { n = bufsize - 1; }
+  memcpy(buf, s.data() + (index < s.size() ? index : 0), n);
+  buf[n] = '\0';
+}
+
+
+void String::replace(const String& find, const String& with) {
+
+  if (find.s.empty()) { return; }
+  for (size_t i = s.find(find.s); i != std::string::npos; i = s.find(find.s, i + with.s.size())) {
+    s.replace(i, find.s.size(), with.s);
+  }
+}
+
+
+void String::trim() {
+
+  size_t b = s.find_first_not_of(" \t\r\n");
+  size_t e = s.find_last_not_of(" \t\r\n");
+  s = b == std::string::npos ? std::string() : s.substr(b, e - b + 1);
+}
+
+
+String operator+(const String& lhs, const String& rhs) { String r(lhs); r += rhs; return r; }
+String operator+(const String& lhs, const char* rhs) { String r(lhs); r += rhs; return r; }
+String operator+(const char* lhs, const String& rhs) { String r(lhs); r += rhs; return r; }
+String operator+(const String& lhs, char rhs) { String r(lhs); r += rhs; return r; }
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Print, Stream and Serial
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+size_t Print::write(const uint8_t* buffer, size_t size) {
+
+  size_t n = 0;
+  while (size--) { n += write(*buffer++); }
+  return n;
+}
+
+
+size_t Print::printf(const char* format, ...) {
+
+  char buf[256];
+  va_list arg;
+  va_start(arg, format);
+  int len = vsnprintf(buf, sizeof(buf), format, arg);
+  va_end(arg);
+  if (len < 0) { return 0; }
+  return write((const uint8_t*)buf, (size_t)len < sizeof(buf) ? len : sizeof(buf) - 1);
+}
+
+
+size_t Stream::readBytes(char* buffer, size_t length) {
+
+  size_t n = 0;
+  while (n < length) {
+    int c = read();
+    if (c < 0) { break; }
+    buffer[n++] = (char)c;
+  }
+  return n;
+}
+
+
+static bool serialOn() {
+
+  static int on = -1;
+  if (on < 0) { on = getenv("TAMBOX_SERIAL") != nullptr; }
+  return on;
+}
+
+
+size_t HardwareSerial::write(uint8_t c) {
+
+  if (serialOn()) { fputc(c, stderr); }
+  return 1;
+}
+
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+
+  if (serialOn()) { fwrite(buffer, 1, size, stderr); }
+  return size;
+}
+
+
+String IPAddress::toString() const {
+
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%u.%u.%u.%u", addr[0], addr[1], addr[2], addr[3]);
+  return String(buf);
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  WebServer and IotWebConf
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+String WebServer::arg(const String& name) {
+
+  auto a = args.find(name.c_str());
+  return a == args.end() ? String() : String(a->second.c_str());
+}
+
+
+int WebServer::request(const char* uri, const char* query, String& page) {
+
+  args.clear();
+  for (String q(query ? query : ""); q.length(); ) {
+    int amp = q.indexOf('&');
+    String pair = amp < 0 ? q : q.substring(0, amp);
+    q = amp < 0 ? String() : q.substring(amp + 1);
+    int eq = pair.indexOf('=');
+    args[(eq < 0 ? pair : pair.substring(0, eq)).c_str()] = eq < 0 ? "" : pair.substring(eq + 1).c_str();
+  }
+
+  response = String();
+  code = 404;
+  auto h = handlers.find(uri);
+  if (h != handlers.end()) { h->second(); }
+  else if (notFound) { notFound(); }
+  page = response;
+  return code;
+}
+
+
+namespace iotwebconf {
+
+Parameter::Parameter(const char* label, const char* id, char* valueBuffer, int length, const char* defaultValue)
+  : label(label), id(id), valueBuffer(valueBuffer), length(length) {
+
+  strlcpy(valueBuffer, defaultValue ? defaultValue : "", length);
+}
+
+
+void Parameter::applyHostValue() {
+
+  const char* value = halOps->param ? halOps->param(halOps->ctx, id) : nullptr;
+  if (value) { strlcpy(valueBuffer, value, length); }
+}
+
+
+bool IotWebConf::init() {
+
+  for (ParameterGroup* group : groups) {
+    for (Parameter* parameter : group->items) { parameter->applyHostValue(); }
+  }
+  state = Connecting;
+  return true;
+}
+
+
+const char* IotWebConf::getThingName() {
+
+  return halOps && halOps->thingName ? halOps->thingName : defaultThingName;
+}
+
+
+void IotWebConf::doLoop() {
+
+  if (state != OnLine) {                                      // WiFi comes up at once
+    state = OnLine;
+    if (wifiConnected) { wifiConnected(); }
+  }
+}
+
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  LittleFS
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+int File::available() {
+
+  if (!f) { return 0; }
+  long pos = ftell(f.get());
+  return (int)(size() - pos);
+}
+
+
+int File::read() {
+
+  if (!f) { return -1; }
+  int c = fgetc(f.get());
+  return c == EOF ? -1 : c;
+}
+
+
+int File::peek() {
+
+  if (!f) { return -1; }
+  int c = fgetc(f.get());
+  if (c == EOF) { return -1; }
+  ungetc(c, f.get());
+  return c;
+}
+
+
+size_t File::size() const {
+
+  struct stat st;
+  if (!f || fstat(fileno(f.get()), &st) != 0) { return 0; }
+  return st.st_size;
+}
+
+
+std::string FS::hostPath(const char* path) {
+
+  return std::string(halOps->fsRoot) + path;
+}
+
+
+bool FS::begin() {
+
+  if (!halOps->fsRoot) { return false; }
+  mkdir(halOps->fsRoot, 0755);
+  struct stat st;
+  return stat(halOps->fsRoot, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+
+File FS::open(const char* path, const char* mode) {
+
+  const char* hostMode = mode[0] == 'w' ? "wb" : mode[0] == 'a' ? "ab" : "rb";
+  FILE* f = fopen(hostPath(path).c_str(), hostMode);
+  return f ? File(f) : File();
+}
+
+
+bool FS::exists(const char* path) {
+
+  struct stat st;
+  return stat(hostPath(path).c_str(), &st) == 0;
+}
+
+
+bool FS::remove(const char* path) {
+
+  return ::remove(hostPath(path).c_str()) == 0;
+}
+
+
+bool FS::rename(const char* pathFrom, const char* pathTo) {
+
+  return ::rename(hostPath(pathFrom).c_str(), hostPath(pathTo).c_str()) == 0;
+}
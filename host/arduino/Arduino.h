@@ -0,0 +1,226 @@
+/**
+  * Arduino core for the host build of mqttTamBox, only what the sketch uses.
+  *
+  * The clock, delay and random forward to the tamBoxHalOps table, see tamBoxHal.h. ESP.restart and
+  * ESP.deepSleep throw, the exceptions are caught by tamBoxLoop in tamBoxModule.cpp.
+  */
+#ifndef TAMBOX_HOST_ARDUINO_H
+#define TAMBOX_HOST_ARDUINO_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#ifndef ESP8266
+#define ESP8266                                       1       // The sketch takes the ESP8266 paths
+#endif
+
+using std::min;
+using std::max;
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define D0                                           16
+#define D5                                           14
+#define LED_BUILTIN                                   2
+#define INPUT                                         0
+#define OUTPUT                                        1
+#define LOW                                           0
+#define HIGH                                          1
+#define DEC                                          10
+#define HEX                                          16
+
+#define PROGMEM
+#define F(string_literal)                 (string_literal)
+#define PSTR(string_literal)              (string_literal)
+#define FPSTR(pstr_pointer)                 (pstr_pointer)
+
+#if defined(__GLIBC__) && (__GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38))
+size_t strlcpy(char* dst, const char* src, size_t size);
+#endif
+
+struct tamBoxRestart {};                                      // Thrown by ESP.restart
+struct tamBoxSleep {};                                        // Thrown by ESP.deepSleep
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void yield(void);
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+void tone(uint8_t pin, unsigned int frequency, unsigned long duration = 0);
+void noTone(uint8_t pin);
+
+
+/**
+ * String, the parts of the ESP8266 WString the sketch uses
+ */
+class String {
+ public:
+  String(const char* cstr = "") : s(cstr ? cstr : "") {}
+  String(const String& str) = default;
+  String(String&& str) = default;
+  explicit String(char c) : s(1, c) {}
+  explicit String(unsigned char value, unsigned char base = 10) : String((unsigned long)value, base) {}
+  explicit String(int value, unsigned char base = 10) : String((long)value, base) {}
+  explicit String(unsigned int value, unsigned char base = 10) : String((unsigned long)value, base) {}
+  explicit String(long value, unsigned char base = 10);
+  explicit String(unsigned long value, unsigned char base = 10);
+  explicit String(long long value, unsigned char base = 10) : String((long)value, base) {}
+  explicit String(unsigned long long value, unsigned char base = 10) : String((unsigned long)value, base) {}
+  explicit String(float value, unsigned char decimalPlaces = 2) : String((double)value, decimalPlaces) {}
+  explicit String(double value, unsigned char decimalPlaces = 2);
+
+  String& operator=(const String& rhs) = default;
+  String& operator=(String&& rhs) = default;
+  String& operator=(const char* cstr) { s = cstr ? cstr : ""; return *this; }
+
+  const char* c_str() const { return s.c_str(); }
+  unsigned int length() const { return s.size(); }
+  bool isEmpty() const { return s.empty(); }
+  bool reserve(unsigned int size) { s.reserve(size); return true; }
+
+  bool concat(const String& str) { s += str.s; return true; }
+  bool concat(const char* cstr) { if (cstr) { s += cstr; } return true; }
+  bool concat(const char* cstr, unsigned int length) { if (cstr) { s.append(cstr, length); } return true; }
+  bool concat(char c) { s += c; return true; }
+  String& operator+=(const String& rhs) { concat(rhs); return *this; }
+  String& operator+=(const char* cstr) { concat(cstr); return *this; }
+  String& operator+=(char c) { concat(c); return *this; }
+
+  bool equals(const String& str) const { return s == str.s; }
+  bool equals(const char* cstr) const { return s == (cstr ? cstr : ""); }
+  bool operator==(const String& rhs) const { return equals(rhs); }
+  bool operator==(const char* cstr) const { return equals(cstr); }
+  bool operator!=(const String& rhs) const { return !equals(rhs); }
+  bool operator!=(const char* cstr) const { return !equals(cstr); }
+  bool operator<(const String& rhs) const { return s < rhs.s; }
+  bool startsWith(const String& prefix) const { return s.compare(0, prefix.s.size(), prefix.s) == 0; }
+  bool endsWith(const String& suffix) const;
+
+  char charAt(unsigned int index) const { return index < s.size() ? s[index] : 0; }
+  char operator[](unsigned int index) const { return charAt(index); }
+  char& operator[](unsigned int index) { return s[index]; }
+  int indexOf(char c, unsigned int from = 0) const;
+  int indexOf(const String& str, unsigned int from = 0) const;
+  int lastIndexOf(char c) const;
+  String substring(unsigned int from) const { return substring(from, s.size()); }
+  String substring(unsigned int from, unsigned int to) const;
+  void toCharArray(char* buf, unsigned int bufsize, unsigned int index = 0) const;
+
+  void replace(const String& find, const String& with);
+  void toLowerCase() { for (char& c : s) { c = tolower((unsigned char)c); } }
+  void toUpperCase() { for (char& c : s) { c = toupper((unsigned char)c); } }
+  void trim();
+  long toInt() const { return atol(s.c_str()); }
+  float toFloat() const { return atof(s.c_str()); }
+
+ private:
+  std::string s;
+};
+
+String operator+(const String& lhs, const String& rhs);
+String operator+(const String& lhs, const char* rhs);
+String operator+(const char* lhs, const String& rhs);
+String operator+(const String& lhs, char rhs);
+inline bool operator==(const char* lhs, const String& rhs) { return rhs == lhs; }
+inline bool operator!=(const char* lhs, const String& rhs) { return rhs != lhs; }
+
+
+/**
+ * Print and Stream
+ */
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* buffer, size_t size);
+  size_t write(const char* str) { return str ? write((const uint8_t*)str, strlen(str)) : 0; }
+  size_t write(const char* buffer, size_t size) { return write((const uint8_t*)buffer, size); }
+
+  size_t print(const String& s) { return write(s.c_str(), s.length()); }
+  size_t print(const char* str) { return write(str); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(int n, int base = DEC) { return print((long)n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(long n, int base = DEC) { return print(String(n, base)); }
+  size_t print(unsigned long n, int base = DEC) { return print(String(n, base)); }
+  size_t print(double n, int digits = 2) { return print(String(n, digits)); }
+
+  size_t println() { return write("\r\n"); }
+  template <class T> size_t println(const T& value) { size_t n = print(value); return n + println(); }
+  template <class T> size_t println(const T& value, int format) { size_t n = print(value, format); return n + println(); }
+
+  size_t printf(const char* format, ...);
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  void setTimeout(unsigned long timeout) { this->timeout = timeout; }
+  unsigned long getTimeout() const { return timeout; }
+  size_t readBytes(char* buffer, size_t length);
+  size_t readBytes(uint8_t* buffer, size_t length) { return readBytes((char*)buffer, length); }
+
+ protected:
+  unsigned long timeout = 1000;
+};
+
+class StringStream : public Stream {                          // Reads from a copy of a buffer, used by the host halHttp
+ public:
+  void set(const char* data, size_t len) { buffer.assign(data, len); pos = 0; }
+  int available() override { return buffer.size() - pos; }
+  int read() override { return pos < buffer.size() ? (uint8_t)buffer[pos++] : -1; }
+  int peek() override { return pos < buffer.size() ? (uint8_t)buffer[pos] : -1; }
+  size_t write(uint8_t c) override { (void)c; return 0; }
+  using Print::write;
+
+ private:
+  std::string buffer;
+  size_t pos = 0;
+};
+
+class HardwareSerial : public Stream {                        // Goes to stderr when TAMBOX_SERIAL is set
+ public:
+  void begin(unsigned long baud) { (void)baud; }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+
+/**
+ * ESP8266 specifics
+ */
+class EspClass {
+ public:
+  [[noreturn]] void restart() { throw tamBoxRestart(); }
+  [[noreturn]] void deepSleep(uint64_t time_us) { (void)time_us; throw tamBoxSleep(); }
+  uint32_t getFreeHeap() { return 40000; }                    // The heap is not modelled
+  uint32_t getMaxFreeBlockSize() { return 38000; }
+  uint8_t getHeapFragmentation() { return 0; }
+  uint32_t getChipId() { return 0; }
+};
+
+extern EspClass ESP;
+
+#endif
@@ -0,0 +1,10 @@
+/**
+  * Over-the-Air programming for the host build of mqttTamBox, not available. The sketch only uses
+  * ArduinoOTA when __ARDUINO_OTA_H is defined.
+  */
+#ifndef TAMBOX_HOST_ARDUINOOTA_H
+#define TAMBOX_HOST_ARDUINOOTA_H
+
+#include <Arduino.h>
+
+#endif
@@ -0,0 +1,15 @@
+/**
+  * Firmware update server for the host build of mqttTamBox, does nothing
+  */
+#ifndef TAMBOX_HOST_ESP8266HTTPUPDATESERVER_H
+#define TAMBOX_HOST_ESP8266HTTPUPDATESERVER_H
+
+#include <IotWebConf.h>
+
+class ESP8266HTTPUpdateServer {
+ public:
+  void setup(WebServer* server, const char* path) { (void)server; (void)path; }
+  void updateCredentials(const char* username, char* password) { (void)username; (void)password; }
+};
+
+#endif
@@ -0,0 +1,37 @@
+/**
+  * WiFi for the host build of mqttTamBox, the box is always connected
+  */
+#ifndef TAMBOX_HOST_ESP8266WIFI_H
+#define TAMBOX_HOST_ESP8266WIFI_H
+
+#include <Arduino.h>
+
+class IPAddress {
+ public:
+  IPAddress(uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0) : addr{a, b, c, d} {}
+  String toString() const;
+
+ private:
+  uint8_t addr[4];
+};
+
+class WiFiClient : public Stream {                            // Only carries the timeout, the broker and HTTP go through halOps
+ public:
+  WiFiClient() { timeout = 5000; }                            // ESP8266 WiFiClient default
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  size_t write(uint8_t c) override { (void)c; return 0; }
+  using Print::write;
+  void stop() {}
+};
+
+class ESP8266WiFiClass {
+ public:
+  int32_t RSSI() { return -60; }                              // As in the ESP8266 core
+  IPAddress localIP() { return IPAddress(10, 0, 0, 2); }
+};
+
+extern ESP8266WiFiClass WiFi;
+
+#endif
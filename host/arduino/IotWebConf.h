@@ -0,0 +1,140 @@
+/**
+  * IotWebConf for the host build of mqttTamBox.
+  *
+  * Parameters start with their default value, init() then applies the values given by the host in
+  * tamBoxHalOps::param. The first doLoop() brings the WiFi up and calls the connection callback.
+  * WebServer keeps the handlers so the host can fetch a page with tamBoxPage.
+  */
+#ifndef TAMBOX_HOST_IOTWEBCONF_H
+#define TAMBOX_HOST_IOTWEBCONF_H
+
+#include <functional>
+#include <map>
+#include <vector>
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+#define CONTENT_LENGTH_UNKNOWN                  ((size_t)-1)
+
+class DNSServer {};
+
+class WebServer;
+extern WebServer* hostWebServer;                              // Last constructed, the one tamBoxPage asks
+
+class WebServer {
+ public:
+  typedef std::function<void(void)> THandlerFunction;
+
+  WebServer(int port) { (void)port; hostWebServer = this; }
+
+  void on(const char* uri, THandlerFunction handler) { handlers[uri] = handler; }
+  void onNotFound(THandlerFunction handler) { notFound = handler; }
+  String arg(const String& name);
+  bool hasArg(const String& name) { return args.count(name.c_str()) > 0; }
+
+  void setContentLength(size_t length) { (void)length; }
+  void send(int code, const char* contentType, const String& content) { this->code = code; response += content; }
+  void sendContent(const char* content) { response += content; }
+  void sendContent(const char* content, size_t length) { response.concat(content, length); }
+  void sendContent(const String& content) { response += content; }
+
+  int request(const char* uri, const char* query, String& page);  // Runs the handler for uri, query is name=value&...
+
+ private:
+  std::map<std::string, THandlerFunction> handlers;
+  THandlerFunction notFound;
+  std::map<std::string, std::string> args;
+  String response;
+  int code = 0;
+};
+
+namespace iotwebconf {
+
+enum NetworkState { Boot, NotConfigured, ApMode, Connecting, OnLine, OffLine };
+
+class WebRequestWrapper {
+ public:
+  String arg(const String& name) { (void)name; return String(); }
+};
+
+class Parameter {
+ public:
+  Parameter(const char* label, const char* id, char* valueBuffer, int length, const char* defaultValue);
+  const char* getId() { return id; }
+  void applyHostValue(void);
+
+  const char* label;
+  const char* id;
+  char* valueBuffer;
+  int length;
+  bool visible = true;
+  const char* errorMessage = nullptr;
+};
+
+class TextParameter : public Parameter {
+ public:
+  TextParameter(const char* label, const char* id, char* valueBuffer, int length, const char* defaultValue = nullptr)
+    : Parameter(label, id, valueBuffer, length, defaultValue) {}
+};
+
+class NumberParameter : public Parameter {
+ public:
+  NumberParameter(const char* label, const char* id, char* valueBuffer, int length, const char* defaultValue = nullptr)
+    : Parameter(label, id, valueBuffer, length, defaultValue) {}
+};
+
+class SelectParameter : public Parameter {
+ public:
+  SelectParameter(const char* label, const char* id, char* valueBuffer, int length, const char* optionValues,
+                  const char* optionNames, size_t optionCount, size_t nameLength, const char* defaultValue = nullptr)
+    : Parameter(label, id, valueBuffer, length, defaultValue) {}
+};
+
+class ParameterGroup {
+ public:
+  ParameterGroup(const char* id, const char* label = "") : id(id) { (void)label; }
+  void addItem(Parameter* parameter) { items.push_back(parameter); }
+
+  const char* id;
+  std::vector<Parameter*> items;
+};
+
+class IotWebConf {
+ public:
+  IotWebConf(const char* thingName, DNSServer* dnsServer, WebServer* server, const char* initialApPassword,
+             const char* configVersion) : defaultThingName(thingName) {}
+
+  void setWifiConnectionTimeoutMs(unsigned long ms) { (void)ms; }
+  void setStatusPin(int pin) { (void)pin; }
+  void setConfigPin(int pin) { (void)pin; }
+  void addParameterGroup(ParameterGroup* group) { groups.push_back(group); }
+  void setConfigSavedCallback(std::function<void()> callback) { configSaved = callback; }
+  void setWifiConnectionCallback(std::function<void()> callback) { wifiConnected = callback; }
+  void setFormValidator(std::function<bool(WebRequestWrapper*)> validator) { (void)validator; }
+  Parameter* getApTimeoutParameter() { return &apTimeout; }
+  template <class S, class C> void setupUpdateServer(S setup, C credentials) { (void)setup; (void)credentials; }
+
+  bool init(void);
+  const char* getThingName(void);
+  NetworkState getState() { return state; }
+  void doLoop(void);
+  void delay(unsigned long ms) { ::delay(ms); }
+  void handleConfig() {}
+  void handleNotFound() {}
+  bool handleCaptivePortal() { return false; }
+
+ private:
+  const char* defaultThingName;
+  std::vector<ParameterGroup*> groups;
+  std::function<void()> configSaved;
+  std::function<void()> wifiConnected;
+  NetworkState state = Boot;
+  char apTimeoutValue[8];
+  Parameter apTimeout = Parameter("AP timeout", "apTimeout", apTimeoutValue, sizeof(apTimeoutValue), "30");
+};
+
+}
+
+using iotwebconf::IotWebConf;
+
+#endif
@@ -0,0 +1,24 @@
+/**
+  * Multiple WiFi networks for the host build of mqttTamBox, does nothing
+  */
+#ifndef TAMBOX_HOST_IOTWEBCONFMULTIPLEWIFI_H
+#define TAMBOX_HOST_IOTWEBCONFMULTIPLEWIFI_H
+
+#include <IotWebConf.h>
+
+namespace iotwebconf {
+
+class ChainedWifiParameterGroup : public ParameterGroup {
+ public:
+  ChainedWifiParameterGroup(const char* id) : ParameterGroup(id) {}
+};
+
+class MultipleWifiAddition {
+ public:
+  MultipleWifiAddition(IotWebConf* iotWebConf, ChainedWifiParameterGroup* groups, size_t count) {}
+  void init() {}
+};
+
+}
+
+#endif
@@ -0,0 +1,14 @@
+/**
+  * IotWebConf aliases for the host build of mqttTamBox
+  */
+#ifndef TAMBOX_HOST_IOTWEBCONFUSING_H
+#define TAMBOX_HOST_IOTWEBCONFUSING_H
+
+#include <IotWebConf.h>
+
+typedef iotwebconf::ParameterGroup IotWebConfParameterGroup;
+typedef iotwebconf::TextParameter IotWebConfTextParameter;
+typedef iotwebconf::NumberParameter IotWebConfNumberParameter;
+typedef iotwebconf::SelectParameter IotWebConfSelectParameter;
+
+#endif
@@ -0,0 +1,45 @@
+/**
+  * LittleFS for the host build of mqttTamBox, the files are kept in tamBoxHalOps::fsRoot
+  */
+#ifndef TAMBOX_HOST_LITTLEFS_H
+#define TAMBOX_HOST_LITTLEFS_H
+
+#include <memory>
+#include <Arduino.h>
+
+class File : public Stream {
+ public:
+  File() {}
+  File(FILE* f) : f(f, fclose) {}
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t read(uint8_t* buffer, size_t size) { return f ? fread(buffer, 1, size, f.get()) : 0; }
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* buffer, size_t size) override { return f ? fwrite(buffer, 1, size, f.get()) : 0; }
+  using Print::write;
+  size_t size() const;
+  void flush() { if (f) { fflush(f.get()); } }
+  void close() { f.reset(); }
+  operator bool() const { return (bool)f; }
+
+ private:
+  std::shared_ptr<FILE> f;
+};
+
+class FS {
+ public:
+  bool begin(void);
+  File open(const char* path, const char* mode);
+  bool exists(const char* path);
+  bool remove(const char* path);
+  bool rename(const char* pathFrom, const char* pathTo);
+
+ private:
+  std::string hostPath(const char* path);
+};
+
+extern FS LittleFS;
+
+#endif
@@ -0,0 +1,9 @@
+/**
+  * I2C for the host build of mqttTamBox, the keypad and the LCD go through halOps
+  */
+#ifndef TAMBOX_HOST_WIRE_H
+#define TAMBOX_HOST_WIRE_H
+
+#include <Arduino.h>
+
+#endif
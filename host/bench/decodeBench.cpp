@@ -0,0 +1,451 @@
+/**
+  * tamBoxDecodeBench, topic dispatch and body decode against the old String based code.
+  *
+  *   tamBoxDecodeBench [--iterations N]
+  *
+  * Recorded topics and bodies, as seen by tambox-1 with tambox-2 on A and tambox-3 on B, are run
+  * through decodeTopic and the decoder of jsonReceived (peekBodyType, peekNodeId, tamMessageWanted
+  * and decodeTamMessage), and through the old code in legacyDecode.h. The rate is messages per
+  * second on the host, allocs the number of operator new calls per message. The host String keeps
+  * up to 15 characters without allocating, the ESP8266 String less, so the old code allocates more
+  * on the box. The stack is the deepest use of a painted thread stack while decoding each body.
+  *
+  * The heap part loads a recorded config into the typed config structs through getConfigFile, and
+  * into the old String tables, then runs the topics and bodies through the new and the old code.
+  * Every allocation on the way is replayed in a model of the ESP8266 heap, first fit in 8 byte
+  * blocks with a 4 byte header like umm_malloc, starting from BENCH_HEAP_SIZE free. Free heap and
+  * the largest free block are reported after the config is loaded and after the traffic, static is
+  * the size of the config tables themselves with a 12 byte ESP8266 String. The allocation sizes are
+  * the host ones, so a String of 11 to 15 characters allocates on the box and not here.
+  * Exits with 1 if the two disagree on a route or a tam body.
+  */
+#include <Arduino.h>
+#include "mqttTamBox.ino"
+#include "legacyDecode.h"
+#include <pthread.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+const tamBoxHalOps* halOps;
+
+#define BENCH_STACK_SIZE                         (256 * 1024)
+#define BENCH_STACK_PAINT                                0xa5
+#define BENCH_HEAP_SIZE                               40000   // Free heap of a tambox after setup, as ESP.getFreeHeap() on the host
+#define BENCH_HEAP_BLOCK                                  8   // umm_malloc block
+#define BENCH_HEAP_HEADER                                 4   // umm_malloc header, in the first block
+#define BENCH_HEAP_BLOCKS      (BENCH_HEAP_SIZE / BENCH_HEAP_BLOCK)
+#define BENCH_HEAP_LIVE                                4096   // Allocations followed at the same time
+#define BENCH_HEAP_ROUNDS                               200   // Times the topics and bodies are run for the heap
+#define BENCH_ESP_STRING                                 12   // sizeof(String) on the ESP8266
+
+struct recordedTopic { const char* name; const char* topic; uint8_t dest; };  // dest from decodeTopic
+struct recordedBody { const char* name; uint8_t order; const char* body; };
+struct heapAlloc { void* p; uint16_t first; uint16_t blocks; };
+struct heapState { size_t free; size_t largest; };
+
+static const recordedTopic topics[] = {
+  {"request", "cmd/h0/tam/tambox-1/a/req", OWN},
+  {"response", "cmd/h0/tam/tambox-1/b/res", OWN},
+  {"data", "dt/h0/tam/tambox-2/b", DEST_A},
+  {"data other port", "dt/h0/tam/tambox-3/b", TOPIC_NOT_FOUND},
+  {"supervisor", "cmd/h0/node/tambox-1-supervisor/req", TOPIC_SUPERVISOR},
+  {"node state", "dt/h0/node/tambox-3/$state", TOPIC_NOT_FOUND},
+  {"other scale", "dt/n/tam/tambox-2/b", DEST_A},
+};
+#define TOPICS_SIZE                          (sizeof(topics) / sizeof(topics[0]))
+
+static const recordedBody corpus[] = {
+  {"direction req", _REQUEST,
+   "{\"tam\": {\"version\": \"1.0\", \"timestamp\": 1590520093, \"session-id\": \"req:1590520093\", \"node-id\": \"tambox-1\", "
+   "\"port-id\": \"a\", \"track\": \"left\", \"respond-to\": \"cmd/h0/tam/tambox-2/b/res\", \"state\": {\"desired\": \"in\"}}}"},
+  {"train req", _REQUEST,
+   "{\"tam\": {\"version\": \"1.0\", \"timestamp\": 1590520094, \"session-id\": \"req:1590520094\", \"node-id\": \"tambox-1\", "
+   "\"port-id\": \"a\", \"track\": \"left\", \"identity\": 1234, \"respond-to\": \"cmd/h0/tam/tambox-2/b/res\", "
+   "\"state\": {\"desired\": \"accept\"}}}"},
+  {"accepted res", _RESPONSE,
+   "{\"tam\": {\"version\": \"1.0\", \"timestamp\": 1590520095, \"session-id\": \"req:1590520000\", \"node-id\": \"tambox-1\", "
+   "\"port-id\": \"b\", \"track\": \"left\", \"identity\": 1234, \"state\": {\"desired\": \"accept\", \"reported\": \"accepted\"}}}"},
+  {"direction res", _RESPONSE,
+   "{\"tam\": {\"version\": \"1.0\", \"timestamp\": 1590520096, \"session-id\": \"req:1590520000\", \"node-id\": \"tambox-1\", "
+   "\"port-id\": \"b\", \"track\": \"left\", \"state\": {\"desired\": \"in\", \"reported\": \"in\"}}}"},
+  {"data in", _DATA,
+   "{\"tam\": {\"version\": \"1.0\", \"timestamp\": 1590520097, \"session-id\": \"dt:1590520097\", \"node-id\": \"tambox-2\", "
+   "\"port-id\": \"b\", \"track\": \"left\", \"identity\": 1234, \"state\": {\"reported\": \"in\"}}}"},
+  {"data other port", _DATA,
+   "{\"tam\": {\"version\": \"1.0\", \"timestamp\": 1590520098, \"session-id\": \"dt:1590520098\", \"node-id\": \"tambox-3\", "
+   "\"port-id\": \"b\", \"track\": \"left\", \"identity\": 4321, \"state\": {\"reported\": \"in\"}}}"},
+  {"data out", _DATA,
+   "{\"tam\": {\"version\": \"1.0\", \"timestamp\": 1590520098, \"session-id\": \"dt:1590520098\", \"node-id\": \"tambox-3\", "
+   "\"port-id\": \"a\", \"track\": \"right\", \"identity\": 4321, \"state\": {\"reported\": \"out\"}}}"},
+  {"ping", _DATA,
+   "{\"ping\": {\"version\": \"1.0\", \"timestamp\": 1590520099, \"session-id\": \"req:1590520099\", \"node-id\": \"tambox-2\", "
+   "\"state\": {\"reported\": \"ping\"}}}"},
+  {"foreign ping", _DATA,
+   "{\"ping\": {\"version\": \"1.0\", \"timestamp\": 1590520099, \"session-id\": \"req:1590520099\", \"node-id\": \"tambox-9\", "
+   "\"state\": {\"reported\": \"ping\"}}}"},
+  {"reboot", _REQUEST,
+   "{\"node\": {\"version\": \"1.0\", \"timestamp\": 1590520100, \"session-id\": \"req:1590520100\", "
+   "\"node-id\": \"tambox-1-supervisor\", \"state\": {\"desired\": \"reboot\"}}}"},
+  {"inventory", _REQUEST,
+   "{\"tower\": {\"version\": \"1.0\", \"timestamp\": 1590520101, \"session-id\": \"req:1590520101\", \"node-id\": \"tambox-1\", "
+   "\"port-id\": \"inventory\", \"respond-to\": \"cmd/h0/tower/mqtt-registry/res\", \"state\": {\"desired\": {\"report\": \"inventory\"}}}}"},
+  {"foreign req", _REQUEST,
+   "{\"tam\": {\"version\": \"1.0\", \"timestamp\": 1590520102, \"session-id\": \"req:1590520102\", \"node-id\": \"tambox-7\", "
+   "\"port-id\": \"a\", \"track\": \"left\", \"respond-to\": \"cmd/h0/tam/tambox-8/b/res\", \"state\": {\"desired\": \"in\"}}}"},
+};
+#define CORPUS_SIZE                          (sizeof(corpus) / sizeof(corpus[0]))
+
+static const char configBody[] =                              // tambox-1 with tambox-2 on A and tambox-3 on B
+  "{\"id\": \"tambox-1\", \"config\": {\"signature\": \"CDA\", \"name\": \"Charlottendal\", \"destinations\": 2, "
+  "\"destination\": {\"A\": {\"tracks\": 1, \"type\": \"single\", \"single\": {\"id\": \"tambox-2\", \"tracks\": 1, "
+  "\"exit\": \"B\", \"signature\": \"GLA\"}}, \"B\": {\"tracks\": 1, \"type\": \"single\", \"single\": {\"id\": \"tambox-3\", "
+  "\"tracks\": 1, \"exit\": \"A\", \"signature\": \"VST\"}}}}, \"mqtt\": {\"server\": \"mqtt-broker.local\", "
+  "\"port\": 1883, \"usr\": \"\", \"pwd\": \"\", \"scale\": \"h0\", \"epoch\": 1679333055}}";
+
+static char bodyBuf[MQTT_BUFFER_SIZE + 1];
+static char topicBuf[LCP_TOPIC_LEN + 1];
+static const recordedBody* stackBody;
+static unsigned long allocations;
+static bool heapModel;                                        // Replay allocations in the heap model
+static bool heapUsed[BENCH_HEAP_BLOCKS];
+static heapAlloc heapLive[BENCH_HEAP_LIVE];
+static size_t heapLiveCount;
+static unsigned long heapFailed;                              // Allocations that would have failed on the box
+
+
+static void heapAllocate(void* p, size_t size) {
+
+  size_t blocks = (size + BENCH_HEAP_HEADER + BENCH_HEAP_BLOCK - 1) / BENCH_HEAP_BLOCK;
+  size_t run = 0;
+
+  for (size_t b = 0; b < BENCH_HEAP_BLOCKS && heapLiveCount < BENCH_HEAP_LIVE; b++) {           // First fit
+    run = heapUsed[b] ? 0 : run + 1;
+    if (run == blocks) {
+      size_t first = b + 1 - blocks;
+      for (size_t i = first; i <= b; i++) { heapUsed[i] = true; }
+      heapLive[heapLiveCount++] = {p, (uint16_t)first, (uint16_t)blocks};
+      return;
+    }
+  }
+
+  heapFailed++;
+}
+
+
+static void heapRelease(void* p) {
+
+  for (size_t i = 0; i < heapLiveCount; i++) {
+    if (heapLive[i].p == p) {
+      for (size_t b = heapLive[i].first; b < heapLive[i].first + heapLive[i].blocks; b++) { heapUsed[b] = false; }
+      heapLive[i] = heapLive[--heapLiveCount];
+      return;
+    }
+  }
+}
+
+
+static void heapReset() {
+
+  memset(heapUsed, 0, sizeof(heapUsed));
+  heapLiveCount = 0;
+  heapFailed = 0;
+}
+
+
+static heapState heapNow() {
+
+  heapState state = {0, 0};
+  size_t run = 0;
+
+  for (size_t b = 0; b < BENCH_HEAP_BLOCKS; b++) {
+    run = heapUsed[b] ? 0 : run + 1;
+    state.free += heapUsed[b] ? 0 : BENCH_HEAP_BLOCK;
+    state.largest = std::max(state.largest, run * BENCH_HEAP_BLOCK);
+  }
+
+  if (state.largest > BENCH_HEAP_HEADER) { state.largest -= BENCH_HEAP_HEADER; }                // As ESP.getMaxFreeBlockSize()
+  return state;
+}
+
+
+void* operator new(size_t size) {
+
+  allocations++;
+  void* p = malloc(size ? size : 1);
+  if (p == nullptr) { throw std::bad_alloc(); }
+  if (heapModel) { heapAllocate(p, size); }
+  return p;
+}
+
+
+void operator delete(void* p) noexcept { if (heapModel) { heapRelease(p); } free(p); }
+void operator delete(void* p, size_t) noexcept { if (heapModel) { heapRelease(p); } free(p); }
+
+
+static unsigned long benchMillis(void*) {
+
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+static unsigned long benchMicros(void*) {
+
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+static void benchHttpGet(void*, const char*, const char*, unsigned long, halHttpResult* res) {
+
+  *res = {HTTP_CODE_OK, configBody, strlen(configBody), "", ""};
+}
+
+
+static void benchConfig() {
+
+  static tamBoxHalOps ops = {};
+  ops.millis = benchMillis;
+  ops.micros = benchMicros;
+  ops.httpGet = benchHttpGet;
+  halOps = &ops;
+  clientID = "tambox-1";
+
+  strcpy(tamBoxMqtt.scale, "h0");
+  for (uint8_t slot = 0; slot < CONFIG_DEST; slot++) { strcpy(tamBoxConfig[slot].id, NOT_USED_T); }
+  strcpy(tamBoxConfig[OWN].id, "tambox-1");
+  strcpy(tamBoxConfig[DEST_A].id, "tambox-2"); strcpy(tamBoxConfig[DEST_A].exit, "b");
+  strcpy(tamBoxConfig[DEST_B].id, "tambox-3"); strcpy(tamBoxConfig[DEST_B].exit, "a");
+  tamBoxConfig[DEST_A].type = tamBoxConfig[DEST_B].type = TRACK_TYPE_SINGLE;
+  ports.at(DEST_A, LEFT_TRACK).state = ports.at(DEST_B, LEFT_TRACK).state = _IDLE;
+  strcpy(ports[DEST_B].resSessionId, "req:1590520000");
+
+  setTopicIndex();
+  setTamFilter();
+  legacyConfig();
+}
+
+
+static uint8_t dispatchNew(const recordedTopic& r, uint8_t& dest) {
+
+  TamTopic t;
+  strcpy(topicBuf, r.topic);
+  decodeTopic(topicBuf, t);
+  dest = t.dest;
+
+  if (!t.scale)                                                   { return ROUTE_NONE; }
+  if (t.msgType == MSG_COMMAND && t.order == ORDER_REQUEST)       { return ROUTE_REQUEST; }
+  if (t.msgType == MSG_COMMAND && t.order == ORDER_RESPONSE)      { return (t.bodyType == BODY_TAM) ? ROUTE_RESPONSE : ROUTE_NONE; }
+  if (t.msgType == MSG_COMMAND && t.bodyType == BODY_NODE)        { return (t.dest == TOPIC_SUPERVISOR) ? ROUTE_SUPERVISOR : ROUTE_NONE; }
+  if (t.msgType == MSG_DATA && t.bodyType == BODY_TAM)            { return ROUTE_DATA; }
+  if (t.msgType == MSG_DATA && t.bodyType == BODY_NODE)           { return (t.port == TOPIC_PORT_STATE) ? ROUTE_STATE : ROUTE_NONE; }
+  return ROUTE_NONE;
+}
+
+
+static uint8_t dispatchOld(const recordedTopic& r, uint8_t& dest) {
+
+  strcpy(topicBuf, r.topic);
+  return legacyDispatch(topicBuf, dest);
+}
+
+
+static bool decodeNew(const recordedBody& r, TamMessage& msg) {
+
+  strcpy(bodyBuf, r.body);                                                                      // Decoding in place changes the body
+  msg.body = peekBodyType(bodyBuf);
+  msg.node = peekNodeId(bodyBuf);
+  if (!tamMessageWanted(r.order, msg)) { return false; }
+  if (msg.body != BODY_TAM && msg.body != BODY_NODE) { return true; }
+  return decodeTamMessage(bodyBuf, r.order, msg);
+}
+
+
+static void decodeOld(const recordedBody& r, legacyResult& res) {
+
+  strcpy(bodyBuf, r.body);
+  legacyDecode(r.order, bodyBuf, res);
+}
+
+
+static void trafficNew() {
+
+  for (const recordedTopic& r : topics) { uint8_t dest; dispatchNew(r, dest); }
+  for (const recordedBody& r : corpus) { TamMessage msg; decodeNew(r, msg); }
+}
+
+
+static void trafficOld() {
+
+  for (const recordedTopic& r : topics) { uint8_t dest; dispatchOld(r, dest); }
+  for (const recordedBody& r : corpus) { legacyResult res; decodeOld(r, res); }
+}
+
+
+static void heapRun(const char* name, size_t staticSize, void (*load)(), void (*traffic)()) {
+
+  heapReset();
+  heapModel = true;
+  load();
+  heapState boot = heapNow();
+  for (unsigned i = 0; i < BENCH_HEAP_ROUNDS; i++) { traffic(); }
+  heapState run = heapNow();
+  heapModel = false;
+
+  printf("  %-16s %10zu %10zu %10zu %10zu %10zu %10lu\n", name, staticSize, boot.free, boot.largest, run.free, run.largest,
+         heapFailed);
+}
+
+
+static void loadNew() { getConfigFile(); }
+static void loadOld() { legacyConfigFile(configBody); }
+
+
+static void* stackNew(void*) { TamMessage msg; decodeNew(*stackBody, msg); return nullptr; }
+static void* stackOld(void*) { legacyResult res; decodeOld(*stackBody, res); return nullptr; }
+static void* stackNone(void*) { return nullptr; }
+
+
+static size_t stackUse(void* (*run)(void*)) {
+
+  uint8_t* stack = (uint8_t*)malloc(BENCH_STACK_SIZE);
+  memset(stack, BENCH_STACK_PAINT, BENCH_STACK_SIZE);
+
+  pthread_attr_t attr;
+  pthread_t thread;
+  pthread_attr_init(&attr);
+  pthread_attr_setstack(&attr, stack, BENCH_STACK_SIZE);
+  pthread_create(&thread, &attr, run, nullptr);
+  pthread_join(thread, nullptr);
+  pthread_attr_destroy(&attr);
+
+  size_t low = 0;                                                                               // Stack grows down
+  while (low < BENCH_STACK_SIZE && stack[low] == BENCH_STACK_PAINT) { low++; }
+  free(stack);
+  return BENCH_STACK_SIZE - low;
+}
+
+
+int main(int argc, char** argv) {
+
+  unsigned iterations = 20000;
+  bool failed = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) { iterations = atoi(argv[++i]); }
+    else {
+      fprintf(stderr, "usage: tamBoxDecodeBench [--iterations N]\n");
+      return 2;
+    }
+  }
+
+  benchConfig();
+
+  for (const recordedTopic& r : topics) {                                                       // Same route for every topic
+    uint8_t newDest, oldDest;
+    uint8_t route = dispatchNew(r, newDest);
+    if (route != dispatchOld(r, oldDest) || newDest != r.dest) {
+      printf("%-16s differs: new route %d dest %d, old route %d\n", r.name, route, newDest, dispatchOld(r, oldDest));
+      failed = true;
+    }
+  }
+
+  for (const recordedBody& r : corpus) {                                                        // Same result for every tam body
+    TamMessage msg;
+    legacyResult res;
+    bool wanted = decodeNew(r, msg);
+    decodeOld(r, res);
+    if (wanted && msg.body == BODY_TAM) {
+      uint8_t dest = (r.order == _REQUEST) ? msg.sender : msg.node;
+      if (r.order == _RESPONSE) {
+        dest = TOPIC_NOT_FOUND;
+        for (uint8_t d = 0; d < DEST_BUTTONS; d++) { if (strcmp(ports[d].resSessionId, msg.sessionId) == 0) { dest = d; } }
+      }
+      if (res.body != BODY_TAM || res.dest != dest || res.orderCode != msg.orderCode || res.track != msg.track ||
+          res.train != msg.train) {
+        printf("%-16s differs: new dest %d code %d track %d train %d, old dest %d code %d track %d train %d\n", r.name, dest,
+               msg.orderCode, msg.track, msg.train, res.dest, res.orderCode, res.track, res.train);
+        failed = true;
+      }
+    }
+    else if (res.body == BODY_TAM && strcmp(r.name, "data other port") != 0) {                  // The old parse takes any port
+      printf("%-16s differs: only the old parse takes it\n", r.name);
+      failed = true;
+    }
+  }
+
+  printf("tamBoxDecodeBench: %zu topics, %zu bodies, %u iterations\n", TOPICS_SIZE, CORPUS_SIZE, iterations);
+  printf("  %-16s %12s %12s %10s %10s\n", "topic", "new msg/s", "old msg/s", "new allocs", "old allocs");
+
+  double newDispatch = 0, oldDispatch = 0;
+  for (const recordedTopic& r : topics) {
+    uint8_t dest;
+
+    unsigned long before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < iterations; i++) { dispatchNew(r, dest); }
+    double newSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double newAllocs = (double)(allocations - before) / iterations;
+
+    before = allocations;
+    start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < iterations; i++) { dispatchOld(r, dest); }
+    double oldSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double oldAllocs = (double)(allocations - before) / iterations;
+
+    newDispatch += newSec;
+    oldDispatch += oldSec;
+    printf("  %-16s %12.0f %12.0f %10.1f %10.1f\n", r.name, iterations / newSec, iterations / oldSec, newAllocs, oldAllocs);
+  }
+
+  printf("  %-16s %12.0f %12.0f\n\n", "all", TOPICS_SIZE * iterations / newDispatch, TOPICS_SIZE * iterations / oldDispatch);
+
+  size_t threadBase = stackUse(stackNone);
+  printf("  %-16s %12s %12s %10s %10s %10s %10s\n", "body", "new msg/s", "old msg/s", "new allocs", "old allocs", "new stack",
+         "old stack");
+
+  double newTotal = 0, oldTotal = 0;
+  size_t newPeak = 0, oldPeak = 0;
+  for (const recordedBody& r : corpus) {
+    TamMessage msg;
+    legacyResult res;
+
+    unsigned long before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < iterations; i++) { decodeNew(r, msg); }
+    double newSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double newAllocs = (double)(allocations - before) / iterations;
+
+    before = allocations;
+    start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < iterations; i++) { decodeOld(r, res); }
+    double oldSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double oldAllocs = (double)(allocations - before) / iterations;
+
+    stackBody = &r;
+    size_t newStack = stackUse(stackNew) - threadBase;
+    size_t oldStack = stackUse(stackOld) - threadBase;
+    newTotal += newSec;
+    oldTotal += oldSec;
+    newPeak = std::max(newPeak, newStack);
+    oldPeak = std::max(oldPeak, oldStack);
+
+    printf("  %-16s %12.0f %12.0f %10.1f %10.1f %10zu %10zu\n", r.name, iterations / newSec, iterations / oldSec, newAllocs, oldAllocs,
+           newStack, oldStack);
+  }
+
+  printf("  %-16s %12.0f %12.0f %10s %10s %10zu %10zu\n\n", "all", CORPUS_SIZE * iterations / newTotal,
+         CORPUS_SIZE * iterations / oldTotal, "", "", newPeak, oldPeak);
+
+  if (getConfigFile() != CONFIG_RECEIVED) {                                                     // Also sizes the host HTTP stream once
+    printf("getConfigFile didn't take the recorded config\n");
+    failed = true;
+  }
+
+  printf("  %-16s %10s %10s %10s %10s %10s %10s\n", "heap", "static", "boot free", "boot block", "run free", "run block",
+         "failed");
+  heapRun("new config", sizeof(tamBoxConfig) + sizeof(tamBoxMqtt), loadNew, trafficNew);
+  heapRun("old config", BENCH_ESP_STRING * (LEGACY_CONFIG_DEST * LEGACY_CONFIG_PARAM + LEGACY_MQTT_PARAM), loadOld, trafficOld);
+  return failed ? 1 : 0;
+}
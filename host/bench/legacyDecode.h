@@ -0,0 +1,270 @@
+/**
+  * The topic dispatch of mqttCallback and the body parse of jsonReceived as they were before the
+  * subscription index and the TamMessage decoder, and the String configuration tables filled by
+  * getConfigFile, kept as the reference for tamBoxDecodeBench. The String splits, compares and
+  * copies are the same as before, the handler calls are replaced by a route or by filling in a
+  * legacyResult. StaticJsonDocument<384> and DynamicJsonDocument are a JsonDocument in ArduinoJson 7.
+  *
+  * Include after mqttTamBox.ino.
+  */
+#ifndef TAMBOX_LEGACY_DECODE_H
+#define TAMBOX_LEGACY_DECODE_H
+
+enum {ROUTE_NONE, ROUTE_REQUEST, ROUTE_RESPONSE, ROUTE_SUPERVISOR, ROUTE_DATA, ROUTE_STATE};
+
+#define LEGACY_MQTT_PARAM                             5       // Size of var legacyTamBoxMqtt
+enum {LEGACY_SERVER, LEGACY_PORT, LEGACY_USER, LEGACY_PASS, LEGACY_SCALE};
+
+#define LEGACY_CONFIG_DEST                            9       // Size of var legacyTamBoxConfig
+#define LEGACY_CONFIG_PARAM                           8
+enum {LEGACY_ID, LEGACY_SIGN, LEGACY_NAME, LEGACY_NUMOFDEST, LEGACY_TRACKS, LEGACY_EXIT, LEGACY_TOTTRACKS, LEGACY_TYPE};
+
+struct legacyResult {
+  uint8_t body;                                               // BODY_*, BODY_UNKNOWN when not handled
+  uint8_t dest;
+  uint8_t orderCode;
+  uint8_t track;
+  uint16_t train;
+};
+
+String legacyId[CONFIG_DEST];                                 // tamBoxConfig[dest][ID]
+String legacyResSession[DEST_BUTTONS];                        // resCmd[dest][LCP_SESSION_ID]
+String legacyReq[DEST_BUTTONS][6];                            // reqCmd[dest]
+String legacyTamBoxMqtt[LEGACY_MQTT_PARAM];                   // tamBoxMqtt[SERVER..SCALE]
+String legacyTamBoxConfig[LEGACY_CONFIG_DEST][LEGACY_CONFIG_PARAM];  // tamBoxConfig[dest][ID..TYPE]
+
+
+void legacyConfig() {
+
+  for (uint8_t i = 0; i < CONFIG_DEST; i++) { legacyId[i] = tamBoxConfig[i].id; }
+  for (uint8_t i = 0; i < DEST_BUTTONS; i++) { legacyResSession[i] = ports[i].resSessionId; }
+}
+
+
+uint8_t legacyDispatch(char* topic, uint8_t& dest) {
+
+  String tpc  = String((char*)topic);
+  uint8_t i = 0;
+  uint8_t p = 0;
+  String s;
+  String subTopic[NUM_OF_TOPICS];                                                               // Topic array
+
+  for (uint8_t t = 0; t < NUM_OF_TOPICS; t++) {                                                 // Split topic string into an array
+    i = tpc.indexOf("/", p);
+    s = tpc.substring(p, i);
+    p = i + 1;
+    subTopic[t] = s;
+  }
+
+  dest = TOPIC_NOT_FOUND;
+
+  if (subTopic[TOPIC_SCALE] == tamBoxMqtt.scale) {                                              // Scale (1)
+    if (subTopic[TOPIC_MSGTYPE] == COMMAND && subTopic[TOPIC_ORDER] == REQUEST) {               // Command (0) Request (5)
+      return ROUTE_REQUEST;
+    }
+
+    else if (subTopic[TOPIC_MSGTYPE] == COMMAND && subTopic[TOPIC_ORDER] == RESPONSE) {         // Command (0) Response (5)
+      if (subTopic[TOPIC_TYPE] == TAM) {                                                        // TAM
+        return ROUTE_RESPONSE;
+      }
+    }
+
+    else if (subTopic[TOPIC_MSGTYPE] == COMMAND && subTopic[TOPIC_TYPE] == NODE) {              // Node command
+      if (subTopic[TOPIC_NODE_ID] == legacyId[OWN] + "-" + NODE_SUPERVISOR) {                   // Own supervisor
+        return ROUTE_SUPERVISOR;
+      }
+    }
+
+    else if (subTopic[TOPIC_MSGTYPE] == DATA && subTopic[TOPIC_TYPE] == TAM) {                  // Data message received
+      return ROUTE_DATA;
+    }
+
+    else if (subTopic[TOPIC_MSGTYPE] == DATA && subTopic[TOPIC_TYPE] == NODE) {                 // Node data message
+      for (dest = 0; dest < CONFIG_DEST; dest++) {
+        if (subTopic[TOPIC_NODE_ID] == legacyId[dest]) {                                        // Subscribed client
+          if (subTopic[TOPIC_PORT_ID].substring(0, 6) == "$state") {                            // State messages
+            return ROUTE_STATE;
+          }
+        }
+      }
+      dest = TOPIC_NOT_FOUND;
+    }
+  }
+
+  return ROUTE_NONE;
+}
+
+
+void legacyDecode(uint8_t order, char* body, legacyResult& res) {
+
+  uint8_t MyP = 0;
+  uint8_t MyI = 0;
+  uint8_t dest = 255;
+  String s, tpc, nodeId, portId;
+  JsonDocument doc;
+  deserializeJson(doc, body);
+
+  res.body = BODY_UNKNOWN;
+
+  if (String(doc[TAM][VERSION]) == LCP_BODY_VER) {                                              // Type is tam
+    if (order == _REQUEST) {
+      if (String(doc[TAM][NODE_ID]) == legacyId[OWN]) {
+        tpc = String(doc[TAM][RESPOND_TO]);
+
+        for (uint8_t i = 0; i < NUM_OF_TOPICS; i++) {                                           // Get sending node-id
+          MyI = tpc.indexOf("/", MyP);
+          s   = tpc.substring(MyP, MyI);
+          MyP = MyI + 1;
+          if (i == TOPIC_NODE_ID) {
+            nodeId = s;
+          }
+
+          else if (i == TOPIC_PORT_ID) {
+            portId = s;
+          }
+        }
+
+        for (uint8_t i = 0; i < NUM_OF_DEST_STRINGS && i < CONFIG_DEST; i++) {
+          if (legacyId[i] == nodeId) {
+            dest = i;
+            break;
+          }
+        }
+
+        if (dest < 255) {
+          res.track = (String(doc[TAM][TRACK]) == LEFT) ? LEFT_TRACK : RIGHT_TRACK;
+
+          if (String(doc[TAM][STATE][DESIRED]) == ACCEPT) { res.orderCode = CODE_ACCEPT; }
+          else if (String(doc[TAM][STATE][DESIRED]) == IN) { res.orderCode = CODE_TRAFDIR_REQ_IN; }
+          else { res.orderCode = CODE_CANCEL; }
+
+          legacyReq[dest % DEST_BUTTONS][0] = String(doc[TAM][SESSION_ID]);
+          legacyReq[dest % DEST_BUTTONS][1] = String(doc[TAM][RESPOND_TO]);
+          legacyReq[dest % DEST_BUTTONS][2] = String(doc[TAM][STATE][DESIRED]);
+          legacyReq[dest % DEST_BUTTONS][3] = nodeId;
+          legacyReq[dest % DEST_BUTTONS][4] = portId;
+          legacyReq[dest % DEST_BUTTONS][5] = String(doc[TAM][TRACK]);
+
+          res.body = BODY_TAM;
+          res.dest = dest;
+          res.train = doc[TAM][TRAIN_ID] ? (uint16_t)doc[TAM][TRAIN_ID] : 0;
+        }
+      }
+    }
+
+    else if (order == _RESPONSE) {
+      if (String(doc[TAM][NODE_ID]) == legacyId[OWN]) {
+        for (dest = 0; dest < DEST_BUTTONS; dest++) {
+          if (legacyResSession[dest] == String(doc[TAM][SESSION_ID])) {
+            res.track = (String(doc[TAM][TRACK]) == LEFT) ? LEFT_TRACK : RIGHT_TRACK;
+
+            if (doc[TAM][TRAIN_ID]) {
+              res.train = doc[TAM][TRAIN_ID];
+              res.orderCode = (String(doc[TAM][STATE][REPORTED]) == ACCEPTED) ? CODE_ACCEPTED : CODE_REJECTED;
+            }
+
+            else {
+              res.train = 0;
+              res.orderCode = (String(doc[TAM][STATE][REPORTED]) == IN) ? CODE_TRAFDIR_RES_IN : CODE_TRAFDIR_RES_OUT;
+            }
+
+            res.body = BODY_TAM;
+            res.dest = dest;
+            break;
+          }
+        }
+      }
+    }
+
+    else if (order == _DATA) {
+      for (dest = 0; dest < DEST_BUTTONS; dest++) {
+        if (String(doc[TAM][NODE_ID]) == legacyId[dest]) {
+          res.track = (String(doc[TAM][TRACK]) == LEFT) ? LEFT_TRACK : RIGHT_TRACK;
+          res.orderCode = (String(doc[TAM][STATE][REPORTED]) == IN) ? CODE_TRAIN_IN : CODE_TRAIN_OUT;
+          res.train = doc[TAM][TRAIN_ID];
+          res.body = BODY_TAM;
+          res.dest = dest;
+          break;
+        }
+      }
+    }
+  }
+
+  else if (String(doc[PING][VERSION]) == LCP_BODY_VER) {                                        // Type is Ping
+    for (dest = 0; dest < DEST_BUTTONS; dest++) {
+      if (String(doc[TAM][NODE_ID]) == legacyId[dest]) {
+        res.body = BODY_PING;
+        res.dest = dest;
+      }
+    }
+  }
+
+  else if (String(doc[TOWER][VERSION]) == LCP_BODY_VER &&
+           String(doc[TOWER][PORT_ID]) == INVENTORY) {                                          // Type is Tower inventory
+    if (String(doc[TAM][NODE_ID]) == legacyId[OWN]) {
+      res.body = BODY_TOWER;
+    }
+  }
+
+  else if (String(doc[NODE][VERSION]) == LCP_BODY_VER) {                                        // Type is Node
+    if (order == _REQUEST) {
+      if (String(doc[TAM][NODE_ID]) == (legacyId[OWN] + "-" + NODE_SUPERVISOR)) {
+        if (String(doc[NODE][STATE][DESIRED]) == LCP_BODY_REBOOT) { res.body = BODY_NODE; }
+        else if (String(doc[NODE][STATE][DESIRED]) == LCP_BODY_SHUTDOWN) { res.body = BODY_NODE; }
+      }
+    }
+  }
+}
+
+
+void legacyConfigFile(const char* body) {
+
+  JsonDocument doc;                                                                             // DynamicJsonDocument doc(1024)
+  deserializeJson(doc, body);
+
+  if (String(doc[ID_T]) == clientID) {
+    for (uint8_t i = 0; i < DEST_BUTTONS; i++) {
+      legacyTamBoxConfig[i][LEGACY_ID]        = NOT_USED_T;
+      legacyTamBoxConfig[i][LEGACY_TOTTRACKS] = "0";
+    }
+
+    JsonObject mqtt = doc[MQTT_T];                                                              // (int), numbers come out as text as they did before
+    legacyTamBoxMqtt[LEGACY_SERVER]           = String(mqtt[SERVER_T]);
+    legacyTamBoxMqtt[LEGACY_PORT]             = String((int)mqtt[PORT_T]);
+    legacyTamBoxMqtt[LEGACY_USER]             = String(mqtt[USER_T]);
+    legacyTamBoxMqtt[LEGACY_PASS]             = String(mqtt[PASS_T]);
+    legacyTamBoxMqtt[LEGACY_SCALE]            = String(mqtt[SCALE_T]);
+
+    JsonObject config = doc[CONFIG_T];
+    legacyTamBoxConfig[OWN][LEGACY_ID]        = String(doc[ID_T]);
+    legacyTamBoxConfig[OWN][LEGACY_SIGN]      = String(config[SIGN_T]);
+    legacyTamBoxConfig[OWN][LEGACY_NAME]      = String(config[NAME_T]);
+    legacyTamBoxConfig[OWN][LEGACY_NUMOFDEST] = String((int)config[DESTS_T]);
+
+    uint8_t i = 0;
+    for (JsonPair dest : config[DEST_T].as<JsonObject>()) {                                     // Destinations
+      if (i + 1 > DEST_BUTTONS) { break; }
+      if (dest.key() == "B") { i=1; }
+      else if (dest.key() == "C") { i=2; }
+      else if (dest.key() == "D") { i=3; }
+
+      if (dest.value()[TRACK_T] > 0) {
+        legacyTamBoxConfig[i][LEGACY_TOTTRACKS] = String((int)dest.value()[TRACK_T]);
+        legacyTamBoxConfig[i][LEGACY_TYPE]      = String(dest.value()[TYPE_T]);
+        bool split    = legacyTamBoxConfig[i][LEGACY_TYPE] == TYPE_SPLIT_T;
+
+        for (uint8_t side = 0; side < (split ? 2 : 1); side++) {                                // Left and right track of a split
+          uint8_t slot = i + side * 5;
+          JsonObject node = dest.value()[split ? (side ? TYPE_RIGHT_T : TYPE_LEFT_T) : legacyTamBoxConfig[i][LEGACY_TYPE].c_str()];
+          legacyTamBoxConfig[slot][LEGACY_ID]     = String(node[ID_T]);
+          legacyTamBoxConfig[slot][LEGACY_SIGN]   = String(node[SIGN_T]);
+          legacyTamBoxConfig[slot][LEGACY_TRACKS] = String((int)node[TRACK_T]);
+          legacyTamBoxConfig[slot][LEGACY_EXIT]   = String(node[EXIT_T]);
+          legacyTamBoxConfig[slot][LEGACY_EXIT].toLowerCase();
+        }
+      }
+    }
+  }
+}
+
+#endif
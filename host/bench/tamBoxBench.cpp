@@ -0,0 +1,193 @@
+/**
+  * tamBoxBench, latency and throughput of the tam handshake with a growing number of boxes.
+  *
+  *   tamBoxBench [--boxes 3,10,25,50] [--trains N] [--settle S] [--net US] [--broker US] [--cpu-scale X] [--lcd]
+  *
+  * The boxes are paired 1-2, 3-4, ... and every pair sends --trains trains back and forth at the
+  * same time, so the broker load grows with the number of boxes. The latencies are simulated time,
+  * from the key press to the state change on the other box, plus publish to delivery for every
+  * tam message. With --cpu-scale the host time spent in loop() is added to the box clock, scaled
+  * to the ESP8266. The trains start --settle seconds after all boxes are ready, 0 by default.
+  *
+  * --lcd runs the first number of boxes on double track with a 16x2 and a 20x4 LCD, once drawing
+  * every cell on every update as before the LCD shadow and once with the shadow, and prints the
+  * I2C bytes per LCD update and their time on a 100 kHz bus. It fails if the shadow sends more.
+  */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "tamBoxSim.h"
+
+using namespace tamsim;
+
+
+static void usage() {
+
+  fprintf(stderr, "usage: tamBoxBench [--boxes 3,10,25,50] [--trains N] [--settle S] [--net US] [--broker US] [--cpu-scale X] [--lcd]\n");
+  exit(2);
+}
+
+
+static void printLatency(const char* name, const std::vector<usec>& values) {
+
+  printf("  %-10s n=%-6zu p50 %8.2f  p95 %8.2f  p99 %8.2f ms\n", name, values.size(), percentile(values, 50) / 1000.0,
+         percentile(values, 95) / 1000.0, percentile(values, 99) / 1000.0);
+}
+
+
+/*
+ * I2C bytes and LCD updates of all boxes, from all ready until the trains are done
+ */
+static bool lcdRun(SimConfig cfg, unsigned trains, usec settle, uint64_t& bytes, uint64_t& updates) {
+
+  Sim sim(cfg);
+  sim.powerOnAll(1000000);
+  if (!sim.runUntil([&sim]() { return sim.allReady(); }, 120000000)) { return false; }
+
+  bytes = 0;
+  updates = 0;
+  for (unsigned station = 1; station <= cfg.stations; station++) {
+    tamBoxStatus status = sim.box(station).status();
+    bytes -= status.lcdI2cBytes;
+    updates -= status.lcdUpdates;
+  }
+
+  Traffic traffic(sim);
+  for (unsigned from = 1; from + 1 <= cfg.stations; from += 2) {
+    for (unsigned t = 0; t < trains; t++) {
+      traffic.add(t % 2 ? from + 1 : from, t % 2 ? from : from + 1, 100 + t, sim.now() + settle);
+    }
+  }
+  bool done = traffic.run(600000000);
+
+  for (unsigned station = 1; station <= cfg.stations; station++) {
+    tamBoxStatus status = sim.box(station).status();
+    bytes += status.lcdI2cBytes;
+    updates += status.lcdUpdates;
+  }
+  return done && !traffic.failed;
+}
+
+
+static bool lcdBench(const SimConfig& base, unsigned boxes, unsigned trains, usec settle) {
+
+  const char* panels[][2] = {{"2", "16"}, {"4", "20"}};
+  bool ok = true;
+
+  printf("tamBoxBench --lcd: %u boxes on double track, %u trains per pair\n", boxes, trains);
+  for (auto& panel : panels) {
+    double perUpdate[2] = {0, 0};
+
+    for (int shadow = 0; shadow < 2; shadow++) {
+      SimConfig cfg = base;
+      cfg.stations = boxes;
+      cfg.doubleTrack = true;
+      cfg.module = shadow ? "" : TAMBOX_MODULE_FULL_REDRAW;
+      cfg.params["webLcdRows"] = panel[0];
+      cfg.params["webLcdChar"] = panel[1];
+
+      uint64_t bytes = 0;
+      uint64_t updates = 0;
+      bool done = lcdRun(cfg, trains, settle, bytes, updates);
+      perUpdate[shadow] = updates ? (double)bytes / updates : 0;
+      printf("  %sx%s %-11s %6llu updates, %8llu I2C bytes, %6.1f bytes per update, %6.2f ms at 100 kHz%s\n", panel[1], panel[0],
+             shadow ? "shadow" : "full redraw", (unsigned long long)updates, (unsigned long long)bytes, perUpdate[shadow],
+             perUpdate[shadow] * 90 / 1000.0, done ? "" : ", failed");
+      ok = ok && done && updates;
+    }
+
+    ok = ok && perUpdate[1] < perUpdate[0];
+  }
+
+  return ok;
+}
+
+
+int main(int argc, char** argv) {
+
+  SimConfig base;
+  std::vector<unsigned> boxCounts = {3, 10, 25, 50};
+  unsigned trains = 5;
+  usec settle = 0;
+  bool lcd = false;
+  bool failed = false;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (arg == "--lcd") { lcd = true; continue; }
+    if (!value) { usage(); }
+
+    if (arg == "--boxes") {
+      boxCounts.clear();
+      std::stringstream list(value);
+      for (std::string n; std::getline(list, n, ','); ) { boxCounts.push_back(atoi(n.c_str())); }
+    }
+    else if (arg == "--trains") { trains = atoi(value); }
+    else if (arg == "--settle") { settle = (usec)(atof(value) * 1000000); }
+    else if (arg == "--net") { base.netDelay = atol(value); }
+    else if (arg == "--broker") { base.brokerTime = atol(value); }
+    else if (arg == "--cpu-scale") { base.cpuScale = atof(value); }
+    else { usage(); }
+    i++;
+  }
+
+  if (lcd) {
+    if (boxCounts.empty() || boxCounts[0] < 2) { usage(); }
+    return lcdBench(base, boxCounts[0], trains, settle) ? 0 : 1;
+  }
+
+  printf("tamBoxBench: %u trains per pair, net %llu us, broker %llu us per delivery, cpu scale %.1f\n", trains,
+         (unsigned long long)base.netDelay, (unsigned long long)base.brokerTime, base.cpuScale);
+
+  for (unsigned boxes : boxCounts) {
+    if (boxes < 2) { usage(); }
+    SimConfig cfg = base;
+    cfg.stations = boxes;
+    Sim sim(cfg);
+    auto wallStart = std::chrono::steady_clock::now();
+
+    sim.powerOnAll(1000000);
+    if (!sim.runUntil([&sim]() { return sim.allReady(); }, 120000000)) {
+      printf("%u boxes: not all ready after 120 s\n", boxes);
+      failed = true;
+      continue;
+    }
+    usec readyAt = sim.now();
+
+    Traffic traffic(sim);
+    uint64_t published = sim.published;
+    uint64_t delivered = sim.delivered;
+    sim.hopLatency.clear();
+    for (unsigned from = 1; from + 1 <= boxes; from += 2) {
+      for (unsigned t = 0; t < trains; t++) {
+        traffic.add(t % 2 ? from + 1 : from, t % 2 ? from : from + 1, 100 + t, sim.now() + settle);
+      }
+    }
+
+    bool done = traffic.run(600000000);
+    double simSec = (sim.now() - readyAt) / 1e6;
+    double wallSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    uint64_t msgs = sim.delivered - delivered;
+
+    printf("%u boxes: all ready at %.2f s, %u trains, %u failed, %u retried%s\n", boxes, readyAt / 1e6, traffic.completed,
+           traffic.failed, traffic.retries, done ? "" : ", timed out");
+    printf("  messages   %llu published, %llu delivered in %.1f s simulated: %.1f msg/s, host %.0f msg/s, %.0fx real time\n",
+           (unsigned long long)(sim.published - published), (unsigned long long)msgs, simSec, msgs / simSec,
+           msgs / wallSec, sim.now() / 1e6 / wallSec);
+    printLatency("hop", sim.hopLatency);
+    printLatency("direction", traffic.directionLatency);
+    printLatency("request", traffic.requestLatency);
+    printLatency("accept", traffic.acceptLatency);
+    printLatency("depart", traffic.departLatency);
+    printLatency("arrive", traffic.arriveLatency);
+    printLatency("run", traffic.runTime);
+    failed |= !done || traffic.failed;
+  }
+
+  return failed ? 1 : 0;
+}
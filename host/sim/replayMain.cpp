@@ -0,0 +1,240 @@
+/**
+  * tamBoxReplay, runs the recorder log of one tambox through a simulated tambox and compares.
+  *
+  *   tamBoxReplay LOG [--station N] [--stations N] [--double] [--real-time] [--param ID=VALUE]... [--verbose]
+  *
+  * LOG is the /record page of a tambox built with RECORDER, or what tamBoxSim --record wrote. The
+  * tambox is tambox-N of the simulated line, 2 by default, and gets its config from the simulated
+  * config server, so the line must be the one that was recorded. A double track line is taken from
+  * the recorded track states, only there a right track is used, so --double is not needed. It runs
+  * alone, the broker delivers nothing. Every received message in the log is handed to mqttCallback
+  * and every key press to the keypad at its recorded millis(), from there they reach keyReceived,
+  * handleDirection and handleTrain as on the box. The log is replayed as fast as possible, or with --real-time at the
+  * recorded speed.
+  *
+  * The messages published by the replayed tambox must be those in the log, in the same order per
+  * topic. Timestamps and the times in session ids are left out, pings are not compared. Before each
+  * received message or key press, and at the end, the track states must be the last recorded ones.
+  * Only the last start in the log is replayed. Exits with 1 on any difference, the replay rate is
+  * records per second host time.
+  */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "tamBoxSim.h"
+#include "mqttTamBox.h"
+
+using namespace tamsim;
+
+struct Record { uint32_t millis; uint8_t type; std::string topic; std::string body; };
+
+// TAMBOX_NOTUSED ... TAMBOX_LOST
+static const char* stateNames[] = {"notused", "idle", "trafdir", "inrequest", "inaccept", "intrain", "outrequest", "outaccept",
+                                   "outtrain", "lost"};
+
+
+static void usage() {
+
+  fprintf(stderr, "usage: tamBoxReplay LOG [--station N] [--stations N] [--double] [--real-time] [--param ID=VALUE]... [--verbose]\n");
+  exit(2);
+}
+
+
+/*
+ * The records of the last start, a segment that starts before the end of the one before is a restart
+ */
+static bool readLog(const char* path, std::vector<Record>& records, unsigned& starts) {
+
+  std::ifstream file(path, std::ios::binary);
+  std::string log((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  size_t pos = 0;
+  uint32_t last = 0;
+
+  if (!file && log.empty()) { return false; }
+  starts = 0;
+
+  while (pos + sizeof(recordSegmentHeader) <= log.size()) {
+    recordSegmentHeader seg;
+    memcpy(&seg, log.data() + pos, sizeof(seg));
+    if (seg.magic != RECORD_MAGIC || seg.version != RECORD_VER) { return false; }
+    pos += sizeof(seg);
+
+    if (starts == 0 || seg.millis < last) {
+      records.clear();
+      starts++;
+    }
+    last = seg.millis;
+
+    while (pos + sizeof(recordHeader) <= log.size()) {
+      recordHeader head;
+      memcpy(&head, log.data() + pos, sizeof(head));
+      memcpy(&seg, log.data() + pos, std::min(sizeof(seg), log.size() - pos));
+      if (seg.magic == RECORD_MAGIC && seg.version == RECORD_VER) { break; }                    // Next segment header
+      if (pos + sizeof(head) + head.topicLen + head.bodyLen > log.size()) { return false; }
+
+      pos += sizeof(head);
+      records.push_back({head.millis, head.type, log.substr(pos, head.topicLen), log.substr(pos + head.topicLen, head.bodyLen)});
+      pos += head.topicLen + head.bodyLen;
+      last = head.millis;
+    }
+  }
+
+  return pos == log.size();
+}
+
+
+/*
+ * Leaves out what depends on the clock of the box
+ */
+static std::string normalized(const std::string& body) {
+
+  static const std::regex timestamp("\"timestamp\":[0-9]+");
+  static const std::regex session("\"(req|dt):[0-9]+\"");
+  return std::regex_replace(std::regex_replace(body, timestamp, "\"timestamp\":0"), session, "\"$1:0\"");
+}
+
+
+static bool isPing(const std::string& topic) { return topic.find("/ping/") != std::string::npos; }
+
+
+static bool statesAre(Sim& sim, int station, const std::string& expected, uint32_t millis, bool verbose) {
+
+  tamBoxStatus status = sim.box(station).status();
+  bool same = true;
+
+  for (size_t i = 0; i < expected.size() && i < TAMBOX_HOST_DESTS * TAMBOX_HOST_TRACKS; i++) {
+    uint8_t state = status.track[i / TAMBOX_HOST_TRACKS][i % TAMBOX_HOST_TRACKS].state;
+    uint8_t recorded = (uint8_t)expected[i];
+    if (state != recorded) {
+      if (same || verbose) {
+        printf("%10.3f %c%s is %s, recorded %s\n", millis / 1000.0, 'A' + (int)(i / TAMBOX_HOST_TRACKS), i % TAMBOX_HOST_TRACKS ? " right" : "",
+               state <= TAMBOX_LOST ? stateNames[state] : "?", recorded <= TAMBOX_LOST ? stateNames[recorded] : "?");
+      }
+      same = false;
+    }
+  }
+  return same;
+}
+
+
+int main(int argc, char** argv) {
+
+  SimConfig cfg;
+  const char* logPath = nullptr;
+  int station = 2;
+  bool realTime = false;
+  bool verbose = false;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+    if (arg == "--station" && value) { station = atoi(value); i++; }
+    else if (arg == "--stations" && value) { cfg.stations = atoi(value); i++; }
+    else if (arg == "--double") { cfg.doubleTrack = true; }
+    else if (arg == "--real-time") { realTime = true; }
+    else if (arg == "--verbose") { verbose = true; }
+    else if (arg == "--param" && value && strchr(value, '=')) {
+      const char* eq = strchr(value, '=');
+      cfg.params[std::string(value, eq - value)] = eq + 1;
+      i++;
+    }
+    else if (arg[0] != '-' && !logPath) { logPath = argv[i]; }
+    else { usage(); }
+  }
+
+  if (!logPath || station < 1 || station > (int)cfg.stations) { usage(); }
+
+  std::vector<Record> records;
+  unsigned starts = 0;
+  if (!readLog(logPath, records, starts)) {
+    fprintf(stderr, "tamBoxReplay: %s isn't a recorder log of version %d\n", logPath, RECORD_VER);
+    return 1;
+  }
+
+  std::map<std::string, std::vector<std::string>> recordedOut;
+  unsigned in = 0, keys = 0, states = 0;
+  for (const Record& r : records) {
+    if ((r.type == RECORD_OUT || r.type == RECORD_OUT_FAILED) && !isPing(r.topic)) { recordedOut[r.topic].push_back(normalized(r.body)); }
+    in += r.type == RECORD_IN;
+    keys += r.type == RECORD_KEY;
+    states += r.type == RECORD_STATE;
+    for (size_t i = 1; r.type == RECORD_STATE && i < r.body.size(); i += TAMBOX_HOST_TRACKS) {
+      if ((uint8_t)r.body[i] != TAMBOX_NOTUSED) { cfg.doubleTrack = true; }                     // Right track in use
+    }
+  }
+  printf("%s: %zu records of the last of %u starts, %u received, %u keys, %u track state changes, %.3f s%s\n", logPath, records.size(),
+         starts, in, keys, states, records.empty() ? 0.0 : records.back().millis / 1000.0, cfg.doubleTrack ? ", double track" : "");
+
+  cfg.isolated = true;
+  Sim sim(cfg);
+  Box& box = sim.box(station);
+  std::map<std::string, std::vector<std::string>> replayedOut;
+  sim.trace = [&](const TraceEntry& e) {
+    if (e.out && e.station == station && !isPing(e.topic)) { replayedOut[e.topic].push_back(normalized(e.payload)); }
+  };
+
+  auto wallStart = std::chrono::steady_clock::now();
+  box.powerOn();
+
+  std::string expected;
+  unsigned stateDiffs = 0;
+  for (const Record& r : records) {
+    usec at = (usec)r.millis * 1000;
+
+    if (realTime) {
+      std::this_thread::sleep_until(wallStart + std::chrono::microseconds(at));
+    }
+
+    if (r.type == RECORD_STATE) {
+      expected = r.body;
+      continue;
+    }
+
+    if (r.type != RECORD_IN && r.type != RECORD_KEY) { continue; }
+
+    sim.runUntil(at);
+    if (!expected.empty() && !statesAre(sim, station, expected, r.millis, verbose)) { stateDiffs++; }
+
+    if (r.type == RECORD_IN) { box.deliver(r.topic, r.body); }
+    else if (!r.body.empty()) { box.press(r.body, 0); }
+  }
+
+  if (!records.empty()) { sim.runUntil((usec)records.back().millis * 1000 + 1000); }
+  if (!expected.empty() && !statesAre(sim, station, expected, records.empty() ? 0 : records.back().millis, verbose)) { stateDiffs++; }
+  double wallSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+  unsigned outDiffs = 0, outCount = 0;
+  for (auto& topic : recordedOut) {
+    std::vector<std::string>& replayed = replayedOut[topic.first];
+    outCount += topic.second.size();
+    for (size_t i = 0; i < std::max(topic.second.size(), replayed.size()); i++) {
+      if (i < topic.second.size() && i < replayed.size() && topic.second[i] == replayed[i]) { continue; }
+      if (outDiffs == 0 || verbose) {
+        printf("%s #%zu\n  recorded %s\n  replayed %s\n", topic.first.c_str(), i + 1,
+               i < topic.second.size() ? topic.second[i].c_str() : "-", i < replayed.size() ? replayed[i].c_str() : "-");
+      }
+      outDiffs++;
+    }
+  }
+  for (auto& topic : replayedOut) {
+    if (!recordedOut.count(topic.first)) {
+      if (outDiffs == 0 || verbose) { printf("%s\n  not recorded, replayed %zu\n", topic.first.c_str(), topic.second.size()); }
+      outDiffs += topic.second.size();
+    }
+  }
+
+  printf("replayed in %.3f s: %.0f records/s, %.0fx real time\n", wallSec, records.size() / wallSec,
+         records.empty() ? 0.0 : records.back().millis / 1000.0 / wallSec);
+  printf("published: %u compared, %u different, track states: %u different\n", outCount, outDiffs, stateDiffs);
+  return outDiffs || stateDiffs ? 1 : 0;
+}
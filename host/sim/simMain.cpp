@@ -0,0 +1,496 @@
+/**
+  * tamBoxSim, runs a line of tamboxes and sends trains between them.
+  *
+  *   tamBoxSim [--stations N] [--double] [--trains N] [--pairs] [--settle S] [--keys STATION:KEYS@MS]...
+  *             [--pub TOPIC=PAYLOAD@MS]... [--expect STATION:DEST:STATE]... [--broker-down MS:S] [--max-loop MS] [--drop FILTER]...
+  *             [--flood N] [--cold-start S] [--reboot S] [--time S] [--param ID=VALUE]... [--record STATION:FILE] [--trace]
+  *             [--lcd] [--serial] [--keep]
+  *
+  * Without --keys or --pub, --trains trains run back and forth between station 1 and 2, or with
+  * --pairs between 1 and 2, 3 and 4, ... at the same time. Exits with 1 if a box isn't ready or a
+  * train doesn't reach its destination. The trains start --settle seconds after all boxes are ready,
+  * 0 by default.
+  *
+  * --keys and --pub are done MS after all boxes are ready, --pub publishes as another node would.
+  * At the end of the run every --expect is checked, e.g. 2:B:outtrain for the left track of B.
+  *
+  * --broker-down takes the broker down MS after all boxes are ready for S seconds, every box must
+  * be connected again at the end of the run. The longest loop() pass of each box after all boxes
+  * are ready is printed, with --max-loop it is an error if it is longer than MS.
+  *
+  * --drop loses the first message on a topic matching FILTER after all boxes are ready. The tam
+  * publish counts of every box are printed, a message given up on is an error.
+  *
+  * --flood runs N rounds of trains into tambox-2 from both neighbours on every track at once. The
+  * neighbours are played with messages like --pub, tambox-2 is operated with keys. The train out
+  * reports of a round come in one burst while the operator is busy, every one of them must move
+  * its track to intrain and no report text may be dropped. The report time is from the burst to
+  * the track state, the text time until the last text was shown.
+  *
+  * --cold-start compares the power on to ready time with and without the config cache. After the
+  * first start, from the config server, all boxes are powered off for S seconds and started again
+  * from the cache, then once more with the config server down, which is brought up again until
+  * the config check is retried. The clock of every box must be set from the config server after a
+  * start from the cache. While the server is down it is the time the cache was saved.
+  *
+  * --reboot forces tambox-2 off for S seconds while a train from tambox-1 is on its way to it. The
+  * time to a consistent state is from power on until both boxes show the train on the track again,
+  * from the retained snapshots, then the train is reported in. On double track the train runs on
+  * the left track of tambox-1 and comes in on the right track of tambox-2.
+  *
+  * --record writes the recorder log of a station to FILE at the end of the run, for tamBoxReplay.
+  * The module must be built with RECORDER, e.g. TAMBOX_MODULE=build/libtamBoxModuleRecorder.so.
+  */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "tamBoxSim.h"
+
+using namespace tamsim;
+
+struct ScriptedKeys { int station; std::string keys; usec at; };
+struct ScriptedPub { std::string topic; std::string payload; usec at; };
+struct Expected { int station; uint8_t dest; uint8_t state; };
+struct FloodResult { unsigned reports = 0; unsigned lost = 0; std::vector<usec> reportTime; std::vector<usec> textTime; };
+struct ColdStart { std::vector<usec> readyTime; unsigned fromCache = 0; unsigned clockOff = 0; };
+
+// TAMBOX_NOTUSED ... TAMBOX_LOST
+static const char* stateNames[] = {"notused", "idle", "trafdir", "inrequest", "inaccept", "intrain", "outrequest", "outaccept",
+                                   "outtrain", "lost"};
+
+
+static void usage() {
+
+  fprintf(stderr, "usage: tamBoxSim [--stations N] [--double] [--trains N] [--pairs] [--settle S] [--keys STATION:KEYS@MS]...\n"
+                  "                 [--pub TOPIC=PAYLOAD@MS]... [--expect STATION:DEST:STATE]... [--broker-down MS:S] [--max-loop MS] [--drop FILTER]...\n"
+                  "                 [--flood N] [--cold-start S] [--reboot S] [--time S] [--param ID=VALUE]... [--record STATION:FILE] [--trace]\n"
+                  "                 [--lcd] [--serial] [--keep]\n");
+  exit(2);
+}
+
+
+/*
+ * A tam message to tambox-2 as its neighbour on dest would send it, A is tambox-1 and B tambox-3
+ */
+static void floodPublish(Sim& sim, uint8_t dest, bool request, uint8_t track, uint16_t train) {
+
+  std::string neighbour = "tambox-" + std::to_string(dest == 0 ? 1 : 3);
+  std::string port = dest == 0 ? "b" : "a";                   // The neighbours port toward tambox-2
+  std::string when = std::to_string(sim.config().epoch + sim.now() / 1000000);
+  std::string body = "{\"tam\":{\"version\":\"1.0\",\"timestamp\":" + when + ",\"track\":\"" + (track ? "right" : "left") +
+                     "\",\"identity\":" + std::to_string(train) + ",";
+
+  if (request) {
+    body += "\"node-id\":\"tambox-2\",\"port-id\":\"" + std::string(dest == 0 ? "a" : "b") + "\",\"session-id\":\"req:" +
+            std::to_string(train) + "\",\"respond-to\":\"cmd/h0/tam/" + neighbour + "/" + port + "/res\",\"state\":{\"desired\":\"accept\"}}}";
+    sim.publish("cmd/h0/tam/tambox-2/" + std::string(dest == 0 ? "a" : "b") + "/req", body);
+  }
+
+  else {
+    body += "\"node-id\":\"" + neighbour + "\",\"port-id\":\"" + port + "\",\"session-id\":\"dt:" + std::to_string(train) +
+            "\",\"state\":{\"reported\":\"out\"}}}";
+    sim.publish("dt/h0/tam/" + neighbour + "/" + port, body);
+  }
+}
+
+
+static bool floodTracksAre(Sim& sim, unsigned tracks, uint8_t state) {
+
+  tamBoxStatus status = sim.box(2).status();
+  for (uint8_t dest = 0; dest < 2; dest++) {
+    for (uint8_t track = 0; track < tracks; track++) {
+      if (status.track[dest][track].state != state) { return false; }
+    }
+  }
+  return true;
+}
+
+
+/*
+ * One round, every track of tambox-2 gets a request that is accepted, then the train out reports
+ * all come at the same time while the operator looks at the station name, then the arrivals are
+ * reported. A report on the right track comes on the neighbours left track.
+ */
+static bool floodRound(Sim& sim, unsigned tracks, uint16_t firstTrain, FloodResult& result) {
+
+  std::string accept;
+  uint16_t train = firstTrain;
+
+  for (uint8_t dest = 0; dest < 2; dest++) {
+    for (uint8_t track = 0; track < tracks; track++) {
+      floodPublish(sim, dest, true, track, train++);
+      accept += std::string(1, 'A' + dest) + "#";
+    }
+  }
+
+  if (!sim.runUntil([&]() { return floodTracksAre(sim, tracks, TAMBOX_INREQUEST); }, 5000000)) { return false; }
+  sim.box(2).press(accept);
+  if (!sim.runUntil([&]() { return floodTracksAre(sim, tracks, TAMBOX_INACCEPT); }, 10000000)) { return false; }
+
+  sim.box(2).press("*");                                      // Station name on the LCD, the operator is busy
+  sim.runUntil([&]() { return sim.box(2).status().showText; }, 1000000);
+
+  usec burst = sim.now();
+  train = firstTrain;
+  for (uint8_t dest = 0; dest < 2; dest++) {
+    for (uint8_t track = 0; track < tracks; track++) {
+      floodPublish(sim, dest, false, tracks == 2 ? !track : track, train++);
+      result.reports++;
+    }
+  }
+
+  std::vector<bool> moved(2 * tracks, false);
+  sim.runUntil([&]() {
+    tamBoxStatus status = sim.box(2).status();
+    bool all = true;
+    for (unsigned i = 0; i < moved.size(); i++) {
+      if (!moved[i] && status.track[i / tracks][i % tracks].state == TAMBOX_INTRAIN) {
+        moved[i] = true;
+        result.reportTime.push_back(sim.now() - burst);
+      }
+      all = all && moved[i];
+    }
+    return all;
+  }, 60000000);
+
+  for (bool m : moved) { result.lost += m ? 0 : 1; }
+  sim.runUntil([&]() { tamBoxStatus status = sim.box(2).status(); return status.dtQueueLen == 0 && status.idle; }, 60000000);
+  result.textTime.push_back(sim.now() - burst);
+
+  std::string arrive;
+  for (uint8_t dest = 0; dest < 2; dest++) {
+    for (uint8_t track = 0; track < tracks; track++) { arrive += std::string(1, 'A' + dest) + "#"; }
+  }
+
+  sim.box(2).press(arrive);
+  return sim.runUntil([&]() { return floodTracksAre(sim, tracks, TAMBOX_IDLE); }, 10000000);
+}
+
+
+/*
+ * Power on to ready of every box, and how many seconds its clock is off the simulated wall clock
+ */
+static ColdStart coldStartResult(Sim& sim) {
+
+  ColdStart result;
+  for (int s = 1; s <= sim.stations(); s++) {
+    tamBoxStatus status = sim.box(s).status();
+    unsigned int now = sim.config().epoch + sim.box(s).localTime() / 1000000;
+    result.readyTime.push_back((usec)status.coldStartTime * 1000);
+    result.fromCache += status.configFromCache ? 1 : 0;
+    result.clockOff = std::max(result.clockOff, status.timestamp > now ? status.timestamp - now : now - status.timestamp);
+  }
+  return result;
+}
+
+
+static bool coldStartAgain(Sim& sim, usec offTime, bool httpUp) {
+
+  for (int s = 1; s <= sim.stations(); s++) { sim.box(s).powerOff(); }
+  sim.runFor(offTime);
+  sim.setHttpUp(httpUp);
+  sim.powerOnAll(500000);
+  return sim.runUntil([&sim]() { return sim.allReady(); }, 60000000);
+}
+
+
+static void coldStartPrint(const char* name, const ColdStart& result) {
+
+  printf("  %-20s ready p50 %8.1f ms  p100 %8.1f ms  %u from cache, clock off %u s\n", name, percentile(result.readyTime, 50) / 1000.0,
+         percentile(result.readyTime, 100) / 1000.0, result.fromCache, result.clockOff);
+}
+
+
+static bool trainIs(Sim& sim, uint8_t out, uint8_t in) {
+
+  uint8_t inTrack = sim.config().doubleTrack ? 1 : 0;         // The same track, seen from the other end
+
+  return sim.box(1).status().track[1][0].state == out && sim.box(2).status().track[0][inTrack].state == in;
+}
+
+
+/*
+ * tambox-1 B to tambox-2 A, tambox-2 is powered off once the train is out. The times are from
+ * power on, consistent when both show the train again.
+ */
+static bool rebootRun(Sim& sim, usec offTime, usec& readyTime, usec& consistentTime) {
+
+  sim.box(1).press("B5#");
+  if (!sim.runUntil([&]() { return trainIs(sim, TAMBOX_OUTREQUEST, TAMBOX_INREQUEST); }, 10000000)) { return false; }
+  sim.box(2).press("#");
+  if (!sim.runUntil([&]() { return trainIs(sim, TAMBOX_OUTACCEPT, TAMBOX_INACCEPT); }, 10000000)) { return false; }
+  sim.box(1).press("B#");
+  if (!sim.runUntil([&]() { return trainIs(sim, TAMBOX_OUTTRAIN, TAMBOX_INTRAIN); }, 10000000)) { return false; }
+  sim.runFor(1000000);                                        // The snapshots are retained
+
+  sim.box(2).powerOff();
+  sim.runFor(offTime);
+  sim.box(2).powerOn();
+  usec on = sim.now();
+  readyTime = 0;
+
+  if (!sim.runUntil([&]() {
+        if (!readyTime && sim.box(2).status().ready) { readyTime = sim.now() - on; }
+        return readyTime && trainIs(sim, TAMBOX_OUTTRAIN, TAMBOX_INTRAIN);
+      }, 60000000)) { return false; }
+  consistentTime = sim.now() - on;
+
+  sim.box(2).press("A#");
+  return sim.runUntil([&]() { return trainIs(sim, TAMBOX_IDLE, TAMBOX_IDLE); }, 10000000);
+}
+
+
+int main(int argc, char** argv) {
+
+  SimConfig cfg;
+  unsigned trains = 1;
+  usec settle = 0;
+  usec runTime = 300000000;
+  usec downAt = 0;
+  usec downTime = 0;
+  usec maxLoop = 0;
+  unsigned floodRounds = 0;
+  usec coldStartOff = 0;
+  usec rebootOff = 0;
+  int recordStation = 0;
+  std::string recordFile;
+  bool pairs = false;
+  bool trace = false;
+  bool showLcd = false;
+  std::vector<ScriptedKeys> scripted;
+  std::vector<ScriptedPub> pubs;
+  std::vector<Expected> expected;
+  std::vector<std::string> drops;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+    if (arg == "--stations" && value) { cfg.stations = atoi(value); i++; }
+    else if (arg == "--double") { cfg.doubleTrack = true; }
+    else if (arg == "--trains" && value) { trains = atoi(value); i++; }
+    else if (arg == "--time" && value) { runTime = (usec)(atof(value) * 1000000); i++; }
+    else if (arg == "--pairs") { pairs = true; }
+    else if (arg == "--settle" && value) { settle = (usec)(atof(value) * 1000000); i++; }
+    else if (arg == "--trace") { trace = true; }
+    else if (arg == "--lcd") { showLcd = true; }
+    else if (arg == "--serial") { setenv("TAMBOX_SERIAL", "1", 1); }
+    else if (arg == "--keep") { cfg.keepFiles = true; }
+    else if (arg == "--max-loop" && value) { maxLoop = (usec)atol(value) * 1000; i++; }
+    else if (arg == "--flood" && value) { floodRounds = atoi(value); i++; }
+    else if (arg == "--cold-start" && value) { coldStartOff = (usec)(atof(value) * 1000000); i++; }
+    else if (arg == "--reboot" && value) { rebootOff = (usec)(atof(value) * 1000000); i++; }
+    else if (arg == "--broker-down" && value && strchr(value, ':')) {
+      downAt = (usec)atol(value) * 1000;
+      downTime = (usec)(atof(strchr(value, ':') + 1) * 1000000);
+      i++;
+    }
+    else if (arg == "--record" && value && strchr(value, ':')) {
+      recordStation = atoi(value);
+      recordFile = strchr(value, ':') + 1;
+      i++;
+    }
+    else if (arg == "--drop" && value) { drops.push_back(value); i++; }
+    else if (arg == "--param" && value && strchr(value, '=')) {
+      const char* eq = strchr(value, '=');
+      cfg.params[std::string(value, eq - value)] = eq + 1;
+      i++;
+    }
+
+    else if (arg == "--keys" && value && strchr(value, ':')) {
+      const char* colon = strchr(value, ':');
+      const char* at = strchr(colon, '@');
+      scripted.push_back({atoi(value), at ? std::string(colon + 1, at - colon - 1) : std::string(colon + 1),
+                          at ? (usec)atol(at + 1) * 1000 : 0});
+      i++;
+    }
+
+    else if (arg == "--pub" && value && strchr(value, '=')) {
+      const char* eq = strchr(value, '=');
+      const char* at = strrchr(eq, '@');
+      pubs.push_back({std::string(value, eq - value), at ? std::string(eq + 1, at - eq - 1) : std::string(eq + 1),
+                      at ? (usec)atol(at + 1) * 1000 : 0});
+      i++;
+    }
+
+    else if (arg == "--expect" && value && strchr(value, ':') && strlen(strchr(value, ':')) > 3) {
+      const char* colon = strchr(value, ':');
+      Expected e = {atoi(value), (uint8_t)(colon[1] - 'A'), TAMBOX_LOST + 1};
+      for (uint8_t state = TAMBOX_NOTUSED; state <= TAMBOX_LOST; state++) {
+        if (colon[2] == ':' && strcmp(colon + 3, stateNames[state]) == 0) { e.state = state; }
+      }
+      if (e.dest >= TAMBOX_HOST_DESTS || e.state > TAMBOX_LOST) { usage(); }
+      expected.push_back(e);
+      i++;
+    }
+
+    else { usage(); }
+  }
+
+  if (cfg.stations < 2 || (floodRounds && cfg.stations < 3) || recordStation > (int)cfg.stations) {
+    usage();
+  }
+
+  Sim sim(cfg);
+  if (trace) {
+    sim.trace = [](const TraceEntry& e) {
+      printf("%10.3f %-10s %s %s %s\n", e.at / 1000.0, ("tambox-" + std::to_string(e.station)).c_str(), e.out ? "->" : "<-",
+             e.topic.c_str(), e.payload.c_str());
+    };
+  }
+
+  sim.powerOnAll(500000);
+  if (!sim.runUntil([&sim]() { return sim.allReady(); }, 60000000)) {
+    fprintf(stderr, "tamBoxSim: not all boxes ready after 60 s\n");
+    return 1;
+  }
+  printf("all %d boxes ready at %.3f s\n", sim.stations(), sim.now() / 1e6);
+  for (int s = 1; s <= sim.stations(); s++) { sim.box(s).clearLongestLoop(); }                  // The start up isn't measured
+  for (const std::string& filter : drops) { sim.drop(filter); }
+
+  bool ok = true;
+  if (coldStartOff) {
+    ColdStart server = coldStartResult(sim);
+    bool ready = coldStartAgain(sim, coldStartOff, true);
+    ColdStart cache = coldStartResult(sim);
+    ready = ready && coldStartAgain(sim, coldStartOff, false);
+    ColdStart cacheDown = coldStartResult(sim);
+    sim.setHttpUp(true);
+    sim.runFor(70000000);                                     // The config check is retried after a minute
+    ColdStart retried = coldStartResult(sim);
+
+    printf("cold start, %d boxes, powered off for %.0f s between the starts\n", sim.stations(), coldStartOff / 1e6);
+    coldStartPrint("config server", server);
+    coldStartPrint("cache", cache);
+    coldStartPrint("cache, server down", cacheDown);
+    coldStartPrint("server up again", retried);
+    ok = ready && cache.fromCache == (unsigned)sim.stations() && cacheDown.fromCache == (unsigned)sim.stations() &&
+         server.clockOff <= 1 && cache.clockOff <= 1 && retried.clockOff <= 1;
+  }
+
+  else if (rebootOff) {
+    usec readyTime = 0, consistentTime = 0;
+    sim.runFor(settle);
+    ok = rebootRun(sim, rebootOff, readyTime, consistentTime);
+    tamBoxStatus status = sim.box(2).status();
+    printf("reboot: tambox-2 off for %.1f s, ready after %.1f ms, consistent after %.1f ms, ", rebootOff / 1e6, readyTime / 1000.0,
+           consistentTime / 1000.0);
+    if (status.resyncTime) { printf("all snapshots after %lu ms%s\n", status.resyncTime, ok ? "" : ", failed"); }
+    else { printf("some snapshots not retained%s\n", ok ? "" : ", failed"); }
+  }
+
+  else if (floodRounds) {
+    FloodResult result;
+    unsigned tracks = cfg.doubleTrack ? 2 : 1;
+    unsigned round = 0;
+    sim.runFor(settle);
+    while (round < floodRounds && floodRound(sim, tracks, 100 * (round + 1), result)) { round++; }
+
+    tamBoxStatus status = sim.box(2).status();
+    printf("flood: %u of %u rounds, %u reports, %u lost, queue high %u, %u dropped\n", round, floodRounds, result.reports,
+           result.lost, status.dtQueueHigh, status.dtQueueDrops);
+    printf("report p50 %.1f ms, p100 %.1f ms, texts shown p50 %.1f ms\n", percentile(result.reportTime, 50) / 1000.0,
+           percentile(result.reportTime, 100) / 1000.0, percentile(result.textTime, 50) / 1000.0);
+    ok = round == floodRounds && result.lost == 0 && status.dtQueueDrops == 0;
+  }
+
+  else if (!scripted.empty() || !pubs.empty() || downTime) {
+    usec start = sim.now();
+    size_t k = 0, p = 0;
+    bool down = false;
+    while (k < scripted.size() || p < pubs.size() || (downTime && !down)) {                     // In time order, keys first
+      if (downTime && !down && (k == scripted.size() || downAt < scripted[k].at) && (p == pubs.size() || downAt < pubs[p].at)) {
+        sim.runUntil(start + downAt);
+        sim.setBrokerUp(false);
+        sim.runUntil(start + downAt + downTime);
+        sim.setBrokerUp(true);
+        printf("broker down from %.3f s to %.3f s\n", (start + downAt) / 1e6, sim.now() / 1e6);
+        down = true;
+      }
+      else if (p == pubs.size() || (k < scripted.size() && scripted[k].at <= pubs[p].at)) {
+        if (scripted[k].station < 1 || scripted[k].station > sim.stations()) { usage(); }
+        sim.runUntil(start + scripted[k].at);
+        sim.box(scripted[k].station).press(scripted[k].keys);
+        k++;
+      }
+      else {
+        sim.runUntil(start + pubs[p].at);
+        sim.publish(pubs[p].topic, pubs[p].payload);
+        p++;
+      }
+    }
+    sim.runUntil(start + runTime);
+  }
+
+  else {
+    Traffic traffic(sim);
+    for (int from = 1; from + 1 <= (pairs ? sim.stations() : 2); from += 2) {
+      for (unsigned t = 0; t < trains; t++) {
+        traffic.add(t % 2 ? from + 1 : from, t % 2 ? from : from + 1, 100 * from + t, sim.now() + settle);
+      }
+    }
+    ok = traffic.run(runTime) && traffic.failed == 0;
+    printf("trains: %u completed, %u failed, %u retried\n", traffic.completed, traffic.failed, traffic.retries);
+    if (traffic.completed) {
+      printf("request  p50 %.1f ms, run p50 %.1f ms\n", percentile(traffic.requestLatency, 50) / 1000.0,
+             percentile(traffic.runTime, 50) / 1000.0);
+    }
+  }
+
+  printf("messages: %llu published, %llu delivered, sim time %.3f s\n", (unsigned long long)sim.published,
+         (unsigned long long)sim.delivered, sim.now() / 1e6);
+
+  for (const Expected& e : expected) {
+    if (e.station < 1 || e.station > sim.stations()) { usage(); }
+    uint8_t state = sim.box(e.station).status().track[e.dest][0].state;
+    if (state != e.state) {
+      printf("tambox-%d %c is %s, expected %s\n", e.station, 'A' + e.dest, stateNames[state], stateNames[e.state]);
+      ok = false;
+    }
+  }
+
+  for (int s = 1; s <= sim.stations() && !drops.empty(); s++) {
+    tamBoxStatus status = sim.box(s).status();
+    printf("%s: %u tam messages sent, %u retries, %u failed\n", sim.box(s).id().c_str(), status.pubSent, status.pubRetries,
+           status.pubFailures);
+    ok = ok && status.pubFailures == 0;
+  }
+  if (!drops.empty()) { printf("%llu messages lost\n", (unsigned long long)sim.lost); }
+
+  for (int s = 1; s <= sim.stations() && (downTime || maxLoop); s++) {
+    tamBoxStatus status = sim.box(s).status();
+    printf("%s: longest loop %.1f ms, %u reconnects, %lu ms without broker\n", sim.box(s).id().c_str(),
+           sim.box(s).longestLoop() / 1000.0, status.mqttReconnects, status.mqttReconnectTime);
+    if (downTime && (!status.mqttConnected || status.mqttReconnects == 0)) {
+      printf("%s isn't connected again\n", sim.box(s).id().c_str());
+      ok = false;
+    }
+    if (maxLoop && sim.box(s).longestLoop() > maxLoop) {
+      printf("%s blocked loop() for more than %.1f ms\n", sim.box(s).id().c_str(), maxLoop / 1000.0);
+      ok = false;
+    }
+  }
+
+  if (recordStation > 0) {
+    sim.box(recordStation).powerOff();                        // Closes the segment being written
+    std::string log = sim.box(recordStation).recordLog();
+    FILE* file = fopen(recordFile.c_str(), "wb");
+    if (log.empty() || !file || fwrite(log.data(), 1, log.size(), file) != log.size()) {
+      printf("no recorder log of tambox-%d written to %s, is the module built with RECORDER?\n", recordStation, recordFile.c_str());
+      ok = false;
+    }
+    else {
+      printf("recorder log of tambox-%d, %zu bytes, written to %s\n", recordStation, log.size(), recordFile.c_str());
+    }
+    if (file) { fclose(file); }
+  }
+
+  if (showLcd) {
+    for (int s = 1; s <= sim.stations(); s++) { printf("%s\n%s", sim.box(s).id().c_str(), sim.box(s).lcdText().c_str()); }
+  }
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,828 @@
+/**
+  * Multi-box simulator for mqttTamBox, see tamBoxSim.h
+  */
+#include <dlfcn.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include "tamBoxSim.h"
+#include "mqttTamBox.h"
+
+#ifndef TAMBOX_MODULE_PATH
+#define TAMBOX_MODULE_PATH ""
+#endif
+
+namespace tamsim {
+
+static const char* BROKER_HOST = "broker.sim";
+static const uint8_t BROKER_IP[4] = {10, 0, 0, 1};
+static const char* BROKER_ADDRESS = "10.0.0.1";
+static const char* SCALE       = "h0";
+static const uint8_t LCD_ROWS  = 4;
+static const uint8_t LCD_COLS  = 20;
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Box
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+Box::Box(Sim* sim, int station) : sim(sim), index(station) {
+
+  nodeId = "tambox-" + std::to_string(station);
+  fsRoot = sim->dir + "/" + nodeId;
+  lcd.assign(LCD_ROWS, std::string(LCD_COLS, ' '));
+  fillOps();
+}
+
+
+Box::~Box() {
+
+  if (handle) { dlclose(handle); }
+}
+
+
+void Box::fillOps() {
+
+  memset(&ops, 0, sizeof(ops));
+  ops.ctx           = this;
+  ops.thingName     = nodeId.c_str();
+  ops.fsRoot        = fsRoot.c_str();
+  ops.param         = opParam;
+  ops.millis        = opMillis;
+  ops.micros        = opMicros;
+  ops.delay         = opDelay;
+  ops.resolve       = opResolve;
+  ops.mqttConnect   = opMqttConnect;
+  ops.mqttConnected = opMqttConnected;
+  ops.mqttState     = opMqttState;
+  ops.mqttPublish   = opMqttPublish;
+  ops.mqttSubscribe = opMqttSubscribe;
+  ops.mqttPoll      = opMqttPoll;
+  ops.getKey        = opGetKey;
+  ops.lcdBegin      = opLcdBegin;
+  ops.lcdClear      = opLcdClear;
+  ops.lcdSetCursor  = opLcdSetCursor;
+  ops.lcdWrite      = opLcdWrite;
+  ops.httpGet       = opHttpGet;
+}
+
+
+/*
+ * A fresh copy of the library per power on, dlopen would otherwise hand back the
+ * already loaded one with its globals as they were.
+ */
+void Box::powerOn() {
+
+  if (handle) { return; }
+
+  std::string copy = sim->dir + "/" + nodeId + "-" + std::to_string(++generation) + ".so";
+  {
+    std::ifstream src(sim->modulePath, std::ios::binary);
+    std::ofstream dst(copy, std::ios::binary);
+    if (!src || !dst) { throw std::runtime_error("can't copy " + sim->modulePath); }
+    dst << src.rdbuf();
+  }
+
+  handle = dlopen(copy.c_str(), RTLD_NOW | RTLD_LOCAL);
+  unlink(copy.c_str());
+  if (!handle) { throw std::runtime_error(std::string("dlopen: ") + dlerror()); }
+
+  tamBoxAttachFn attach = (tamBoxAttachFn)dlsym(handle, "tamBoxAttach");
+  fnSetup  = (tamBoxRunFn)dlsym(handle, "tamBoxSetup");
+  fnLoop   = (tamBoxRunFn)dlsym(handle, "tamBoxLoop");
+  fnStatus = (tamBoxGetStatusFn)dlsym(handle, "tamBoxGetStatus");
+  fnPage   = (tamBoxPageFn)dlsym(handle, "tamBoxPage");
+  fnDeliver = (tamBoxDeliverFn)dlsym(handle, "tamBoxDeliver");
+  if (!attach || !fnSetup || !fnLoop || !fnStatus || !fnPage || !fnDeliver) { throw std::runtime_error("tamBoxModule symbols missing"); }
+
+  bootTime = local;
+  keys.clear();
+  attach(&ops);
+  if (fnSetup() != TAMBOX_RUNNING) { powerOff(); }
+}
+
+
+void Box::powerOff() {
+
+  if (!handle) { return; }
+  sim->broker.dropped(*this, local, true);
+  dlclose(handle);
+  handle = nullptr;
+}
+
+
+void Box::loopOnce() {
+
+  auto start = std::chrono::steady_clock::now();
+  usec startLocal = local;
+  int result = fnLoop();
+  sim->loops++;
+
+  if (sim->cfg.cpuScale > 0) {
+    auto spent = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    local += (usec)(spent * sim->cfg.cpuScale);
+  }
+  local += sim->cfg.loopTime;
+  loopMax = std::max(loopMax, local - startLocal);
+
+  if (result == TAMBOX_RESTART) {
+    powerOff();
+    powerOn();
+  }
+
+  else if (result == TAMBOX_SLEEP) {
+    powerOff();
+  }
+}
+
+
+void Box::press(const std::string& pressed, usec gap) {
+
+  usec at = std::max(sim->clock, keyTime + gap);
+  for (char c : pressed) {
+    keys.push_back({at, c});
+    keyTime = at;
+    at += gap;
+  }
+}
+
+
+tamBoxStatus Box::status() {
+
+  tamBoxStatus status;
+  memset(&status, 0, sizeof(status));
+  if (handle) { fnStatus(&status); }
+  return status;
+}
+
+
+std::string Box::lcdText() const {
+
+  std::string text;
+  for (const std::string& row : lcd) { text += "|" + row + "|\n"; }
+  return text;
+}
+
+
+int Box::page(const char* uri, const char* query, std::string& content) {
+
+  static char buf[16384];
+
+  if (!handle) { return -1; }
+  int code = fnPage(uri, query, buf, sizeof(buf));
+  content = buf;
+  return code;
+}
+
+
+void Box::deliver(const std::string& topic, const std::string& payload) {
+
+  if (handle) { fnDeliver(topic.c_str(), payload.data(), payload.size()); }
+}
+
+
+std::string Box::recordLog() const {
+
+  std::string segment[RECORD_SEGMENTS];
+  const char* path[RECORD_SEGMENTS] = {RECORD_FILE_0, RECORD_FILE_1};
+  recordSegmentHeader head[RECORD_SEGMENTS];
+
+  for (int i = 0; i < RECORD_SEGMENTS; i++) {
+    std::ifstream file(fsRoot + path[i], std::ios::binary);
+    segment[i].assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    if (segment[i].size() < sizeof(head[i])) { segment[i].clear(); continue; }
+    memcpy(&head[i], segment[i].data(), sizeof(head[i]));
+    if (head[i].magic != RECORD_MAGIC) { segment[i].clear(); }
+  }
+
+  if (segment[0].empty() || segment[1].empty()) { return segment[0] + segment[1]; }
+  return head[0].seq < head[1].seq ? segment[0] + segment[1] : segment[1] + segment[0];
+}
+
+
+unsigned long Box::opMillis(void* ctx) {
+
+  Box* box = (Box*)ctx;
+  return (box->local - box->bootTime) / 1000;
+}
+
+
+unsigned long Box::opMicros(void* ctx) {
+
+  Box* box = (Box*)ctx;
+  return box->local - box->bootTime;
+}
+
+
+void Box::opDelay(void* ctx, unsigned long ms) {
+
+  ((Box*)ctx)->local += (usec)ms * 1000;
+}
+
+
+const char* Box::opParam(void* ctx, const char* id) {
+
+  Box* box = (Box*)ctx;
+  auto p = box->sim->cfg.params.find(id);
+  return p == box->sim->cfg.params.end() ? nullptr : p->second.c_str();
+}
+
+
+/*
+ * Only the broker name resolves, anything else blocks for the whole DNS timeout.
+ */
+bool Box::opResolve(void* ctx, const char* host, uint8_t ip[4], unsigned long timeout) {
+
+  Box* box = (Box*)ctx;
+
+  if (host == nullptr || strcmp(host, BROKER_HOST) != 0) {
+    box->local += (usec)timeout * 1000;
+    return false;
+  }
+
+  box->local += box->sim->cfg.dnsTime;
+  memcpy(ip, BROKER_IP, sizeof(BROKER_IP));
+  return true;
+}
+
+
+/*
+ * A broker that is down looks like a host that doesn't answer, the connect
+ * blocks for the whole TCP timeout.
+ */
+bool Box::opMqttConnect(void* ctx, const char* host, uint16_t port, const char* id, const char* user, const char* pass,
+                        const char* willTopic, bool willRetain, const char* willMsg, unsigned long timeout) {
+
+  Box* box = (Box*)ctx;
+  Sim* sim = box->sim;
+  (void)port; (void)id; (void)user; (void)pass;
+
+  if (!sim->broker.up || host == nullptr || (strcmp(host, BROKER_HOST) != 0 && strcmp(host, BROKER_ADDRESS) != 0)) {
+    box->local += (usec)timeout * 1000;
+    box->connected = false;
+    box->state = HAL_MQTT_CONNECT_FAILED;
+    return false;
+  }
+
+  box->local += 2 * sim->cfg.netDelay;                        // CONNECT and CONNACK
+  box->connected = true;
+  box->state = HAL_MQTT_CONNECTED;
+  box->subscriptions.clear();
+  box->inbox.clear();
+  box->willTopic = willTopic ? willTopic : "";
+  box->willMsg = willMsg ? willMsg : "";
+  box->willRetain = willRetain;
+  return true;
+}
+
+
+bool Box::opMqttConnected(void* ctx) {
+
+  return ((Box*)ctx)->connected;
+}
+
+
+int Box::opMqttState(void* ctx) {
+
+  return ((Box*)ctx)->state;
+}
+
+
+bool Box::opMqttPublish(void* ctx, const char* topic, const char* payload, size_t len, bool retain) {
+
+  Box* box = (Box*)ctx;
+
+  if (!box->connected) { return false; }
+  box->sim->broker.publish(box->index, box->local, topic, std::string(payload, len), retain);
+  return true;
+}
+
+
+bool Box::opMqttSubscribe(void* ctx, const char* topic) {
+
+  Box* box = (Box*)ctx;
+
+  if (!box->connected) { return false; }
+  if (std::find(box->subscriptions.begin(), box->subscriptions.end(), topic) == box->subscriptions.end()) {
+    box->subscriptions.push_back(topic);
+  }
+  box->sim->broker.subscribed(*box, topic);
+  return true;
+}
+
+
+bool Box::opMqttPoll(void* ctx, const char** topic, const char** payload, size_t* len) {
+
+  Box* box = (Box*)ctx;
+  Sim* sim = box->sim;
+
+  if (!box->connected || box->inbox.empty() || box->inbox.front().at > box->local) { return false; }
+
+  Delivery& d = box->inbox.front();
+  box->rxTopic.swap(d.topic);
+  box->rxPayload.swap(d.payload);
+  usec sent = d.sent;
+  box->inbox.pop_front();
+
+  sim->delivered++;
+  if (box->rxTopic.find("/tam/") != std::string::npos && box->rxTopic.find("/snapshot") == std::string::npos) {
+    sim->hopLatency.push_back(box->local - sent);
+  }
+  if (sim->trace) { sim->trace({box->local, box->index, false, box->rxTopic, box->rxPayload}); }
+
+  *topic = box->rxTopic.c_str();
+  *payload = box->rxPayload.data();
+  *len = box->rxPayload.size();
+  return true;
+}
+
+
+char Box::opGetKey(void* ctx) {
+
+  Box* box = (Box*)ctx;
+
+  if (box->keys.empty() || box->keys.front().first > box->local) { return 0; }
+  char key = box->keys.front().second;
+  box->keys.pop_front();
+  return key;
+}
+
+
+void Box::opLcdBegin(void* ctx, uint8_t cols, uint8_t rows) {
+
+  Box* box = (Box*)ctx;
+  box->lcd.assign(rows, std::string(cols, ' '));
+  box->lcdCol = box->lcdRow = 0;
+}
+
+
+void Box::opLcdClear(void* ctx) {
+
+  Box* box = (Box*)ctx;
+  for (std::string& row : box->lcd) { row.assign(row.size(), ' '); }
+  box->lcdCol = box->lcdRow = 0;
+}
+
+
+void Box::opLcdSetCursor(void* ctx, uint8_t col, uint8_t row) {
+
+  Box* box = (Box*)ctx;
+  box->lcdCol = col;
+  box->lcdRow = row;
+}
+
+
+void Box::opLcdWrite(void* ctx, uint8_t c) {
+
+  Box* box = (Box*)ctx;
+  if (box->lcdRow < box->lcd.size() && box->lcdCol < box->lcd[box->lcdRow].size()) {
+    box->lcd[box->lcdRow][box->lcdCol] = c >= ' ' && c < 0x7f ? c : '?';
+  }
+  box->lcdCol++;
+}
+
+
+/*
+ * The config server. The ETag covers the config, not the epoch, so an unchanged
+ * config is answered with 304.
+ */
+void Box::opHttpGet(void* ctx, const char* url, const char* ifNoneMatch, unsigned long timeout, halHttpResult* res) {
+
+  Box* box = (Box*)ctx;
+  Sim* sim = box->sim;
+
+  sim->httpRequests++;
+  if (!sim->httpUp) {
+    box->local += (usec)timeout * 1000;
+    res->code = -1;
+    return;
+  }
+
+  box->local += sim->cfg.httpTime;
+  uint32_t epoch = sim->cfg.epoch + box->local / 1000000;
+
+  const char* id = strstr(url, "id=");
+  int station = id && strncmp(id + 3, "tambox-", 7) == 0 ? atoi(id + 10) : 0;
+  if (station < 1 || station > sim->stations()) {
+    box->httpBody = "{}";
+    box->httpEtag = "";
+  }
+
+  else {
+    std::string config = sim->configFor(station, 0);
+    uint32_t hash = 2166136261u;
+    for (char c : config) { hash = (hash ^ (uint8_t)c) * 16777619u; }
+    char etag[16];
+    snprintf(etag, sizeof(etag), "\"%08x\"", hash);
+    box->httpEtag = etag;
+    box->httpBody = sim->configFor(station, epoch);
+  }
+
+  char date[40];
+  time_t now = epoch;
+  struct tm tm;
+  gmtime_r(&now, &tm);
+  strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  box->httpDate = date;
+
+  bool notModified = !box->httpEtag.empty() && ifNoneMatch && box->httpEtag == ifNoneMatch;
+  res->code    = notModified ? HTTP_CODE_NOT_MODIFIED : HTTP_CODE_OK;
+  res->body    = notModified ? "" : box->httpBody.c_str();
+  res->bodyLen = notModified ? 0 : box->httpBody.size();
+  res->etag    = box->httpEtag.c_str();
+  res->date    = box->httpDate.c_str();
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Broker
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+bool Broker::matches(const std::string& filter, const std::string& topic) {
+
+  size_t f = 0, t = 0;
+
+  while (f < filter.size()) {
+    if (filter[f] == '#') { return true; }
+    if (filter[f] == '+') {
+      while (t < topic.size() && topic[t] != '/') { t++; }
+      f++;
+    }
+
+    else {
+      if (t >= topic.size() || filter[f] != topic[t]) { return false; }
+      f++;
+      t++;
+    }
+  }
+
+  return t == topic.size();
+}
+
+
+void Broker::publish(int from, usec at, const std::string& topic, const std::string& payload, bool retain) {
+
+  sim->published++;
+  if (sim->trace) { sim->trace({at, from, true, topic, payload}); }
+  pending.push({at + sim->cfg.netDelay, seq++, at, from, topic, payload, retain});
+}
+
+
+/*
+ * Messages are handled in the order the broker received them, each delivery
+ * takes brokerTime so a burst queues up.
+ */
+void Broker::process(usec upTo) {
+
+  while (!pending.empty() && pending.top().received <= upTo) {
+    Pending p = pending.top();
+    pending.pop();
+    if (!up) { continue; }
+
+    auto drop = std::find_if(drops.begin(), drops.end(), [&p](const std::string& filter) { return matches(filter, p.topic); });
+    if (drop != drops.end()) {
+      drops.erase(drop);
+      sim->lost++;
+      if (sim->trace) { sim->trace({p.received, 0, false, p.topic, "(lost)"}); }
+      continue;
+    }
+
+    if (p.retain) {
+      if (p.payload.empty()) { retained.erase(p.topic); }
+      else { retained[p.topic] = p.payload; }
+    }
+
+    usec at = std::max(freeAt, p.received);
+    for (auto& box : sim->boxes) {
+      if (!box->connected) { continue; }
+      for (const std::string& filter : box->subscriptions) {
+        if (matches(filter, p.topic)) {
+          at += sim->cfg.brokerTime;
+          deliver(*box, at + sim->cfg.netDelay, p.sent, p.topic, p.payload);
+          break;
+        }
+      }
+    }
+    freeAt = at;
+  }
+}
+
+
+void Broker::deliver(Box& box, usec at, usec sent, const std::string& topic, const std::string& payload) {
+
+  if (sim->cfg.isolated) { return; }
+  auto pos = box.inbox.end();
+  while (pos != box.inbox.begin() && std::prev(pos)->at > at) { --pos; }
+  box.inbox.insert(pos, {at, sent, topic, payload});
+}
+
+
+void Broker::subscribed(Box& box, const std::string& filter) {
+
+  if (!up) { return; }
+  usec at = std::max(freeAt, box.local + sim->cfg.netDelay);
+  for (auto& r : retained) {
+    if (matches(filter, r.first)) {
+      at += sim->cfg.brokerTime;
+      deliver(box, at + sim->cfg.netDelay, box.local, r.first, r.second);
+    }
+  }
+  freeAt = at;
+}
+
+
+void Broker::dropped(Box& box, usec at, bool sendWill) {
+
+  if (box.connected && sendWill && up && !box.willTopic.empty()) {
+    publish(box.index, at, box.willTopic, box.willMsg, box.willRetain);
+  }
+  box.connected = false;
+  box.state = HAL_MQTT_CONNECTION_TIMEOUT;
+  box.subscriptions.clear();
+  box.inbox.clear();
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Sim
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+Sim::Sim(const SimConfig& config) : cfg(config), broker(this) {
+
+  modulePath = cfg.module;
+  if (modulePath.empty() && getenv("TAMBOX_MODULE")) { modulePath = getenv("TAMBOX_MODULE"); }
+  if (modulePath.empty()) { modulePath = TAMBOX_MODULE_PATH; }
+
+  char tmpl[] = "/tmp/tambox-sim-XXXXXX";
+  if (!mkdtemp(tmpl)) { throw std::runtime_error("mkdtemp failed"); }
+  dir = tmpl;
+
+  for (unsigned i = 1; i <= cfg.stations; i++) { boxes.emplace_back(new Box(this, i)); }
+}
+
+
+static int removeEntry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+
+  (void)st; (void)flag; (void)ftw;
+  return remove(path);
+}
+
+
+Sim::~Sim() {
+
+  boxes.clear();
+  if (!cfg.keepFiles) { nftw(dir.c_str(), removeEntry, 8, FTW_DEPTH | FTW_PHYS); }
+}
+
+
+void Sim::powerOnAll(usec spread) {
+
+  uint32_t seed = 12345;
+  for (auto& box : boxes) {
+    seed = seed * 1103515245 + 12345;
+    box->local = clock + (spread ? (seed >> 8) % spread : 0);
+    box->powerOn();
+  }
+}
+
+
+/*
+ * The box furthest behind runs next, until every box has passed at. The broker
+ * first delivers what it received up to that box's time.
+ */
+void Sim::runUntil(usec at) {
+
+  for (;;) {
+    Box* next = nullptr;
+    for (auto& box : boxes) {
+      if (box->running() && (!next || box->local < next->local)) { next = box.get(); }
+    }
+
+    if (!next || next->local >= at) { break; }
+    clock = std::max(clock, next->local);
+    broker.process(next->local);
+    next->loopOnce();
+  }
+
+  clock = std::max(clock, at);
+  broker.process(clock);
+  for (auto& box : boxes) {
+    if (!box->running() && box->local < clock) { box->local = clock; }
+  }
+}
+
+
+bool Sim::runUntil(const std::function<bool()>& done, usec timeout, usec step) {
+
+  usec end = clock + timeout;
+  while (!done()) {
+    if (clock >= end) { return false; }
+    runUntil(std::min(end, clock + step));
+  }
+  return true;
+}
+
+
+bool Sim::allReady() {
+
+  for (auto& box : boxes) {
+    if (!box->running() || !box->status().ready) { return false; }
+  }
+  return true;
+}
+
+
+void Sim::setBrokerUp(bool isUp) {
+
+  if (broker.up == isUp) { return; }
+  if (!isUp) {
+    for (auto& box : boxes) { broker.dropped(*box, clock, false); }
+    broker.retained.clear();                                  // A restarted broker without persistence
+  }
+  broker.up = isUp;
+}
+
+
+void Sim::publish(const std::string& topic, const std::string& payload, bool retain) {
+
+  broker.publish(0, clock, topic, payload, retain);
+}
+
+
+/*
+ * Stations on a line, A is toward the lower number and B toward the higher,
+ * the neighbour is always entered on the opposite exit.
+ */
+std::string Sim::configFor(int station, unsigned int epoch) {
+
+  const char* type = cfg.doubleTrack ? "double" : "single";
+  int tracks = cfg.doubleTrack ? 2 : 1;
+  std::string name = "Station " + std::to_string(station) + (configVersion > 1 ? " v" + std::to_string(configVersion) : "");
+  std::string dests;
+  int count = 0;
+
+  for (int side = 0; side < 2; side++) {
+    int neighbour = side == 0 ? station - 1 : station + 1;
+    if (neighbour < 1 || neighbour > stations()) { continue; }
+    if (count++) { dests += ","; }
+    dests += std::string("\"") + (side == 0 ? "A" : "B") + "\":{\"tracks\":" + std::to_string(tracks) + ",\"type\":\"" + type +
+             "\",\"" + type + "\":{\"id\":\"tambox-" + std::to_string(neighbour) + "\",\"tracks\":" + std::to_string(tracks) +
+             ",\"exit\":\"" + (side == 0 ? "B" : "A") + "\",\"signature\":\"S" + std::to_string(neighbour) + "\"}}";
+  }
+
+  return "{\"id\":\"tambox-" + std::to_string(station) + "\",\"config\":{\"signature\":\"S" + std::to_string(station) +
+         "\",\"name\":\"" + name + "\",\"destinations\":" + std::to_string(count) + ",\"destination\":{" + dests +
+         "}},\"mqtt\":{\"server\":\"" + BROKER_HOST + "\",\"port\":1883,\"usr\":\"\",\"pwd\":\"\",\"scale\":\"" + SCALE +
+         "\",\"epoch\":" + std::to_string(epoch) + "}}";
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Traffic
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+enum {WAIT_START, WAIT_OUTREQUEST, WAIT_INREQUEST, WAIT_OUTACCEPT, WAIT_INTRAIN, WAIT_IDLE};
+
+
+void Traffic::add(int from, int to, uint16_t train, usec at) {
+
+  active.push_back({from, to, train, at, WAIT_START, at, 0, 0});
+}
+
+
+/*
+ * Trains run out on the left track, on a double track they arrive on the right track.
+ */
+uint8_t Traffic::trackState(int station, int toward, bool in) {
+
+  return sim.box(station).status().track[dest(station, toward)][in && sim.config().doubleTrack ? 1 : 0].state;
+}
+
+
+bool Traffic::busy(const Run& run, size_t index) {
+
+  for (size_t i = 0; i < index; i++) {                        // Earlier runs at the same stations go first
+    const Run& r = active[i];
+    if (r.from == run.from || r.from == run.to || r.to == run.from || r.to == run.to) { return true; }
+  }
+  return false;
+}
+
+
+void Traffic::press(int station, const std::string& keys, Run& run) {
+
+  Box& box = sim.box(station);
+  box.press(keys, keyGap);
+  run.keyAt = box.lastKeyTime();
+}
+
+
+/*
+ * The operators wait for the tambox before the next step, like they would for the LCD. A
+ * rejected direction or request is tried again after retryDelay, a run that doesn't move on
+ * within phaseTimeout counts as failed.
+ */
+void Traffic::step() {
+
+  usec now = sim.now();
+
+  for (size_t i = 0; i < active.size(); ) {
+    Run& r = active[i];
+    bool finished = false;
+
+    if (r.phase != WAIT_START && now - r.phaseStart > phaseTimeout) {
+      failed++;
+      finished = true;
+    }
+
+    else if (r.phase >= WAIT_OUTREQUEST && r.phase <= WAIT_OUTACCEPT && now > r.keyAt + sim.config().loopTime * 2 &&
+             trackState(r.from, r.to) == TAMBOX_IDLE) {                                         // Rejected, try again later
+      retries++;
+      r.start = now + retryDelay;
+      r.phase = WAIT_START;
+    }
+
+    else switch (r.phase) {
+      case WAIT_START:
+        if (now >= r.start && !busy(r, i) && trackState(r.from, r.to) == TAMBOX_IDLE && trackState(r.to, r.from, true) == TAMBOX_IDLE) {
+          r.begun = now;
+          press(r.from, std::string(1, key(r.from, r.to)), r);
+          r.phase = WAIT_OUTREQUEST;
+          r.phaseStart = now;
+        }
+      break;
+
+      case WAIT_OUTREQUEST:
+        if (now >= r.keyAt && trackState(r.from, r.to) == TAMBOX_OUTREQUEST) {
+          directionLatency.push_back(now - r.keyAt);
+          press(r.from, std::to_string(r.train) + "#", r);
+          r.phase = WAIT_INREQUEST;
+          r.phaseStart = now;
+        }
+      break;
+
+      case WAIT_INREQUEST:
+        if (now >= r.keyAt && trackState(r.to, r.from, true) == TAMBOX_INREQUEST) {
+          requestLatency.push_back(now - r.keyAt);
+          press(r.to, "#", r);
+          r.phase = WAIT_OUTACCEPT;
+          r.phaseStart = now;
+        }
+      break;
+
+      case WAIT_OUTACCEPT:
+        if (now >= r.keyAt && trackState(r.from, r.to) == TAMBOX_OUTACCEPT) {
+          acceptLatency.push_back(now - r.keyAt);
+          press(r.from, std::string(1, key(r.from, r.to)) + "#", r);
+          r.phase = WAIT_INTRAIN;
+          r.phaseStart = now;
+        }
+      break;
+
+      case WAIT_INTRAIN:
+        if (now >= r.keyAt && trackState(r.to, r.from, true) == TAMBOX_INTRAIN) {
+          departLatency.push_back(now - r.keyAt);
+          press(r.to, std::string(1, key(r.to, r.from)) + "#", r);
+          r.phase = WAIT_IDLE;
+          r.phaseStart = now;
+        }
+      break;
+
+      case WAIT_IDLE:
+        if (now >= r.keyAt && trackState(r.from, r.to) == TAMBOX_IDLE && trackState(r.to, r.from, true) == TAMBOX_IDLE) {
+          arriveLatency.push_back(now - r.keyAt);
+          runTime.push_back(now - r.begun);
+          completed++;
+          finished = true;
+        }
+      break;
+    }
+
+    if (finished) { active.erase(active.begin() + i); }
+    else { i++; }
+  }
+}
+
+
+bool Traffic::run(usec timeout) {
+
+  return sim.runUntil([this]() { step(); return done(); }, timeout);
+}
+
+
+usec percentile(std::vector<usec> values, double p) {
+
+  if (values.empty()) { return 0; }
+  size_t rank = (size_t)(p / 100.0 * (values.size() - 1) + 0.5);
+  std::nth_element(values.begin(), values.begin() + rank, values.end());
+  return values[rank];
+}
+
+}
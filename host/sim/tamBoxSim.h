@@ -0,0 +1,280 @@
+/**
+  * Multi-box simulator for mqttTamBox.
+  *
+  * Every box is its own copy of the tamBoxModule shared library, so each has its own globals, and
+  * its own clock. The boxes are run one loop() at a time, always the box that is furthest behind,
+  * so a box never sees a message before it was sent. The broker, the config server and the
+  * operators at the keypads are simulated here.
+  *
+  * Times are in simulated us unless the name says otherwise.
+  */
+#ifndef TAMBOX_SIM_H
+#define TAMBOX_SIM_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+#include "tamBoxHal.h"
+#include "tamBoxModule.h"
+
+namespace tamsim {
+
+typedef uint64_t usec;
+
+struct SimConfig {
+  unsigned stations = 3;                                      // tambox-1 ... tambox-<stations> on a line
+  bool doubleTrack = false;                                   // Double instead of single track between the stations
+  usec loopTime = 1000;                                       // One idle loop() pass on the ESP8266
+  double cpuScale = 0;                                        // Host time of a loop() pass times cpuScale is added, 0 leaves it out
+  usec netDelay = 2000;                                       // One way between a box and the broker
+  usec brokerTime = 50;                                       // Broker time per delivered message, deliveries are served in order
+  usec httpTime = 40000;                                      // Config server answer
+  usec dnsTime = 5000;                                        // Broker name lookup
+  uint32_t epoch = 1760000000;                                // Wall clock at the start of the simulation
+  std::map<std::string, std::string> params;                  // IotWebConf parameter values for every box, e.g. webDtShowTime
+  std::string module;                                         // tamBoxModule library, TAMBOX_MODULE or the built one when empty
+  bool keepFiles = false;                                     // Keep the work directory with the box file systems
+  bool isolated = false;                                      // The broker delivers nothing, only Box::deliver, see tamBoxReplay
+};
+
+struct TraceEntry {                                           // One message, see Sim::trace
+  usec at;
+  int station;
+  bool out;                                                   // Published by the station, else delivered to it
+  std::string topic;
+  std::string payload;
+};
+
+class Sim;
+
+/**
+ * One tambox
+ */
+class Box {
+ public:
+  Box(Sim* sim, int station);
+  ~Box();
+
+  void powerOn(void);                                         // Loads a fresh copy of the module and runs setup()
+  void powerOff(void);                                        // The broker sees the connection drop
+  bool running() const { return handle != nullptr; }
+  void press(const std::string& keys, usec gap = 100000);     // Queues key presses, the first one now
+  tamBoxStatus status(void);
+  std::string lcdText(void) const;
+  int page(const char* uri, const char* query, std::string& content);
+  void deliver(const std::string& topic, const std::string& payload);  // Straight to mqttCallback, not through the broker
+  std::string recordLog(void) const;                          // Recorder segments oldest first, as on /record, empty without RECORDER
+
+  const std::string& id() const { return nodeId; }
+  int station() const { return index; }
+  usec localTime() const { return local; }
+  usec lastKeyTime() const { return keyTime; }
+  usec longestLoop() const { return loopMax; }                // Longest loop() pass, blocking calls included
+  void clearLongestLoop() { loopMax = 0; }
+
+ private:
+  friend class Sim;
+  friend struct Broker;
+
+  void loopOnce(void);
+  void fillOps(void);
+
+  static unsigned long opMillis(void* ctx);
+  static unsigned long opMicros(void* ctx);
+  static void opDelay(void* ctx, unsigned long ms);
+  static const char* opParam(void* ctx, const char* id);
+  static bool opResolve(void* ctx, const char* host, uint8_t ip[4], unsigned long timeout);
+  static bool opMqttConnect(void* ctx, const char* host, uint16_t port, const char* id, const char* user, const char* pass,
+                            const char* willTopic, bool willRetain, const char* willMsg, unsigned long timeout);
+  static bool opMqttConnected(void* ctx);
+  static int opMqttState(void* ctx);
+  static bool opMqttPublish(void* ctx, const char* topic, const char* payload, size_t len, bool retain);
+  static bool opMqttSubscribe(void* ctx, const char* topic);
+  static bool opMqttPoll(void* ctx, const char** topic, const char** payload, size_t* len);
+  static char opGetKey(void* ctx);
+  static void opLcdBegin(void* ctx, uint8_t cols, uint8_t rows);
+  static void opLcdClear(void* ctx);
+  static void opLcdSetCursor(void* ctx, uint8_t col, uint8_t row);
+  static void opLcdWrite(void* ctx, uint8_t c);
+  static void opHttpGet(void* ctx, const char* url, const char* ifNoneMatch, unsigned long timeout, halHttpResult* res);
+
+  Sim* sim;
+  int index;
+  std::string nodeId;
+  std::string fsRoot;
+  tamBoxHalOps ops;
+  void* handle = nullptr;
+  unsigned generation = 0;
+  tamBoxRunFn fnSetup = nullptr;
+  tamBoxRunFn fnLoop = nullptr;
+  tamBoxGetStatusFn fnStatus = nullptr;
+  tamBoxPageFn fnPage = nullptr;
+  tamBoxDeliverFn fnDeliver = nullptr;
+
+  usec local = 0;                                             // Clock of this box
+  usec bootTime = 0;                                          // local at power on, millis() counts from here
+  usec loopMax = 0;
+
+  // Broker session
+  bool connected = false;
+  int state = HAL_MQTT_DISCONNECTED;
+  std::vector<std::string> subscriptions;
+  std::string willTopic;
+  std::string willMsg;
+  bool willRetain = false;
+  struct Delivery { usec at; usec sent; std::string topic; std::string payload; };
+  std::deque<Delivery> inbox;                                 // Sorted on at
+  std::string rxTopic;
+  std::string rxPayload;
+
+  std::deque<std::pair<usec, char>> keys;
+  usec keyTime = 0;                                           // When the last queued key is pressed
+  std::vector<std::string> lcd;
+  uint8_t lcdCol = 0;
+  uint8_t lcdRow = 0;
+  std::string httpBody;
+  std::string httpEtag;
+  std::string httpDate;
+};
+
+
+/**
+ * The broker, retained messages and wills, no QoS 1 or 2
+ */
+struct Broker {
+  struct Pending { usec received; uint64_t seq; usec sent; int from; std::string topic; std::string payload; bool retain; };
+  struct Later { bool operator()(const Pending& a, const Pending& b) const { return a.received != b.received ? a.received > b.received : a.seq > b.seq; } };
+
+  explicit Broker(Sim* sim) : sim(sim) {}
+  static bool matches(const std::string& filter, const std::string& topic);
+  void publish(int from, usec at, const std::string& topic, const std::string& payload, bool retain);
+  void process(usec upTo);                                    // Delivers the messages received up to upTo
+  void deliver(Box& box, usec at, usec sent, const std::string& topic, const std::string& payload);
+  void subscribed(Box& box, const std::string& filter);       // Sends the retained messages
+  void dropped(Box& box, usec at, bool sendWill);
+
+  Sim* sim;
+  bool up = true;
+  usec freeAt = 0;                                            // Broker busy until
+  uint64_t seq = 0;
+  std::priority_queue<Pending, std::vector<Pending>, Later> pending;
+  std::map<std::string, std::string> retained;
+  std::vector<std::string> drops;                             // Topic filters, the next message on each is lost
+};
+
+
+/**
+ * The simulation, stations are numbered from 1
+ */
+class Sim {
+ public:
+  explicit Sim(const SimConfig& config);
+  ~Sim();
+
+  Box& box(int station) { return *boxes.at(station - 1); }
+  int stations() const { return boxes.size(); }
+  usec now() const { return clock; }
+  const SimConfig& config() const { return cfg; }
+
+  void powerOnAll(usec spread = 0);                           // Power on times are spread over spread us
+  void runUntil(usec at);
+  void runFor(usec time) { runUntil(clock + time); }
+  bool runUntil(const std::function<bool()>& done, usec timeout, usec step = 1000);  // false on timeout
+  bool allReady(void);
+
+  void setBrokerUp(bool up);
+  void drop(const std::string& filter) { broker.drops.push_back(filter); }  // Loses the next message on filter
+  void publish(const std::string& topic, const std::string& payload, bool retain = false);  // From outside, station 0 in the trace
+  void setHttpUp(bool up) { httpUp = up; }
+  void setConfigVersion(int version) { configVersion = version; }  // Changes the station names on the config server
+  std::string configFor(int station, unsigned int epoch);
+  std::string workDir() const { return dir; }
+
+  std::function<void(const TraceEntry&)> trace;
+  std::vector<usec> hopLatency;                               // Publish to delivery of the tam messages
+  uint64_t published = 0;
+  uint64_t delivered = 0;
+  uint64_t lost = 0;                                          // Taken by drop
+  uint64_t loops = 0;
+  uint64_t httpRequests = 0;
+
+ private:
+  friend class Box;
+  friend struct Broker;
+
+  SimConfig cfg;
+  std::vector<std::unique_ptr<Box>> boxes;
+  std::vector<usec> powerOnAt;
+  Broker broker;
+  usec clock = 0;
+  bool httpUp = true;
+  int configVersion = 1;
+  std::string dir;
+  std::string modulePath;
+};
+
+
+/**
+ * Operators sending trains between neighbours, runs that share a station go in the order they
+ * were added. Each train is
+ *   sender:   dest key, train number, #        request
+ *   receiver: #                                accept
+ *   sender:   dest key, #                      train out
+ *   receiver: dest key, #                      train in
+ */
+class Traffic {
+ public:
+  struct Run {
+    int from;
+    int to;
+    uint16_t train;
+    usec start;
+    int phase;
+    usec phaseStart;
+    usec keyAt;                                               // When the last key of the phase was pressed
+    usec begun;
+  };
+
+  Traffic(Sim& sim, usec keyGap = 100000) : sim(sim), keyGap(keyGap) {}
+
+  void add(int from, int to, uint16_t train, usec at);
+  void step(void);                                            // Call every simulated ms
+  bool done() const { return active.empty(); }
+  bool run(usec timeout);                                     // Steps until done, false on timeout
+
+  std::vector<usec> directionLatency;                         // Sender dest key to _OUTREQUEST
+  std::vector<usec> requestLatency;                           // Sender # to receiver _INREQUEST
+  std::vector<usec> acceptLatency;                            // Receiver # to sender _OUTACCEPT
+  std::vector<usec> departLatency;                            // Sender # to receiver _INTRAIN
+  std::vector<usec> arriveLatency;                            // Receiver # to sender _IDLE
+  std::vector<usec> runTime;                                  // First key to both tracks idle
+  unsigned completed = 0;
+  unsigned failed = 0;
+  unsigned retries = 0;                                       // Rejected and started again
+  usec phaseTimeout = 60000000;
+  usec retryDelay = 5000000;
+
+ private:
+  char key(int station, int toward) const { return toward > station ? 'B' : 'A'; }
+  uint8_t dest(int station, int toward) const { return toward > station ? 1 : 0; }
+  uint8_t trackState(int station, int toward, bool in = false);
+  bool busy(const Run& run, size_t index);
+  void press(int station, const std::string& keys, Run& run);
+
+  Sim& sim;
+  usec keyGap;
+  std::vector<Run> active;
+};
+
+
+// Percentile of the values, p in 0 - 100
+usec percentile(std::vector<usec> values, double p);
+
+}
+
+#endif
@@ -0,0 +1,103 @@
+/**
+  * The sketch built as one tambox for the host.
+  *
+  * mqttTamBox.ino is compiled as it is, with TAMBOX_HOST set, against the stubs in host/arduino and
+  * the host branch of tamBoxHal.h.
+  */
+#include <Arduino.h>
+#include "mqttTamBox.ino"
+#include "tamBoxModule.h"
+
+const tamBoxHalOps* halOps;
+
+static_assert(TAMBOX_HOST_DESTS >= DEST_BUTTONS && TAMBOX_HOST_TRACKS == MAX_NUM_OF_TRACKS, "tamBoxStatus size");
+static_assert((int)TAMBOX_IDLE == _IDLE && (int)TAMBOX_INTRAIN == _INTRAIN && (int)TAMBOX_OUTTRAIN == _OUTTRAIN && (int)TAMBOX_LOST == _LOST,
+              "tamBoxModule.h track states");
+
+
+TAMBOX_API void tamBoxAttach(const tamBoxHalOps* ops) {
+
+  halOps = ops;
+}
+
+
+static int tamBoxRun(void (*step)(void)) {
+
+  try {
+    step();
+  }
+
+  catch (const tamBoxRestart&) {
+    return TAMBOX_RESTART;
+  }
+
+  catch (const tamBoxSleep&) {
+    return TAMBOX_SLEEP;
+  }
+
+  return TAMBOX_RUNNING;
+}
+
+
+TAMBOX_API int tamBoxSetup() { return tamBoxRun(setup); }
+TAMBOX_API int tamBoxLoop() { return tamBoxRun(loop); }
+
+
+TAMBOX_API void tamBoxGetStatus(tamBoxStatus* status) {
+
+  memset(status, 0, sizeof(*status));
+  status->ready             = tamboxReady;
+  status->idle              = tamBoxIdle;
+  status->showText          = showText;
+  status->configFromCache   = configFromCache;
+  status->mqttState         = mqttState;
+  status->mqttConnected     = mqttState == MQTT_CONNECTED && mqttClient.connected();
+  status->destination       = destination;
+  for (uint8_t dest = 0; dest < DEST_BUTTONS; dest++) {                                         // Exits not in the profile stay _NOTUSED
+    for (uint8_t track = 0; track < MAX_NUM_OF_TRACKS; track++) {
+      status->track[dest][track] = {ports.at(dest, track).trainId, ports.at(dest, track).state, ports.at(dest, track).traffDir};
+    }
+
+    status->pubSent        += pubStat[dest].sent;
+    status->pubRetries     += pubStat[dest].retries;
+    status->pubFailures    += pubStat[dest].failures;
+  }
+
+  status->dtQueueLen        = dtQueueLen;
+  status->dtQueueHigh       = dtQueueHigh;
+  status->dtQueueDrops      = dtQueueDrops;
+  status->coldStartTime     = coldStartTime;
+  status->resyncTime        = resyncTime;
+  status->mqttReconnectTime = mqttReconnectTime;
+  status->mqttReconnects    = mqttReconnects;
+  status->mqttReceived      = mqttReceived;
+  status->epochTime         = epochTime;
+  status->timestamp         = epochTime + halMillis() / 1000;
+  status->lcdI2cBytes       = lcdI2cBytes;
+  status->lcdUpdates        = lcdUpdates;
+}
+
+
+TAMBOX_API void tamBoxDeliver(const char* topic, const char* payload, size_t len) {
+
+  static char topicBuf[LCP_TOPIC_LEN + 1];
+  static uint8_t payloadBuf[MQTT_BUFFER_SIZE + 1];
+
+  strlcpy(topicBuf, topic, sizeof(topicBuf));
+  if (len > MQTT_BUFFER_SIZE) { len = MQTT_BUFFER_SIZE; }
+  memcpy(payloadBuf, payload, len);
+  mqttCallback(topicBuf, payloadBuf, len);
+}
+
+
+TAMBOX_API int tamBoxPage(const char* uri, const char* query, char* page, size_t len) {
+
+  String content;
+  int code = hostWebServer ? hostWebServer->request(uri, query, content) : 404;
+  if (len) {
+    size_t n = content.length() < len - 1 ? content.length() : len - 1;
+    memcpy(page, content.c_str(), n);
+    page[n] = '\0';
+  }
+  return code;
+}
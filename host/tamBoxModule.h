@@ -0,0 +1,69 @@
+/**
+  * The sketch built as one tambox for the host, see tamBoxModule.cpp.
+  *
+  * The simulator loads one copy of the module per box, each copy has its own globals. Single box
+  * tools link the module objects directly and call the same functions.
+  */
+#ifndef TAMBOX_MODULE_H
+#define TAMBOX_MODULE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define TAMBOX_HOST_DESTS                             6       // Largest DEST_BUTTONS of the layout profiles
+#define TAMBOX_HOST_TRACKS                            2       // MAX_NUM_OF_TRACKS
+
+enum {TAMBOX_RUNNING, TAMBOX_RESTART, TAMBOX_SLEEP};          // tamBoxSetup and tamBoxLoop
+enum {TAMBOX_NOTUSED, TAMBOX_IDLE, TAMBOX_TRAFDIR, TAMBOX_INREQUEST, TAMBOX_INACCEPT, TAMBOX_INTRAIN,
+      TAMBOX_OUTREQUEST, TAMBOX_OUTACCEPT, TAMBOX_OUTTRAIN, TAMBOX_LOST};  // Track states, _NOTUSED ... _LOST
+
+struct tamBoxHalOps;
+
+struct tamBoxTrackStatus {
+  uint16_t trainId;
+  uint8_t state;                                              // _NOTUSED, _IDLE, ...
+  uint8_t traffDir;                                           // DIR_OUT, DIR_IN or DIR_LOST
+};
+
+struct tamBoxStatus {                                         // Filled in by tamBoxGetStatus
+  bool ready;                                                 // tamboxReady
+  bool idle;                                                  // tamBoxIdle
+  bool showText;
+  bool configFromCache;
+  uint8_t mqttState;                                          // MQTT_IDLE, ... MQTT_CONNECTED
+  bool mqttConnected;                                         // mqttState is MQTT_CONNECTED and the broker is there
+  uint8_t destination;                                        // Selected destination
+  tamBoxTrackStatus track[TAMBOX_HOST_DESTS][TAMBOX_HOST_TRACKS];
+  uint8_t dtQueueLen;
+  uint8_t dtQueueHigh;
+  uint16_t dtQueueDrops;
+  unsigned long coldStartTime;                                // ms, power on to ready
+  unsigned long resyncTime;                                   // ms, subscribe to all snapshots received
+  unsigned long mqttReconnectTime;                            // ms without broker at the last reconnect
+  uint16_t mqttReconnects;
+  uint32_t mqttReceived;
+  unsigned int epochTime;
+  unsigned int timestamp;                                     // epochTime + halMillis() / 1000, as stamped on the messages
+  uint16_t pubSent;                                           // Summed over the destinations
+  uint16_t pubRetries;
+  uint16_t pubFailures;
+  uint32_t lcdI2cBytes;                                       // I2C bytes sent to the LCD
+  uint32_t lcdUpdates;                                        // LCD updates, lcdFlush calls
+};
+
+#define TAMBOX_API extern "C" __attribute__((visibility("default")))
+
+TAMBOX_API void tamBoxAttach(const tamBoxHalOps* ops);        // Before tamBoxSetup, ops must outlive the module
+TAMBOX_API int tamBoxSetup(void);
+TAMBOX_API int tamBoxLoop(void);
+TAMBOX_API void tamBoxGetStatus(tamBoxStatus* status);
+TAMBOX_API void tamBoxDeliver(const char* topic, const char* payload, size_t len);  // Straight to mqttCallback
+TAMBOX_API int tamBoxPage(const char* uri, const char* query, char* page, size_t len);  // HTTP status, page is cut to len
+
+typedef void (*tamBoxAttachFn)(const tamBoxHalOps*);
+typedef int (*tamBoxRunFn)(void);
+typedef void (*tamBoxGetStatusFn)(tamBoxStatus*);
+typedef void (*tamBoxDeliverFn)(const char*, const char*, size_t);
+typedef int (*tamBoxPageFn)(const char*, const char*, char*, size_t);
+
+#endif
@@ -20,6 +20,12 @@
 //#define DEBUG_ALL                                           // Extended debug mode
 #endif
 
+// Traffic recorder, uncomment to record MQTT traffic and key presses in flash, read it on /record
+//#define RECORDER
+
+// Send every drawn LCD cell, as before the LCD shadow, to compare the I2C traffic on /metrics
+//#define LCD_FULL_REDRAW
+
 // When CONFIG_PIN is pulled to ground on startup, the client will use the initial
 // password to build an AP. (E.g. in case of lost password)
 #define CONFIG_PIN                                   D0       // Configuration pin
@@ -47,6 +53,14 @@
 #define TIME_BEEP_PAUS                             2000       // Default time for a beep paus, 2 seconds
 #define TIME_PING_INTERVAL                        10000       // 10 seconds ping interval
 #define TIME_TOGGLE_TRACK                          2000       // Toggle track between left and right on duoble track every 2 sec
+#define TIME_MQTT_BACKOFF_MIN                      1000       // First wait before retrying the broker, 1 second
+#define TIME_MQTT_BACKOFF_MAX                     30000       // Longest wait before retrying the broker, 30 seconds
+#define TIME_MQTT_STABLE                          30000       // Connected this long resets the backoff, 30 seconds
+#define TIME_MQTT_DNS                              2000       // Longest wait for the broker name lookup, 2 seconds
+#define TIME_MQTT_CONNECT                          2000       // Longest wait for the TCP connect to the broker, 2 seconds
+#define TIME_MQTT_SOCKET                              2       // Seconds to wait for the broker to answer a connect
+// A mqttConnect step blocks loop() for at most TIME_MQTT_DNS, or TIME_MQTT_CONNECT + TIME_MQTT_SOCKET, 4 seconds
+#define TIME_SHOW_OWN                              4000       // Show own station on the LCD after start up, 4 seconds
 
 // FastLED settings
 #define NUM_LED_DRIVERS                               4       // Max number of signal RGB LED drivers
@@ -58,12 +72,14 @@
 
 // LCD settings
 enum {LCD_FIRST_ROW, LCD_SECOND_ROW, LCD_THIRD_ROW, LCD_FOURTH_ROW};
-#define LCD_PARTS                                     3
-enum {LCD_DEST, LCD_DIR, LCD_NODE};
 #define LCD_FIRST_COL                                 0       // Start position
 #define LCD_DIR_LEN                                   1       // Direction symbol length
 #define LCD_DEST_LEN                                  1       // Destination character length
 #define LCD_BACKLIGHT                               128       // Default LCD backlight
+#define LCD_MAX_ROWS                                  4       // Largest supported LCD, 20x4
+#define LCD_MAX_CHARS                                20       // Largest supported LCD, 20x4
+#define LCD_I2C_BYTES                                 5       // I2C bytes per LCD command or character, address + two nibbles with enable pulse
+#define LCD_CELL_UNKNOWN                           0xff       // Content of a shown cell is not known
 
 // Buzzer settings
 #define BEEP_KEY_CLK                                500       // 500 Hz
@@ -87,39 +103,57 @@ enum {LCD_DEST, LCD_DIR, LCD_NODE};
 #define DB_SIGN_LEN                                   5       // Same length as in mySQL database
 
 // MQTT node configuration (tamBoxMqtt)
-// String tamBoxMqtt[MQTT_PARAM]
-#define MQTT_PARAM                                    5       // Size of var tamBoxMqtt
-enum {SERVER, PORT, USER, PASS, SCALE};
+// tamBoxMqttConfiguration tamBoxMqtt
+#define MQTT_DEFAULT_PORT                          1883       // Used when the config server sends no port
 
 // TamBox node configuration (tamBoxConfig)
-// String tamBoxConfig[CONFIG_DEST][CONFIG_PARAM]
-#define CONFIG_DEST                                   9       // Size of var tamBoxConfig
-#define CONFIG_PARAM                                  8       // for all dest:    ID, SIGN, NAME, TRACKS, EXIT, TOTTRACKS, TYPE
-enum {
-  ID,                                                         // max size 20 characters
-  SIGN,                                                       // max size 4 characters
-  NAME,                                                       // for own station, max size 30 characters
-  NUMOFDEST,                                                  // for own station
-  TRACKS,                                                     // integer
-  EXIT,                                                       // max size 1 character
-  TOTTRACKS,                                                  // integer
-  TYPE                                                        // max size 6 characters
-};
+// tamBoxConfiguration tamBoxConfig[CONFIG_DEST]
+#define CONFIG_DEST              (2 * DEST_BUTTONS + 1)       // Size of var tamBoxConfig, destinations, own and split right tracks
+#define UTF8_BYTES                                    2       // Bytes per escaped character (\xc3 + character)
+
+// Track types, from "type" in received config
+enum {TRACK_TYPE_NONE, TRACK_TYPE_SINGLE, TRACK_TYPE_SPLIT, TRACK_TYPE_DOUBLE};
+
+// Layout profile, sizes the port table and everything per destination and track
+// portTable<DEST_BUTTONS, MAX_NUM_OF_TRACKS> ports
+// Select with -DLAYOUT_PROFILE=<profile> when building
+#define LAYOUT_4X2                                    0       // Four exits A-D with max two tracks each
+#define LAYOUT_6X2                                    1       // Six exits A-F with max two tracks each
+#ifndef LAYOUT_PROFILE
+#define LAYOUT_PROFILE                       LAYOUT_4X2
+#endif
+
+#if LAYOUT_PROFILE == LAYOUT_4X2
+#define DEST_BUTTONS                                  4       // Number of Destination buttons A-D
+#define MAX_NUM_OF_TRACKS                             2       // Max number of tracks
+#elif LAYOUT_PROFILE == LAYOUT_6X2
+#define DEST_BUTTONS                                  6       // Number of Destinations A-F, A-D on the keypad
+#define MAX_NUM_OF_TRACKS                             2       // Max number of tracks
+#else
+#error "Unknown LAYOUT_PROFILE"
+#endif
 
 // Destinations
 // const char* destIDTxt[NUM_OF_DEST]
-#define DEST_BUTTONS                                  4       // Number of Destination buttons A-D
-#define NUM_OF_DEST_STRINGS                          12       // Number of Destination strings
+#define NUM_OF_DEST_STRINGS          (CONFIG_DEST + 3)       // Number of Destination strings
 enum {
   DEST_A,                                                     // Destination on left side outgoing track
   DEST_B,                                                     // Destination on right side outgoing track
   DEST_C,                                                     // Destination on left side outgoing track
   DEST_D,                                                     // Destination on right side outgoing track
+#if DEST_BUTTONS > 4
+  DEST_E,                                                     // Destination on left side outgoing track
+  DEST_F,                                                     // Destination on right side outgoing track
+#endif
   OWN,                                                        // Own Module
   DEST_A_RIGHT,                                               // Used when type is split on left side outgoing track
   DEST_B_RIGHT,                                               // Used when type is split on right side outgoing track
   DEST_C_RIGHT,                                               // Used when type is split on left side outgoing track
   DEST_D_RIGHT,                                               // Used when type is split on right side outgoing track
+#if DEST_BUTTONS > 4
+  DEST_E_RIGHT,                                               // Used when type is split on left side outgoing track
+  DEST_F_RIGHT,                                               // Used when type is split on right side outgoing track
+#endif
   DEST_CONFIG,                                                // Configuration mode selected
   DEST_ALL_DEST,                                              // All destinations
   DEST_NOT_SELECTED                                           // Destination not selected
@@ -128,11 +162,15 @@ enum {
 #define DEST_B_T                                     "B"      // 1
 #define DEST_C_T                                     "C"      // 2
 #define DEST_D_T                                     "D"      // 3
+#define DEST_E_T                                     "E"      // Six exits only
+#define DEST_F_T                                     "F"      // Six exits only
 #define DEST_OWN_STATION_T            "Show own station"      // 4
 #define DEST_A_RIGHT_T                              "Ar"      // 5
 #define DEST_B_RIGHT_T                              "Br"      // 6
 #define DEST_C_RIGHT_T                              "Cr"      // 7
 #define DEST_D_RIGHT_T                              "Dr"      // 8
+#define DEST_E_RIGHT_T                              "Er"      // Six exits only
+#define DEST_F_RIGHT_T                              "Fr"      // Six exits only
 #define DEST_CONFIG_T                  "Config selected"      // 9
 #define DEST_ALL_DEST_T               "All destinations"      // 10
 #define DEST_NOT_SELECTED_T               "Not selected"      // 11
@@ -177,6 +215,17 @@ enum {_NOTUSED, _IDLE, _TRAFDIR, _INREQUEST, _INACCEPT, _INTRAIN, _OUTREQUEST, _
 #define _OUTACCEPT_T                        "_OUTACCEPT"
 #define _OUTTRAIN_T                          "_OUTTRAIN"
 #define _LOST_T                                  "_LOST"
+// State names in retained snapshots, see snapshotStateTxt
+#define SNAP_NOTUSED_T                         "notused"
+#define SNAP_IDLE_T                               "idle"
+#define SNAP_TRAFDIR_T                         "trafdir"
+#define SNAP_INREQUEST_T                     "inrequest"
+#define SNAP_INACCEPT_T                       "inaccept"
+#define SNAP_INTRAIN_T                         "intrain"
+#define SNAP_OUTREQUEST_T                   "outrequest"
+#define SNAP_OUTACCEPT_T                     "outaccept"
+#define SNAP_OUTTRAIN_T                       "outtrain"
+#define SNAP_LOST_T                               "lost"
 
 enum {LEFT_TRACK, RIGHT_TRACK};
 #define DEST_TRAIN_0                                  0
@@ -185,6 +234,7 @@ enum {LEFT_TRACK, RIGHT_TRACK};
                                                               // cmd/h0/tam/tambox-1/a/req
                                                               // cmd/h0/tam/tambox-1/a/res
                                                               // dt/h0/ping/tambox-1
+                                                              // dt/h0/tam/tambox-1/a/snapshot
 #define NUM_OF_TOPICS                                 6
 enum {
   TOPIC_MSGTYPE,                                              // cmd,dt
@@ -192,17 +242,83 @@ enum {
   TOPIC_TYPE,                                                 // tam,node,tower,ping
   TOPIC_NODE_ID,                                              // node id
   TOPIC_PORT_ID,                                              // port id
-  TOPIC_ORDER                                                 // req,res
+  TOPIC_ORDER                                                 // req,res,snapshot
 };
 
+// Parsed topic fields, see decodeTopic
+enum {MSG_UNKNOWN, MSG_COMMAND, MSG_DATA};                    // TOPIC_MSGTYPE
+enum {BODY_UNKNOWN, BODY_TAM, BODY_NODE, BODY_TOWER, BODY_PING};
+enum {ORDER_NONE, ORDER_REQUEST, ORDER_RESPONSE, ORDER_SNAPSHOT};  // TOPIC_ORDER
+#define TOPIC_PORT_STATE                            254       // Port id is $state
+#define TOPIC_NOT_FOUND                             255       // Node or port not in the subscription index
+#define TOPIC_SUPERVISOR                            253       // Node id is own supervisor
+
+// Subscription index, built once in mqttConnect
+// topicIndexEntry topicIndex[TOPIC_INDEX_SIZE]
+#define TOPIC_INDEX_SIZE                             32       // Open addressed on the hash, power of two and at least twice TOPIC_INDEX_USED
+#define TOPIC_INDEX_USED              (CONFIG_DEST + 1)       // All destinations, own node and own supervisor
+#if TOPIC_INDEX_SIZE < 2 * TOPIC_INDEX_USED || (TOPIC_INDEX_SIZE & (TOPIC_INDEX_SIZE - 1))
+#error "TOPIC_INDEX_SIZE too small for the layout profile"
+#endif
+#define FNV_OFFSET_BASIS                    2166136261UL      // FNV-1a 32 bit hash
+#define FNV_PRIME                             16777619UL      // FNV-1a 32 bit hash
+
+// Broker connection states, see mqttConnect
+enum {MQTT_IDLE, MQTT_WAIT_RETRY, MQTT_RESOLVE, MQTT_CONNECTING, MQTT_SUBSCRIBE, MQTT_ANNOUNCE, MQTT_SHOW_OWN, MQTT_CONNECTED};
+#define MQTT_SUBSCRIBE_STEPS    (CONFIG_DEST * 2 + 3)         // Tam and node topic per destination, own tam, supervisor and own snapshots
+
 // Codes used when handling incoming MQTT messages
-enum {CODE_LOST, CODE_READY, CODE_TRAFDIR_REQ_IN, CODE_TRAFDIR_RES_IN, CODE_TRAFDIR_RES_OUT, CODE_TRAIN_IN, CODE_TRAIN_OUT, CODE_ACCEPT, CODE_ACCEPTED, CODE_REJECTED, CODE_CANCEL, CODE_CANCELED};
+enum {CODE_LOST, CODE_READY, CODE_TRAFDIR_REQ_IN, CODE_TRAFDIR_RES_IN, CODE_TRAFDIR_RES_OUT, CODE_TRAIN_IN, CODE_TRAIN_OUT, CODE_ACCEPT, CODE_ACCEPTED, CODE_REJECTED, CODE_CANCEL, CODE_CANCELED, CODE_RECEIVED};
+
+// Report texts waiting for the display, shown in order when the tambox is idle
+// dtEvent dtQueue[DT_QUEUE_DEPTH]
+#define DT_QUEUE_DEPTH                               16       // Queued texts, one per destination and track, max 255
+#define TIME_QUEUE_DRAIN                            100       // Check if the next queued text can be shown every 100 ms
+
+// Outbound tam messages, see publishTam
+// pubMessage pubQueue[PUB_QUEUE_DEPTH]
+enum {PUB_ONCE, PUB_AWAIT};                                   // Retry until published, or until the response is received
+#define PUB_BODY_LEN                                256       // Serialized tam body
+#define PUB_QUEUE_DEPTH                               4       // Messages waiting for a retry or a response
+#define TIME_PUB_RETRY                             2000       // Retry a message every 2 seconds
+#define MQTT_BUFFER_SIZE                            768       // Incoming JSON bodies and the ping, which is up to 650 bytes
+#define MQTT_PUB_HEADER                               7       // Fixed header and topic length in the buffer, see PubSubClient::publish
+
+// Metrics, always on, served on /metrics and summed up in the ping
+// metricHist metric[METRICS]
+enum {METRIC_LOOP, METRIC_MQTT_LCD, METRIC_KEY_PUB, METRIC_JSON, METRICS};
+#define METRIC_BUCKETS                                8       // Histogram buckets, the last is +Inf
+#define METRIC_BOUNDS   {100, 250, 1000, 2500, 10000, 25000, 100000}  // Bucket upper bounds in us
+#define METRIC_LINE_LEN                             160       // One /metrics line
+
+// Recorder log, see recordEvent
+// Two segments used as a ring, each starts with a recordSegmentHeader followed by records.
+// A record is a recordHeader, topicLen bytes topic and bodyLen bytes body, little endian.
+// A RECORD_STATE body is the state of each track, dest * MAX_NUM_OF_TRACKS + track, see recordTrackStates.
+#define RECORD_SEGMENTS                               2
+#define RECORD_FILE_0                      "/record.0"
+#define RECORD_FILE_1                      "/record.1"
+#define RECORD_MAGIC                        0x43455254UL      // "TREC"
+#define RECORD_VER                                    2
+#define RECORD_SEGMENT_SIZE                       32768       // Start the next segment, removing the oldest, when full
+#define RECORD_STREAM_LEN                           256       // Read buffer when sending /record
+#define TIME_RECORD_FLUSH                          1000       // Flush the current segment at most once a second
+enum {RECORD_IN, RECORD_OUT, RECORD_OUT_FAILED, RECORD_KEY, RECORD_STATE};  // recordHeader type
+
+// Retained track snapshots, see snapshotCheck and snapshotReceived
+// One per destination, the newest of our own and the one from the neighbours port facing us is
+// used after a start, when the local state is unknown. Our own wins when both have the same timestamp.
+#define TIME_RESYNC                                5000       // Use received snapshots for 5 seconds after subscribing
+#define RESYNC_OWN                                   16       // First bit for own snapshots in resyncPending, below are slots
+#if CONFIG_DEST > RESYNC_OWN
+#error "resyncPending too small for the layout profile"
+#endif
 
-// Incoming dt queue
-// uint16_t dtInQueue[DEST_BUTTONS][Q_DATA]
-enum {Q_INACTIVE, Q_ACTIVE};
-#define Q_DATA                                        4       // Number of queue data
-enum {Q_STATE, Q_TRACK, Q_ORDERCODE, Q_TRAIN};
+// Timers, see setTimer and runTimers
+// tamBoxTimer timer[TIMER_SLOTS]
+enum {TIMER_PING, TIMER_TOGGLE, TIMER_SHOW_TEXT, TIMER_QUEUE, TIMER_PUB, TIMER_CONFIG, TIMER_TAM, TIMER_BEEP};
+#define TIMER_SHARED                                  6       // Ping, toggle, show text, queue, publish retry and config check, one each
+#define TIMER_SLOTS     (TIMER_SHARED + 2 * DEST_BUTTONS * MAX_NUM_OF_TRACKS)  // Tam and beep per destination and track
 
 // MQTT Topics strings
 enum {_REQUEST, _RESPONSE, _DATA};
@@ -215,6 +331,7 @@ enum {_REQUEST, _RESPONSE, _DATA};
 #define INVENTORY                            "inventory"      // Port id for inventory requests
 #define REQUEST                                    "req"      // Message subtype used in cmd
 #define RESPONSE                                   "res"      // Message subtype used in cmd
+#define SNAPSHOT                              "snapshot"      // Message subtype used in dt, retained track state
 
 // MQTT Body strings
 // const char* useTrackTxt[DIR_STATES]
@@ -236,6 +353,7 @@ enum {_REQUEST, _RESPONSE, _DATA};
 #define ACCEPTED                              "accepted"
 #define CANCELED                              "canceled"
 #define REJECTED                              "rejected"
+#define RECEIVED                              "received"      // Request delivered, the operator hasn't answered yet
 #define LOST                                      "lost"
 #define READY                                    "ready"
 #define IN                                          "in"
@@ -243,29 +361,43 @@ enum {_REQUEST, _RESPONSE, _DATA};
 #define LEFT                                      "left"
 #define RIGHT                                    "right"
 #define METADATA                              "metadata"
+#define SNAPSHOT_TRACKS                         "tracks"      // Snapshot, [state name, "in" or "out", train id] per track
 #define M_ID                                        "id"      // Used in metadata
 #define M_TYPE                                    "type"      // Used in metadata
 #define M_VER                                      "ver"      // Used in metadata
 #define M_NAME                                    "name"      // Used in metadata
 #define M_SIGN                                    "sign"      // Used in metadata
 #define M_RSSI                                    "rssi"      // Used in metadata
+#define M_RECONNECTS                        "reconnects"      // Used in metadata
+#define M_RECONNECT_MS                    "reconnect-ms"      // Used in metadata
+#define M_QUEUE_HIGH                        "queue-high"      // Used in metadata
+#define M_QUEUE_DROPS                      "queue-drops"      // Used in metadata
+#define M_COLD_START                     "cold-start-ms"      // Used in metadata, power on to tambox ready
+#define M_CONFIG                                "config"      // Used in metadata, M_CONFIG_CACHE or M_CONFIG_SERVER
+#define M_CONFIG_CACHE                           "cache"
+#define M_CONFIG_SERVER                         "server"
+#define M_PUB                                      "pub"      // Used in metadata, [sent, retries, failures, latency ms] per destination
+#define M_PERF                                    "perf"      // Used in metadata, [peak us per METRIC_* since last ping, lowest free heap, fragmentation %]
+#define M_RESYNC_MS                          "resync-ms"      // Used in metadata, subscribe to all snapshots received at the last (re)connect
 
 // mqtt-lcp support
 #define LCP_BODY_VER                               "1.0"
 #define LCP_BODY_REBOOT                         "reboot"
 #define LCP_BODY_SHUTDOWN                     "shutdown"
 #define NODE_SUPERVISOR                     "supervisor"
-enum {LCP_SESSION_ID, LCP_RESPOND_TO, LCP_DESIRED_STATE, LCP_NODE_ID, LCP_PORT_ID, LCP_TRACK};
+
+// Decoded mqtt-lcp body, see decodeTamMessage
+#define LCP_SESSION_LEN                              24       // "req:" + epoch time, with margin
+#define LCP_TOPIC_LEN                                64       // Longest respond-to topic
+#define LCP_STATE_LEN                                10       // Longest desired or reported state
 
 // Directions
-// uint8_t traffDir[DEST_BUTTONS][MAX_NUM_OF_TRACKS]
-// uint8_t lastTraffDir[DEST_BUTTONS][MAX_NUM_OF_TRACKS]
+// tamBoxTrack traffDir, lastTraffDir
 #define DIR_STATES                                    2       // Number of Direction states, OUT/IN
 enum {DIR_OUT, DIR_IN};
 #define DIR_LOST                                     15       // Connection lost
 #define SINGLE_TRACK                                  1
 #define DOUBLE_TRACK                                  2
-#define MAX_NUM_OF_TRACKS                             2       // Max number of tracks
 enum {TRAFFIC_LEFT, TRAFFIC_RIGHT};
 
 // Direction symbols                                             Max one character
@@ -338,14 +470,188 @@ enum {LCD_TRAIN, LCD_TRAINDIR_NOK, LCD_DEPATURE, LCD_TAM_CANCEL, LCD_TAM_ACCEPT,
 #define LCD_WIFI_NOT_FOUND              "WiFi not found"      // Max length 16 characters
 #define LCD_LOADING_CONF_NOK          "Config not found"      // Max length 16 characters
 
+// Configuration cache in LittleFS, see saveConfigCache
+// Binary file, configCacheHeader followed by tamBoxMqtt and tamBoxConfig
+#define CONFIG_CACHE_FILE                  "/config.bin"
+#define CONFIG_CACHE_TMP                   "/config.tmp"      // Written first, then renamed to CONFIG_CACHE_FILE
+#define CONFIG_CACHE_MAGIC                  0x58434254UL      // "TBCX"
+#define CONFIG_CACHE_VER                              1       // Change when tamBoxConfiguration or tamBoxMqttConfiguration changes
+#define CONFIG_ETAG_LEN                              40
+#define HTTP_ETAG                                 "ETag"      // Config server response header
+#define HTTP_IF_NONE_MATCH               "If-None-Match"      // Config server request header
+#define HTTP_DATE                                 "Date"      // Config server response header, sets the clock
+#define TIME_CONFIG_CHECK                          5000       // Check again 5 seconds later if the operator is busy
+#define TIME_CONFIG_RETRY                         60000       // Check again every minute if the config server could not be reached
+#define TIME_CONFIG_HTTP                           2000       // Wait max 2 seconds for the config server when starting
+#define TIME_CONFIG_RETRY_HTTP                      250       // Wait max 250 ms when checking again, loop() waits too
+enum {CONFIG_FAILED, CONFIG_RECEIVED, CONFIG_NOT_MODIFIED};   // getConfigFile
+
 // Structs
-//struct tamBoxConfiguration {                                    // Values from received JSON configuration
-//  char id[50];                                                  // ID
-//  char sign[5];                                                 // SIGN
-//  char name[50];                                                // NAME
-//  char type[6];                                                 // TYPE
-//  char exit[1];                                                 // EXIT
-//  int numOfDest;                                                // NUMOFDEST
-//  int totTracks;                                                // TOTTRACKS
-//  int tracks;                                                   // TRACKS
-//};
+struct tamBoxConfiguration {                                  // Values from received JSON configuration
+  char id[DB_CLIENTID_LEN + 1];                               // Node id, NOT_USED_T when destination not used
+  char sign[DB_SIGN_LEN * UTF8_BYTES + 1];                    // Signature, may hold escaped characters
+  char name[DB_STNNAME_LEN + 1];                              // Station name, only used for own station
+  char exit[DB_DEST_LEN + 1];                                 // Port id at destination, lower case
+  uint8_t type;                                               // TRACK_TYPE_NONE, _SINGLE, _SPLIT or _DOUBLE
+  uint8_t numOfDest;                                          // Number of destinations, only used for own station
+  uint8_t totTracks;                                          // Total number of tracks to destination
+  uint8_t tracks;                                             // Number of tracks to this node
+};
+
+struct tamBoxMqttConfiguration {                              // MQTT values from received JSON configuration
+  char server[DB_HOST_LEN + 1];                               // Broker host name
+  uint16_t port;                                              // Broker port
+  char user[DB_USER_NAME + 1];                                // Broker user
+  char pass[DB_USER_PASS + 1];                                // Broker password
+  char scale[DB_TOPIC_LEN + 1];                               // Second topic level, e.g. h0
+};
+
+struct TamMessage {                                           // One received tam or node body
+  uint8_t body;                                               // BODY_TAM, BODY_NODE, BODY_TOWER or BODY_PING
+  uint8_t node;                                               // node-id as slot in tamBoxConfig, TOPIC_SUPERVISOR or TOPIC_NOT_FOUND
+  uint8_t sender;                                             // Destination in respond-to, TOPIC_NOT_FOUND if missing
+  uint8_t orderCode;                                          // CODE_* derived from order and state
+  uint8_t track;                                              // LEFT_TRACK or RIGHT_TRACK
+  bool hasTrain;                                              // Train id included
+  uint16_t train;                                             // Train id
+  char senderPort[DB_DEST_LEN + 1];                           // Port id in respond-to
+  char sessionId[LCP_SESSION_LEN + 1];
+  char respondTo[LCP_TOPIC_LEN + 1];
+  char desired[LCP_STATE_LEN + 1];
+};
+
+struct TamTopic {                                             // One received topic, split in place, see decodeTopic
+  const char* level[NUM_OF_TOPICS];                           // Start of each topic level
+  uint8_t levelLen[NUM_OF_TOPICS];                            // Length of each topic level
+  uint8_t msgType;                                            // MSG_*
+  uint8_t bodyType;                                           // BODY_*
+  uint8_t order;                                              // ORDER_*
+  uint8_t port;                                               // Port a-d as 0-3, TOPIC_PORT_STATE or TOPIC_NOT_FOUND
+  uint8_t dest;                                               // Slot for node and port id, see findTopicDest
+  bool scale;                                                 // Own scale
+};
+
+struct topicIndexEntry {                                      // Subscribed node id, see mqttConnect
+  uint32_t hash;                                              // FNV-1a hash of the node id, and "/" port id for a destination
+  uint8_t dest;                                               // Slot in tamBoxConfig, TOPIC_SUPERVISOR or TOPIC_NOT_FOUND when free
+};
+
+struct tamBoxTrack {                                          // One track to a destination, see portTable
+  uint16_t trainId;                                           // Train on the track, DEST_TRAIN_0 when none
+  uint8_t state;                                              // _NOTUSED, _IDLE, _TRAFDIR, ...
+  uint8_t traffDir;                                           // DIR_OUT, DIR_IN or DIR_LOST
+  uint8_t lastTraffDir;                                       // Direction to go back to when the destination is ready again
+  uint8_t lastState;                                          // State to go back to when the destination is ready again
+};
+
+struct tamBoxRequest {                                        // Last received tam request, answered from keyReceived or handleDirection
+  char portId[DB_DEST_LEN + 1];                               // Port id at the requesting node
+  char sessionId[LCP_SESSION_LEN + 1];
+  char respondTo[LCP_TOPIC_LEN + 1];
+  char desired[LCP_STATE_LEN + 1];
+  const char* reported;                                       // Sent response, NULL until answered, see respondRequest
+  bool hasTrain;                                              // Train request, else direction request
+  uint16_t trainId;
+};
+
+template <uint8_t TRACKS>
+struct tamBoxPort {                                           // One destination, A-D on the keypad
+  tamBoxTrack track[TRACKS];
+  tamBoxRequest req[TRACKS];                                  // Received request per track
+  char resSessionId[LCP_SESSION_LEN + 1];                     // Session id of the sent request, matched with the response
+  tamBoxTrack sent[TRACKS];                                   // Tracks in the last snapshot
+  unsigned int snapshotTime[TRACKS];                          // Timestamp of the last snapshot per track, sent or used
+  bool snapshotDirty;                                         // Changed since the last published snapshot
+};
+
+template <uint8_t EXITS, uint8_t TRACKS>
+struct portTable {                                            // State per destination and track, sized by the layout profile
+  tamBoxPort<TRACKS> port[EXITS];
+  uint8_t slotDest[2 * EXITS + 1];                            // Slot in tamBoxConfig to destination, TOPIC_NOT_FOUND for own
+
+  portTable() {
+    for (uint8_t dest = 0; dest < EXITS; dest++) {
+      for (uint8_t track = 0; track < TRACKS; track++) {      // Left track out, right track in
+        port[dest].track[track] = {DEST_TRAIN_0, _NOTUSED, (uint8_t)(track % DIR_STATES), (uint8_t)(track % DIR_STATES), _NOTUSED};
+        port[dest].sent[track]  = port[dest].track[track];
+      }
+    }
+
+    for (uint8_t slot = 0; slot < 2 * EXITS + 1; slot++) {
+      slotDest[slot] = (slot < EXITS) ? slot : (slot > EXITS) ? slot - (EXITS + 1) : TOPIC_NOT_FOUND;
+    }
+  }
+
+  tamBoxPort<TRACKS>& operator[](uint8_t dest) { return port[dest]; }
+  tamBoxTrack& at(uint8_t dest, uint8_t track) { return port[dest].track[track]; }
+  uint8_t dest(uint8_t slot) { return (slot < 2 * EXITS + 1) ? slotDest[slot] : TOPIC_NOT_FOUND; }
+  uint8_t splitSlot(uint8_t dest) { return EXITS + 1 + dest; }
+  bool isSplitSlot(uint8_t slot) { return slot > EXITS && slot < 2 * EXITS + 1; }
+};
+
+struct dtEvent {                                              // One queued report text, see dtQueuePush
+  uint8_t dest;
+  uint8_t track;
+  uint8_t str;                                                // LCD_ text of the latest report
+};
+
+struct configCacheHeader {                                    // First in CONFIG_CACHE_FILE
+  uint32_t magic;                                             // CONFIG_CACHE_MAGIC
+  uint16_t version;                                           // CONFIG_CACHE_VER
+  uint16_t size;                                              // Size of tamBoxMqtt and tamBoxConfig
+  uint32_t hash;                                              // FNV-1a hash of tamBoxMqtt and tamBoxConfig, see configHash
+  unsigned int epoch;                                         // Time when saved
+  char etag[CONFIG_ETAG_LEN + 1];                             // ETag of the config server response
+};
+
+struct configScratch {                                        // A received config, taken into use only when complete and new
+  tamBoxMqttConfiguration mqtt;
+  tamBoxConfiguration config[CONFIG_DEST];
+};
+
+struct pubMessage {                                           // One message in the publish queue, see publishTam
+  unsigned long firstTry;                                     // millis() when first published
+  unsigned long nextTry;                                      // millis() when to publish again
+  uint8_t dest;
+  uint8_t kind;                                               // PUB_ONCE or PUB_AWAIT
+  bool active;
+  char topic[LCP_TOPIC_LEN + 1];
+  char sessionId[LCP_SESSION_LEN + 1];
+  char body[PUB_BODY_LEN];
+};
+
+struct pubStats {                                             // Publish metrics per destination
+  uint16_t sent;
+  uint16_t retries;
+  uint16_t failures;                                          // Messages dropped at the deadline or on a full queue
+  unsigned long latency;                                      // Last try of a request to its answer in ms, see pubResponded
+};
+
+struct tamBoxTimer {                                          // One timer, see setTimer
+  unsigned long deadline;                                     // millis() when the timer is due
+  bool active;
+};
+
+struct recordSegmentHeader {                                  // First in each recorder segment
+  uint32_t magic;                                             // RECORD_MAGIC
+  uint16_t version;                                           // RECORD_VER
+  uint16_t seq;                                               // Segment number, the file is RECORD_FILE_<seq % 2>
+  uint32_t epoch;                                             // Time when started, 0 if not known yet
+  uint32_t millis;                                            // millis() when started
+};
+
+struct recordHeader {                                         // One record, followed by topic and body
+  uint32_t millis;                                            // millis() when recorded
+  uint8_t type;                                               // RECORD_IN, _OUT, _OUT_FAILED, _KEY or _STATE
+  uint8_t topicLen;                                           // 0 for a key press and track states
+  uint16_t bodyLen;                                           // The key for a key press
+};
+
+struct metricHist {                                           // One latency histogram, see metricEnd
+  uint32_t bucket[METRIC_BUCKETS];                            // Not cumulative, summed up in handleMetrics
+  uint32_t count;
+  uint64_t sum;                                               // us
+  unsigned long peak;                                         // Longest in us since the last ping
+  unsigned long start;                                        // micros() when started by metricBegin
+  bool open;
+};
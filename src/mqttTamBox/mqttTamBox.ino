@@ -31,9 +31,7 @@
  *
  ********************************************************************************************************************************
  */
-#include <ESP8266HTTPClient.h>                                // Library to handle HTTP download of config file
 #include <ArduinoJson.h>                                      // Library to handle JSON objekts
-#include <PubSubClient.h>                                     // Library to handle MQTT communication
 #include <IotWebConf.h>                                       // Library to take care of client local settings
 #include <IotWebConfMultipleWifi.h>                           // Library to handle multiple wifi networks
 #include <IotWebConfUsing.h>                                  // This loads aliases for easier class names.
@@ -44,9 +42,9 @@
   #include <IotWebConfESP32HTTPUpdateServer.h>                // Library for Firmware update
 #endif
 #include <Wire.h>                                             // Library to handle i2c communication
-#include <Keypad_I2C.h>                                       // Library to handle i2c keypad
-#include <LiquidCrystal_PCF8574.h>                            // Library to handle i2c LCD
 #include <ArduinoOTA.h>                                       // Library for Over-the-Air programming
+#include <LittleFS.h>                                         // Library to keep the received config in flash
+#include "tamBoxHal.h"                                        // Clock, broker, keypad, LCD and config server, see tamBoxHal.h
 #include "mqttTamBox.h"                                       // Some of the client settings
 
 // ------------------------------------------------------------------------------------------------------------------------------
@@ -55,26 +53,93 @@ void setDefaults(void);
 void wifiConnected(void);
 void setupBroker(void);
 bool mqttConnect(void);
-bool getConfigFile(void);
+void mqttRetryLater(void);
+void setTopicIndex(void);
+void setPubTopics(void);
+bool subscribeStep(uint8_t step);
+uint8_t getConfigFile(uint16_t timeout = TIME_CONFIG_HTTP);
+uint32_t httpDate(const char* date);
+void checkConfigFile(void);
+bool loadConfigCache(void);
+bool saveConfigCache(void);
+uint32_t configHash(void);
 void sendPing(void);
 void handleRoot(void);
+void handleMetrics(void);
+void metricSend(const char* name, const char* type, const char* help, const char* value);
+void metricBegin(uint8_t m);
+void metricEnd(uint8_t m);
+void metricCancel(uint8_t m);
+void metricSeconds(char* txt, size_t len, uint64_t us);
+#ifdef RECORDER
+void recordBegin(void);
+void recordOpen(uint16_t seq);
+void recordEvent(uint8_t type, const char* topic, const char* body, uint16_t bodyLen);
+void recordTrackStates(void);
+void handleRecord(void);
+#endif
 void keyReceived(char key);
+void rejectRequest(uint8_t dest, uint8_t track);
+void respondRequest(uint8_t dest, uint8_t track, const char* reported);
+uint8_t keyTrack(uint8_t dest);
 void handleInfo(uint8_t dest, uint8_t orderCode);
+void snapshotCheck(void);
+bool snapshotPublish(uint8_t dest);
+void snapshotReceived(uint8_t slot, uint8_t port, char* body);
+uint8_t snapshotState(uint8_t state, bool mirror);
+uint8_t snapshotCode(const char* name, const char* const names[], uint8_t count);
 void handleDirection(uint8_t dest, uint8_t track, uint8_t orderCode);
 void handleTrain(uint8_t dest, uint8_t track, uint8_t orderCode, uint16_t train);
-void jsonReceived(uint8_t order, char* body);
+void showReport(uint8_t dest, uint8_t track, uint8_t str);
+bool dtQueuePush(uint8_t dest, uint8_t track, uint8_t str);
+bool dtQueuePop(dtEvent& event);
+void jsonReceived(uint8_t order, uint8_t port, char* body);
+void setTamFilter(void);
+uint8_t peekBodyType(const char* body);
+uint8_t peekNodeId(const char* body);
+const char* peekString(const char* body, const char* key, uint8_t& len);
+bool tamMessageWanted(uint8_t order, TamMessage& msg);
+bool decodeTamMessage(char* body, uint8_t order, TamMessage& msg);
+void towerInventory(char* body);
 void mqttJson(char* action, char* bodyType);
 void printString(uint8_t str, uint8_t dest, uint16_t train);
 void updateLcd(uint8_t dest);
 void setDirString(uint8_t dest, uint8_t track);
 void setNodeString(uint8_t dest, uint8_t track);
-void fixSpecialChar(String text, uint8_t col, uint8_t row);
-String removeEscapeChar(String text);
+const char* dirSymbol(uint8_t dest, uint8_t track);
+void setLcdGlyphs(void);
+void drawDest(uint8_t dest);
+uint8_t lcdLen(const char* text);
+uint8_t lcdPut(uint8_t col, uint8_t row, const char* text);
+void lcdFill(uint8_t col, uint8_t row, uint8_t len);
+void lcdClear(bool display);
+void lcdFlush(void);
 void toggleTrack(void);
+uint8_t timerSlot(uint8_t purpose, uint8_t dest, uint8_t track);
+void setTimer(uint8_t purpose, uint8_t dest, uint8_t track, unsigned long wait);
+void clearTimer(uint8_t purpose, uint8_t dest, uint8_t track);
+void setShowTimer(void);
+void runTimers(void);
+void timerFired(uint8_t purpose, uint8_t dest, uint8_t track);
 String addBlanks(uint8_t blanks);
 uint8_t centerText(String txt);
-void beep(unsigned char duration, unsigned int freq);
-void printSpecialChar(uint8_t character);
+void beep(unsigned int duration, unsigned int freq);
+bool mqttPublish(const char* topic, const char* body, bool retain);
+bool publishTam(uint8_t dest, const char* topic, JsonDocument& doc, uint8_t kind);
+bool pubQueuePush(uint8_t dest, const char* topic, const char* body, const char* sessionId, uint8_t kind);
+void pubResponded(uint8_t dest, const char* sessionId);
+void pubRetry(void);
+void decodeTopic(const char* topic, TamTopic& t);
+void nodeStateReceived(const char* id, uint8_t len, uint8_t orderCode);
+uint32_t hashTopicKey(uint32_t hash, const char* text, uint8_t len);
+void addTopicIndex(uint8_t dest, const char* id, const char* port);
+uint8_t findTopicDest(const char* id, uint8_t len, const char* port, uint8_t portLen);
+bool topicLevelIs(const char* level, uint8_t len, const char* txt);
+void setConfigDest(tamBoxConfiguration& dest, JsonObject node);
+uint8_t trackType(const char* type);
+void setDeviceSettings(void);
+bool mqttSubscribe(const char* topic);
+char readKey(void);
 
 // Callback method declarations
 void mqttCallback(char* topic, byte* payload, unsigned int length);
@@ -84,11 +149,11 @@ bool formValidator(iotwebconf::WebRequestWrapper* webRequestWrapper);
 // ------------------------------------------------------------------------------------------------------------------------------
 // Make objects for the PubSubClient
 WiFiClient wifiClient;
-PubSubClient mqttClient(wifiClient);
+halMqtt mqttClient(wifiClient);
 
 // ------------------------------------------------------------------------------------------------------------------------------
 // Construct an LCD object and pass it the I2C address
-LiquidCrystal_PCF8574 lcd(LCD_I2C_ADDR);
+halLcd lcd(LCD_I2C_ADDR);
 
 // ------------------------------------------------------------------------------------------------------------------------------
 // Construct an Keypad object and pass it the I2C address
@@ -103,7 +168,7 @@ char keys[ROWS][COLS]               = {{'1', '2', '3', 'A'},
 byte rowPins[ROWS]                  = {4, 5, 6, 7};           // Connect to the row pinouts of the keypad
 byte colPins[COLS]                  = {0, 1, 2, 3};           // Connect to the column pinouts of the keypad
 
-Keypad_I2C Keypad(makeKeymap(keys), rowPins, colPins, ROWS, COLS, KEY_I2C_ADDR);
+halKeypad Keypad(makeKeymap(keys), rowPins, colPins, ROWS, COLS, KEY_I2C_ADDR);
 
 // ------------------------------------------------------------------------------------------------------------------------------
 // IotWebConf variables set for the configuration web page
@@ -131,6 +196,17 @@ static char chooserNames[][DB_NUMBER_LEN]   = {"Svenska", "English"};
 // IotWebConfig variables
 
 bool needMqttConnect                = false;
+uint8_t mqttState                   = MQTT_IDLE;              // Broker connection state
+uint8_t mqttStep;                                             // Next subscription when subscribing
+unsigned long mqttStateTime;                                  // Time the current wait started
+unsigned long mqttBackoff;                                    // Backoff before next retry, doubled for each failure
+unsigned long mqttRetryDelay;                                 // Backoff with jitter for this retry
+unsigned long mqttLostTime;                                   // Time the broker connection was lost
+unsigned long mqttConnectedTime;                              // Time of the last connect
+IPAddress mqttBrokerIp;                                       // Broker address, kept until a connect to it fails
+bool mqttBrokerResolved             = false;
+unsigned long mqttReconnectTime;                              // ms without broker at the last (re)connect
+uint16_t mqttReconnects;                                      // Number of lost broker connections
 bool needReset                      = false;
 
 // Make objects for IotWebConf
@@ -186,16 +262,24 @@ IotWebConfSelectParameter webLanguage       = IotWebConfSelectParameter(
 // Name of the config server we want to get config from
 
 char configHost[DB_CONFIGPATH_LEN];
-const char* configPath;
-const char* tmpMqttServer;
+char configPath[DB_CONFIGPATH_LEN + DB_CLIENTID_LEN + 1];     // configHost + clientID
+char configEtag[CONFIG_ETAG_LEN + 1];                         // ETag of the last received config
+configCacheHeader configCache;                                // Header of the config in flash
+configScratch received;                                       // Parsed config before it replaces tamBoxMqtt and tamBoxConfig
+bool configFromCache                = false;                  // Started from the config in flash
+unsigned long coldStartTime;                                  // Power on to tambox ready in ms
 
 // Where received config are stored
-String tamBoxMqtt[MQTT_PARAM];                                // [SERVER,PORT,USER,PASS,TOPIC]
-String tamBoxConfig[CONFIG_DEST][CONFIG_PARAM];               // [DEST_A,DEST_B,DEST_C,DEST_D,OWN][ID,SIGN,NAME,NUMOFDEST,TRACKS,EXIT,TOTTRACKS,TYPE]
+tamBoxMqttConfiguration tamBoxMqtt;                           // Broker, port, user, password and scale
+tamBoxConfiguration tamBoxConfig[CONFIG_DEST];                // [DEST_A,...,DEST_D,OWN,DEST_A_RIGHT,...,DEST_D_RIGHT] with 4 exits
 
 bool notReceivedConfig;
 bool tamboxReady                    = false;
 
+// Subscription index, node id hashes mapped to destinations
+topicIndexEntry topicIndex[TOPIC_INDEX_SIZE];
+char supervisorId[DB_CLIENTID_LEN + sizeof(NODE_SUPERVISOR) + 1];  // Own node id + "-" + NODE_SUPERVISOR
+
 // ------------------------------------------------------------------------------------------------------------------------------
 // Define MQTT topic variables
 const byte NORETAIN                 = 0;                      // Used to publish topics as NOT retained
@@ -207,6 +291,11 @@ const byte RETAIN                   = 1;                      // Used to publish
 // Variables to be set after getting configuration from file
 String clientID;
 uint8_t lcdBackLight;
+uint8_t lcdChars;                                             // Parsed from cfgLcdChar
+uint8_t lcdRows;                                              // Parsed from cfgLcdRows
+uint8_t lcdLanguage;                                          // Parsed from cfgLanguage
+unsigned long tamTimeOut;                                     // Parsed from cfgTamTimeOut, in ms
+unsigned long dtShowTime;                                     // Parsed from cfgDtShowTime, in ms
 uint8_t buzzerPin                   = BUZZER_PIN;             // Define buzzerPin
 
 uint8_t destination;
@@ -231,22 +320,49 @@ const char* destIDTxt[NUM_OF_DEST_STRINGS]  = {DEST_A_T,
                                                DEST_B_T,
                                                DEST_C_T,
                                                DEST_D_T,
+#if DEST_BUTTONS > 4
+                                               DEST_E_T,
+                                               DEST_F_T,
+#endif
                                                DEST_OWN_STATION_T,
                                                DEST_A_RIGHT_T,
                                                DEST_B_RIGHT_T,
                                                DEST_C_RIGHT_T,
                                                DEST_D_RIGHT_T,
+#if DEST_BUTTONS > 4
+                                               DEST_E_RIGHT_T,
+                                               DEST_F_RIGHT_T,
+#endif
                                                DEST_CONFIG_T,
                                                DEST_ALL_DEST_T,
                                                DEST_NOT_SELECTED_T};
 
+// Names in retained snapshots, they don't change with the enums
+const char* snapshotStateTxt[NUM_OF_STATES] = {SNAP_NOTUSED_T,
+                                               SNAP_IDLE_T,
+                                               SNAP_TRAFDIR_T,
+                                               SNAP_INREQUEST_T,
+                                               SNAP_INACCEPT_T,
+                                               SNAP_INTRAIN_T,
+                                               SNAP_OUTREQUEST_T,
+                                               SNAP_OUTACCEPT_T,
+                                               SNAP_OUTTRAIN_T,
+                                               SNAP_LOST_T};
+const char* snapshotDirTxt[DIR_STATES]      = {OUT, IN};
+
 // For LCD destinations
-String lcdString[DEST_BUTTONS][LCD_PARTS];                    // String for each destination with 3 positions
+uint8_t lcdNodeTrack[DEST_BUTTONS];                           // Track shown by the sign or train number
+uint8_t lcdDirTrack[DEST_BUTTONS];                            // Track shown by the direction symbol
+
+// Shadow of the LCD, only changed cells are sent by lcdFlush
+uint8_t lcdFrame[LCD_MAX_ROWS][LCD_MAX_CHARS];                // Cells to be shown
+uint8_t lcdShown[LCD_MAX_ROWS][LCD_MAX_CHARS];                // Cells on the LCD
+uint8_t lcdGlyph[128];                                        // LCD character for each byte 0x80 - 0xff
+unsigned long lcdI2cBytes;                                    // I2C bytes sent by lcdFlush
+unsigned long lcdUpdates;                                     // lcdFlush calls
+unsigned long lcdUpdateTime;                                  // us spent in the last lcdFlush
 
 const char* useTrackTxt[DIR_STATES]                   = {LEFT, RIGHT};
-uint16_t trainId[DEST_BUTTONS][MAX_NUM_OF_TRACKS];            // Store the train id per track and destination
-uint8_t traffDir[DEST_BUTTONS][MAX_NUM_OF_TRACKS]     = {{DIR_OUT, DIR_IN}, {DIR_OUT, DIR_IN}, {DIR_OUT, DIR_IN}, {DIR_OUT, DIR_IN}};
-uint8_t lastTraffDir[DEST_BUTTONS][MAX_NUM_OF_TRACKS] = {{DIR_OUT, DIR_IN}, {DIR_OUT, DIR_IN}, {DIR_OUT, DIR_IN}, {DIR_OUT, DIR_IN}};
 const char* stringTxt[languages][LCD_STRINGS]         = {{LCD_TRAIN_T,          // TRAIN            Swedish
                                                           LCD_TRAINDIR_NOK_T,   // LCD_TRAINDIR_NOK
                                                           LCD_DEPATURE_T,       // LCD_DEPATURE
@@ -272,26 +388,71 @@ const char* stringTxt[languages][LCD_STRINGS]         = {{LCD_TRAIN_T,
 
 const char* escapeChar              = "\xc3";                 // Character sent before special characters
 // Variables to store actual states
-uint8_t trackState[DEST_BUTTONS][MAX_NUM_OF_TRACKS];          // State per track and destination
-
-// Store respond-to, session-id, port-id and desired state on sent and received cmd per destination
-String resCmd[DEST_BUTTONS][6];                               // response cmd
-String reqCmd[DEST_BUTTONS][6];                               // request cmd
-
-// Store incoming data message if tambox is busy
-uint16_t dtInQueue[DEST_BUTTONS][Q_DATA];                     // state, id, track, train
+// Track state, train id and traffic direction per destination and track, received request and sent
+// session id per destination
+portTable<DEST_BUTTONS, MAX_NUM_OF_TRACKS> ports;
+
+// Outbound tam topics, built once in setPubTopics when connecting to the broker
+char pubReqTopic[DEST_BUTTONS][LCP_TOPIC_LEN + 1];            // cmd/<scale>/tam/<dest id>/<dest exit>/req
+char pubResTopic[DEST_BUTTONS][LCP_TOPIC_LEN + 1];            // cmd/<scale>/tam/<own id>/<port>/res, our respond-to
+char pubDataTopic[DEST_BUTTONS][LCP_TOPIC_LEN + 1];           // dt/<scale>/tam/<own id>/<port>
+char pubSnapshotTopic[DEST_BUTTONS][LCP_TOPIC_LEN + 1];       // dt/<scale>/tam/<own id>/<port>/snapshot
+char pingTopic[LCP_TOPIC_LEN + 1];                            // dt/<scale>/ping/<own id>
+
+// Resync from retained snapshots, see snapshotReceived
+bool resyncOpen                     = false;                  // Received snapshots are used
+unsigned long resyncStart;                                    // Time subscribing started
+unsigned long resyncTime;                                     // ms until all snapshots were received, 0 if some are missing
+uint32_t resyncPending;                                       // Snapshots not yet received, bit per slot and RESYNC_OWN + destination
+
+// Outbound tam messages, see publishTam
+char pubBody[PUB_BODY_LEN];                                   // Serialized body, reused by every tam publish
+pubMessage pubQueue[PUB_QUEUE_DEPTH];                         // Messages waiting for a retry or a response
+pubStats pubStat[DEST_BUTTONS];
+
+// Metrics, see metricEnd and handleMetrics
+metricHist metric[METRICS];
+const unsigned long metricBound[METRIC_BUCKETS - 1] = METRIC_BOUNDS;
+const char* metricName[METRICS]     = {"tambox_loop_seconds",
+                                       "tambox_mqtt_to_lcd_seconds",
+                                       "tambox_key_to_publish_seconds",
+                                       "tambox_json_decode_seconds"};
+const char* metricHelp[METRICS]     = {"One pass of loop()",
+                                       "mqttCallback() entry to LCD update",
+                                       "Key press to tam publish",
+                                       "Decode of a tam or node body"};
+uint32_t heapLow                    = UINT32_MAX;             // Lowest free heap seen by loop
+uint32_t mqttReceived;                                        // Messages received by mqttCallback
+
+#ifdef RECORDER
+// Traffic recorder, see recordEvent
+const char* recordPath[RECORD_SEGMENTS] = {RECORD_FILE_0, RECORD_FILE_1};
+File recordFile;                                              // Segment being written
+uint16_t recordSeq;                                           // Number of the segment being written
+uint32_t recordSize;                                          // Bytes in the segment being written
+unsigned long recordFlushTime;
+uint8_t recordStates[DEST_BUTTONS * MAX_NUM_OF_TRACKS];       // Track states in the last RECORD_STATE
+#endif
+
+// Fields kept when decoding a tam or node body, see setTamFilter
+JsonDocument tamFilter;
+
+// Texts of reports handled while the tambox is busy, see dtQueuePush
+dtEvent dtQueue[DT_QUEUE_DEPTH];
+uint8_t dtQueueHead                 = 0;                      // Oldest queued report
+uint8_t dtQueueLen                  = 0;                      // Number of queued reports
+uint8_t dtQueueHigh                 = 0;                      // Most reports queued at the same time
+uint16_t dtQueueDrops               = 0;                      // Reports lost on a full queue
 
 uint8_t destBtnPushed;
 uint8_t currentTrack                = LEFT_TRACK;             // Used when toggling the track in LCD
-uint8_t requestTrack                = LEFT_TRACK;             // Used when checking TAM timeout
 bool tamBoxIdle                     = false;                  // Set tambox busy
 bool showText                       = false;                  // Show information text string
 unsigned int epochTime;                                       // For the timestamp in MQTT body
-unsigned long pingTime;
-unsigned long tamTime;
-unsigned long beepPaus;
-unsigned long showTime;
-unsigned long toggleTime;
+
+// Ping, toggle, show text, queue, publish retry and config check timers plus tam timeout and beep per destination and track
+tamBoxTimer timer[TIMER_SLOTS];
+unsigned long nextDeadline;                                   // Earliest deadline of the active timers
 
 // Custom character for LCD
 byte chr1[8] = {0x8, 0x4, 0xa, 0xd, 0xa, 0x4, 0x8, 0x0};      // Character >>
@@ -305,7 +466,7 @@ byte chr7[8] = {0xa, 0x0, 0xe, 0x1, 0xf, 0x11, 0xf, 0x0};     // Character ä
 byte chr8[8] = {0xa, 0x0, 0xe, 0x11, 0x11, 0x11, 0xe, 0x0};   // Character ö
 #endif
 
-HTTPClient http;
+halHttp http;
 
 /* ------------------------------------------------------------------------------------------------------------------------------
  *  Standard setup function
@@ -384,8 +545,21 @@ void setup() {
     lcdBackLight                    = atoi(cfgBackLight);
   }
 
+  setDeviceSettings();
   notReceivedConfig = true;
 
+  if (!LittleFS.begin()) {                                    // Start without the config cache
+#ifdef DEBUG
+    Serial.printf("%-16s: %d LittleFS mount failed\n", __func__, __LINE__);
+#endif
+  }
+#ifdef RECORDER
+
+  else {
+    recordBegin();
+  }
+#endif
+
 #ifdef __ARDUINO_OTA_H
   // ----------------------------------------------------------------------------------------------------------------------------
   // Setup for OTA handling (Over-the-Air programming)
@@ -433,7 +607,7 @@ void setup() {
   // The begin call takes the width and height. This
   // Should match the number provided to the constructor.
 
-  lcd.begin(atoi(cfgLcdChar), atoi(cfgLcdRows));
+  lcd.begin(lcdChars, lcdRows);
   lcd.setBacklight(lcdBackLight);
 
   // Only 8 custom characters can be defined into the LCD
@@ -447,19 +621,25 @@ void setup() {
   lcd.createChar(SWE_LOW_Ä, chr7);                            // Create character lowercase ä
   lcd.createChar(SWE_LOW_Ö, chr8);                            // Create character lowercase ö
 #endif
+  setLcdGlyphs();
+  memset(lcdShown, LCD_CELL_UNKNOWN, sizeof(lcdShown));         // Start up texts are not in the shadow
   lcd.clear();
-  lcd.setCursor(atoi(cfgLcdChar) / 2 - centerText(LCD_AP_MODE), LCD_FIRST_ROW);
+  lcd.setCursor(lcdChars / 2 - centerText(LCD_AP_MODE), LCD_FIRST_ROW);
   lcd.print(LCD_AP_MODE);
-  lcd.setCursor(atoi(cfgLcdChar) / 2 - centerText(String(iotWebConf.getThingName())), LCD_SECOND_ROW);
+  lcd.setCursor(lcdChars / 2 - centerText(String(iotWebConf.getThingName())), LCD_SECOND_ROW);
   lcd.print(String(iotWebConf.getThingName()));
 
 
   // Set up required URL handlers for the config web pages
   server.on("/", handleRoot);
   server.on("/config", []{iotWebConf.handleConfig();});
+  server.on("/metrics", handleMetrics);
+#ifdef RECORDER
+  server.on("/record", handleRecord);
+#endif
   server.onNotFound([](){iotWebConf.handleNotFound();});
 
-  delay(2000);                                                // Wait for IotWebServer to start network connection
+  halDelay(2000);                                             // Wait for IotWebServer to start network connection
 
   // ----------------------------------------------------------------------------------------------------------------------------
   // Set-up i2c key board
@@ -470,8 +650,11 @@ void setup() {
   // Set default values
 
   setDefaults();
+  setTamFilter();
   destination = DEST_NOT_SELECTED;
-  toggleTime = pingTime = tamTime = beepPaus = showTime = millis();
+  setTimer(TIMER_PING, OWN, LEFT_TRACK, TIME_PING_INTERVAL);
+  setTimer(TIMER_TOGGLE, OWN, LEFT_TRACK, TIME_TOGGLE_TRACK);
+  setShowTimer();
 }
 
 
@@ -481,6 +664,8 @@ void setup() {
  */
 void loop() {
 
+  metricBegin(METRIC_LOOP);
+
 #ifdef __ARDUINO_OTA_H
   // Handler for the OTA process
   ArduinoOTA.handle();
@@ -493,11 +678,8 @@ void loop() {
     }
   }
 
-  else if ((iotWebConf.getState() == iotwebconf::OnLine) && (!mqttClient.connected())) {
-#ifdef DEBUG
-    Serial.printf("%-16s: %d  MQTT reconnect\n", __func__, __LINE__);
-#endif
-    mqttConnect();
+  else if ((iotWebConf.getState() == iotwebconf::OnLine) && (mqttState != MQTT_CONNECTED || !mqttClient.connected())) {
+    mqttConnect();                                                                              // Next reconnect step, never blocks
   }
 
   if (needReset) {
@@ -516,69 +698,24 @@ void loop() {
   iotWebConf.doLoop();                                                                          // Check for IotWebConfig actions
 
   if (tamboxReady) {
-    char key = Keypad.getKey();                                                                 // Get key input
+    char key = readKey();                                                                       // Get key input
     if (key) {
+      metricBegin(METRIC_KEY_PUB);                                                              // Ended by publishTam
       beep(4, BEEP_KEY_CLK);                                                                    // Key click 4ms
       keyReceived(key);
+      metricCancel(METRIC_KEY_PUB);                                                             // Key didn't publish
     }
 
-    if (showText && (millis() - showTime > atoi(cfgDtShowTime) * 1000)) {                       // Information text is shown
-      showTime = millis();
-      tamBoxIdle = true;                                                                        // Set tambox idle
-#ifdef DEBUG
-      Serial.printf("%-16s: %d  - tamBoxIdle set to true\n", __func__, __LINE__);
-#endif
-      showText = false;
-      updateLcd(DEST_ALL_DEST);                                                                 // Restore the LCD
-#ifdef DEBUG
-      Serial.printf("%-16s: %d  - ShowText set to false\n", __func__, __LINE__);
-#endif
-    }
-
-    if (tamBoxIdle && (millis() - showTime > atoi(cfgDtShowTime) * 1000)) {                     // Check the queue
-      showTime = millis();
-      for (uint8_t dest = 0; dest < DEST_BUTTONS; dest++) {
-        if (dtInQueue[dest][Q_STATE] == Q_ACTIVE) {                                             // Check incoming dt queue
-          dtInQueue[dest][Q_STATE] = Q_INACTIVE;                                                // Handle the queued message
-#ifdef DEBUG
-          Serial.printf("%-16s: %d  Queue for dest %s executed\n", __func__, __LINE__, destIDTxt[dest]);
-#endif
-          handleTrain(dest, dtInQueue[dest][Q_TRACK], dtInQueue[dest][Q_ORDERCODE], dtInQueue[dest][Q_TRAIN]);
-          break;
-        }
-      }
-    }
-
-    if (tamBoxIdle && (millis() - toggleTime > TIME_TOGGLE_TRACK)) {                            // Toggle double track view
-      toggleTime = millis();
-      toggleTrack();
-    }
-
-    if (millis() - pingTime > TIME_PING_INTERVAL) {                                             // Send Ping
-      pingTime = millis();
-      sendPing();
-    }
-
-    for (uint8_t dest = 0; dest < DEST_BUTTONS; dest++) {
-      if (trackState[dest][requestTrack] == _INREQUEST) {
-        if (millis() - tamTime > atoi(cfgTamTimeOut) * 1000) {                                  // TAM request times out
-          tamTime = millis();
-#ifdef DEBUG
-          Serial.printf("%-16s: %d  - tamTime set to millis()\n", __func__, __LINE__);
+    runTimers();                                                                                // Only does work when a timer is due
+    snapshotCheck();                                                                            // Publish changed tracks
+  }
+#ifdef RECORDER
+  recordTrackStates();                                                                          // After everything this pass did
 #endif
-          keyReceived('*');                                                                     // Send reject when timed out
-        }
 
-        else if (millis() - beepPaus > TIME_BEEP_PAUS) {
-          beepPaus = millis();
-#ifdef DEBUG
-          Serial.printf("%-16s: %d  - beepPaus set to millis()\n", __func__, __LINE__);
-#endif
-          beep(TIME_BEEP_DURATION, BEEP_OK);
-        }
-      }
-    }
-  }
+  uint32_t heap = ESP.getFreeHeap();
+  if (heap < heapLow) { heapLow = heap; }
+  metricEnd(METRIC_LOOP);
 }
 
 
@@ -589,6 +726,9 @@ void loop() {
  *  Incoming request on normal track from destination A
  *    # Accept      OK
  *    * Reject      NOK
+ *  Incoming request from destination B while another is shown
+ *    B# Accept     OK
+ *    B* Reject     NOK
  *  Report train in on normal track from destination A
  *    A#
  *  Report train in on other track from destination C
@@ -611,16 +751,11 @@ void keyReceived(char key) {
   Serial.printf("%-16s: %d  Destination in: %s\n", __func__, __LINE__, destIDTxt[destination]);
 #endif
 
-  StaticJsonDocument<255> doc;                                                                  // Create a json object
-  uint8_t maxSize = 255;
+  JsonDocument doc;                                                                             // Create a json object
   uint8_t ownTrack = LEFT_TRACK;                                                                // Default single track traffic
   uint8_t destinationTrack = LEFT_TRACK;                                                        // Default single track traffic
   String portId;
-  char body[254];
-  char receiver[32];
-  uint8_t check;
-  unsigned int timestamp = epochTime + millis() / 1000;
-  size_t n;
+  unsigned int timestamp = epochTime + halMillis() / 1000;
 
   doc[TAM][VERSION]   = LCP_BODY_VER;
   doc[TAM][TIMESTAMP] = timestamp;
@@ -628,71 +763,24 @@ void keyReceived(char key) {
   switch (key) {
     case '*':                                                                                   // NOK, Not accepted button pushed
       if (destination < DEST_CONFIG) {                                                          // If valid destination has been selected
-        if (tamBoxConfig[destination][TRACKS].toInt() == DOUBLE_TRACK) {                        // If double track to destination
-          destinationTrack = RIGHT_TRACK;
-          if (trackState[destination][RIGHT_TRACK] == _INREQUEST ||                             // If right track state is in request
-              trackState[destination][RIGHT_TRACK] == _INTRAIN) {                               // If right track status is incoming train
-            ownTrack = RIGHT_TRACK;
-          }
+        if (tamBoxConfig[destination].tracks == DOUBLE_TRACK) {                                 // If double track to destination
+          ownTrack = keyTrack(destination);
+          destinationTrack = (ownTrack == RIGHT_TRACK) ? LEFT_TRACK : RIGHT_TRACK;              // Same track at the destination
         }
 
 #ifdef DEBUG
-        Serial.printf("%-16s: %d  Destination: %s, State in: %s for %s track\n", __func__, __LINE__, destIDTxt[destination], trackStateTxt[trackState[destination][ownTrack]], useTrackTxt[ownTrack]);
+        Serial.printf("%-16s: %d  Destination: %s, State in: %s for %s track\n", __func__, __LINE__, destIDTxt[destination], trackStateTxt[ports.at(destination, ownTrack).state], useTrackTxt[ownTrack]);
         Serial.printf("%-16s: %d  Destination selected %d times\n", __func__, __LINE__, destBtnPushed);
 #endif
-        switch (trackState[destination][ownTrack]) {                                            // Check track state
+        switch (ports.at(destination, ownTrack).state) {                                        // Check track state
           case _INREQUEST:                                                                      // If incoming request
-            if (tamBoxConfig[destination][TRACKS].toInt() == DOUBLE_TRACK) {
-              ownTrack = (destinationTrack == RIGHT_TRACK) ? RIGHT_TRACK : LEFT_TRACK;
-            }
-
-            trackState[destination][ownTrack] = _IDLE;                                          // Set track state to idle
-
-            doc[TAM][NODE_ID]                       = reqCmd[destination][LCP_NODE_ID];
-            doc[TAM][PORT_ID]                       = reqCmd[destination][LCP_PORT_ID];
-            doc[TAM][TRACK]                         = String(useTrackTxt[destinationTrack]);
-            doc[TAM][TRAIN_ID]                      = trainId[destination][ownTrack];
-            doc[TAM][SESSION_ID]                    = reqCmd[destination][LCP_SESSION_ID];
-            doc[TAM][STATE][DESIRED]                = reqCmd[destination][LCP_DESIRED_STATE];
-            doc[TAM][STATE][REPORTED]               = REJECTED;
-
-            strcpy(receiver, reqCmd[destination][LCP_RESPOND_TO].c_str());
-/*
- * char body[512];
- * serializeJson(doc, body);
- * mqttPublish("putTopic", body);
- * 
- * några CPU cycler snabbare om storleken på payload skickas till mqttPublish
- * char body[512];
- * aize_t n = serializeJson(doc, body);
- * mqttPublish("outTopic", body, n);
- */
-            n = serializeJson(doc, body);                                                       // Create a json body
-            check = mqttClient.publish(receiver, body, NORETAIN);                               // Publish a tam rejected message
-#ifdef DEBUG
-            if (check == 1) {
-              Serial.printf("%-16s: %d  Publish a TAM rejected message with body size: %d (%d to max size)\n", __func__, __LINE__, n, maxSize - n);
-              Serial.printf("%-16s: %d  Publish: %s - %s\n", __func__, __LINE__, receiver, body);
-            }
-
-            else {
-              Serial.printf("%-16s: %d  Publish %s failed with code: %d\n", __func__, __LINE__, receiver, check);
-            }
-#endif
-            trainId[destination][ownTrack] = DEST_TRAIN_0;                                      // Clear the train number
-#ifdef DEBUG
-            Serial.printf("%-16s: %d  State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[destination][ownTrack]], useTrackTxt[ownTrack]);
-#endif
-            tamBoxIdle = true;                                                                  // Set tambox busy
-#ifdef DEBUG
-            Serial.printf("%-16s: %d  - tamBoxIdle set to true\n", __func__, __LINE__);
-#endif
+            rejectRequest(destination, ownTrack);                                               // Reject the request on its own track
           break;
 //----------------------------------------------------------------------------------------------
           case _TRAFDIR:                                                                        // Cancel Traffic direction request
-            trackState[destination][ownTrack] = _IDLE;                                          // Set track state to idle
+            ports.at(destination, ownTrack).state = _IDLE;                                      // Set track state to idle
 #ifdef DEBUG
-            Serial.printf("%-16s: %d  State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[destination][ownTrack]], useTrackTxt[ownTrack]);
+            Serial.printf("%-16s: %d  State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(destination, ownTrack).state], useTrackTxt[ownTrack]);
 #endif
           break;
 //----------------------------------------------------------------------------------------------
@@ -702,62 +790,36 @@ void keyReceived(char key) {
             Serial.printf("%-16s: %d  - tamBoxIdle set to false\n", __func__, __LINE__);
 #endif
             trainNumber = "";
-            trackState[destination][ownTrack] = _IDLE;                                          // Set track state to idle
+            ports.at(destination, ownTrack).state = _IDLE;                                      // Set track state to idle
             setDirString(destination, ownTrack);
 #ifdef DEBUG
-            Serial.printf("%-16s: %d  State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[destination][ownTrack]], useTrackTxt[ownTrack]);
-#endif
-            if (trainId[destination][ownTrack] != DEST_TRAIN_0) {
-              resCmd[destination][LCP_NODE_ID]        = tamBoxConfig[destination][ID];
-              resCmd[destination][LCP_PORT_ID]        = tamBoxConfig[destination][EXIT];
-              resCmd[destination][LCP_SESSION_ID]     = "req:" + String(timestamp);
-              resCmd[destination][LCP_RESPOND_TO]     = "cmd/" + tamBoxMqtt[SCALE] + "/" +
-                                                        "tam/" + tamBoxConfig[OWN][ID] + "/" +
-                                                         resCmd[destination][LCP_PORT_ID] + "/res";
-              resCmd[destination][LCP_TRACK]          = String(useTrackTxt[destinationTrack]);
-              resCmd[destination][LCP_DESIRED_STATE]  = CANCEL;
-
-              doc[TAM][NODE_ID]                       = resCmd[destination][LCP_NODE_ID];
-              doc[TAM][PORT_ID]                       = resCmd[destination][LCP_PORT_ID];
-              doc[TAM][TRACK]                         = resCmd[destination][LCP_TRACK];
-              doc[TAM][TRAIN_ID]                      = trainId[destination][ownTrack];
-              doc[TAM][SESSION_ID]                    = resCmd[destination][LCP_SESSION_ID];
-              doc[TAM][RESPOND_TO]                    = resCmd[destination][LCP_RESPOND_TO];
-              doc[TAM][STATE][DESIRED]                = resCmd[destination][LCP_DESIRED_STATE];
-
-              strcpy(receiver, COMMAND); strcat(receiver, "/");
-              strcat(receiver, tamBoxMqtt[SCALE].c_str()); strcat(receiver, "/");
-              strcat(receiver, TAM); strcat(receiver, "/");
-              strcat(receiver, tamBoxConfig[destination][ID].c_str()); strcat(receiver, "/");
-              strcat(receiver, tamBoxConfig[destination][EXIT].c_str()); strcat(receiver, "/");
-              strcat(receiver, REQUEST);
-              n = serializeJson(doc, body);                                                     // Create a json body
-
-              check = mqttClient.publish(receiver, body, NORETAIN);                             // Publish a tam cancel message
-
-#ifdef DEBUG
-              if (check == 1) {
-                Serial.printf("%-16s: %d  Publish a TAM cancel message with body size: %d (%d to max size)\n", __func__, __LINE__, n, maxSize - n);
-                Serial.printf("%-16s: %d  Publish: %s - %s\n", __func__, __LINE__, receiver, body);
-              }
-
-              else {
-                Serial.printf("%-16s: %d  Publish %s failed with code: %d\n", __func__, __LINE__, receiver, check);
-              }
+            Serial.printf("%-16s: %d  State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(destination, ownTrack).state], useTrackTxt[ownTrack]);
 #endif
+            if (ports.at(destination, ownTrack).trainId != DEST_TRAIN_0) {
+              snprintf(ports[destination].resSessionId, sizeof(ports[destination].resSessionId), "req:%u", timestamp);
+
+              doc[TAM][NODE_ID]                       = tamBoxConfig[destination].id;
+              doc[TAM][PORT_ID]                       = tamBoxConfig[destination].exit;
+              doc[TAM][TRACK]                         = useTrackTxt[destinationTrack];
+              doc[TAM][TRAIN_ID]                      = ports.at(destination, ownTrack).trainId;
+              doc[TAM][SESSION_ID]                    = ports[destination].resSessionId;
+              doc[TAM][RESPOND_TO]                    = pubResTopic[destination];
+              doc[TAM][STATE][DESIRED]                = CANCEL;
+
+              publishTam(destination, pubReqTopic[destination], doc, PUB_AWAIT);                // Publish a tam cancel message
             }
 
             lcd.noBlink();
             lcd.noCursor();
             printString(LCD_TAM_CANCELED, destination, DEST_TRAIN_0);
-            trainId[destination][ownTrack] = DEST_TRAIN_0;
+            ports.at(destination, ownTrack).trainId = DEST_TRAIN_0;
             showText = true;                                                                    // Show info string
 #ifdef DEBUG
             Serial.printf("%-16s: %d  - ShowText set to true\n", __func__, __LINE__);
 #endif
-            showTime = millis();
+            setShowTimer();
 #ifdef DEBUG
-            Serial.printf("%-16s: %d  - showTime set to millis()\n", __func__, __LINE__);
+            Serial.printf("%-16s: %d  - show timer restarted\n", __func__, __LINE__);
 #endif
           break;
         }
@@ -780,150 +842,71 @@ void keyReceived(char key) {
 #endif
       }
 
-      showTime = millis();
+      setShowTimer();
 #ifdef DEBUG
-      Serial.printf("%-16s: %d  - showTime set to millis()\n", __func__, __LINE__);
+      Serial.printf("%-16s: %d  - show timer restarted\n", __func__, __LINE__);
 #endif
       destBtnPushed = 0;
-      toggleTime = millis();
+      setTimer(TIMER_TOGGLE, OWN, LEFT_TRACK, TIME_TOGGLE_TRACK);
     break;
 //----------------------------------------------------------------------------------------------
     case '#':                                                                                   // OK, Accepted button pushed
       if (destination < DEST_CONFIG) {
-        if (tamBoxConfig[destination][TRACKS].toInt() == DOUBLE_TRACK) {                        // If double track to destination
-          destinationTrack = RIGHT_TRACK;
-          if (trackState[destination][destinationTrack] == _INREQUEST ||                        // If left track state is incoming request
-              trackState[destination][destinationTrack] == _INTRAIN) {                          // If left track state is incoming train
-              ownTrack = RIGHT_TRACK;
-            if (destBtnPushed > 1) {
-              ownTrack = LEFT_TRACK;
-              destinationTrack = RIGHT_TRACK;
-            }
-          }
+        if (tamBoxConfig[destination].tracks == DOUBLE_TRACK) {                                 // If double track to destination
+          ownTrack = keyTrack(destination);
+          destinationTrack = (ownTrack == RIGHT_TRACK) ? LEFT_TRACK : RIGHT_TRACK;              // Same track at the destination
         }
 #ifdef DEBUG
-        Serial.printf("%-16s: %d  Destination: %s, State in: %s for %s track\n", __func__, __LINE__, destIDTxt[destination], trackStateTxt[trackState[destination][ownTrack]], useTrackTxt[ownTrack]);
+        Serial.printf("%-16s: %d  Destination: %s, State in: %s for %s track\n", __func__, __LINE__, destIDTxt[destination], trackStateTxt[ports.at(destination, ownTrack).state], useTrackTxt[ownTrack]);
         Serial.printf("%-16s: %d  Destination selected %d times\n", __func__, __LINE__, destBtnPushed);
 #endif
         portId = String(destIDTxt[destination]);
         portId.toLowerCase();
 
-        switch (trackState[destination][ownTrack]) {                                            // Check track state
+        switch (ports.at(destination, ownTrack).state) {                                        // Check track state
           case _INTRAIN:                                                                        // If track state is incoming train
-            if (tamBoxConfig[destination][TRACKS].toInt() == DOUBLE_TRACK) {
-              ownTrack = (destinationTrack == RIGHT_TRACK) ? RIGHT_TRACK : LEFT_TRACK;
-            }
+            ports.at(destination, ownTrack).state = _IDLE;                                      // Set track state to idle
 
-            trackState[destination][ownTrack] = _IDLE;                                          // Set track state to idle
-
-            doc[TAM][NODE_ID]                       = tamBoxConfig[OWN][ID];
+            doc[TAM][NODE_ID]                       = tamBoxConfig[OWN].id;
             doc[TAM][PORT_ID]                       = portId;
-            doc[TAM][TRACK]                         = String(useTrackTxt[destinationTrack]);
-            doc[TAM][TRAIN_ID]                      = trainId[destination][ownTrack];
+            doc[TAM][TRACK]                         = String(useTrackTxt[ownTrack]);
+            doc[TAM][TRAIN_ID]                      = ports.at(destination, ownTrack).trainId;
             doc[TAM][STATE][REPORTED]               = IN;
 
-            strcpy(receiver, DATA); strcat(receiver, "/");
-            strcat(receiver, tamBoxMqtt[SCALE].c_str()); strcat(receiver, "/");
-            strcat(receiver, TAM); strcat(receiver, "/");
-            strcat(receiver, tamBoxConfig[OWN][ID].c_str()); strcat(receiver, "/");
-            strcat(receiver, portId.c_str());
-
-            n = serializeJson(doc, body);                                                       // Create a json body
-            check = mqttClient.publish(receiver, body, NORETAIN);                               // Publish a train in message
-
-#ifdef DEBUG
-            if (check == 1) {
-              Serial.printf("%-16s: %d  Publish a train in message with body size: %d (%d to max size)\n", __func__, __LINE__, n, maxSize - n);
-              Serial.printf("%-16s: %d  Publish: %s - %s\n", __func__, __LINE__, receiver, body);
-            }
-
-            else {
-              Serial.printf("%-16s: %d  Publish %s failed with code: %d\n", __func__, __LINE__, receiver, check);
-            }
-#endif
-            trainId[destination][ownTrack] = DEST_TRAIN_0;                                      // Clear the train number
+            publishTam(destination, pubDataTopic[destination], doc, PUB_ONCE);                  // Publish a train in message
+            ports.at(destination, ownTrack).trainId = DEST_TRAIN_0;                             // Clear the train number
 #ifdef DEBUG
-            Serial.printf("%-16s: %d  State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[destination][ownTrack]], useTrackTxt[ownTrack]);
+            Serial.printf("%-16s: %d  State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(destination, ownTrack).state], useTrackTxt[ownTrack]);
 #endif
           break;
 //----------------------------------------------------------------------------------------------
           case _INREQUEST:                                                                      // If track state is incoming request
-            if (tamBoxConfig[destination][TRACKS].toInt() == DOUBLE_TRACK) {
-              ownTrack = (destinationTrack == RIGHT_TRACK) ? RIGHT_TRACK : LEFT_TRACK;
-            }
-
-            trackState[destination][ownTrack] = _INACCEPT;                                      // Set state to incoming accept
-
-            doc[TAM][NODE_ID]                       = reqCmd[destination][LCP_NODE_ID];
-            doc[TAM][PORT_ID]                       = reqCmd[destination][LCP_PORT_ID];
-            doc[TAM][TRACK]                         = String(useTrackTxt[destinationTrack]);
-            doc[TAM][TRAIN_ID]                      = trainId[destination][ownTrack];
-            doc[TAM][SESSION_ID]                    = reqCmd[destination][LCP_SESSION_ID];
-            doc[TAM][STATE][DESIRED]                = reqCmd[destination][LCP_DESIRED_STATE];
-            doc[TAM][STATE][REPORTED]               = ACCEPTED;
-
-            strcpy(receiver, reqCmd[destination][LCP_RESPOND_TO].c_str());
-
-            n = serializeJson(doc, body);                                                       // Create a json body
-            check = mqttClient.publish(receiver, body, NORETAIN);                               // Publish a tam accepted message
-#ifdef DEBUG
-            if (check == 1) {
-              Serial.printf("%-16s: %d Publish a TAM accepted message with body size: %d (%d to max size)\n", __func__, __LINE__, n, maxSize - n);
-              Serial.printf("%-16s: %d Publish: %s - %s\n", __func__, __LINE__, receiver, body);
-            }
+            ports.at(destination, ownTrack).state = _INACCEPT;                                  // Set state to incoming accept
 
-            else {
-              Serial.printf("%-16s: %d Publish %s failed with code: %d\n", __func__, __LINE__,receiver, check);
-            }
-#endif
+            respondRequest(destination, ownTrack, ACCEPTED);                                    // Publish a tam accepted message
             tamBoxIdle = true;                                                                  // Set tambox idle
 #ifdef DEBUG
             Serial.printf("%-16s: %d - tamBoxIdle set to true\n", __func__, __LINE__);
-            Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[destination][ownTrack]], useTrackTxt[ownTrack]);
+            Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(destination, ownTrack).state], useTrackTxt[ownTrack]);
 #endif
           break;
 //----------------------------------------------------------------------------------------------
           case _OUTREQUEST:                                                                     // If state is Outgoing request
-            trainId[destination][ownTrack] = trainNumber.toInt();                               // set train number
+            ports.at(destination, ownTrack).trainId = trainNumber.toInt();                      // set train number
             lcd.noCursor();
             lcd.noBlink();
             trainNumber = "";
-            resCmd[destination][LCP_NODE_ID]        = tamBoxConfig[destination][ID];
-            resCmd[destination][LCP_PORT_ID]        = tamBoxConfig[destination][EXIT];
-            resCmd[destination][LCP_SESSION_ID]     = "req:" + String(timestamp);
-            resCmd[destination][LCP_RESPOND_TO]     = "cmd/" + tamBoxMqtt[SCALE] + "/" +
-                                                      "tam/" + tamBoxConfig[OWN][ID] + "/" +
-                                                       portId + "/res";
-            resCmd[destination][LCP_TRACK]          = String(useTrackTxt[ownTrack]);
-            resCmd[destination][LCP_DESIRED_STATE]  = ACCEPT;
-
-            doc[TAM][NODE_ID]                       = resCmd[destination][LCP_NODE_ID];
-            doc[TAM][PORT_ID]                       = resCmd[destination][LCP_PORT_ID];
+            snprintf(ports[destination].resSessionId, sizeof(ports[destination].resSessionId), "req:%u", timestamp);
+
+            doc[TAM][NODE_ID]                       = tamBoxConfig[destination].id;
+            doc[TAM][PORT_ID]                       = tamBoxConfig[destination].exit;
             doc[TAM][TRACK]                         = String(useTrackTxt[destinationTrack]);
-            doc[TAM][TRAIN_ID]                      = trainId[destination][ownTrack];
-            doc[TAM][SESSION_ID]                    = resCmd[destination][LCP_SESSION_ID];
-            doc[TAM][RESPOND_TO]                    = resCmd[destination][LCP_RESPOND_TO];
-            doc[TAM][STATE][DESIRED]                = resCmd[destination][LCP_DESIRED_STATE];
-
-            strcpy(receiver, COMMAND); strcat(receiver, "/");
-            strcat(receiver, tamBoxMqtt[SCALE].c_str()); strcat(receiver, "/");
-            strcat(receiver, TAM); strcat(receiver, "/");
-            strcat(receiver, tamBoxConfig[destination][ID].c_str()); strcat(receiver, "/");
-            strcat(receiver, tamBoxConfig[destination][EXIT].c_str()); strcat(receiver, "/");
-            strcat(receiver, REQUEST);
-
-            n = serializeJson(doc, body);                                                       // Create a json body
-            check = mqttClient.publish(receiver, body, NORETAIN);                               // Publish a tam request message
-#ifdef DEBUG
-            if (check == 1) {
-              Serial.printf("%-16s: %d Publish a TAM request message with body size: %d (%d to max size)\n", __func__, __LINE__, n, maxSize - n);
-              Serial.printf("%-16s: %d Publish: %s - %s\n", __func__, __LINE__, receiver, body);
-            }
+            doc[TAM][TRAIN_ID]                      = ports.at(destination, ownTrack).trainId;
+            doc[TAM][SESSION_ID]                    = ports[destination].resSessionId;
+            doc[TAM][RESPOND_TO]                    = pubResTopic[destination];
+            doc[TAM][STATE][DESIRED]                = ACCEPT;
 
-            else {
-              Serial.printf("%-16s: %d Publish %s failed with code: %d\n", __func__, __LINE__, receiver, check);
-            }
-#endif
+            publishTam(destination, pubReqTopic[destination], doc, PUB_AWAIT);                  // Publish a tam request message
             tamBoxIdle = true;                                                                  // Set tambox idle
 #ifdef DEBUG
             Serial.printf("%-16s: %d - tamBoxIdle set to true\n", __func__, __LINE__);
@@ -931,34 +914,17 @@ void keyReceived(char key) {
           break;
 //----------------------------------------------------------------------------------------------
           case _OUTACCEPT:                                                                      // If state is Outgoing request accepted
-            trackState[destination][ownTrack] = _OUTTRAIN;                                      // Set state to outgoing train
+            ports.at(destination, ownTrack).state = _OUTTRAIN;                                  // Set state to outgoing train
 
-            doc[TAM][NODE_ID]                       = tamBoxConfig[OWN][ID];
+            doc[TAM][NODE_ID]                       = tamBoxConfig[OWN].id;
             doc[TAM][PORT_ID]                       = portId;
             doc[TAM][TRACK]                         = String(useTrackTxt[ownTrack]);
-            doc[TAM][TRAIN_ID]                      = trainId[destination][ownTrack];
+            doc[TAM][TRAIN_ID]                      = ports.at(destination, ownTrack).trainId;
             doc[TAM][STATE][REPORTED]               = OUT;
 
-            strcpy(receiver, DATA); strcat(receiver, "/");
-            strcat(receiver, tamBoxMqtt[SCALE].c_str()); strcat(receiver, "/");
-            strcat(receiver, TAM); strcat(receiver, "/");
-            strcat(receiver, tamBoxConfig[OWN][ID].c_str()); strcat(receiver, "/");
-            strcat(receiver, portId.c_str());
-
-            n = serializeJson(doc, body);                                                       // Create a json body
-            check = mqttClient.publish(receiver, body, NORETAIN);                               // Publish a train out message
-#ifdef DEBUG
-            if (check == 1) {
-              Serial.printf("%-16s: %d Publish a train out message with body size: %d (%d to max size)\n", __func__, __LINE__, n, maxSize - n);
-              Serial.printf("%-16s: %d Publish: %s - %s\n", __func__, __LINE__, receiver, body);
-            }
-
-            else {
-              Serial.printf("%-16s: %d Publish %s failed with code: %d\n", __func__, __LINE__, receiver, check);
-            }
-#endif
+            publishTam(destination, pubDataTopic[destination], doc, PUB_ONCE);                  // Publish a train out message
 #ifdef DEBUG
-            Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[destination][ownTrack]], useTrackTxt[ownTrack]);
+            Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(destination, ownTrack).state], useTrackTxt[ownTrack]);
 #endif
           break;
         }
@@ -984,12 +950,12 @@ void keyReceived(char key) {
 #endif
       }
 
-      showTime = millis();
+      setShowTimer();
 #ifdef DEBUG
-      Serial.printf("%-16s: %d - showTime set to millis()\n", __func__, __LINE__);
+      Serial.printf("%-16s: %d - show timer restarted\n", __func__, __LINE__);
 #endif
       destBtnPushed = 0;
-      toggleTime = millis();
+      setTimer(TIMER_TOGGLE, OWN, LEFT_TRACK, TIME_TOGGLE_TRACK);
     break;
 //----------------------------------------------------------------------------------------------
     case 'A':                                                                                   // Destination key pressed
@@ -1023,26 +989,19 @@ void keyReceived(char key) {
         updateLcd(DEST_ALL_DEST);
       }
 #ifdef DEBUG
-      Serial.printf("%-16s: %d Destination: %s, Current state: %s for %s track\n", __func__, __LINE__, destIDTxt[destination], trackStateTxt[trackState[destination][LEFT_TRACK]], useTrackTxt[LEFT_TRACK]);
-      Serial.printf("%-16s: %d Destination: %s, Current state: %s for %s track\n", __func__, __LINE__, destIDTxt[destination], trackStateTxt[trackState[destination][RIGHT_TRACK]], useTrackTxt[RIGHT_TRACK]);
+      Serial.printf("%-16s: %d Destination: %s, Current state: %s for %s track\n", __func__, __LINE__, destIDTxt[destination], trackStateTxt[ports.at(destination, LEFT_TRACK).state], useTrackTxt[LEFT_TRACK]);
+      Serial.printf("%-16s: %d Destination: %s, Current state: %s for %s track\n", __func__, __LINE__, destIDTxt[destination], trackStateTxt[ports.at(destination, RIGHT_TRACK).state], useTrackTxt[RIGHT_TRACK]);
       Serial.printf("%-16s: %d Destination selected %d times\n", __func__, __LINE__, destBtnPushed);
 #endif
-      if (tamBoxConfig[destination][TRACKS].toInt() == DOUBLE_TRACK) {                          // If double track to destination
-        destinationTrack = RIGHT_TRACK;
-        if (trackState[destination][destinationTrack] == _INTRAIN) {                            // If right track state is incoming train
-          ownTrack = RIGHT_TRACK;
-          destinationTrack = LEFT_TRACK;
-          if (destBtnPushed == 1) {
-            ownTrack = LEFT_TRACK;
-            destinationTrack = RIGHT_TRACK;
+      if (tamBoxConfig[destination].tracks == DOUBLE_TRACK) {                                   // If double track to destination
+        ownTrack = keyTrack(destination);
+        destinationTrack = (ownTrack == RIGHT_TRACK) ? LEFT_TRACK : RIGHT_TRACK;                // Same track at the destination
 #ifdef DEBUG
-            Serial.printf("%-16s: %d Destination: %s track %s is in state %s\n", __func__, __LINE__, destIDTxt[destination], useTrackTxt[ownTrack], trackStateTxt[trackState[destination][ownTrack]]);
+        Serial.printf("%-16s: %d Destination: %s track %s is in state %s\n", __func__, __LINE__, destIDTxt[destination], useTrackTxt[ownTrack], trackStateTxt[ports.at(destination, ownTrack).state]);
 #endif
-          }
-        }
       }
 
-      switch (trackState[destination][ownTrack]) {                                              // Check track state
+      switch (ports.at(destination, ownTrack).state) {                                          // Check track state
         case _OUTREQUEST:                                                                       // If state is outgoing request
           tamBoxIdle = false;                                                                   // Set tambox busy
 #ifdef DEBUG
@@ -1050,6 +1009,14 @@ void keyReceived(char key) {
 #endif
           printString(LCD_TAM_CANCEL, destination, DEST_TRAIN_0);                               // Report cancel?
         break;
+//----------------------------------------------------------------------------------------------
+        case _INREQUEST:                                                                        // If state is incoming request
+          tamBoxIdle = false;                                                                   // Set tambox busy
+#ifdef DEBUG
+          Serial.printf("%-16s: %d - tamBoxIdle set to false\n", __func__, __LINE__);
+#endif
+          printString(LCD_TAM_ACCEPT, destination, DEST_TRAIN_0);                               // Accept?
+        break;
 //----------------------------------------------------------------------------------------------
         case _INTRAIN:                                                                          // If state is incoming train
           tamBoxIdle = false;                                                                   // Set tambox busy
@@ -1076,53 +1043,26 @@ void keyReceived(char key) {
         break;
 //----------------------------------------------------------------------------------------------
         case _IDLE:                                                                             // If track state is idle
-          portId = String(destIDTxt[destination]);
-          portId.toLowerCase();
-          traffDir[destination][ownTrack] = DIR_OUT;
-
-          resCmd[destination][LCP_NODE_ID]        = tamBoxConfig[destination][ID];
-          resCmd[destination][LCP_PORT_ID]        = tamBoxConfig[destination][EXIT];
-          resCmd[destination][LCP_SESSION_ID]     = "req:" + String(timestamp);
-          resCmd[destination][LCP_RESPOND_TO]     = "cmd/" + tamBoxMqtt[SCALE] + "/" +
-                                                    "tam/" + tamBoxConfig[OWN][ID] + "/" +
-                                                     portId + "/res";
-          resCmd[destination][LCP_TRACK]          = String(useTrackTxt[destinationTrack]);
-          resCmd[destination][LCP_DESIRED_STATE]  = IN;
-
-          doc[TAM][NODE_ID]                       = resCmd[destination][LCP_NODE_ID];
-          doc[TAM][PORT_ID]                       = resCmd[destination][LCP_PORT_ID];
-          doc[TAM][TRACK]                         = resCmd[destination][LCP_TRACK];
-          doc[TAM][SESSION_ID]                    = resCmd[destination][LCP_SESSION_ID];
-          doc[TAM][RESPOND_TO]                    = resCmd[destination][LCP_RESPOND_TO];
-          doc[TAM][STATE][DESIRED]                = resCmd[destination][LCP_DESIRED_STATE];
-
-          strcpy(receiver, COMMAND); strcat(receiver, "/");
-          strcat(receiver, tamBoxMqtt[SCALE].c_str()); strcat(receiver, "/");
-          strcat(receiver, TAM); strcat(receiver, "/");
-          strcat(receiver, tamBoxConfig[destination][ID].c_str()); strcat(receiver, "/");
-          strcat(receiver, tamBoxConfig[destination][EXIT].c_str()); strcat(receiver, "/");
-          strcat(receiver, REQUEST);
-
-          n = serializeJson(doc, body);                                                         // Create a json body
-          check = mqttClient.publish(receiver, body, NORETAIN);                                 // Publish a direction in request
-#ifdef DEBUG
-            if (check == 1) {
-              Serial.printf("%-16s: %d Publish a direction in request with body size: %d (%d to max size)\n", __func__, __LINE__, n, maxSize - n);
-              Serial.printf("%-16s: %d Publish: %s - %s\n", __func__, __LINE__, receiver, body);
-            }
+          ports.at(destination, ownTrack).traffDir = DIR_OUT;
 
-            else {
-              Serial.printf("%-16s: %d Publish %s failed with code: %d\n", __func__, __LINE__, receiver, check);
-            }
-#endif
-          trackState[destination][ownTrack] = _TRAFDIR;                                         // Set state to direction selection
+          snprintf(ports[destination].resSessionId, sizeof(ports[destination].resSessionId), "req:%u", timestamp);
+
+          doc[TAM][NODE_ID]                       = tamBoxConfig[destination].id;
+          doc[TAM][PORT_ID]                       = tamBoxConfig[destination].exit;
+          doc[TAM][TRACK]                         = useTrackTxt[destinationTrack];
+          doc[TAM][SESSION_ID]                    = ports[destination].resSessionId;
+          doc[TAM][RESPOND_TO]                    = pubResTopic[destination];
+          doc[TAM][STATE][DESIRED]                = IN;
+
+          publishTam(destination, pubReqTopic[destination], doc, PUB_AWAIT);                    // Publish a direction in request
+          ports.at(destination, ownTrack).state = _TRAFDIR;                                     // Set state to direction selection
           tamBoxIdle = true;                                                                    // Set tambox idle
 #ifdef DEBUG
           Serial.printf("%-16s: %d - tamBoxIdle set to true\n", __func__, __LINE__);
 #endif
 #ifdef DEBUG
-          Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[destination][ownTrack]], useTrackTxt[ownTrack]);
-          Serial.printf("%-16s: %d Traffic direction %s set\n", __func__, __LINE__, useTrackTxt[traffDir[destination][ownTrack]]);
+          Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(destination, ownTrack).state], useTrackTxt[ownTrack]);
+          Serial.printf("%-16s: %d Traffic direction %s set\n", __func__, __LINE__, useTrackTxt[ports.at(destination, ownTrack).traffDir]);
 #endif
         break;
 //----------------------------------------------------------------------------------------------
@@ -1139,8 +1079,9 @@ void keyReceived(char key) {
 //----------------------------------------------------------------------------------------------
     default:                                                                                    // Number key pressed
       if (destination < DEST_NOT_SELECTED) {                                                    // A destination has been selected
-        switch (trackState[destination][LEFT_TRACK]) {                                          // Check left track state
-          case _OUTREQUEST:                                                                     // If left track state is outgoing request
+        ownTrack = keyTrack(destination);
+        switch (ports.at(destination, ownTrack).state) {                                        // Check track state
+          case _OUTREQUEST:                                                                     // If track state is outgoing request
             tamBoxIdle = false;                                                                 // Set tambox busy
 #ifdef DEBUG
             Serial.printf("%-16s: %d - tamBoxIdle set to false\n", __func__, __LINE__);
@@ -1165,9 +1106,9 @@ void keyReceived(char key) {
 #ifdef DEBUG
         Serial.printf("%-16s: %d - showText set to true\n", __func__, __LINE__);
 #endif
-        showTime = millis();
+        setShowTimer();
 #ifdef DEBUG
-        Serial.printf("%-16s: %d - showTime set to millis()\n", __func__, __LINE__);
+        Serial.printf("%-16s: %d - show timer restarted\n", __func__, __LINE__);
 #endif
       }
     break;
@@ -1176,16 +1117,105 @@ void keyReceived(char key) {
 #ifdef DEBUG
   if (destination != DEST_NOT_SELECTED) {
     Serial.printf("%-16s: %d Destination out %s set\n", __func__, __LINE__, destIDTxt[destination]);
-    Serial.printf("%-16s: %d Destination: %s, New state: %s for %s track\n", __func__, __LINE__, destIDTxt[destination], trackStateTxt[trackState[destination][ownTrack]], useTrackTxt[ownTrack]);
+    Serial.printf("%-16s: %d Destination: %s, New state: %s for %s track\n", __func__, __LINE__, destIDTxt[destination], trackStateTxt[ports.at(destination, ownTrack).state], useTrackTxt[ownTrack]);
   }
 #endif
 }
 
 
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Reject an incoming request, from the * key or when its tam timer is due
+ *
+ *  rejectRequest(dest, track)
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void rejectRequest(uint8_t dest, uint8_t track) {
+
+#ifdef DEBUG
+  Serial.printf("%-16s: %d  %s(dest: %d, track: %d)\n", __func__, __LINE__, __func__, dest, track);
+#endif
+
+  ports.at(dest, track).state = _IDLE;                                                          // Set track state to idle
+  clearTimer(TIMER_TAM, dest, track);
+  clearTimer(TIMER_BEEP, dest, track);
+
+  respondRequest(dest, track, REJECTED);                                                        // Publish a tam rejected message
+  ports.at(dest, track).trainId = DEST_TRAIN_0;                                                 // Clear the train number
+#ifdef DEBUG
+  Serial.printf("%-16s: %d  State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(dest, track).state], useTrackTxt[track]);
+#endif
+  if (destination == dest || destination == DEST_NOT_SELECTED) {                                // Not while the operator is busy with another destination
+    tamBoxIdle = true;                                                                          // Set tambox idle
+#ifdef DEBUG
+    Serial.printf("%-16s: %d  - tamBoxIdle set to true\n", __func__, __LINE__);
+#endif
+  }
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Publish the response to the request on a track, kept with the request so it can be sent again
+ *
+ *  A request that is sent again, with the same session-id, gets the kept response, or RECEIVED while
+ *  the operator hasn't answered it yet. The sender stops retrying on either.
+ *
+ *  respondRequest(dest, track, {IN, OUT, ACCEPTED, REJECTED, CANCELED, RECEIVED})
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void respondRequest(uint8_t dest, uint8_t track, const char* reported) {
+
+  JsonDocument doc;                                                                             // Create a json object
+  tamBoxRequest& req = ports[dest].req[track];
+  req.reported = reported;
+
+  doc[TAM][VERSION]                       = LCP_BODY_VER;
+  doc[TAM][TIMESTAMP]                     = epochTime + halMillis() / 1000;
+  doc[TAM][NODE_ID]                       = tamBoxConfig[dest].id;
+  doc[TAM][PORT_ID]                       = req.portId;
+  doc[TAM][TRACK]                         = useTrackTxt[track];
+  if (req.hasTrain) {                                                                           // Not in a direction response
+    doc[TAM][TRAIN_ID]                    = req.trainId;
+  }
+  doc[TAM][SESSION_ID]                    = req.sessionId;
+  doc[TAM][STATE][DESIRED]                = req.desired;
+  doc[TAM][STATE][REPORTED]               = reported;
+
+  publishTam(dest, req.respondTo, doc, PUB_ONCE);
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Track picked by the keypad for a double track destination
+ *
+ *  Pressed once the normal tracks are used, right track in and left track out, pressed again the other tracks.
+ *  The in track is picked when it has a request or a train to answer, unless a train number is being entered.
+ *
+ *  keyTrack(dest)
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+uint8_t keyTrack(uint8_t dest) {
+
+  if (tamBoxConfig[dest].tracks != DOUBLE_TRACK) {
+    return LEFT_TRACK;                                                                          // Single track traffic
+  }
+
+  uint8_t inTrack  = (destBtnPushed > 1) ? LEFT_TRACK : RIGHT_TRACK;                            // Pressed again, the other tracks
+  uint8_t outTrack = (destBtnPushed > 1) ? RIGHT_TRACK : LEFT_TRACK;
+  uint8_t state    = ports.at(dest, inTrack).state;
+
+  if ((state == _INREQUEST || state == _INTRAIN) && ports.at(dest, outTrack).state != _OUTREQUEST) {
+    return inTrack;
+  }
+  return outTrack;
+}
+
+
 /* ------------------------------------------------------------------------------------------------------------------------------
  *  Function that gets called when a info message is received
  *
  *  handleInfo(dest, {CODE_READY, CODE_LOST})
+ *  A lost destination goes back to its state before it was lost when ready again, a request in
+ *  progress is lost with its session.
  * ------------------------------------------------------------------------------------------------------------------------------
  */
 void handleInfo(uint8_t dest, uint8_t orderCode) {
@@ -1198,13 +1228,16 @@ void handleInfo(uint8_t dest, uint8_t orderCode) {
   switch (orderCode) {
     case CODE_LOST:                                                                             // Connection lost
       for (uint8_t track = 0; track < MAX_NUM_OF_TRACKS; track++) {
-        lastTraffDir[dest][track] = traffDir[dest][track];
-        traffDir[dest][track] = DIR_LOST;
+        if (ports.at(dest, track).state != _LOST) {                                             // Not already lost
+          ports.at(dest, track).lastTraffDir = ports.at(dest, track).traffDir;
+          ports.at(dest, track).lastState = ports.at(dest, track).state;
+        }
+        ports.at(dest, track).traffDir = DIR_LOST;
 
-        if (trackState[dest][track] != _NOTUSED) {                                              // If track state is used
-          trackState[dest][track] = _LOST;                                                      // Set track state to lost
+        if (ports.at(dest, track).state != _NOTUSED) {                                          // If track state is used
+          ports.at(dest, track).state = _LOST;                                                  // Set track state to lost
 #ifdef DEBUG
-          Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[dest][track]], useTrackTxt[track]);
+          Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(dest, track).state], useTrackTxt[track]);
 #endif
         }
 
@@ -1219,15 +1252,22 @@ void handleInfo(uint8_t dest, uint8_t orderCode) {
 
     case CODE_READY:                                                                            // Connection restored
       for (uint8_t track = 0; track < MAX_NUM_OF_TRACKS; track++) {
-        traffDir[dest][track] = lastTraffDir[dest][track];
+        if (ports.at(dest, track).traffDir == DIR_LOST) {                                       // Retained ready doesn't change a resynced track
+          ports.at(dest, track).traffDir = ports.at(dest, track).lastTraffDir;
+        }
 
-        if (trackState[dest][track] != _NOTUSED) {                                              // If track state is used
-          trackState[dest][track] = _IDLE;                                                      // Set track state to idle
+        if (ports.at(dest, track).state == _LOST) {                                             // If track state was lost
+          ports.at(dest, track).state = snapshotState(ports.at(dest, track).lastState, false);  // Set track state back, requests to idle
 #ifdef DEBUG
-          Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[dest][track]], useTrackTxt[track]);
+          Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(dest, track).state], useTrackTxt[track]);
 #endif
-          trainId[dest][track] = DEST_TRAIN_0;                                                  // Clear train id
-          setNodeString(dest, track);                                                           // Set idle text
+          if (ports.at(dest, track).state == _IDLE) {
+            ports.at(dest, track).trainId = DEST_TRAIN_0;                                       // Clear train id
+          }
+          setNodeString(dest, track);                                                           // Set idle or train text
+        }
+
+        if (ports.at(dest, track).state != _NOTUSED) {
           setDirString(dest, track);                                                            // Set normal direction sign
         }
       }
@@ -1245,143 +1285,286 @@ void handleInfo(uint8_t dest, uint8_t orderCode) {
 
 
 /* ------------------------------------------------------------------------------------------------------------------------------
- *  Function that gets called when a direction message is received
- *
- *  handleDirection(dest, {LEFT_TRACK, RIGHT_TRACK}, {CODE_TRAFDIR_REQ_IN, CODE_TRAFDIR_RES_IN, CODE_TRAFDIR_RES_OUT})
+ *  Publish a retained snapshot for each destination with changed tracks
+ *  A lost destination keeps its last snapshot. Nothing is published while received snapshots are
+ *  used, so the defaults after a reboot can't replace the retained snapshot before it is read.
  * ------------------------------------------------------------------------------------------------------------------------------
  */
-void handleDirection(uint8_t dest, uint8_t receivedTrack, uint8_t orderCode) {
+void snapshotCheck() {
 
-#ifdef DEBUG
-  String setTo;
-  Serial.printf("%-16s: %d \n", __func__, __LINE__);
-  Serial.printf("%-16s: %d %s(dest: %d, track: %d, orderCode: %d)\n", __func__, __LINE__, __func__, dest, receivedTrack, orderCode);
-#endif
+  if (resyncOpen && halMillis() - resyncStart < TIME_RESYNC) {
+    return;
+  }
 
-  String portId;
-  char receiver[32];                                                                            // mqtt message receiver
-  char body[254];                                                                               // json body
-  uint8_t check;
-  uint8_t ownTrack = LEFT_TRACK;                                                                // Default single track traffic
-  size_t n;
+  resyncOpen = false;
 
-  StaticJsonDocument<255> doc;                                                                  // Create a json object
-  uint8_t maxSize = 255;
-  doc[TAM][VERSION]   = LCP_BODY_VER;
-  doc[TAM][TIMESTAMP] = epochTime + millis() / 1000;
+  for (uint8_t dest = 0; dest < DEST_BUTTONS; dest++) {
+    if (ports.at(dest, LEFT_TRACK).state == _NOTUSED) { continue; }
 
-  switch (orderCode) {
-    case CODE_TRAFDIR_REQ_IN:                                                                   // Incoming traffic direction change
-      if (tamBoxConfig[dest][TRACKS].toInt() == DOUBLE_TRACK) {
-        ownTrack = (receivedTrack == RIGHT_TRACK) ? RIGHT_TRACK : LEFT_TRACK;
+    bool changed = false;
+    bool lost    = false;
+
+    for (uint8_t track = 0; track < MAX_NUM_OF_TRACKS; track++) {
+      tamBoxTrack& now  = ports.at(dest, track);
+      tamBoxTrack& sent = ports[dest].sent[track];
+
+      if (now.state == _LOST) { lost = true; }
+      if (now.state != sent.state || now.traffDir != sent.traffDir || now.trainId != sent.trainId) { changed = true; }
+    }
+
+    if (lost) { continue; }
+
+    if (changed) {
+      for (uint8_t track = 0; track < MAX_NUM_OF_TRACKS; track++) {
+        ports[dest].sent[track]         = ports.at(dest, track);
+        ports[dest].snapshotTime[track] = epochTime + halMillis() / 1000;
       }
+
+      ports[dest].snapshotDirty = true;
+    }
+
+    if (ports[dest].snapshotDirty && mqttState == MQTT_CONNECTED && mqttClient.connected()) {
+      ports[dest].snapshotDirty = !snapshotPublish(dest);                                       // Try again next loop if it failed
+    }
+  }
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Publish the tracks to a destination as a retained snapshot
+ *
+ *  dt/h0/tam/tambox-1/a/snapshot
+ *  {"tam": {"version": "1.0", "timestamp": 1590520093, "node-id": "tambox-1", "port-id": "a",
+ *           "state": {"reported": "snapshot"}, "tracks": [["intrain", "in", 233], ["idle", "in", 0]]}}
+ *
+ *  States and directions are sent by name, a tambox with other enums still reads them.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+bool snapshotPublish(uint8_t dest) {
+
+  JsonDocument doc;                                                                             // Create a json object
+  char body[PUB_BODY_LEN];
+  char port[2] = {(char)tolower(destIDTxt[dest][0]), '\0'};
+  unsigned int timestamp = 0;
+
+  for (uint8_t track = 0; track < MAX_NUM_OF_TRACKS; track++) {
+    timestamp = max(timestamp, ports[dest].snapshotTime[track]);
+  }
+
+  doc[TAM][VERSION]           = LCP_BODY_VER;
+  doc[TAM][TIMESTAMP]         = timestamp;
+  doc[TAM][NODE_ID]           = tamBoxConfig[OWN].id;
+  doc[TAM][PORT_ID]           = port;
+  doc[TAM][STATE][REPORTED]   = SNAPSHOT;
+
+  JsonArray tracks = doc[TAM][SNAPSHOT_TRACKS].to<JsonArray>();
+  for (uint8_t track = 0; track < MAX_NUM_OF_TRACKS; track++) {
+    JsonArray t = tracks.add<JsonArray>();
+    t.add(snapshotStateTxt[ports[dest].sent[track].state]);
+    t.add(ports[dest].sent[track].traffDir < DIR_STATES ? snapshotDirTxt[ports[dest].sent[track].traffDir] : DIR_LOST_T);
+    t.add(ports[dest].sent[track].trainId);
+  }
+
+  serializeJson(doc, body, sizeof(body));
 #ifdef DEBUG
-      Serial.printf("%-16s: %d Destination: %s, Current state: %s for %s track\n", __func__, __LINE__, destIDTxt[dest], trackStateTxt[trackState[dest][ownTrack]], useTrackTxt[ownTrack]);
+  Serial.printf("%-16s: %d Snapshot %s: %s\n", __func__, __LINE__, pubSnapshotTopic[dest], body);
 #endif
-      switch (trackState[dest][ownTrack]) {
-        case _IDLE:                                                                             // Track idle
-          if (tamBoxIdle) {                                                                     // Tambox idle, acknowledge direction in
-            traffDir[dest][ownTrack] = DIR_IN;                                                  // Set traffic direction to in
-            setDirString(dest, ownTrack);
-            updateLcd(dest);
+  return mqttPublish(pubSnapshotTopic[dest], body, RETAIN);
+}
 
-            doc[TAM][NODE_ID]         = reqCmd[dest][LCP_NODE_ID];
-            doc[TAM][PORT_ID]         = reqCmd[dest][LCP_PORT_ID];
-            doc[TAM][TRACK]           = String(useTrackTxt[receivedTrack]);
-            doc[TAM][SESSION_ID]      = reqCmd[dest][LCP_SESSION_ID];
-            doc[TAM][STATE][DESIRED]  = reqCmd[dest][LCP_DESIRED_STATE];
-            doc[TAM][STATE][REPORTED] = IN;                                                     // in = accepted
 
-            strcpy(receiver, reqCmd[dest][LCP_RESPOND_TO].c_str());
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Use a retained snapshot received after (re)connecting
+ *  slot is OWN for our own snapshots, port is the destination. For a neighbour it is the slot in
+ *  tamBoxConfig and port the neighbours port, the index only maps the one facing us. The neighbours tracks
+ *  are mirrored, its out is our in and on a double track its left track is our right track.
+ *  The newest snapshot for a track wins, our own wins over a neighbours with the same timestamp. A
+ *  track with a request or traffic direction change waiting is kept, and so are names not known.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void snapshotReceived(uint8_t slot, uint8_t port, char* body) {
 
-            n = serializeJson(doc, body);                                                       // Create a json body
-            check = mqttClient.publish(receiver, body, NORETAIN);                               // Publish direction change accepted
-#ifdef DEBUG
-            if (check == 1) {
-              Serial.printf("%-16s: %d Publish direction change accepted with body size: %d (%d to max size)\n", __func__, __LINE__, n, maxSize - n);
-              Serial.printf("%-16s: %d Publish: %s - %s\n", __func__, __LINE__, receiver, body);
-            }
+  if (!resyncOpen) {
+    return;
+  }
 
-            else {
-              Serial.printf("%-16s: %d Publish %s failed with code: %d\n", __func__, __LINE__, receiver, check);
-            }
-            setTo = String(trainDirTxt[traffDir[dest][ownTrack]]);
+  bool own     = (slot == OWN);
+  uint8_t dest = own ? port : ports.dest(slot);
+  uint8_t bit  = own ? RESYNC_OWN + dest : slot;
+
+  if (dest >= DEST_BUTTONS || ports.at(dest, LEFT_TRACK).state == _NOTUSED) {
+    return;
+  }
+
+  JsonDocument doc;
+
+  if (deserializeJson(doc, body)) {
+#ifdef DEBUG
+    Serial.printf("%-16s: %d Snapshot not decoded\n", __func__, __LINE__);
 #endif
-          }
+    return;
+  }
 
-          else {                                                                                // Tambox busy, reject direction in
-            traffDir[dest][ownTrack] = DIR_OUT;                                                 // Set traffic direction to out
+  resyncPending &= ~(1UL << bit);
+  if (resyncPending == 0 && resyncTime == 0) {
+    resyncTime = halMillis() - resyncStart;                                                     // Time to consistent state
+  }
 
-            doc[TAM][NODE_ID]         = reqCmd[dest][LCP_NODE_ID];
-            doc[TAM][PORT_ID]         = reqCmd[dest][LCP_PORT_ID];
-            doc[TAM][TRACK]           = String(useTrackTxt[receivedTrack]);
-            doc[TAM][SESSION_ID]      = reqCmd[dest][LCP_SESSION_ID];
-            doc[TAM][STATE][DESIRED]  = reqCmd[dest][LCP_DESIRED_STATE];
-            doc[TAM][STATE][REPORTED] = OUT;                                                    // out = rejected
+  unsigned int timestamp = doc[TAM][TIMESTAMP] | 0;
+  JsonArray tracks = doc[TAM][SNAPSHOT_TRACKS];
+  uint8_t received = own ? MAX_NUM_OF_TRACKS : (tamBoxConfig[dest].type == TRACK_TYPE_DOUBLE) ? DOUBLE_TRACK : SINGLE_TRACK;
 
-            strcpy(receiver, reqCmd[dest][LCP_RESPOND_TO].c_str());
+  for (uint8_t i = 0; i < received && i < tracks.size(); i++) {
+    uint8_t track;
+    uint8_t state = snapshotCode(tracks[i][0] | "", snapshotStateTxt, NUM_OF_STATES);
+    uint8_t dir   = snapshotCode(tracks[i][1] | "", snapshotDirTxt, DIR_STATES);
 
-            n = serializeJson(doc, body);                                                       // Create a json body
-            check = mqttClient.publish(receiver, body, NORETAIN);                               // Publish direction change accepted
-#ifdef DEBUG
-            if (check == 1) {
-              Serial.printf("%-16s: %d Publish direction change rejected with body size: %d (%d to max size)\n", __func__, __LINE__, n, maxSize - n);
-              Serial.printf("%-16s: %d Publish: %s - %s\n", __func__, __LINE__, receiver, body);
-            }
+    if (own)                                                 { track = i; }
+    else if (tamBoxConfig[dest].type == TRACK_TYPE_DOUBLE)   { track = (i == LEFT_TRACK) ? RIGHT_TRACK : LEFT_TRACK; }
+    else                                                     { track = ports.isSplitSlot(slot) ? RIGHT_TRACK : LEFT_TRACK; }
 
-            else {
-              Serial.printf("%-16s: %d Publish %s failed with code: %d\n", __func__, __LINE__, receiver, check);
-            }
-            setTo = String(trainDirTxt[traffDir[dest][ownTrack]]);
-#endif
-          }
-        break;
-//----------------------------------------------------------------------------------------------
-        case _OUTREQUEST:                                                                       // If track state is outgoing request
-          doc[TAM][NODE_ID]         = reqCmd[dest][LCP_NODE_ID];
-          doc[TAM][PORT_ID]         = reqCmd[dest][LCP_PORT_ID];
-          doc[TAM][TRACK]           = String(useTrackTxt[receivedTrack]);
-          doc[TAM][SESSION_ID]      = reqCmd[dest][LCP_SESSION_ID];
-          doc[TAM][STATE][DESIRED]  = reqCmd[dest][LCP_DESIRED_STATE];
-          doc[TAM][STATE][REPORTED] = OUT;                                                      // out = rejected
+    if (state == _NOTUSED || state >= NUM_OF_STATES || dir >= DIR_STATES || ports.at(dest, track).state == _NOTUSED) {
+      continue;
+    }
 
-          strcpy(receiver, reqCmd[dest][LCP_RESPOND_TO].c_str());
+    tamBoxTrack& t = ports.at(dest, track);
+    if (own ? timestamp < ports[dest].snapshotTime[track] : timestamp <= ports[dest].snapshotTime[track]) {
+      continue;                                                                                 // Older than what we have
+    }
 
-          n = serializeJson(doc, body);                                                         // Create a json body
-          check = mqttClient.publish(receiver, body, NORETAIN);                                 // Publish direction change accepted
-#ifdef DEBUG
-          if (check == 1) {
-            Serial.printf("%-16s: %d Publish direction change rejected with body size: %d (%d to max size)\n", __func__, __LINE__, n, maxSize - n);
-            Serial.printf("%-16s: %d Publish: %s - %s\n", __func__, __LINE__, receiver, body);
-          }
+    if (t.state == _TRAFDIR || t.state == _INREQUEST || t.state == _OUTREQUEST) {
+      continue;                                                                                 // Waiting for an answer
+    }
 
-          else {
-            Serial.printf("%-16s: %d Publish %s failed with code: %d\n", __func__, __LINE__, receiver, check);
-          }
-#endif
-        break;
+    t.lastState    = snapshotState(state, !own);
+    t.lastTraffDir = (own == (dir == DIR_OUT)) ? DIR_OUT : DIR_IN;                              // The neighbour sees the opposite direction
+    t.trainId      = (t.lastState == _IDLE) ? DEST_TRAIN_0 : (uint16_t)(tracks[i][2] | DEST_TRAIN_0);
 #ifdef DEBUG
-        Serial.printf("%-16s: %d Traffic direction from %s on track %s set to %s\n", __func__, __LINE__, destIDTxt[dest], useTrackTxt[ownTrack], setTo);
+    Serial.printf("%-16s: %d Destination %s %s track set to %s\n", __func__, __LINE__, destIDTxt[dest], useTrackTxt[track], trackStateTxt[t.lastState]);
 #endif
-      }
 
-    break;
-//----------------------------------------------------------------------------------------------
-    case CODE_TRAFDIR_RES_IN:                                                                   // Direction change accepted
-      if (tamBoxConfig[dest][TRACKS].toInt() == DOUBLE_TRACK) {
-        ownTrack = (receivedTrack == RIGHT_TRACK) ? LEFT_TRACK : RIGHT_TRACK;
-      }
+    if (t.state != _LOST) {                                                                     // A lost destination uses it when ready again
+      t.state    = t.lastState;
+      t.traffDir = t.lastTraffDir;
+      setNodeString(dest, track);
+      setDirString(dest, track);
+    }
+
+    ports[dest].snapshotTime[track] = timestamp;
+  }
+
+  if (tamboxReady) {                                                                            // The start up screen is shown until ready
+    updateLcd(dest);
+  }
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  State to use from a snapshot, mirrored for a neighbours snapshot
+ *  Requests are set to idle, their sessions are gone.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+uint8_t snapshotState(uint8_t state, bool mirror) {
+
+  switch (state) {
+    case _INACCEPT:   return mirror ? _OUTACCEPT : _INACCEPT;
+    case _OUTACCEPT:  return mirror ? _INACCEPT : _OUTACCEPT;
+    case _INTRAIN:    return mirror ? _OUTTRAIN : _INTRAIN;
+    case _OUTTRAIN:   return mirror ? _INTRAIN : _OUTTRAIN;
+    default:          return _IDLE;                                                             // Requests, traffic direction and lost
+  }
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Index of a name in a snapshot, count if it isn't one of names
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+uint8_t snapshotCode(const char* name, const char* const names[], uint8_t count) {
+
+  for (uint8_t i = 0; i < count; i++) {
+    if (strcmp(name, names[i]) == 0) {
+      return i;
+    }
+  }
+
+  return count;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Function that gets called when a direction message is received
+ *
+ *  handleDirection(dest, {LEFT_TRACK, RIGHT_TRACK}, {CODE_TRAFDIR_REQ_IN, CODE_TRAFDIR_RES_IN, CODE_TRAFDIR_RES_OUT})
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void handleDirection(uint8_t dest, uint8_t receivedTrack, uint8_t orderCode) {
+
+#ifdef DEBUG
+  String setTo;
+  Serial.printf("%-16s: %d \n", __func__, __LINE__);
+  Serial.printf("%-16s: %d %s(dest: %d, track: %d, orderCode: %d)\n", __func__, __LINE__, __func__, dest, receivedTrack, orderCode);
+#endif
+
+  String portId;
+  uint8_t ownTrack = LEFT_TRACK;                                                                // Default single track traffic
+
+  switch (orderCode) {
+    case CODE_TRAFDIR_REQ_IN:                                                                   // Incoming traffic direction change
+      if (tamBoxConfig[dest].tracks == DOUBLE_TRACK) {
+        ownTrack = (receivedTrack == RIGHT_TRACK) ? RIGHT_TRACK : LEFT_TRACK;
+      }
+#ifdef DEBUG
+      Serial.printf("%-16s: %d Destination: %s, Current state: %s for %s track\n", __func__, __LINE__, destIDTxt[dest], trackStateTxt[ports.at(dest, ownTrack).state], useTrackTxt[ownTrack]);
+#endif
+      switch (ports.at(dest, ownTrack).state) {
+        case _IDLE:                                                                             // Track idle
+          if (tamBoxIdle) {                                                                     // Tambox idle, acknowledge direction in
+            ports.at(dest, ownTrack).traffDir = DIR_IN;                                         // Set traffic direction to in
+            setDirString(dest, ownTrack);
+            updateLcd(dest);
+
+            respondRequest(dest, ownTrack, IN);                                                 // Publish direction change accepted
+#ifdef DEBUG
+            setTo = String(trainDirTxt[ports.at(dest, ownTrack).traffDir]);
+#endif
+          }
+
+          else {                                                                                // Tambox busy, reject direction in
+            ports.at(dest, ownTrack).traffDir = DIR_OUT;                                        // Set traffic direction to out
+
+            respondRequest(dest, ownTrack, OUT);                                                // Publish direction change rejected
+#ifdef DEBUG
+            setTo = String(trainDirTxt[ports.at(dest, ownTrack).traffDir]);
+#endif
+          }
+        break;
+//----------------------------------------------------------------------------------------------
+        case _OUTREQUEST:                                                                       // If track state is outgoing request
+          respondRequest(dest, ownTrack, OUT);                                                  // Publish direction change rejected
+        break;
+#ifdef DEBUG
+        Serial.printf("%-16s: %d Traffic direction from %s on track %s set to %s\n", __func__, __LINE__, destIDTxt[dest], useTrackTxt[ownTrack], setTo);
+#endif
+      }
+
+    break;
+//----------------------------------------------------------------------------------------------
+    case CODE_TRAFDIR_RES_IN:                                                                   // Direction change accepted
+      if (tamBoxConfig[dest].tracks == DOUBLE_TRACK) {
+        ownTrack = (receivedTrack == RIGHT_TRACK) ? LEFT_TRACK : RIGHT_TRACK;
+      }
 #ifdef DEBUG
-      Serial.printf("%-16s: %d Destination: %s, Current state: %s for %s track\n", __func__, __LINE__, destIDTxt[dest], trackStateTxt[trackState[dest][ownTrack]], useTrackTxt[ownTrack]);
+      Serial.printf("%-16s: %d Destination: %s, Current state: %s for %s track\n", __func__, __LINE__, destIDTxt[dest], trackStateTxt[ports.at(dest, ownTrack).state], useTrackTxt[ownTrack]);
 #endif
-      if (trackState[dest][ownTrack] == _TRAFDIR) {
+      if (ports.at(dest, ownTrack).state == _TRAFDIR) {
         tamBoxIdle = false;                                                                     // Set tambox busy
 #ifdef DEBUG
         Serial.printf("%-16s: %d - tamBoxIdle set to false\n", __func__, __LINE__);
 #endif
-        trackState[dest][ownTrack] = _OUTREQUEST;                                               // Set track state to outgoing request
+        ports.at(dest, ownTrack).state = _OUTREQUEST;                                           // Set track state to outgoing request
 #ifdef DEBUG
-        Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[dest][ownTrack]], useTrackTxt[ownTrack]);
+        Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(dest, ownTrack).state], useTrackTxt[ownTrack]);
 #endif
         printString(LCD_TRAIN, dest, DEST_TRAIN_0);
 #ifdef DEBUG
@@ -1391,15 +1574,16 @@ void handleDirection(uint8_t dest, uint8_t receivedTrack, uint8_t orderCode) {
     break;
 
     case CODE_TRAFDIR_RES_OUT:                                                                  // Direction change rejected
-      traffDir[dest][ownTrack] = DIR_OUT;                                                       // Set traffic direction to out
+      ports.at(dest, ownTrack).traffDir = DIR_OUT;                                              // Set traffic direction to out
       setDirString(dest, ownTrack);
       tamBoxIdle = false;                                                                       // Set tambox busy
 #ifdef DEBUG
       Serial.printf("%-16s: %d - tamBoxIdle set to false\n", __func__, __LINE__);
 #endif
-      trackState[dest][ownTrack] = _IDLE;                                                       // Set track state to idle
+      ports.at(dest, ownTrack).state = _IDLE;                                                   // Set track state to idle
+      destBtnPushed = 0;                                                                        // Next try starts on the normal track
 #ifdef DEBUG
-       Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[dest][ownTrack]], useTrackTxt[ownTrack]);
+       Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(dest, ownTrack).state], useTrackTxt[ownTrack]);
 #endif
       printString(LCD_TRAINDIR_NOK, dest, DEST_TRAIN_0);
       beep(TIME_BEEP_DURATION, BEEP_NOK);                                                       // Beep nok
@@ -1407,10 +1591,10 @@ void handleDirection(uint8_t dest, uint8_t receivedTrack, uint8_t orderCode) {
 #ifdef DEBUG
       Serial.printf("%-16s: %d - showText set to true\n", __func__, __LINE__);
 #endif
-      showTime = millis();
+      setShowTimer();
 #ifdef DEBUG
-      Serial.printf("%-16s: %d - showTime set to millis()\n", __func__, __LINE__);
-      setTo = String(trainDirTxt[traffDir[dest][ownTrack]]);
+      Serial.printf("%-16s: %d - show timer restarted\n", __func__, __LINE__);
+      setTo = String(trainDirTxt[ports.at(dest, ownTrack).traffDir]);
     break;
 
     default:
@@ -1432,72 +1616,34 @@ void handleTrain(uint8_t dest, uint8_t receivedTrack, uint8_t orderCode, uint16_
 #ifdef DEBUG
   Serial.printf("%-16s: %d \n", __func__, __LINE__);
   Serial.printf("%-16s: %d %s(dest: %d, receivedTrack: %d, orderCode: %d, train: %d)\n", __func__, __LINE__, __func__, dest, receivedTrack, orderCode, train);
-  uint8_t maxSize = 255;
 #endif
 
-  StaticJsonDocument<255> doc;                                                                  // Create a json object
-  char receiver[32];                                                                            // mqtt message receiver
-  char body[254];                                                                               // json body
-  uint8_t check;
-  size_t n;
   uint8_t ownTrack = LEFT_TRACK;                                                                // Default single track traffic
 
   if (orderCode == CODE_CANCEL) {                                                               // Incoming cancel, overrides busy tambox
-    switch (trackState[dest][ownTrack]) {                                                       // Check track state
+    if (tamBoxConfig[dest].tracks == DOUBLE_TRACK) {
+      ownTrack = (receivedTrack == RIGHT_TRACK) ? RIGHT_TRACK : LEFT_TRACK;
+    }
+
+    switch (ports.at(dest, ownTrack).state) {                                                   // Check track state
       case _INREQUEST:                                                                          // If track state is incoming request
-        if (trainId[dest][ownTrack] == train) {
+        if (ports.at(dest, ownTrack).trainId == train) {
 #ifdef DEBUG
           Serial.printf("%-16s: %d Incoming request from: %s with train %d canceled\n", __func__, __LINE__, destIDTxt[dest], train);
 #endif
-          trainId[dest][ownTrack] = DEST_TRAIN_0;
-          tamBoxIdle = false;                                                                   // Set tambox busy
-#ifdef DEBUG
-          Serial.printf("%-16s: %d - tamBoxIdle set to false\n", __func__, __LINE__);
-#endif
-          trackState[dest][ownTrack] = _IDLE;                                                   // Set track state to idle
+          ports.at(dest, ownTrack).trainId = DEST_TRAIN_0;
+          ports.at(dest, ownTrack).state = _IDLE;                                               // Set track state to idle
 #ifdef DEBUG
-          Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[dest][ownTrack]], useTrackTxt[ownTrack]);
+          Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(dest, ownTrack).state], useTrackTxt[ownTrack]);
 #endif
-          traffDir[dest][ownTrack] = DIR_IN;                                                    // Set traffic direction to in
+          ports.at(dest, ownTrack).traffDir = DIR_IN;                                           // Set traffic direction to in
           setDirString(dest, ownTrack);
-          updateLcd(dest);
-
-          doc[TAM][VERSION]         = LCP_BODY_VER;
-          doc[TAM][TIMESTAMP]       = epochTime + millis() / 1000;
-          doc[TAM][NODE_ID]         = reqCmd[dest][LCP_NODE_ID];
-          doc[TAM][PORT_ID]         = reqCmd[dest][LCP_PORT_ID];
-          doc[TAM][TRACK]           = String(useTrackTxt[receivedTrack]);
-          doc[TAM][TRAIN_ID]        = train;
-          doc[TAM][SESSION_ID]      = reqCmd[dest][LCP_SESSION_ID];
-          doc[TAM][STATE][DESIRED]  = reqCmd[dest][LCP_DESIRED_STATE];
-          doc[TAM][STATE][REPORTED] = CANCELED;                                                 // reply canceled
-
-          strcpy(receiver, reqCmd[dest][LCP_RESPOND_TO].c_str());
-
-          n = serializeJson(doc, body);                                                         // Create a json body
-          check = mqttClient.publish(receiver, body, NORETAIN);                                 // Publish direction change accepted
-#ifdef DEBUG
-          if (check == 1) {
-            Serial.printf("%-16s: %d Publish direction change accepted with body size: %d (%d to max size)\n", __func__, __LINE__, n, maxSize - n);
-            Serial.printf("%-16s: %d Publish: %s - %s\n", __func__, __LINE__, receiver, body);
-          }
 
-          else {
-            Serial.printf("%-16s: %d Publish %s failed with code: %d\n", __func__, __LINE__, receiver, check);
-          }
-#endif
-          printString(LCD_TAM_CANCELED, destination, DEST_TRAIN_0);                             // Set string to tam canceled
+          respondRequest(dest, ownTrack, CANCELED);                                             // Publish a tam canceled message
           beep(TIME_BEEP_DURATION, BEEP_NOK);                                                   // Beep not ok
-          showText = true;                                                                      // Show the string
-#ifdef DEBUG
-          Serial.printf("%-16s: %d - ShowText set to true\n", __func__, __LINE__);
-#endif
           setNodeString(dest, ownTrack);
           setDirString(dest, ownTrack);
-          showTime = millis();
-#ifdef DEBUG
-          Serial.printf("%-16s: %d - showTime set to millis()\n", __func__, __LINE__);
-#endif
+          showReport(dest, ownTrack, LCD_TAM_CANCELED);                                         // Set string to tam canceled
         }
 #ifdef DEBUG
         else {
@@ -1515,10 +1661,8 @@ void handleTrain(uint8_t dest, uint8_t receivedTrack, uint8_t orderCode, uint16_
   }
 //----------------------------------------------------------------------------------------------
 
-  else if (tamBoxIdle) {
-    destination = dest;                                                                         // Save dest
-
-    if (tamBoxConfig[dest][TRACKS].toInt() == DOUBLE_TRACK) {
+  else {                                                                                        // Handled at once, also while the operator is busy
+    if (tamBoxConfig[dest].tracks == DOUBLE_TRACK) {
       ownTrack = (receivedTrack == RIGHT_TRACK) ? LEFT_TRACK : RIGHT_TRACK;
     }
 #ifdef DEBUG
@@ -1527,32 +1671,36 @@ void handleTrain(uint8_t dest, uint8_t receivedTrack, uint8_t orderCode, uint16_
 
     switch (orderCode) {
       case CODE_ACCEPT:                                                                         // Incoming request
-        if (tamBoxConfig[dest][TRACKS].toInt() == DOUBLE_TRACK) {
+        if (tamBoxConfig[dest].tracks == DOUBLE_TRACK) {
           ownTrack = (receivedTrack == RIGHT_TRACK) ? RIGHT_TRACK : LEFT_TRACK;
         }
 
-        switch (trackState[dest][ownTrack]) {                                                   // Check track state
+        switch (ports.at(dest, ownTrack).state) {                                               // Check track state
           case _IDLE:                                                                           // If track state is idle
-            trainId[dest][ownTrack] = train;
-#ifdef DEBUG
-            Serial.printf("%-16s: %d Incoming request from: %s with train %d on %s track\n", __func__, __LINE__, destIDTxt[dest], trainId[dest][ownTrack], useTrackTxt[ownTrack]);
-#endif
-            tamBoxIdle = false;                                                                 // Set tambox busy
+            ports.at(dest, ownTrack).trainId = train;
 #ifdef DEBUG
-            Serial.printf("%-16s: %d - tamBoxIdle set to false\n", __func__, __LINE__);
+            Serial.printf("%-16s: %d Incoming request from: %s with train %d on %s track\n", __func__, __LINE__, destIDTxt[dest], ports.at(dest, ownTrack).trainId, useTrackTxt[ownTrack]);
 #endif
-            trackState[dest][ownTrack] = _INREQUEST;                                            // Set track state to incoming request
+            ports.at(dest, ownTrack).state = _INREQUEST;                                        // Set track state to incoming request
 #ifdef DEBUG
-            Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[dest][ownTrack]], useTrackTxt[ownTrack]);
+            Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(dest, ownTrack).state], useTrackTxt[ownTrack]);
 #endif
             setDirString(dest, ownTrack);
             setNodeString(dest, ownTrack);
-            updateLcd(dest);
-            printString(LCD_TAM_ACCEPT, dest, DEST_TRAIN_0);                                    // Set string to tam accept?
-            requestTrack = receivedTrack;                                                       // Used for checking TAM timeout
-            tamTime = beepPaus = millis();                                                      // Used for checking TAM timeout
+            if (tamBoxIdle) {                                                                   // Else it is shown when the destination is selected
+              destination = dest;                                                               // Save dest
+              tamBoxIdle = false;                                                               // Set tambox busy
 #ifdef DEBUG
-            Serial.printf("%-16s: %d - tamTime set to millis()\n", __func__, __LINE__);
+              Serial.printf("%-16s: %d - tamBoxIdle set to false\n", __func__, __LINE__);
+#endif
+              updateLcd(dest);
+              printString(LCD_TAM_ACCEPT, dest, DEST_TRAIN_0);                                  // Set string to tam accept?
+            }
+
+            setTimer(TIMER_TAM, dest, ownTrack, tamTimeOut);                                    // This request times out on its own
+            setTimer(TIMER_BEEP, dest, ownTrack, TIME_BEEP_PAUS);
+#ifdef DEBUG
+            Serial.printf("%-16s: %d - tam timer set for %s track\n", __func__, __LINE__, useTrackTxt[ownTrack]);
 #endif
             beep(TIME_BEEP_DURATION, BEEP_OK);
           break;
@@ -1566,31 +1714,19 @@ void handleTrain(uint8_t dest, uint8_t receivedTrack, uint8_t orderCode, uint16_
       break;
 
       case CODE_ACCEPTED:                                                                       // incoming response
-        switch (trackState[dest][ownTrack]) {                                                   // Check track state
+        switch (ports.at(dest, ownTrack).state) {                                               // Check track state
           case _OUTREQUEST:                                                                     // If track state outgoing request
-            if (trainId[dest][ownTrack] == train) {
-#ifdef DEBUG
-              Serial.printf("%-16s: %d Outgoing request to: %s with train %d accepted\n", __func__, __LINE__, destIDTxt[dest], trainId[dest][ownTrack]);
-#endif
-              tamBoxIdle = false;                                                               // Set tambox busy
+            if (ports.at(dest, ownTrack).trainId == train) {
 #ifdef DEBUG
-              Serial.printf("%-16s: %d - tamBoxIdle set to false\n", __func__, __LINE__);
+              Serial.printf("%-16s: %d Outgoing request to: %s with train %d accepted\n", __func__, __LINE__, destIDTxt[dest], ports.at(dest, ownTrack).trainId);
 #endif
-              trackState[dest][ownTrack] = _OUTACCEPT;                                          // Set track state to outgoing accept
+              ports.at(dest, ownTrack).state = _OUTACCEPT;                                      // Set track state to outgoing accept
 #ifdef DEBUG
-              Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[dest][ownTrack]], useTrackTxt[ownTrack]);
+              Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(dest, ownTrack).state], useTrackTxt[ownTrack]);
 #endif
-              printString(LCD_TAM_OK, dest, DEST_TRAIN_0);                                      // Set string to tam accepted
               beep(TIME_BEEP_DURATION, BEEP_OK);                                                // Beep ok
-              showText = true;                                                                  // Show the string
-#ifdef DEBUG
-              Serial.printf("%-16s: %d - ShowText set to true\n", __func__, __LINE__);
-#endif
               setDirString(dest, ownTrack);
-              showTime = millis();
-#ifdef DEBUG
-              Serial.printf("%-16s: %d - showTime set to millis()\n", __func__, __LINE__);
-#endif
+              showReport(dest, ownTrack, LCD_TAM_OK);                                           // Set string to tam accepted
             }
 #ifdef DEBUG
             else {
@@ -1609,33 +1745,21 @@ void handleTrain(uint8_t dest, uint8_t receivedTrack, uint8_t orderCode, uint16_
       break;
 
       case CODE_REJECTED:                                                                       // Incoming reject
-        switch (trackState[dest][ownTrack]) {                                                   // Check track state
+        switch (ports.at(dest, ownTrack).state) {                                               // Check track state
           case _OUTREQUEST:                                                                     // If track state is outgoing request
-            if (trainId[dest][ownTrack] == train) {
+            if (ports.at(dest, ownTrack).trainId == train) {
 #ifdef DEBUG
               Serial.printf("%-16s: %d Outgoing request to: %s with train %d rejected\n", __func__, __LINE__, destIDTxt[dest], train);
 #endif
-              trainId[dest][ownTrack] = DEST_TRAIN_0;
-              tamBoxIdle = false;                                                               // Set tambox busy
-#ifdef DEBUG
-              Serial.printf("%-16s: %d - tamBoxIdle set to false\n", __func__, __LINE__);
-#endif
-              trackState[dest][ownTrack] = _IDLE;                                               // Set track state to idle
+              ports.at(dest, ownTrack).trainId = DEST_TRAIN_0;
+              ports.at(dest, ownTrack).state = _IDLE;                                           // Set track state to idle
 #ifdef DEBUG
-              Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[dest][ownTrack]], useTrackTxt[ownTrack]);
+              Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(dest, ownTrack).state], useTrackTxt[ownTrack]);
 #endif
-              printString(LCD_TAM_NOK, dest, DEST_TRAIN_0);                                     // Set string to tam rejected
               beep(TIME_BEEP_DURATION, BEEP_NOK);                                               // Beep not ok
-              showText = true;                                                                  // Show the string
-#ifdef DEBUG
-              Serial.printf("%-16s: %d - ShowText set to true-\n", __func__, __LINE__);
-#endif
               setDirString(dest, ownTrack);
               setNodeString(dest, ownTrack);
-              showTime = millis();
-#ifdef DEBUG
-              Serial.printf("%-16s: %d - showTime set to millis()\n", __func__, __LINE__);
-#endif
+              showReport(dest, ownTrack, LCD_TAM_NOK);                                          // Set string to tam rejected
             }
 #ifdef DEBUG
             else {
@@ -1654,37 +1778,25 @@ void handleTrain(uint8_t dest, uint8_t receivedTrack, uint8_t orderCode, uint16_
       break;
 
       case CODE_TRAIN_IN:                                                                       // Incoming arrival report
-        if (tamBoxConfig[dest][TRACKS].toInt() == DOUBLE_TRACK) {
+        if (tamBoxConfig[dest].tracks == DOUBLE_TRACK) {
           ownTrack = (receivedTrack == RIGHT_TRACK) ? LEFT_TRACK : RIGHT_TRACK;
         }
 
-        switch (trackState[dest][ownTrack]) {                                                   // Check track state
+        switch (ports.at(dest, ownTrack).state) {                                               // Check track state
           case _OUTTRAIN:                                                                       // If track state is outgoing train
-            if (trainId[dest][ownTrack] == train) {
-              trainId[dest][ownTrack] = DEST_TRAIN_0;
+            if (ports.at(dest, ownTrack).trainId == train) {
+              ports.at(dest, ownTrack).trainId = DEST_TRAIN_0;
 #ifdef DEBUG
               Serial.printf("%-16s: %d Outgoing train to: %s with train %d arrived\n", __func__, __LINE__, destIDTxt[dest], train);
 #endif
-              tamBoxIdle = false;                                                               // Set tambox busy
-#ifdef DEBUG
-              Serial.printf("%-16s: %d - tamBoxIdle set to false\n", __func__, __LINE__);
-#endif
-              trackState[dest][ownTrack] = _IDLE;                                               // Set track state to idle
+              ports.at(dest, ownTrack).state = _IDLE;                                           // Set track state to idle
 #ifdef DEBUG
-              Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[trackState[dest][ownTrack]], useTrackTxt[ownTrack]);
+              Serial.printf("%-16s: %d State changed to %s for %s track!\n", __func__, __LINE__, trackStateTxt[ports.at(dest, ownTrack).state], useTrackTxt[ownTrack]);
 #endif
-              printString(LCD_ARRIVAL_OK, dest, DEST_TRAIN_0);                                  // Set string to train arrived
               beep(TIME_BEEP_DURATION, BEEP_OK);                                                // Beep ok
-              showText = true;                                                                  // Show the string
-#ifdef DEBUG
-              Serial.printf("%-16s: %d - ShowText set to true\n", __func__, __LINE__);
-#endif
               setNodeString(dest, ownTrack);
               setDirString(dest, ownTrack);
-              showTime = millis();
-#ifdef DEBUG
-              Serial.printf("%-16s: %d - showTime set to millis()\n", __func__, __LINE__);
-#endif
+              showReport(dest, ownTrack, LCD_ARRIVAL_OK);                                       // Set string to train arrived
             }
 #ifdef DEBUG
             else {
@@ -1703,31 +1815,18 @@ void handleTrain(uint8_t dest, uint8_t receivedTrack, uint8_t orderCode, uint16_
       break;
 
       case CODE_TRAIN_OUT:                                                                      // Train out report
-        if (tamBoxConfig[dest][TRACKS].toInt() == DOUBLE_TRACK) {
+        if (tamBoxConfig[dest].tracks == DOUBLE_TRACK) {
           ownTrack = (receivedTrack == RIGHT_TRACK) ? LEFT_TRACK : RIGHT_TRACK;
         }
 
-        switch (trackState[dest][ownTrack]) {                                                   // Check track state
+        switch (ports.at(dest, ownTrack).state) {                                               // Check track state
           case _INACCEPT:                                                                       // If track state is incoming accept
-            if (trainId[dest][ownTrack] == train) {
-              tamBoxIdle = false;                                                               // Set tambox busy
-#ifdef DEBUG
-              Serial.printf("%-16s: %d - tamBoxIdle set to false\n", __func__, __LINE__);
-#endif
-
-              trackState[dest][ownTrack] = _INTRAIN;                                            // Set track state to incoming train
-              printString(LCD_DEPATURE_OK, dest, DEST_TRAIN_0);                                 // Set string to train out
+            if (ports.at(dest, ownTrack).trainId == train) {
+              ports.at(dest, ownTrack).state = _INTRAIN;                                        // Set track state to incoming train
               beep(TIME_BEEP_DURATION, BEEP_OK);                                                // Beep ok
-              showText = true;                                                                  // Show the string
-#ifdef DEBUG
-              Serial.printf("%-16s: %d - ShowText set to true\n", __func__, __LINE__);
-#endif
               setNodeString(dest, ownTrack);
               setDirString(dest, ownTrack);
-              showTime = millis();
-#ifdef DEBUG
-              Serial.printf("%-16s: %d - showTime set to millis()\n", __func__, __LINE__);
-#endif
+              showReport(dest, ownTrack, LCD_DEPATURE_OK);                                      // Set string to train out
             }
 #ifdef DEBUG
             else {
@@ -1752,19 +1851,97 @@ void handleTrain(uint8_t dest, uint8_t receivedTrack, uint8_t orderCode, uint16_
     }
   }
 
-  else {
-    dtInQueue[dest][Q_STATE]      = Q_ACTIVE;                                                   // Set queue active
-    dtInQueue[dest][Q_TRACK]      = receivedTrack;                                              // store values for current destination
-    dtInQueue[dest][Q_ORDERCODE]  = orderCode;
-    dtInQueue[dest][Q_TRAIN]      = train;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Show the text of a handled report, or queue it while the operator is busy
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void showReport(uint8_t dest, uint8_t track, uint8_t str) {
+
+  if (!tamBoxIdle) {                                                                            // Shown when the tambox is idle
+    if (dtQueuePush(dest, track, str)) {
+#ifdef DEBUG
+      Serial.printf("%-16s: %d Report text queued for destination: %s (%d queued)\n", __func__, __LINE__, destIDTxt[dest], dtQueueLen);
+#endif
+      setTimer(TIMER_QUEUE, OWN, LEFT_TRACK, TIME_QUEUE_DRAIN);
+    }
+    return;
+  }
+
+  destination = dest;                                                                           // Save dest
+  tamBoxIdle = false;                                                                           // Set tambox busy
 #ifdef DEBUG
-    Serial.printf("%-16s: %d Incoming report queued for destination: %s\n", __func__, __LINE__, destIDTxt[dest]);
+  Serial.printf("%-16s: %d - tamBoxIdle set to false\n", __func__, __LINE__);
 #endif
-    showTime = millis();
+  printString(str, dest, DEST_TRAIN_0);
+  showText = true;                                                                              // Show the string
+#ifdef DEBUG
+  Serial.printf("%-16s: %d - ShowText set to true\n", __func__, __LINE__);
+#endif
+  setShowTimer();
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Queue the text of a report handled while the operator is busy
+ *
+ *  The track state is already changed, only the text waits for the display. A destination and track
+ *  has one entry, in the order of its first report, and a later report replaces its text with the
+ *  latest state. When the queue is full the new text is dropped and counted, the queued ones are kept.
+ *
+ *  Returns true if the text was queued
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+bool dtQueuePush(uint8_t dest, uint8_t track, uint8_t str) {
+
+  for (uint8_t i = 0; i < dtQueueLen; i++) {
+    dtEvent& queued = dtQueue[(dtQueueHead + i) % DT_QUEUE_DEPTH];
+    if (queued.dest == dest && queued.track == track) {                                         // Latest state of the track
+      queued.str = str;
+      return false;
+    }
+  }
+
+  if (dtQueueLen == DT_QUEUE_DEPTH) {                                                           // Queue is full
+    dtQueueDrops++;
 #ifdef DEBUG
-    Serial.printf("%-16s: %d - showTime set to millis()\n", __func__, __LINE__);
+    Serial.printf("%-16s: %d Queue full, report from %s dropped (%d dropped)\n", __func__, __LINE__, destIDTxt[dest], dtQueueDrops);
 #endif
+    return false;
+  }
+
+  dtEvent& event  = dtQueue[(dtQueueHead + dtQueueLen) % DT_QUEUE_DEPTH];
+  event.dest      = dest;
+  event.track     = track;
+  event.str       = str;
+  dtQueueLen++;
+
+  if (dtQueueLen > dtQueueHigh) {
+    dtQueueHigh = dtQueueLen;
+  }
+
+  return true;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Take the oldest queued text
+ *
+ *  Returns false if the queue is empty
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+bool dtQueuePop(dtEvent& event) {
+
+  if (dtQueueLen == 0) {
+    return false;
   }
+
+  event       = dtQueue[dtQueueHead];
+  dtQueueHead = (dtQueueHead + 1) % DT_QUEUE_DEPTH;
+  dtQueueLen--;
+  return true;
 }
 
 
@@ -1782,113 +1959,80 @@ void printString(uint8_t str, uint8_t dest, uint16_t train) {
   uint8_t cRow;                                                                                 // Clear row
   uint8_t cCol;                                                                                 // Clear stringpos start
   uint8_t iRow;                                                                                 // Insert row
-  String text;
-  bool escaped    = false;                                                                      // Set no escape needed
+  uint8_t iCol;                                                                                 // Insert stringpos start
+  const char* text  = "";
 
   if (str < 11) {
-    text = String(stringTxt[atoi(cfgLanguage)][str]);
-#ifdef NON_EU_CHAR_SET
-    // Tempfix, when received unicode is not printed correctly
-    // on the LCD with asian character set
-    if (text.indexOf(String(escapeChar)) >= 0) {                                                // Special character in the string
-      text    = removeEscapeChar(text);
-      escaped = true;                                                                           // Escape character needed
-    }
-#endif
+    text = stringTxt[lcdLanguage][str];
   }
 
   switch (dest) {
     case DEST_A:                                                                                // Destination on left side
       cRow    = LCD_FIRST_ROW;                                                                  // Destination on first row
-      cCol    = atoi(cfgLcdChar) / 2;
-      iRow    = (atoi(cfgLcdRows) == 4) ? LCD_FOURTH_ROW : LCD_SECOND_ROW;                      // Check if it is a four row LCD
+      cCol    = lcdChars / 2;
+      iRow    = (lcdRows == 4) ? LCD_FOURTH_ROW : LCD_SECOND_ROW;                               // Check if it is a four row LCD
     break;
 //----------------------------------------------------------------------------------------------
     case DEST_B:                                                                                // Destination on right side
       cRow    = LCD_FIRST_ROW;                                                                  // Destination on first row
       cCol    = LCD_FIRST_COL;
-      iRow    = (atoi(cfgLcdRows) == 4) ? LCD_FOURTH_ROW : LCD_SECOND_ROW;                      // Check if it is a four row LCD
+      iRow    = (lcdRows == 4) ? LCD_FOURTH_ROW : LCD_SECOND_ROW;                               // Check if it is a four row LCD
     break;
 //----------------------------------------------------------------------------------------------
     case DEST_C:                                                                                // Destination on left side
-      cRow    = (atoi(cfgLcdRows) == 4) ? LCD_THIRD_ROW : LCD_SECOND_ROW;                       // Check if it is a four row LCD
-      cCol    = atoi(cfgLcdChar) / 2;
+      cRow    = (lcdRows == 4) ? LCD_THIRD_ROW : LCD_SECOND_ROW;                                // Check if it is a four row LCD
+      cCol    = lcdChars / 2;
       iRow    = LCD_FIRST_ROW;                                                                  // Info text on first row
     break;
 //----------------------------------------------------------------------------------------------
     case DEST_D:                                                                                // Destination on right side
-      cRow    = (atoi(cfgLcdRows) == 4) ? LCD_THIRD_ROW : LCD_SECOND_ROW;                       // Check if it is a four row LCD
+      cRow    = (lcdRows == 4) ? LCD_THIRD_ROW : LCD_SECOND_ROW;                                // Check if it is a four row LCD
       cCol    = LCD_FIRST_COL;
       iRow    = LCD_FIRST_ROW;                                                                  // Info text on first row
     break;
 //----------------------------------------------------------------------------------------------
+#if DEST_BUTTONS > 4
+    case DEST_E:                                                                                // Destination on left side
+      cRow    = LCD_SECOND_ROW;                                                                 // Destination on second row
+      cCol    = lcdChars / 2;
+      iRow    = (lcdRows == 4) ? LCD_FOURTH_ROW : LCD_FIRST_ROW;                                // Check if it is a four row LCD
+    break;
+//----------------------------------------------------------------------------------------------
+    case DEST_F:                                                                                // Destination on right side
+      cRow    = LCD_SECOND_ROW;                                                                 // Destination on second row
+      cCol    = LCD_FIRST_COL;
+      iRow    = (lcdRows == 4) ? LCD_FOURTH_ROW : LCD_FIRST_ROW;                                // Check if it is a four row LCD
+    break;
+//----------------------------------------------------------------------------------------------
+#endif
   }
   switch (str) {
     case LCD_TRAIN_ID:                                                                          // Train number
-      text  = String(stringTxt[atoi(cfgLanguage)][LCD_TRAIN]);
-      if (text.indexOf(String(escapeChar)) >= 0) {                                              // Special character in the string
-        text = removeEscapeChar(text);
-      }
-
-      if (text.length() < atoi(cfgLcdChar) / 2) {
-        lcd.setCursor(atoi(cfgLcdChar) / 2 - centerText(text) + text.length(), iRow);
-      }
-
-      else {
-        lcd.setCursor(LCD_FIRST_COL + text.length(), iRow);
-      }
-
-      lcd.print(String(train));
+      text  = stringTxt[lcdLanguage][LCD_TRAIN];
+      iCol  = (lcdLen(text) < lcdChars / 2) ? lcdChars / 2 - (lcdLen(text) + 1) / 2 + lcdLen(text) : LCD_FIRST_COL + lcdLen(text);
+      iCol += lcdPut(iCol, iRow, String(train).c_str());
+      lcdFlush();
+      lcd.setCursor(iCol, iRow);                                                                // Keep the cursor after the number
     break;
 //----------------------------------------------------------------------------------------------
     case LCD_TRAIN:                                                                             // Train string
-      lcd.setCursor(cCol, cRow);
-      lcd.print(addBlanks(atoi(cfgLcdChar) / 2));                                               // Clear the position
-      lcd.setCursor(LCD_FIRST_COL, iRow);
-      lcd.print(addBlanks(atoi(cfgLcdChar)));                                                   // Clear the row
-      if (text.length() < atoi(cfgLcdChar) / 2) {
-        lcd.setCursor(atoi(cfgLcdChar) / 2 - centerText(text), iRow);
-      }
-
-      else {
-        lcd.setCursor(LCD_FIRST_COL, iRow);
-      }
-
-      lcd.print(text);
-      if (escaped) {                                                                            // Special character in the string
-        if (text.length() < atoi(cfgLcdChar) / 2) {
-          fixSpecialChar(text, atoi(cfgLcdChar) / 2 - centerText(text), iRow);
-        }
-
-        else {
-          fixSpecialChar(text, LCD_FIRST_COL, iRow);
-        }
-      }
-
+      lcdFill(cCol, cRow, lcdChars / 2);                                                        // Clear the position
+      lcdFill(LCD_FIRST_COL, iRow, lcdChars);                                                   // Clear the row
+      iCol  = (lcdLen(text) < lcdChars / 2) ? lcdChars / 2 - (lcdLen(text) + 1) / 2 : LCD_FIRST_COL;
+      iCol += lcdPut(iCol, iRow, text);
+      lcdFlush();
       lcd.cursor();
-      if (text.length() < atoi(cfgLcdChar) / 2) {
-        lcd.setCursor(atoi(cfgLcdChar) / 2 - centerText(text) + text.length(), iRow);
-      }
-
-      else {
-        lcd.setCursor(LCD_FIRST_COL + text.length(), iRow);
-      }
-
+      lcd.setCursor(iCol, iRow);
       lcd.blink();
     break;
 //----------------------------------------------------------------------------------------------
     default:
-      lcd.setCursor(cCol, cRow);
-      lcd.print(addBlanks(atoi(cfgLcdChar) / 2));                                               // Clear the position
-      lcd.setCursor(LCD_FIRST_COL, iRow);
-      lcd.print(addBlanks(atoi(cfgLcdChar)));                                                   // Clear the row
-      lcd.setCursor(atoi(cfgLcdChar) / 2 - centerText(text), iRow);
-      lcd.print(text);
-      if (escaped) {                                                                            // Special character in the string
-        fixSpecialChar(text, atoi(cfgLcdChar) / 2 - centerText(text), iRow);
-      }
+      lcdFill(cCol, cRow, lcdChars / 2);                                                        // Clear the position
+      lcdFill(LCD_FIRST_COL, iRow, lcdChars);                                                   // Clear the row
+      lcdPut(lcdChars / 2 - (lcdLen(text) + 1) / 2, iRow, text);
+      lcdFlush();
 #ifdef DEBUG
-      Serial.printf("%-16s: %d String: %s\n", __func__, __LINE__, text.c_str());
+      Serial.printf("%-16s: %d String: %s\n", __func__, __LINE__, text);
 #endif
     break;
 //----------------------------------------------------------------------------------------------
@@ -1897,7 +2041,7 @@ void printString(uint8_t str, uint8_t dest, uint16_t train) {
 
 
 /* ------------------------------------------------------------------------------------------------------------------------------
- *  Set destination text
+ *  Set the track shown by the destination text, drawn by drawDest
  * ------------------------------------------------------------------------------------------------------------------------------
  */
 void setNodeString(uint8_t dest, uint8_t track) {
@@ -1907,48 +2051,12 @@ void setNodeString(uint8_t dest, uint8_t track) {
   Serial.printf("%-16s: %d %s(dest: %d, track: %d)\n", __func__, __LINE__, __func__, dest, track);
 #endif
 
-  String destTxt  = tamBoxConfig[dest][SIGN];
-  uint8_t nodeLen = atoi(cfgLcdChar) / 2 - (LCD_DEST_LEN + LCD_DIR_LEN);
-#ifdef DEBUG
-  String trackSymbol = "-";                                                                     // show track sign during debug
-  if (tamBoxConfig[dest][TRACKS].toInt() == DOUBLE_TRACK) {
-    if (tamBoxConfig[dest][TYPE] == TYPE_DOUBLE_T) {
-      trackSymbol = "=";
-    }
-
-    else if (tamBoxConfig[dest][TYPE] == TYPE_SPLIT_T && track == RIGHT_TRACK) {
-      destTxt = tamBoxConfig[dest + 5][SIGN];
-    }
-  }
-#endif
-  if (trainId[dest][track] != DEST_TRAIN_0) { destTxt = String(trainId[dest][track]); }
-
-  switch (dest) {
-    case DEST_A:                                                                                // Destination on left side
-    case DEST_C:                                                                                // Destination on left side
-#ifdef DEBUG
-      if (trainId[dest][track] == DEST_TRAIN_0) {
-        destTxt = destTxt + trackSymbol;                                                        // show track sign during debug
-      }
-#endif
-      lcdString[dest][LCD_NODE] = destTxt + addBlanks(nodeLen - destTxt.length());              // Set destination sign
-    break;
-//----------------------------------------------------------------------------------------------
-    default:                                                                                    // Destination on right side
-#ifdef DEBUG
-      if (trainId[dest][track] == DEST_TRAIN_0) {
-        destTxt = trackSymbol + destTxt;                                                        // show track sign during debug
-      }
-#endif
-      lcdString[dest][LCD_NODE] = addBlanks(nodeLen - destTxt.length()) + destTxt;              // Set destination sign
-    break;
-//----------------------------------------------------------------------------------------------
-  }
+  lcdNodeTrack[dest] = track;
 }
 
 
 /* ------------------------------------------------------------------------------------------------------------------------------
- *  Set direction for a destination
+ *  Set the track shown by the direction symbol, drawn by drawDest
  * ------------------------------------------------------------------------------------------------------------------------------
  */
 void setDirString(uint8_t dest, uint8_t track) {
@@ -1956,90 +2064,107 @@ void setDirString(uint8_t dest, uint8_t track) {
 #ifdef DEBUG_ALL
   Serial.printf("%-16s: %d \n", __func__, __LINE__);
   Serial.printf("%-16s: %d %s(dest: %d, track: %d)\n", __func__, __LINE__, __func__, dest, track);
-  Serial.printf("%-16s: %d Traffic direction: %s\n", __func__, __LINE__, traffDir[dest][track]);
+  Serial.printf("%-16s: %d Traffic direction: %s\n", __func__, __LINE__, ports.at(dest, track).traffDir);
 #endif
 
+  lcdDirTrack[dest] = track;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Direction symbol for a destination
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+const char* dirSymbol(uint8_t dest, uint8_t track) {
+
+  const char* symbol;
+
   switch (dest) {
     case DEST_A:                                                                                // Destination on left side
     case DEST_C:                                                                                // Destination on left side
-      switch (traffDir[dest][track]) {                                                          // Check track traffic direction
+#if DEST_BUTTONS > 4
+    case DEST_E:                                                                                // Destination on left side
+#endif
+      switch (ports.at(dest, track).traffDir) {                                                 // Check track traffic direction
         case DIR_OUT:                                                                           // Track direction is outgoing
-          switch (trackState[dest][track]) {                                                    // Check track state
+          switch (ports.at(dest, track).state) {                                                // Check track state
             case _OUTREQUEST:                                                                   // Track state in outgoing request
-              lcdString[dest][LCD_DIR]  = DIR_QUERY_T;                                          // Show character for ongoing request
+              symbol = DIR_QUERY_T;                                                             // Show character for ongoing request
             break;
 //----------------------------------------------------------------------------------------------
             case _OUTTRAIN:                                                                     // Track state in outgoing train
-              lcdString[dest][LCD_DIR]  = DIR_LEFT_TRAIN_T;                                     // Show character for outgoing train
+              symbol = DIR_LEFT_TRAIN_T;                                                        // Show character for outgoing train
             break;
 //----------------------------------------------------------------------------------------------
             default:                                                                            // Track state in other state
-              lcdString[dest][LCD_DIR]  = DIR_LEFT_T;                                           // Show outgoing traffic direction character
+              symbol = DIR_LEFT_T;                                                              // Show outgoing traffic direction character
             break;
 //----------------------------------------------------------------------------------------------
           }
         break;
 //----------------------------------------------------------------------------------------------
         case DIR_IN:                                                                            // Track direction is incoming
-          switch (trackState[dest][track]) {                                                    // Check track state
+          switch (ports.at(dest, track).state) {                                                // Check track state
             case _INTRAIN:                                                                      // Track state in incoming train
-              lcdString[dest][LCD_DIR]  = DIR_RIGHT_TRAIN_T;                                    // Show character for incoming train
+              symbol = DIR_RIGHT_TRAIN_T;                                                       // Show character for incoming train
             break;
 //----------------------------------------------------------------------------------------------
             default:                                                                            // Track state in other state
-              lcdString[dest][LCD_DIR]  = DIR_RIGHT_T;                                          // Show incoming traffic direction character
+              symbol = DIR_RIGHT_T;                                                             // Show incoming traffic direction character
             break;
 //----------------------------------------------------------------------------------------------
           }
         break;
 //----------------------------------------------------------------------------------------------
         default:                                                                                // Connection lost
-          lcdString[dest][LCD_DIR]      = DIR_LOST_T;                                           // Show lost connection character
+          symbol = DIR_LOST_T;                                                                  // Show lost connection character
         break;
 //----------------------------------------------------------------------------------------------
       }
     break;
 //----------------------------------------------------------------------------------------------
     default:                                                                                    // Destination on right side
-      switch (traffDir[dest][track]) {                                                          // Check track traffic direction
+      switch (ports.at(dest, track).traffDir) {                                                 // Check track traffic direction
         case DIR_OUT:                                                                           // Track direction is outgoing
-          switch (trackState[dest][track]) {                                                    // Check track state
+          switch (ports.at(dest, track).state) {                                                // Check track state
             case _OUTREQUEST:                                                                   // Track state in outgoing request
-              lcdString[dest][LCD_DIR]  = DIR_QUERY_T;                                          // Show character for ongoing request
+              symbol = DIR_QUERY_T;                                                             // Show character for ongoing request
             break;
 //----------------------------------------------------------------------------------------------
             case _OUTTRAIN:                                                                     // Track state in outgoing train
-              lcdString[dest][LCD_DIR]  = DIR_RIGHT_TRAIN_T;                                    // Show character for outgoing train
+              symbol = DIR_RIGHT_TRAIN_T;                                                       // Show character for outgoing train
             break;
 //----------------------------------------------------------------------------------------------
             default:                                                                            // Track state in other state
-              lcdString[dest][LCD_DIR]  = DIR_RIGHT_T;                                          // Show outgoing traffic direction character
+              symbol = DIR_RIGHT_T;                                                             // Show outgoing traffic direction character
             break;
 //----------------------------------------------------------------------------------------------
           }
         break;
 //----------------------------------------------------------------------------------------------
         case DIR_IN:                                                                            // Track direction is incoming
-          switch (trackState[dest][track]) {                                                    // Check track state
+          switch (ports.at(dest, track).state) {                                                // Check track state
             case _INTRAIN:                                                                      // Track state in incoming train
-              lcdString[dest][LCD_DIR]  = DIR_LEFT_TRAIN_T;                                     // Show character for incoming train
+              symbol = DIR_LEFT_TRAIN_T;                                                        // Show character for incoming train
             break;
 //----------------------------------------------------------------------------------------------
             default:                                                                            // Track state in other state
-              lcdString[dest][LCD_DIR]  = DIR_LEFT_T;                                           // Show incoming traffic direction character
+              symbol = DIR_LEFT_T;                                                              // Show incoming traffic direction character
             break;
 //----------------------------------------------------------------------------------------------
           }
         break;
 //----------------------------------------------------------------------------------------------
         default:                                                                                // Connection lost
-          lcdString[dest][LCD_DIR]      = DIR_LOST_T;                                           // Show lost connection character
+          symbol = DIR_LOST_T;                                                                  // Show lost connection character
         break;
 //----------------------------------------------------------------------------------------------
       }
     break;
 //----------------------------------------------------------------------------------------------
   }
+
+  return symbol;
 }
 
 
@@ -2054,242 +2179,239 @@ void updateLcd(uint8_t dest) {
   Serial.printf("%-16s: %d %s(dest: %d)\n", __func__, __LINE__, __func__, dest);
 #endif
 
-  String stnName  = tamBoxConfig[OWN][NAME];
-  String stnSign  = tamBoxConfig[OWN][SIGN];
-  uint8_t signLen, useRow;
-  bool escaped    = false;                                                                      // Set no escape needed
+  const char* stnName = tamBoxConfig[OWN].name;
+  const char* stnSign = tamBoxConfig[OWN].sign;
 
   switch (dest) {
     case OWN:                                                                                   // Show own station
-#ifdef NON_EU_CHAR_SET
-      // Tempfix, when received unicode is not printed correctly
-      // on the LCD with asian character set
-      if (tamBoxConfig[OWN][SIGN].indexOf(String(escapeChar)) >= 0) {
-        stnSign = removeEscapeChar(tamBoxConfig[OWN][SIGN]);
-        escaped = true;                                                                         // Special character in the station name
+      lcdClear(true);
+      lcdPut((lcdLen(stnSign) <= lcdChars) ? lcdChars / 2 - (lcdLen(stnSign) + 1) / 2 : LCD_FIRST_COL, LCD_FIRST_ROW, stnSign);
+      lcdPut((lcdLen(stnName) <= lcdChars) ? lcdChars / 2 - (lcdLen(stnName) + 1) / 2 : LCD_FIRST_COL, LCD_SECOND_ROW, stnName);
+    break;
+//----------------------------------------------------------------------------------------------
+    case DEST_ALL_DEST:                                                                         // Refresh LCD
+      // show running screen
+      lcdClear(false);
+      for (uint8_t i = 0; i < DEST_BUTTONS; i++) {
+        drawDest(i);
       }
-#endif
-      lcd.clear();
-      if(stnSign.length() <= atoi(cfgLcdChar)) {
-        lcd.setCursor(atoi(cfgLcdChar) / 2 - centerText(stnSign), LCD_FIRST_ROW);
+    break;
+//----------------------------------------------------------------------------------------------
+    default:
+      if (dest < DEST_BUTTONS) {
+        drawDest(dest);
       }
+    break;
+//----------------------------------------------------------------------------------------------
+  }
 
-      else {                                                                                    // Station name longer than LCD max character
-        lcd.setCursor(LCD_FIRST_COL, LCD_FIRST_ROW);
-        lcd.autoscroll();                                                                       // scroll the text
-      }
+  lcdFlush();                                                                                   // Send the changed cells
+}
 
-      lcd.print(stnSign);
 
-      if (escaped) {
-        fixSpecialChar(stnSign, atoi(cfgLcdChar) / 2 - centerText(stnSign), LCD_FIRST_ROW);
-        escaped = false;
-      }
-#ifdef NON_EU_CHAR_SET
-      // Tempfix, when received unicode is not printed correctly
-      // on the LCD with asian character set
-      if (tamBoxConfig[OWN][NAME].indexOf(String(escapeChar)) >= 0) {
-        stnName = removeEscapeChar(tamBoxConfig[OWN][NAME]);
-        escaped = true;                                                                         // Special character in the station name
-      }
-#endif
-      lcd.setCursor(atoi(cfgLcdChar) / 2 - centerText(stnName), LCD_SECOND_ROW);
-      lcd.print(stnName);
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Draw one destination into the LCD shadow
+ *  A and C are on the left side, B and D on the right side. On a two row LCD C and D share the
+ *  second row with the info text. With six exits E and F use the second row of a four row LCD and
+ *  are not shown on a two row LCD. The cells are written straight from the track shown, letter,
+ *  direction symbol and the sign or the train number, a destination not used is left blank.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void drawDest(uint8_t dest) {
 
-      if (escaped) {
-        fixSpecialChar(stnName, atoi(cfgLcdChar) / 2 - centerText(stnName), LCD_SECOND_ROW);
-        escaped = false;
-      }
-    break;
-//----------------------------------------------------------------------------------------------
-    case DEST_ALL_DEST:                                                                         // Refresh LCD
-      // show running screen
-      lcd.clear();
-      lcd.noAutoscroll();
-      lcd.home();
-      for (uint8_t i = 0; i < DEST_BUTTONS; i++) {
-        if (i == DEST_A || i == DEST_C) {
-          stnSign = lcdString[i][LCD_NODE];
-#ifdef NON_EU_CHAR_SET
-          // Tempfix, when received unicode is not printed correctly
-          // on the LCD with asian character set
-          if (lcdString[i][LCD_NODE].indexOf(String(escapeChar)) >= 0) {
-            signLen = lcdString[i][LCD_NODE].length();
-            stnSign = removeEscapeChar(lcdString[i][LCD_NODE]);
-            stnSign = stnSign + addBlanks(signLen-stnSign.length());
-            escaped = true;                                                                     // Special character in the station signature
-          }
-#endif
-          if (atoi(cfgLcdRows) == 4 && i == DEST_C) {                                           // Four row LCD
-            useRow = LCD_THIRD_ROW;
-          }
+  uint8_t nodeLen    = lcdChars / 2 - (LCD_DEST_LEN + LCD_DIR_LEN);
+  bool left          = (dest % 2 == 0);                                                         // A, C and E
+  tamBoxTrack& shown = ports.at(dest, lcdNodeTrack[dest]);
+  const char* sign   = tamBoxConfig[dest].sign;
+  char train[6];                                                                                // Train number, up to 65535
+  uint8_t useRow, signLen, col;
 
-          else if (i == DEST_A) {
-            useRow = LCD_FIRST_ROW;
-          }
+  if (dest == DEST_A || dest == DEST_B) {
+    useRow = LCD_FIRST_ROW;
+  }
 
-          else {
-            useRow = LCD_SECOND_ROW;
-          }
+#if DEST_BUTTONS > 4
+  else if (dest == DEST_E || dest == DEST_F) {
+    if (lcdRows != 4) { return; }                                                               // No room on a two row LCD
+    useRow = LCD_SECOND_ROW;
+  }
+#endif
 
-          lcd.setCursor(LCD_FIRST_COL, useRow);
-          lcd.print(lcdString[i][LCD_DEST]);
+  else {
+    useRow = (lcdRows == 4) ? LCD_THIRD_ROW : LCD_SECOND_ROW;                                   // Check if it is a four row LCD
+  }
 
-          if (lcdString[i][LCD_DIR] == DIR_RIGHT_TRAIN_T ||
-              lcdString[i][LCD_DIR] == DIR_LEFT_TRAIN_T) {
-            fixSpecialChar(lcdString[i][LCD_DIR], 1, useRow);
-          }
+  if (ports.at(dest, LEFT_TRACK).state == _NOTUSED) {                                           // Don't show a destination not used
+    lcdFill(left ? LCD_FIRST_COL : lcdChars / 2, useRow, lcdChars / 2);
+    return;
+  }
 
-          else {
-            lcd.print(lcdString[i][LCD_DIR]);
-          }
+#ifdef DEBUG
+  const char* trackSymbol = (tamBoxConfig[dest].tracks == DOUBLE_TRACK && tamBoxConfig[dest].type == TRACK_TYPE_DOUBLE) ? "=" : "-";
+  if (tamBoxConfig[dest].tracks == DOUBLE_TRACK && tamBoxConfig[dest].type == TRACK_TYPE_SPLIT && lcdNodeTrack[dest] == RIGHT_TRACK) {
+    sign = tamBoxConfig[ports.splitSlot(dest)].sign;
+  }
 
-          lcd.print(stnSign);
+  if (shown.trainId != DEST_TRAIN_0) {
+    trackSymbol = "";                                                                           // show track sign during debug
+  }
+#endif
+  if (shown.trainId != DEST_TRAIN_0) {
+    snprintf(train, sizeof(train), "%u", shown.trainId);
+    sign = train;
+  }
 
-          if (escaped) {
-            fixSpecialChar(stnSign, LCD_FIRST_COL + LCD_DEST_LEN + LCD_DIR_LEN, useRow);
-            escaped = false;
-          }
-        }
+  signLen = lcdLen(sign);
+#ifdef DEBUG
+  signLen += lcdLen(trackSymbol);
+#endif
+  if (signLen > nodeLen) { signLen = nodeLen; }
 
-        else {
-          stnSign = lcdString[i][LCD_NODE];
-#ifdef NON_EU_CHAR_SET
-          // Tempfix, when received unicode is not printed correctly
-          // on the LCD with asian character set
-          if (lcdString[i][LCD_NODE].indexOf(String(escapeChar)) >= 0) {
-            signLen = lcdString[i][LCD_NODE].length();
-            stnSign = removeEscapeChar(lcdString[i][LCD_NODE]);
-            stnSign = addBlanks(signLen-stnSign.length()) + stnSign;
-            escaped = true;                                                                     // Special character in the station signature
-          }
+  if (left) {                                                                                   // Destination on left side
+    lcdPut(LCD_FIRST_COL, useRow, destIDTxt[dest]);
+    lcdPut(LCD_FIRST_COL + LCD_DEST_LEN, useRow, dirSymbol(dest, lcdDirTrack[dest]));
+    col = LCD_FIRST_COL + LCD_DEST_LEN + LCD_DIR_LEN;
+    lcdFill(col, useRow, nodeLen);
+    col += lcdPut(col, useRow, sign);
+#ifdef DEBUG
+    lcdPut(col, useRow, trackSymbol);
 #endif
-          if (atoi(cfgLcdRows) == 4 && i == DEST_D) {                                           // Four row LCD
-            useRow = LCD_THIRD_ROW;
-          }
+  }
 
-          else if (i == DEST_B) {
-            useRow = LCD_FIRST_ROW;
-          }
+  else {                                                                                        // Destination on right side
+    lcdFill(lcdChars / 2, useRow, nodeLen);
+    col = lcdChars / 2 + nodeLen - signLen;
+#ifdef DEBUG
+    col += lcdPut(col, useRow, trackSymbol);
+#endif
+    lcdPut(col, useRow, sign);
+    lcdPut(lcdChars - 2, useRow, dirSymbol(dest, lcdDirTrack[dest]));
+    lcdPut(lcdChars - 1, useRow, destIDTxt[dest]);
+  }
+}
 
-          else {
-            useRow = LCD_SECOND_ROW;
-          }
 
-          lcd.setCursor(atoi(cfgLcdChar) / 2, useRow);
-          lcd.print(stnSign);
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  LCD shadow
+ *  Text is written into lcdFrame, lcdFlush compares it with lcdShown and only sends the cells
+ *  that differ. Escaped characters are translated through lcdGlyph, built once at start up.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void setLcdGlyphs() {
 
-          if (escaped) {
-            fixSpecialChar(stnSign, atoi(cfgLcdChar) / 2, useRow);
-            lcd.setCursor(atoi(cfgLcdChar) - 2, useRow);
-            escaped = false;
-          }
+  for (uint8_t i = 0; i < 128; i++) {
+    lcdGlyph[i] = 0x80 + i;                                                                     // Send as is
+  }
 
-          if (lcdString[i][LCD_DIR] == DIR_RIGHT_TRAIN_T ||
-              lcdString[i][LCD_DIR] == DIR_LEFT_TRAIN_T) {
-            fixSpecialChar(lcdString[i][LCD_DIR], atoi(cfgLcdChar) - 2, useRow);
-          }
+  lcdGlyph[0xab - 0x80]   = TRAIN_MOVING_RIGHT;                                                 // >>
+  lcdGlyph[0xbb - 0x80]   = TRAIN_MOVING_LEFT;                                                  // <<
+#ifdef NON_EU_CHAR_SET
+  lcdGlyph[0x85 - 0x80]   = SWE_CAP_Å;                                                          // Å
+  lcdGlyph[0x84 - 0x80]   = SWE_CAP_Ä;                                                          // Ä
+  lcdGlyph[0x96 - 0x80]   = SWE_CAP_Ö;                                                          // Ö
+  lcdGlyph[0x89 - 0x80]   = 'E';                                                                // É
+  lcdGlyph[0x9c - 0x80]   = 'U';                                                                // Ü
+  lcdGlyph[0xa5 - 0x80]   = SWE_LOW_Å;                                                          // å
+  lcdGlyph[0xa4 - 0x80]   = SWE_LOW_Ä;                                                          // ä
+  lcdGlyph[0xb6 - 0x80]   = SWE_LOW_Ö;                                                          // ö
+  lcdGlyph[0xa9 - 0x80]   = 'e';                                                                // é
+  lcdGlyph[0xbc - 0x80]   = 'u';                                                                // ü
+#endif
+}
 
-          else {
-            lcd.print(lcdString[i][LCD_DIR]);
-          }
 
-          lcd.print(lcdString[i][LCD_DEST]);
-        }
-      }
-    break;
-//----------------------------------------------------------------------------------------------
-    default:
-      if (dest == DEST_A || dest == DEST_C) {
-        stnSign = lcdString[dest][LCD_NODE];
+uint8_t lcdLen(const char* text) {
+
+  uint8_t len = 0;
+  for (const char* c = text; *c != '\0'; c++) {
 #ifdef NON_EU_CHAR_SET
-        // Tempfix, when received unicode is not printed correctly
-        // on the LCD with asian character set
-        if (lcdString[dest][LCD_NODE].indexOf(String(escapeChar)) >= 0) {
-          signLen = lcdString[dest][LCD_NODE].length();
-          stnSign = removeEscapeChar(lcdString[dest][LCD_NODE]);
-          stnSign = stnSign + addBlanks(signLen-stnSign.length());
-          escaped = true;                                                                       // Special character in the station signature
-        }
+    if (*c == *escapeChar) { continue; }                                                        // Not shown
 #endif
-        if (atoi(cfgLcdRows) == 4 && dest == DEST_C) {                                          // Four row LCD
-          useRow = LCD_THIRD_ROW;
-        }
+    len++;
+  }
 
-        else if (dest == DEST_A) {
-          useRow = LCD_FIRST_ROW;
-        }
+  return len;
+}
 
-        else {
-          useRow = LCD_SECOND_ROW;
-        }
 
-        lcd.setCursor(LCD_FIRST_COL, useRow);
-        lcd.print(lcdString[dest][LCD_DEST]);
+uint8_t lcdPut(uint8_t col, uint8_t row, const char* text) {
 
-        if (lcdString[dest][LCD_DIR] == DIR_RIGHT_TRAIN_T ||
-            lcdString[dest][LCD_DIR] == DIR_LEFT_TRAIN_T) {
-          fixSpecialChar(lcdString[dest][LCD_DIR], 1, useRow);
-        }
+  uint8_t len = 0;
+  for (const uint8_t* c = (const uint8_t*)text; *c != '\0'; c++) {
+#ifdef NON_EU_CHAR_SET
+    if (*c == (uint8_t)*escapeChar) { continue; }                                               // Not shown
+#endif
+    if (row < LCD_MAX_ROWS && col + len < LCD_MAX_CHARS) {
+      lcdFrame[row][col + len] = (*c & 0x80) ? lcdGlyph[*c - 0x80] : *c;
+#ifdef LCD_FULL_REDRAW
+      lcdShown[row][col + len] = LCD_CELL_UNKNOWN;                                              // Sent even when not changed
+#endif
+    }
+    len++;
+  }
 
-        else {
-          lcd.print(lcdString[dest][LCD_DIR]);
-        }
+  return len;
+}
 
-        lcd.print(stnSign);
 
-        if (escaped) {
-          fixSpecialChar(stnSign, LCD_FIRST_COL + LCD_DEST_LEN + LCD_DIR_LEN, useRow);
-          escaped = false;
-        }
-      }
+void lcdFill(uint8_t col, uint8_t row, uint8_t len) {
 
-      else if (dest == DEST_B || dest == DEST_D) {
-        stnSign = lcdString[dest][LCD_NODE];
-#ifdef NON_EU_CHAR_SET
-        // Tempfix, when received unicode is not printed correctly
-        // on the LCD with asian character set
-        if (lcdString[dest][LCD_NODE].indexOf(String(escapeChar)) >= 0) {
-          signLen = lcdString[dest][LCD_NODE].length();
-          stnSign = removeEscapeChar(lcdString[dest][LCD_NODE]);
-          stnSign = addBlanks(signLen-stnSign.length()) + stnSign;
-          escaped = true;                                                                       // Special character in the station name
-        }
+  for (uint8_t i = col; i < col + len && i < LCD_MAX_CHARS && row < LCD_MAX_ROWS; i++) {
+    lcdFrame[row][i] = ' ';
+#ifdef LCD_FULL_REDRAW
+    lcdShown[row][i] = LCD_CELL_UNKNOWN;                                                        // Sent even when not changed
 #endif
-        if (atoi(cfgLcdRows) == 4 && dest == DEST_D) {                                          // Four row LCD
-          useRow = LCD_THIRD_ROW;
-        }
-        else if (dest == DEST_B) {
-          useRow =  LCD_FIRST_ROW;
-        }
+  }
+}
 
-        else {
-          useRow = LCD_SECOND_ROW;
-        }
 
-        lcd.setCursor(atoi(cfgLcdChar) / 2, useRow);
-        lcd.print(stnSign);
+void lcdClear(bool display) {
 
-        if (escaped) {
-          fixSpecialChar(stnSign, atoi(cfgLcdChar) / 2, useRow);
-          lcd.setCursor(atoi(cfgLcdChar) - 2, useRow);
-          escaped = false;
-        }
+  memset(lcdFrame, ' ', sizeof(lcdFrame));
+#ifdef LCD_FULL_REDRAW
+  display = true;                                                                               // Every redraw clears the LCD
+#endif
+  if (display) {                                                                                // Start from an empty LCD
+    lcd.clear();
+    lcd.noAutoscroll();
+    memset(lcdShown, ' ', sizeof(lcdShown));
+    lcdI2cBytes += 2 * LCD_I2C_BYTES;
+  }
+}
 
-        if (lcdString[dest][LCD_DIR] == DIR_RIGHT_TRAIN_T ||
-            lcdString[dest][LCD_DIR] == DIR_LEFT_TRAIN_T) {
-          fixSpecialChar(lcdString[dest][LCD_DIR], atoi(cfgLcdChar) - 2, useRow);
-        }
 
-        else {
-          lcd.print(lcdString[dest][LCD_DIR]);
-        }
+void lcdFlush() {
 
-        lcd.print(lcdString[dest][LCD_DEST]);
+  unsigned long start = halMicros();
+  uint16_t sent       = 0;                                                                      // LCD commands and characters
+
+  for (uint8_t row = 0; row < lcdRows && row < LCD_MAX_ROWS; row++) {
+    bool atCell = false;                                                                        // LCD cursor is on this cell
+    for (uint8_t col = 0; col < lcdChars && col < LCD_MAX_CHARS; col++) {
+      if (lcdFrame[row][col] == lcdShown[row][col]) {
+        atCell = false;
+        continue;
       }
-    break;
-//----------------------------------------------------------------------------------------------
+
+      if (!atCell) {
+        lcd.setCursor(col, row);
+        sent++;
+      }
+
+      lcd.write(lcdFrame[row][col]);
+      lcdShown[row][col] = lcdFrame[row][col];
+      atCell = true;                                                                            // LCD moves the cursor to the next cell
+      sent++;
+    }
   }
+
+  lcdI2cBytes   += sent * LCD_I2C_BYTES;
+  lcdUpdateTime  = halMicros() - start;
+  lcdUpdates++;
+  metricEnd(METRIC_MQTT_LCD);                                                                   // Started by mqttCallback
+#ifdef DEBUG_ALL
+  Serial.printf("%-16s: %d Sent %d LCD bytes, %d I2C bytes in %d us, total %d I2C bytes\n", __func__, __LINE__, sent, sent * LCD_I2C_BYTES, lcdUpdateTime, lcdI2cBytes);
+#endif
 }
 
 
@@ -2300,401 +2422,690 @@ void updateLcd(uint8_t dest) {
 void setDefaults() {
 
 #ifdef DEBUG
-  String debugTrack;                                                                            // show track sign during debug
   Serial.printf("%-16s: %d \n", __func__, __LINE__);
   Serial.printf("%-16s: %d Setting default values\n", __func__, __LINE__);
 #endif
 
-  String destTxt;
-  uint8_t nodeLen   = atoi(cfgLcdChar) / 2 - (LCD_DEST_LEN + LCD_DIR_LEN);
-
-
   for (uint8_t dest = 0; dest < DEST_BUTTONS; dest++) {
-#ifdef DEBUG
-    debugTrack = (tamBoxConfig[dest][TRACKS].toInt() == SINGLE_TRACK) ? "-" : "=";              // Used for debug to show single track or double track
-#endif
-    destTxt = tamBoxConfig[dest][SIGN];                                                         // Set destinationens sign
-    if (tamBoxConfig[dest][ID] == NOT_USED_T) {                                                 // Not used Destination
-      trackState[dest][LEFT_TRACK]    = _NOTUSED;                                               // Set left track not used
-      trackState[dest][RIGHT_TRACK]   = _NOTUSED;                                               // Set right track not used
-      lcdString[dest][LCD_DEST]       = addBlanks(LCD_DEST_LEN);                                // Don't show destination letter on LCD
-      lcdString[dest][LCD_DIR]        = addBlanks(LCD_DIR_LEN);                                 // Don't show direction character on LCD
-      lcdString[dest][LCD_NODE]       = addBlanks(nodeLen);                                     // Don't show destinations sign on LCD
+    if (strcmp(tamBoxConfig[dest].id, NOT_USED_T) == 0) {                                       // Not used Destination, not shown on LCD
+      ports.at(dest, LEFT_TRACK).state    = _NOTUSED;                                           // Set left track not used
+      ports.at(dest, RIGHT_TRACK).state   = _NOTUSED;                                           // Set right track not used
     }
 
     else {                                                                                      // Destination in use
-      if (tamBoxConfig[dest][TYPE] == TYPE_SINGLE_T) {                                          // Single track Destination
-        trackState[dest][LEFT_TRACK]  = _IDLE;                                                  // Set left track state to lost
-        trackState[dest][RIGHT_TRACK] = _NOTUSED;                                               // Set right track not used
+      if (tamBoxConfig[dest].type == TRACK_TYPE_SINGLE) {                                       // Single track Destination
+        ports.at(dest, LEFT_TRACK).state  = _IDLE;                                              // Set left track state to lost
+        ports.at(dest, RIGHT_TRACK).state = _NOTUSED;                                           // Set right track not used
       }
 
-      else if (tamBoxConfig[dest][TYPE] == TYPE_SPLIT_T) {                                      // Single track to two Destination (Not supported yet)
-        trackState[dest][LEFT_TRACK]  = _IDLE;                                                  // Set left track lost to Destination 1
-        trackState[dest][RIGHT_TRACK] = _IDLE;                                                  // Set right track lost to Destination 2
+      else if (tamBoxConfig[dest].type == TRACK_TYPE_SPLIT) {                                   // Single track to two Destination (Not supported yet)
+        ports.at(dest, LEFT_TRACK).state  = _IDLE;                                              // Set left track lost to Destination 1
+        ports.at(dest, RIGHT_TRACK).state = _IDLE;                                              // Set right track lost to Destination 2
       }
 
       else {                                                                                    // Double track Destination
-        trackState[dest][LEFT_TRACK]  = _IDLE;                                                  // Set left track state to lost
-        setDirString(dest, LEFT_TRACK);
-        trackState[dest][RIGHT_TRACK] = _IDLE;                                                  // Set right track state to lost
+        ports.at(dest, LEFT_TRACK).state  = _IDLE;                                              // Set left track state to lost
+        ports.at(dest, RIGHT_TRACK).state = _IDLE;                                              // Set right track state to lost
       }
-
-      lcdString[dest][LCD_DEST] = String(destIDTxt[dest]);                                      // Set Destinaton letter
-
-      switch (dest) {
-        case DEST_A:                                                                            // Destination on left side
-        case DEST_C:                                                                            // Destination on left side
-#ifdef DEBUG
-          destTxt = destTxt + debugTrack;                                                       // Show track sign during debug
-#endif
-//          lcdString[dest][LCD_DIR]    = DIR_LOST_T;
-          lcdString[dest][LCD_DIR]    = DIR_LEFT_T;                                             // Show left traffic character
-          lcdString[dest][LCD_NODE]   = destTxt + addBlanks(nodeLen - destTxt.length());        // Show destinatins sign
-        break;
-//----------------------------------------------------------------------------------------------
-        default:                                                                                // Destination on right side
-#ifdef DEBUG
-          destTxt = debugTrack + destTxt;                                                       // Show track sign during debug
-#endif
-//          lcdString[dest][LCD_DIR]    = DIR_LOST_T;
-          lcdString[dest][LCD_DIR]    = DIR_RIGHT_T;                                            // Show right traffic character
-          lcdString[dest][LCD_NODE]   = addBlanks(nodeLen - destTxt.length()) + destTxt;        // Show destinatins sign
-        break;
- //----------------------------------------------------------------------------------------------
-     }
     }
+
+    setNodeString(dest, LEFT_TRACK);                                                            // Show the left track first
+    setDirString(dest, LEFT_TRACK);
 //----------------------------------------------------------------------------------------------
 #ifdef DEBUG_ALL
-    switch (dest) {
-      case DEST_A:
-      case DEST_C:
-        Serial.printf("%-16s: %d Destination %s: '%s %s %s'\n", __func__, __LINE__, dest, lcdString[dest][LCD_DEST], lcdString[dest][LCD_DIR], lcdString[dest][LCD_NODE]);
-      break;
-//----------------------------------------------------------------------------------------------
-      default:
-        Serial.printf("%-16s: %d Destination %s: '%s %s %s'\n", __func__, __LINE__, dest, lcdString[dest][LCD_NODE], lcdString[dest][LCD_DIR], lcdString[dest][LCD_DEST]);
-      break;
-//----------------------------------------------------------------------------------------------
-    }
-    Serial.printf("%-16s: %d trackState destination %s  track left  set to %s\n", __func__, __LINE__, destIDTxt[dest], trackStateTxt[trackState[dest][LEFT_TRACK]]]);
-    Serial.printf("%-16s: %d trackState destination %s  track right set to %s\n", __func__, __LINE__, destIDTxt[dest], trackStateTxt[trackState[dest][RIGHT_TRACK]]);
+    Serial.printf("%-16s: %d trackState destination %s  track left  set to %s\n", __func__, __LINE__, destIDTxt[dest], trackStateTxt[ports.at(dest, LEFT_TRACK).state]]);
+    Serial.printf("%-16s: %d trackState destination %s  track right set to %s\n", __func__, __LINE__, destIDTxt[dest], trackStateTxt[ports.at(dest, RIGHT_TRACK).state]);
 #endif
   }
 
+  for (uint8_t dest = 0; dest < DEST_BUTTONS; dest++) {                                         // Defaults are replaced by any snapshot
+    for (uint8_t track = 0; track < MAX_NUM_OF_TRACKS; track++) {
+      ports[dest].sent[track]         = ports.at(dest, track);
+      ports[dest].snapshotTime[track] = 0;
+    }
+
+    ports[dest].snapshotDirty = false;
+  }
+
   destBtnPushed = 0;                                                                            // Set destination button not pushed
 }
 
 
 /* ------------------------------------------------------------------------------------------------------------------------------
  *  (Re)connects to MQTT broker and subscribes to one or more topics
+ *  Called from every loop, each call takes at most one step so keys, timeouts and the web
+ *  config keep running while the broker is down. Failed attempts are retried with exponential
+ *  backoff and jitter. Returns true when connected.
+ *  The name lookup and the connect are separate steps with their own timeouts, so a step blocks
+ *  for at most TIME_MQTT_DNS, or TIME_MQTT_CONNECT plus TIME_MQTT_SOCKET for the CONNACK. The
+ *  broker address is looked up again only after a connect to it has failed.
  * ------------------------------------------------------------------------------------------------------------------------------
  */
 bool mqttConnect() {
 
-#ifdef DEBUG
-  Serial.printf("%-16s: %d \n", __func__, __LINE__);
-  Serial.printf("%-16s: %d Connecting to broker\n", __func__, __LINE__);
-#endif
-
-  char usr[11];                                     // size 10 in the db
-  char pwd[11];                                     // size 10 in the db
   char tmpTopic[60];
   char tmpContent[20];
-  char tmpID[clientID.length()];                    // For converting clientID
-  const char* willMessage;
-  String lost = LOST;
-  willMessage  = lost.c_str();
-  
-  // Set up broker
-  setupBroker();
+  bool connected;
 
-  // check if user and password should be used
-  if (tamBoxMqtt[USER] != NULL && tamBoxMqtt[PASS] != NULL) {
-    tamBoxMqtt[USER].toCharArray(usr, tamBoxMqtt[USER].length() + 1);
-    tamBoxMqtt[PASS].toCharArray(pwd, tamBoxMqtt[PASS].length() + 1);
-  }
+  switch (mqttState) {
+    case MQTT_CONNECTED:
+      if (mqttClient.connected()) {
+        if (halMillis() - mqttConnectedTime > TIME_MQTT_STABLE) {
+          mqttBackoff = TIME_MQTT_BACKOFF_MIN;                                                  // Stable again
+        }
+        return true;
+      }
 
-  // Convert String to char* for last will message
-  clientID.toCharArray(tmpID, clientID.length() + 1);
-  
-  // Loop until we're reconnected
-  while (!mqttClient.connected()) {
-    lcd.home();
-    lcd.print(LCD_STARTING_UP + addBlanks(atoi(cfgLcdChar) - strlen(LCD_STARTING_UP)));
-    lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
-    lcd.print(LCD_STARTING_MQTT + addBlanks(atoi(cfgLcdChar) - strlen(LCD_STARTING_MQTT)));
-    delay(1000);
+      mqttReconnects++;
+      mqttLostTime    = halMillis();
+      mqttRetryLater();                                                                         // Keep the backoff, a flapping broker isn't hammered
 #ifdef DEBUG
-    Serial.printf("%-16s: %d MQTT connecting... ", __func__, __LINE__);
+      Serial.printf("%-16s: %d Connection to broker lost, rc: %d\n", __func__, __LINE__, mqttClient.state());
 #endif
-    strcpy(tmpTopic, DATA); strcat(tmpTopic, "/");
-    strcat(tmpTopic, tamBoxMqtt[SCALE].c_str()); strcat(tmpTopic, "/");
-    strcat(tmpTopic, NODE); strcat(tmpTopic, "/");
-    strcat(tmpTopic, tamBoxConfig[OWN][ID].c_str()); strcat(tmpTopic, "/$state");
-
-    // Attempt to connect
-    // boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
-    if (mqttClient.connect(tmpID, usr, pwd, tmpTopic, 0, true, willMessage)) {
+    break;
+//----------------------------------------------------------------------------------------------
+    case MQTT_IDLE:                                                                             // First connection
+#ifdef DEBUG
+      Serial.printf("%-16s: %d \n", __func__, __LINE__);
+      Serial.printf("%-16s: %d Connecting to broker\n", __func__, __LINE__);
+#endif
+      setupBroker();
+      mqttLostTime    = halMillis();
+      mqttBackoff     = TIME_MQTT_BACKOFF_MIN;
+      mqttState       = MQTT_RESOLVE;
       lcd.home();
-      lcd.print(LCD_STARTING_UP + addBlanks(atoi(cfgLcdChar) - strlen(LCD_STARTING_UP)));
+      lcd.print(LCD_STARTING_UP + addBlanks(lcdChars - strlen(LCD_STARTING_UP)));
       lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
-      lcd.print(LCD_BROKER_CONNECTED + addBlanks(atoi(cfgLcdChar) - strlen(LCD_BROKER_CONNECTED)));
-      delay(1000);
+      lcd.print(LCD_STARTING_MQTT + addBlanks(lcdChars - strlen(LCD_STARTING_MQTT)));
+    break;
+//----------------------------------------------------------------------------------------------
+    case MQTT_WAIT_RETRY:
+      if (halMillis() - mqttStateTime > mqttRetryDelay) {
+        mqttState     = mqttBrokerResolved ? MQTT_CONNECTING : MQTT_RESOLVE;
+      }
+    break;
+//----------------------------------------------------------------------------------------------
+    case MQTT_RESOLVE:                                                                          // Blocks for at most TIME_MQTT_DNS
+      if (halResolve(tamBoxMqtt.server, mqttBrokerIp, TIME_MQTT_DNS)) {
 #ifdef DEBUG
-      Serial.printf("%-16s: %d  ...connected\n", __func__, __LINE__);
-      Serial.printf("%-16s: %d MQTT client id: %s\n", __func__, __LINE__, iotWebConf.getThingName());
+        Serial.printf("%-16s: %d Broker %s is %s\n", __func__, __LINE__, tamBoxMqtt.server, mqttBrokerIp.toString().c_str());
 #endif
+        mqttClient.setServer(mqttBrokerIp, tamBoxMqtt.port);
+        mqttBrokerResolved = true;
+        mqttState     = MQTT_CONNECTING;
+      }
 
-      // Subscribe to all topics
+      else {
 #ifdef DEBUG
-      Serial.printf("%-16s: %d Subscribing to:\n", __func__, __LINE__);
+        Serial.printf("%-16s: %d Broker %s not found\n", __func__, __LINE__, tamBoxMqtt.server);
 #endif
-
-      for (uint8_t dest = 0; dest < DEST_BUTTONS; dest++) {
-        if (trackState[dest][LEFT_TRACK] != _NOTUSED) {                                         // Destination used
-          strcpy(tmpTopic, DATA); strcat(tmpTopic, "/");
-          strcat(tmpTopic, tamBoxMqtt[SCALE].c_str()); strcat(tmpTopic, "/");
-          strcat(tmpTopic, TAM); strcat(tmpTopic, "/");
-          strcat(tmpTopic, tamBoxConfig[dest][ID].c_str()); strcat(tmpTopic, "/#");
+        mqttRetryLater();
+      }
+    break;
+//----------------------------------------------------------------------------------------------
+    case MQTT_CONNECTING:
 #ifdef DEBUG
-          Serial.printf("%-16s: %d - %s\n", __func__, __LINE__, tmpTopic);
+      Serial.printf("%-16s: %d MQTT connecting... ", __func__, __LINE__);
 #endif
-          mqttClient.subscribe(tmpTopic);                                                       // TAM messages for connected destination
+      strcpy(tmpTopic, DATA); strcat(tmpTopic, "/");
+      strcat(tmpTopic, tamBoxMqtt.scale); strcat(tmpTopic, "/");
+      strcat(tmpTopic, NODE); strcat(tmpTopic, "/");
+      strcat(tmpTopic, tamBoxConfig[OWN].id); strcat(tmpTopic, "/$state");
 
-          strcpy(tmpTopic, DATA); strcat(tmpTopic, "/");
-          strcat(tmpTopic, tamBoxMqtt[SCALE].c_str()); strcat(tmpTopic, "/");
-          strcat(tmpTopic, NODE); strcat(tmpTopic, "/");
-          strcat(tmpTopic, tamBoxConfig[dest][ID].c_str()); strcat(tmpTopic, "/#");
-#ifdef DEBUG
-          Serial.printf("%-16s: %d - %s\n", __func__, __LINE__, tmpTopic);
-#endif
-          mqttClient.subscribe(tmpTopic);                                                       // Node messages for connected destination
-        }
+      // Attempt to connect, the HTTP client sets its own timeout on the shared wifiClient
+      wifiClient.setTimeout(TIME_MQTT_CONNECT);
+      // boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
+      connected = mqttClient.connect(clientID.c_str(), tamBoxMqtt.user[0] ? tamBoxMqtt.user : NULL, tamBoxMqtt.pass[0] ? tamBoxMqtt.pass : NULL, tmpTopic, 0, true, LOST);
 
-        if (tamBoxConfig[dest][TYPE] == TYPE_SPLIT_T) {                                         // Double track split to two single tracks
-          if (trackState[dest][RIGHT_TRACK] != _NOTUSED) {                                      // Destination used
-            strcpy(tmpTopic, DATA); strcat(tmpTopic, "/");
-            strcat(tmpTopic, tamBoxMqtt[SCALE].c_str()); strcat(tmpTopic, "/");
-            strcat(tmpTopic, TAM); strcat(tmpTopic, "/");
-            strcat(tmpTopic, tamBoxConfig[dest + 5][ID].c_str()); strcat(tmpTopic, "/#");
+      if (connected) {
 #ifdef DEBUG
-            Serial.printf("%-16s: %d - %s\n", __func__, __LINE__, tmpTopic);
+        Serial.printf("%-16s: %d  ...connected\n", __func__, __LINE__);
+        Serial.printf("%-16s: %d MQTT client id: %s\n", __func__, __LINE__, iotWebConf.getThingName());
+        Serial.printf("%-16s: %d Subscribing to:\n", __func__, __LINE__);
 #endif
-            mqttClient.subscribe(tmpTopic);                                                     // TAM messages for connected destination
+        if (!tamboxReady) {
+          lcd.home();
+          lcd.print(LCD_STARTING_UP + addBlanks(lcdChars - strlen(LCD_STARTING_UP)));
+          lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
+          lcd.print(LCD_BROKER_CONNECTED + addBlanks(lcdChars - strlen(LCD_BROKER_CONNECTED)));
+        }
 
-            strcpy(tmpTopic, DATA); strcat(tmpTopic, "/");
-            strcat(tmpTopic, tamBoxMqtt[SCALE].c_str()); strcat(tmpTopic, "/");
-            strcat(tmpTopic, NODE); strcat(tmpTopic, "/");
-            strcat(tmpTopic, tamBoxConfig[dest + 5][ID].c_str()); strcat(tmpTopic, "/#");
-#ifdef DEBUG
-            Serial.printf("%-16s: %d - %s\n", __func__, __LINE__, tmpTopic);
-#endif
-            mqttClient.subscribe(tmpTopic);                                                     // Node messages for connected destination
+        setTopicIndex();                                                                        // Rebuild the subscription index
+        setPubTopics();                                                                         // Build the outbound topics
+        mqttConnectedTime = halMillis();
+        mqttStep      = 0;
+        mqttState     = MQTT_SUBSCRIBE;
+
+        if (!tamboxReady) {                                                                     // Local state unknown, a reconnect keeps it
+          resyncPending = 0;                                                                    // Retained snapshots arrive while subscribing
+          for (uint8_t slot = 0; slot < CONFIG_DEST; slot++) {
+            uint8_t dest = ports.dest(slot);
+            if (dest >= DEST_BUTTONS || ports.at(dest, LEFT_TRACK).state == _NOTUSED) { continue; }
+            if (ports.isSplitSlot(slot) && (tamBoxConfig[dest].type != TRACK_TYPE_SPLIT || ports.at(dest, RIGHT_TRACK).state == _NOTUSED)) { continue; }
+            resyncPending |= 1UL << slot;
+            resyncPending |= 1UL << (RESYNC_OWN + dest);
           }
+
+          resyncStart   = halMillis();
+          resyncTime    = 0;
+          resyncOpen    = true;
         }
       }
 
-      strcpy(tmpTopic, COMMAND); strcat(tmpTopic, "/");
-      strcat(tmpTopic, tamBoxMqtt[SCALE].c_str()); strcat(tmpTopic, "/");
-      strcat(tmpTopic, TAM); strcat(tmpTopic, "/");
-      strcat(tmpTopic, tamBoxConfig[OWN][ID].c_str()); strcat(tmpTopic, "/#");
+      else {
+        mqttBrokerResolved = false;                                                             // Look it up again, it may have moved
+        mqttRetryLater();
 #ifdef DEBUG
-      Serial.printf("%-16s: %d - %s\n", __func__, __LINE__, tmpTopic);
+        Serial.printf("%-16s: %d  ...connection failed, rc: %d, retrying again in %d ms\n", __func__, __LINE__, mqttClient.state(), mqttRetryDelay);
 #endif
-      mqttClient.subscribe(tmpTopic);                                                           // Command for node
+      }
+    break;
+//----------------------------------------------------------------------------------------------
+    case MQTT_SUBSCRIBE:                                                                        // One subscription per loop
+      if (!mqttClient.connected()) {
+        mqttRetryLater();
+        break;
+      }
 
-      strcpy(tmpTopic, COMMAND); strcat(tmpTopic, "/");
-      strcat(tmpTopic, tamBoxMqtt[SCALE].c_str()); strcat(tmpTopic, "/");
-      strcat(tmpTopic, NODE); strcat(tmpTopic, "/");
-      strcat(tmpTopic, tamBoxConfig[OWN][ID].c_str()); strcat(tmpTopic, "-");
-      strcat(tmpTopic, NODE_SUPERVISOR); strcat(tmpTopic, "/#");
-#ifdef DEBUG
-      Serial.printf("%-16s: %d - %s\n", __func__, __LINE__, tmpTopic);
-#endif
-      mqttClient.subscribe(tmpTopic);                                                           // Command for node supervisor
-    }
+      while (mqttStep < MQTT_SUBSCRIBE_STEPS && !subscribeStep(mqttStep)) { mqttStep++; }
 
-    else {
-      // Show why the connection failed
-      lcd.home();
-      lcd.print(LCD_START_ERROR + addBlanks(atoi(cfgLcdChar) - strlen(LCD_START_ERROR)));
-      lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
-      lcd.print(LCD_BROKER_NOT_FOUND + addBlanks(atoi(cfgLcdChar) - strlen(LCD_BROKER_NOT_FOUND)));
+      if (mqttStep < MQTT_SUBSCRIBE_STEPS) {
+        mqttStep++;
+      }
 
+      else {
+        mqttState     = MQTT_ANNOUNCE;
+      }
+    break;
+//----------------------------------------------------------------------------------------------
+    case MQTT_ANNOUNCE:
 #ifdef DEBUG
-      Serial.printf("%-16s: %d  ...connection failed, rc: %d, retrying again in 5 seconds\n", __func__, __LINE__, mqttClient.state());
+      Serial.printf("%-16s: %d \n", __func__, __LINE__);
+      Serial.printf("%-16s: %d Initial publishing:\n", __func__, __LINE__);
 #endif
-      delay(5000);                                                                              // Wait 5 seconds before retrying
-    }
-
-  // Set node status to "ready"
-  updateLcd(OWN);                                                                               // Show own station id and name
-  delay(4000);                                                                                  // Show it for 4 sec
-  updateLcd(DEST_ALL_DEST);                                                                     // Restore the LCD
-
+      strcpy(tmpTopic, DATA); strcat(tmpTopic, "/");
+      strcat(tmpTopic, tamBoxMqtt.scale); strcat(tmpTopic, "/");
+      strcat(tmpTopic, NODE); strcat(tmpTopic, "/");
+      strcat(tmpTopic, tamBoxConfig[OWN].id); strcat(tmpTopic, "/$state");
+      strcpy(tmpContent, READY);
 #ifdef DEBUG
-  Serial.printf("%-16s: %d \n", __func__, __LINE__);
-  Serial.printf("%-16s: %d Initial publishing:\n", __func__, __LINE__);
+      Serial.printf("%-16s: %d - %s: %s\n", __func__, __LINE__, tmpTopic, tmpContent);
 #endif
-  strcpy(tmpTopic, DATA); strcat(tmpTopic, "/");
-  strcat(tmpTopic, tamBoxMqtt[SCALE].c_str()); strcat(tmpTopic, "/");
-  strcat(tmpTopic, NODE); strcat(tmpTopic, "/");
-  strcat(tmpTopic, tamBoxConfig[OWN][ID].c_str()); strcat(tmpTopic, "/$state");
-  strcpy(tmpContent, READY);
+      mqttPublish(tmpTopic, tmpContent, RETAIN);                                                // Node state
+
+      strcpy(tmpTopic, DATA); strcat(tmpTopic, "/");
+      strcat(tmpTopic, tamBoxMqtt.scale); strcat(tmpTopic, "/");
+      strcat(tmpTopic, NODE); strcat(tmpTopic, "/");
+      strcat(tmpTopic, tamBoxConfig[OWN].id); strcat(tmpTopic, "/$software");
+      strcpy(tmpContent, SW_TYPE);
 #ifdef DEBUG
-  Serial.printf("%-16s: %d - %s: %s\n", __func__, __LINE__, tmpTopic, tmpContent);
+      Serial.printf("%-16s: %d - %s: %s\n", __func__, __LINE__, tmpTopic, tmpContent);
 #endif
-  mqttClient.publish(tmpTopic, tmpContent, RETAIN);                                             // Node state
+      mqttPublish(tmpTopic, tmpContent, NORETAIN);                                              // Node software
 
-  strcpy(tmpTopic, DATA); strcat(tmpTopic, "/");
-  strcat(tmpTopic, tamBoxMqtt[SCALE].c_str()); strcat(tmpTopic, "/");
-  strcat(tmpTopic, NODE); strcat(tmpTopic, "/");
-  strcat(tmpTopic, tamBoxConfig[OWN][ID].c_str()); strcat(tmpTopic, "/$software");
-  strcpy(tmpContent, SW_TYPE);
+      strcpy(tmpTopic, DATA); strcat(tmpTopic, "/");
+      strcat(tmpTopic, tamBoxMqtt.scale); strcat(tmpTopic, "/");
+      strcat(tmpTopic, NODE); strcat(tmpTopic, "/");
+      strcat(tmpTopic, tamBoxConfig[OWN].id); strcat(tmpTopic, "/$softwareversion");
+      strcpy(tmpContent, SW_VERSION);
 #ifdef DEBUG
-  Serial.printf("%-16s: %d - %s: %s\n", __func__, __LINE__, tmpTopic, tmpContent);
+      Serial.printf("%-16s: %d - %s: %s\n", __func__, __LINE__, tmpTopic, tmpContent);
 #endif
-  mqttClient.publish(tmpTopic, tmpContent, NORETAIN);                                           // Node software
+      mqttPublish(tmpTopic, tmpContent, NORETAIN);                                              // Node software version
 
-  strcpy(tmpTopic, DATA); strcat(tmpTopic, "/");
-  strcat(tmpTopic, tamBoxMqtt[SCALE].c_str()); strcat(tmpTopic, "/");
-  strcat(tmpTopic, NODE); strcat(tmpTopic, "/");
-  strcat(tmpTopic, tamBoxConfig[OWN][ID].c_str()); strcat(tmpTopic, "/$softwareversion");
-  strcpy(tmpContent, SW_VERSION);
+      mqttReconnectTime = halMillis() - mqttLostTime;                                           // Time without broker
 #ifdef DEBUG
-  Serial.printf("%-16s: %d - %s: %s\n", __func__, __LINE__, tmpTopic, tmpContent);
+      Serial.printf("%-16s: %d Connected after %d ms, reconnects: %d\n", __func__, __LINE__, mqttReconnectTime, mqttReconnects);
 #endif
-  mqttClient.publish(tmpTopic, tmpContent, NORETAIN);                                           // Node software version
-  }
 
-  tamboxReady = true;                                                                           // Set tambox ready
-  tamBoxIdle  = true;                                                                           // Set tambox idle
+      if (tamboxReady) {                                                                        // Reconnect, keep the local state
+        mqttState     = MQTT_CONNECTED;
+        return true;
+      }
+
+      updateLcd(OWN);                                                                           // Show own station id and name
+      mqttStateTime   = halMillis();
+      mqttState       = MQTT_SHOW_OWN;
+      if (configFromCache) {                                                                    // Clock and config from the server while shown
+        checkConfigFile();
+      }
+    break;
+//----------------------------------------------------------------------------------------------
+    case MQTT_SHOW_OWN:                                                                         // Show it for 4 sec
+      if (halMillis() - mqttStateTime > TIME_SHOW_OWN) {
+        updateLcd(DEST_ALL_DEST);                                                               // Restore the LCD
+        if (!tamboxReady) {
+          coldStartTime = halMillis();
+        }
+
+        tamboxReady   = true;                                                                   // Set tambox ready
+        tamBoxIdle    = true;                                                                   // Set tambox idle
 #ifdef DEBUG
-  Serial.printf("%-16s: %d - tamBoxIdle set to true\n", __func__, __LINE__);
+        Serial.printf("%-16s: %d - tamBoxIdle set to true\n", __func__, __LINE__);
 #endif
-  showTime = millis();
+        setShowTimer();
+        mqttState     = MQTT_CONNECTED;
 #ifdef DEBUG
-  Serial.printf("%-16s: %d -- TamBox Ready! --\n\n", __func__, __LINE__);
+        Serial.printf("%-16s: %d -- TamBox Ready! --\n\n", __func__, __LINE__);
 #endif
-  return true;
+        return true;
+      }
+    break;
+  }
+
+  return false;
 }
 
 
 /* ------------------------------------------------------------------------------------------------------------------------------
- *  Function to handle MQTT messages sent to this node
- *    MQTT structure:
- *    TOPIC_MSGTYPE /TOPIC_SCALE /TOPIC_TYPE /TOPIC_NODE_ID /TOPIC_PORT_ID     payload
- *
- *  ex cmd/h0/tam/tambox-4/a/req    {state: {desired: out}}
- *     cmd/h0/tam/tambox-2/c/req    {loco-id: 233, state: {desired: accept}}
- *     cmd/h0/tam/tambox-3/b/res    {loco-id: 233, state: {desired: accept, reported: accepted}}
- *     cmd/h0/tam/tambox-2/a/res    {loco-id: 233, state: {desired: accept, reported: rejected}}
- *     dt/h0/node/tambox-2/$state   lost
+ *  Wait before the next broker attempt. The backoff doubles for each failure up to
+ *  TIME_MQTT_BACKOFF_MAX, the jitter spreads the retries of all tamboxes when the broker is back.
  * ------------------------------------------------------------------------------------------------------------------------------
  */
-void mqttCallback(char* topic, byte* payload, unsigned int length) {
+void mqttRetryLater() {
 
-  // Don't know why this have to be done :-(
-  payload[length] = '\0';
+  if (!tamboxReady) {                                                                           // Show why the connection failed
+    lcd.home();
+    lcd.print(LCD_START_ERROR + addBlanks(lcdChars - strlen(LCD_START_ERROR)));
+    lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
+    lcd.print(LCD_BROKER_NOT_FOUND + addBlanks(lcdChars - strlen(LCD_BROKER_NOT_FOUND)));
+  }
 
-  // Make strings
-  char* msg   = (char*)payload;
-  String tpc  = String((char*)topic);
+  mqttRetryDelay  = mqttBackoff + random(mqttBackoff / 2);                                      // Jitter spreads the boxes retries
+  mqttBackoff     = min(mqttBackoff * 2, (unsigned long)TIME_MQTT_BACKOFF_MAX);
+  mqttStateTime   = halMillis();
+  mqttState       = MQTT_WAIT_RETRY;
+}
 
-#ifdef DEBUG
-  Serial.printf("%-16s: %d\n", __func__, __LINE__);
-//  Serial.printf("%-16s: %d Recieved message: %s\n", __func__, __LINE__, topic);
-   Serial.printf("%-16s: %d Recieved message: %s - %s\n", __func__, __LINE__, topic, msg);
-#endif
 
-  uint8_t i = 0;
-  uint8_t p = 0;
-  String s;
-  String subTopic[NUM_OF_TOPICS];                                                               // Topic array
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Rebuild the subscription index from the used destinations, keyed on their node id and the port
+ *  facing us, and on the own node and supervisor id
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void setTopicIndex() {
 
-  for (uint8_t t = 0; t < NUM_OF_TOPICS; t++) {                                                 // Split topic string into an array
-    i = tpc.indexOf("/", p);
-    s = tpc.substring(p, i);
-    p = i + 1;
-    subTopic[t] = s;
+  for (uint8_t i = 0; i < TOPIC_INDEX_SIZE; i++) {
+    topicIndex[i].dest = TOPIC_NOT_FOUND;
   }
 
-  if (subTopic[TOPIC_SCALE] == tamBoxMqtt[SCALE]) {                                             // Scale (1)
-    if (subTopic[TOPIC_MSGTYPE] == COMMAND && subTopic[TOPIC_ORDER] == REQUEST) {               // Command (0) Request (5)
-#ifdef DEBUG
-//      Serial.printf("%-16s: %d cmd/../tam/../req\n", __func__, __LINE__);
-#endif
-      jsonReceived(_REQUEST, msg);                                                              // Handle the json body
+  for (uint8_t dest = 0; dest < DEST_BUTTONS; dest++) {
+    if (ports.at(dest, LEFT_TRACK).state != _NOTUSED) {                                         // Destination used
+      addTopicIndex(dest, tamBoxConfig[dest].id, tamBoxConfig[dest].exit);
     }
 
-    else if (subTopic[TOPIC_MSGTYPE] == COMMAND && subTopic[TOPIC_ORDER] == RESPONSE) {         // Command (0) Response (5)
-      if (subTopic[TOPIC_TYPE] == TAM) {                                                        // TAM
-#ifdef DEBUG
-//        Serial.printf("%-16s: %d cmd/../tam/../res\n", __func__, __LINE__);
-#endif
-        jsonReceived(_RESPONSE, msg);                                                           // Handle the json body
-      }
-#ifdef DEBUG
-      else {
-        Serial.printf("%-16s: %d Topic type not implemented, type: %s port id: %s\n", __func__, __LINE__, subTopic[TOPIC_TYPE], subTopic[TOPIC_PORT_ID]);
-      }
-#endif
+    if (tamBoxConfig[dest].type == TRACK_TYPE_SPLIT && ports.at(dest, RIGHT_TRACK).state != _NOTUSED) {
+      uint8_t right = ports.splitSlot(dest);
+      addTopicIndex(right, tamBoxConfig[right].id, tamBoxConfig[right].exit);                   // Right track of a split destination
     }
+  }
 
-    else if (subTopic[TOPIC_MSGTYPE] == COMMAND && subTopic[TOPIC_TYPE] == NODE) {              // Node command
-      if (subTopic[TOPIC_NODE_ID] == tamBoxConfig[OWN][ID] + "-" + NODE_SUPERVISOR) {           // Own supervisor
+  strcpy(supervisorId, tamBoxConfig[OWN].id); strcat(supervisorId, "-");
+  strcat(supervisorId, NODE_SUPERVISOR);
+  addTopicIndex(TOPIC_SUPERVISOR, supervisorId, "");
+  addTopicIndex(OWN, tamBoxConfig[OWN].id, "");
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Build the outbound tam, snapshot and ping topics, the own port to a destination is its letter in lower case
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void setPubTopics() {
+
+  for (uint8_t dest = 0; dest < DEST_BUTTONS; dest++) {
+    char port[2] = {(char)tolower(destIDTxt[dest][0]), '\0'};
+
+    snprintf(pubReqTopic[dest], sizeof(pubReqTopic[dest]), "%s/%s/%s/%s/%s/%s", COMMAND, tamBoxMqtt.scale, TAM, tamBoxConfig[dest].id, tamBoxConfig[dest].exit, REQUEST);
+    snprintf(pubResTopic[dest], sizeof(pubResTopic[dest]), "%s/%s/%s/%s/%s/%s", COMMAND, tamBoxMqtt.scale, TAM, tamBoxConfig[OWN].id, port, RESPONSE);
+    snprintf(pubDataTopic[dest], sizeof(pubDataTopic[dest]), "%s/%s/%s/%s/%s", DATA, tamBoxMqtt.scale, TAM, tamBoxConfig[OWN].id, port);
+    snprintf(pubSnapshotTopic[dest], sizeof(pubSnapshotTopic[dest]), "%s/%s/%s/%s/%s/%s", DATA, tamBoxMqtt.scale, TAM, tamBoxConfig[OWN].id, port, SNAPSHOT);
+  }
+
+  snprintf(pingTopic, sizeof(pingTopic), "%s/%s/%s/%s", DATA, tamBoxMqtt.scale, PING, tamBoxConfig[OWN].id);
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Subscribe to one topic
+ *  Step 0 - 2 * CONFIG_DEST - 1 is the tam and node topic for each slot in tamBoxConfig, then own tam
+ *  commands, own supervisor and own snapshots. Returns false when the step has nothing to subscribe to.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+bool subscribeStep(uint8_t step) {
+
+  char tmpTopic[60];
+  uint8_t slot = step / 2;
+
+  if (slot < CONFIG_DEST) {
+    if (slot == OWN) { return false; }
+    if (slot < DEST_BUTTONS && ports.at(slot, LEFT_TRACK).state == _NOTUSED) { return false; }
+    if (ports.isSplitSlot(slot) && (tamBoxConfig[ports.dest(slot)].type != TRACK_TYPE_SPLIT ||
+                                    ports.at(ports.dest(slot), RIGHT_TRACK).state == _NOTUSED)) { return false; }
+
+    strcpy(tmpTopic, DATA); strcat(tmpTopic, "/");
+    strcat(tmpTopic, tamBoxMqtt.scale); strcat(tmpTopic, "/");
+    strcat(tmpTopic, (step % 2) ? NODE : TAM); strcat(tmpTopic, "/");                         // TAM or node messages
+    strcat(tmpTopic, tamBoxConfig[slot].id); strcat(tmpTopic, "/#");
+  }
+
+  else if (slot == CONFIG_DEST && step % 2 == 0) {                                              // Command for node
+    strcpy(tmpTopic, COMMAND); strcat(tmpTopic, "/");
+    strcat(tmpTopic, tamBoxMqtt.scale); strcat(tmpTopic, "/");
+    strcat(tmpTopic, TAM); strcat(tmpTopic, "/");
+    strcat(tmpTopic, tamBoxConfig[OWN].id); strcat(tmpTopic, "/#");
+  }
+
+  else if (slot == CONFIG_DEST) {                                                               // Command for node supervisor
+    strcpy(tmpTopic, COMMAND); strcat(tmpTopic, "/");
+    strcat(tmpTopic, tamBoxMqtt.scale); strcat(tmpTopic, "/");
+    strcat(tmpTopic, NODE); strcat(tmpTopic, "/");
+    strcat(tmpTopic, supervisorId); strcat(tmpTopic, "/#");
+  }
+
+  else {                                                                                        // Own retained snapshots
+    strcpy(tmpTopic, DATA); strcat(tmpTopic, "/");
+    strcat(tmpTopic, tamBoxMqtt.scale); strcat(tmpTopic, "/");
+    strcat(tmpTopic, TAM); strcat(tmpTopic, "/");
+    strcat(tmpTopic, tamBoxConfig[OWN].id); strcat(tmpTopic, "/+/");
+    strcat(tmpTopic, SNAPSHOT);
+  }
+
+#ifdef DEBUG
+  Serial.printf("%-16s: %d - %s\n", __func__, __LINE__, tmpTopic);
+#endif
+  mqttSubscribe(tmpTopic);
+  return true;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Function to handle MQTT messages sent to this node
+ *    MQTT structure:
+ *    TOPIC_MSGTYPE /TOPIC_SCALE /TOPIC_TYPE /TOPIC_NODE_ID /TOPIC_PORT_ID     payload
+ *
+ *  ex cmd/h0/tam/tambox-4/a/req    {state: {desired: out}}
+ *     cmd/h0/tam/tambox-2/c/req    {loco-id: 233, state: {desired: accept}}
+ *     cmd/h0/tam/tambox-3/b/res    {loco-id: 233, state: {desired: accept, reported: accepted}}
+ *     cmd/h0/tam/tambox-2/a/res    {loco-id: 233, state: {desired: accept, reported: rejected}}
+ *     dt/h0/node/tambox-2/$state   lost
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void mqttCallback(char* topic, byte* payload, unsigned int length) {
+
+  // Don't know why this have to be done :-(
+  payload[length] = '\0';
+
+  char* msg   = (char*)payload;
+  mqttReceived++;
+#ifdef RECORDER
+  recordEvent(RECORD_IN, topic, msg, length);
+#endif
+  metricBegin(METRIC_MQTT_LCD);                                                                 // Ended by lcdFlush
+
+#ifdef DEBUG
+  Serial.printf("%-16s: %d\n", __func__, __LINE__);
+//  Serial.printf("%-16s: %d Recieved message: %s\n", __func__, __LINE__, topic);
+   Serial.printf("%-16s: %d Recieved message: %s - %s\n", __func__, __LINE__, topic, msg);
+#endif
+
+  TamTopic t;
+  decodeTopic(topic, t);
+
+  if (t.scale) {                                                                                // Scale (1)
+    if (t.msgType == MSG_COMMAND && t.order == ORDER_REQUEST) {                                 // Command (0) Request (5)
+#ifdef DEBUG
+//      Serial.printf("%-16s: %d cmd/../tam/../req\n", __func__, __LINE__);
+#endif
+      jsonReceived(_REQUEST, t.port, msg);                                                      // Handle the json body
+    }
+
+    else if (t.msgType == MSG_COMMAND && t.order == ORDER_RESPONSE) {                           // Command (0) Response (5)
+      if (t.bodyType == BODY_TAM) {                                                             // TAM
+#ifdef DEBUG
+//        Serial.printf("%-16s: %d cmd/../tam/../res\n", __func__, __LINE__);
+#endif
+        jsonReceived(_RESPONSE, t.port, msg);                                                   // Handle the json body
+      }
+#ifdef DEBUG
+      else {
+        Serial.printf("%-16s: %d Topic type not implemented, type: %.*s port id: %.*s\n", __func__, __LINE__, t.levelLen[TOPIC_TYPE], t.level[TOPIC_TYPE], t.levelLen[TOPIC_PORT_ID], t.level[TOPIC_PORT_ID]);
+      }
+#endif
+    }
+
+    else if (t.msgType == MSG_COMMAND && t.bodyType == BODY_NODE) {                             // Node command
+      if (t.dest == TOPIC_SUPERVISOR) {                                                         // Own supervisor
 #ifdef DEBUG
 //        Serial.printf("%-16s: %d cmd/../node/../req\n", __func__, __LINE__);
 #endif
-        jsonReceived(_REQUEST, msg);                                                            // Handle the json body
+        jsonReceived(_REQUEST, t.port, msg);                                                    // Handle the json body
       }
-	  
     }
 
-    else if (subTopic[TOPIC_MSGTYPE] == DATA && subTopic[TOPIC_TYPE] == TAM) {                  // Data message received
+    else if (t.msgType == MSG_DATA && t.bodyType == BODY_TAM && t.order == ORDER_SNAPSHOT) {    // Retained snapshot
+      if (t.port < DEST_BUTTONS && t.dest != TOPIC_NOT_FOUND) {
+        snapshotReceived(t.dest, t.port, msg);
+      }
+    }
+
+    else if (t.msgType == MSG_DATA && t.bodyType == BODY_TAM) {                                 // Data message received
 #ifdef DEBUG
 //      Serial.printf("%-16s: %d dt/../tam/..\n", __func__, __LINE__);
 #endif
-      jsonReceived(_DATA, msg);                                                                 // Handle the message
+      jsonReceived(_DATA, t.port, msg);                                                         // Handle the message
     }
 
-    else if (subTopic[TOPIC_MSGTYPE] == DATA && subTopic[TOPIC_TYPE] == NODE) {                 // Node data message
+    else if (t.msgType == MSG_DATA && t.bodyType == BODY_NODE) {                                // Node data message
 #ifdef DEBUG
 //      Serial.printf("%-16s: %d dt/../node/..\n", __func__, __LINE__);
 #endif
-      for (uint8_t dest = 0; dest < CONFIG_DEST; dest++) {
-        if (subTopic[TOPIC_NODE_ID] == tamBoxConfig[dest][ID]) {                                // Subscribed client
-          if (subTopic[TOPIC_PORT_ID].substring(0, 6) == "$state") {                            // State messages
-            handleInfo(dest, (String(msg) == READY) ? CODE_READY : CODE_LOST);                  // Handle state message
-            break;
-          }
-        }
+      if (t.port == TOPIC_PORT_STATE) {                                                         // State message from subscribed client
+        nodeStateReceived(t.level[TOPIC_NODE_ID], t.levelLen[TOPIC_NODE_ID], (strcmp(msg, READY) == 0) ? CODE_READY : CODE_LOST);
       }
     }
 #ifdef DEBUG
     else {
-      Serial.printf("%-16s: %d Message type not implemented, message: %s type: %s\n", __func__, __LINE__, subTopic[TOPIC_MSGTYPE], subTopic[TOPIC_TYPE]);
+      Serial.printf("%-16s: %d Message type not implemented, message: %.*s type: %.*s\n", __func__, __LINE__, t.levelLen[TOPIC_MSGTYPE], t.level[TOPIC_MSGTYPE], t.levelLen[TOPIC_TYPE], t.level[TOPIC_TYPE]);
     }
 #endif
   }
 
 #ifdef DEBUG
   else {
-    Serial.printf("%-16s: %d Scale not implemented, scale: %s\n", __func__, __LINE__, subTopic[TOPIC_SCALE]);
+    Serial.printf("%-16s: %d Scale not implemented, scale: %.*s\n", __func__, __LINE__, t.levelLen[TOPIC_SCALE], t.level[TOPIC_SCALE]);
   }
 #endif
+
+  metricCancel(METRIC_MQTT_LCD);                                                                // Message didn't change the LCD
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Split a received topic in place, no copies, and look up its node and port in the subscription index
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void decodeTopic(const char* topic, TamTopic& t) {
+
+  const char* c = topic;
+
+  for (uint8_t l = 0; l < NUM_OF_TOPICS; l++) {
+    t.level[l]    = c;
+    while (*c != '\0' && *c != '/') { c++; }
+    t.levelLen[l] = c - t.level[l];
+    if (*c == '/') { c++; }
+  }
+
+  t.msgType   = MSG_UNKNOWN;
+  t.bodyType  = BODY_UNKNOWN;
+  t.order     = ORDER_NONE;
+  t.port      = TOPIC_NOT_FOUND;
+  t.scale     = topicLevelIs(t.level[TOPIC_SCALE], t.levelLen[TOPIC_SCALE], tamBoxMqtt.scale);
+  t.dest      = findTopicDest(t.level[TOPIC_NODE_ID], t.levelLen[TOPIC_NODE_ID], t.level[TOPIC_PORT_ID], t.levelLen[TOPIC_PORT_ID]);
+
+  if (topicLevelIs(t.level[TOPIC_MSGTYPE], t.levelLen[TOPIC_MSGTYPE], COMMAND))     { t.msgType = MSG_COMMAND; }
+  else if (topicLevelIs(t.level[TOPIC_MSGTYPE], t.levelLen[TOPIC_MSGTYPE], DATA))   { t.msgType = MSG_DATA; }
+
+  if (topicLevelIs(t.level[TOPIC_TYPE], t.levelLen[TOPIC_TYPE], TAM))               { t.bodyType = BODY_TAM; }
+  else if (topicLevelIs(t.level[TOPIC_TYPE], t.levelLen[TOPIC_TYPE], NODE))         { t.bodyType = BODY_NODE; }
+  else if (topicLevelIs(t.level[TOPIC_TYPE], t.levelLen[TOPIC_TYPE], TOWER))        { t.bodyType = BODY_TOWER; }
+  else if (topicLevelIs(t.level[TOPIC_TYPE], t.levelLen[TOPIC_TYPE], PING))         { t.bodyType = BODY_PING; }
+
+  if (topicLevelIs(t.level[TOPIC_ORDER], t.levelLen[TOPIC_ORDER], REQUEST))         { t.order = ORDER_REQUEST; }
+  else if (topicLevelIs(t.level[TOPIC_ORDER], t.levelLen[TOPIC_ORDER], RESPONSE))   { t.order = ORDER_RESPONSE; }
+  else if (topicLevelIs(t.level[TOPIC_ORDER], t.levelLen[TOPIC_ORDER], SNAPSHOT))   { t.order = ORDER_SNAPSHOT; }
+
+  if (t.levelLen[TOPIC_PORT_ID] >= 6 && strncmp(t.level[TOPIC_PORT_ID], "$state", 6) == 0) {    // State messages
+    t.port = TOPIC_PORT_STATE;
+  }
+
+  else if (t.levelLen[TOPIC_PORT_ID] == 1 && t.level[TOPIC_PORT_ID][0] >= 'a' && t.level[TOPIC_PORT_ID][0] < 'a' + DEST_BUTTONS) {
+    t.port = t.level[TOPIC_PORT_ID][0] - 'a';                                                   // Port a-d
+  }
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Subscription index
+ *  Node ids are hashed once when subscribing, so an incoming topic is mapped to its destination
+ *  without building any String. A destination is keyed on its node id and the port facing us, so a
+ *  neighbours messages from its other ports, or two destinations on the same node, are kept apart.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+uint32_t hashTopicKey(uint32_t hash, const char* text, uint8_t len) {
+
+  for (uint8_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)text[i];
+    hash *= FNV_PRIME;
+  }
+
+  return hash;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  The index is open addressed on the hash with linear probing. It is never more than half full, see
+ *  TOPIC_INDEX_SIZE, so a lookup is one or two compares whatever the number of destinations.
+ *  port is "" for the own node and supervisor.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void addTopicIndex(uint8_t dest, const char* id, const char* port) {
+
+  uint32_t hash = hashTopicKey(FNV_OFFSET_BASIS, id, strlen(id));
+  if (port[0] != '\0') {                                                                        // Destination, node id "/" port id
+    hash = hashTopicKey(hashTopicKey(hash, "/", 1), port, strlen(port));
+  }
+
+  uint8_t i     = hash & (TOPIC_INDEX_SIZE - 1);
+
+  while (topicIndex[i].dest != TOPIC_NOT_FOUND) {                                               // Next free entry
+    i = (i + 1) & (TOPIC_INDEX_SIZE - 1);
+  }
+
+  topicIndex[i].hash  = hash;
+  topicIndex[i].dest  = dest;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Slot of the destination with node id and port, else OWN or TOPIC_SUPERVISOR for the node id
+ *  alone, else TOPIC_NOT_FOUND
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+uint8_t findTopicDest(const char* id, uint8_t len, const char* port, uint8_t portLen) {
+
+  uint32_t nodeHash = hashTopicKey(FNV_OFFSET_BASIS, id, len);
+  uint32_t portHash = hashTopicKey(hashTopicKey(nodeHash, "/", 1), port, portLen);
+  uint8_t i;
+
+  for (i = portHash & (TOPIC_INDEX_SIZE - 1); portLen > 0 && topicIndex[i].dest != TOPIC_NOT_FOUND; i = (i + 1) & (TOPIC_INDEX_SIZE - 1)) {
+    uint8_t slot = topicIndex[i].dest;
+    if (topicIndex[i].hash == portHash && slot < CONFIG_DEST && slot != OWN &&
+        topicLevelIs(id, len, tamBoxConfig[slot].id) && topicLevelIs(port, portLen, tamBoxConfig[slot].exit)) {
+      return slot;                                                                              // Destination, port facing us
+    }
+  }
+
+  for (i = nodeHash & (TOPIC_INDEX_SIZE - 1); topicIndex[i].dest != TOPIC_NOT_FOUND; i = (i + 1) & (TOPIC_INDEX_SIZE - 1)) {
+    uint8_t slot = topicIndex[i].dest;
+    if (topicIndex[i].hash == nodeHash && (slot == OWN || slot == TOPIC_SUPERVISOR) &&
+        topicLevelIs(id, len, (slot == OWN) ? tamBoxConfig[OWN].id : supervisorId)) {
+      return slot;                                                                              // Own node or supervisor, any port
+    }
+  }
+
+  return TOPIC_NOT_FOUND;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  A node state message applies to every destination on the node, whatever port faces us
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void nodeStateReceived(const char* id, uint8_t len, uint8_t orderCode) {
+
+  uint8_t handled = 0;                                                                          // Bit per destination
+
+  for (uint8_t i = 0; i < TOPIC_INDEX_SIZE; i++) {
+    uint8_t slot = topicIndex[i].dest;
+    uint8_t dest = ports.dest(slot);
+
+    if (dest < DEST_BUTTONS && !(handled & (1 << dest)) && topicLevelIs(id, len, tamBoxConfig[slot].id)) {
+      handled |= 1 << dest;
+      handleInfo(dest, orderCode);
+    }
+  }
+}
+
+
+bool topicLevelIs(const char* level, uint8_t len, const char* txt) {
+
+  return strncmp(level, txt, len) == 0 && txt[len] == '\0';
 }
 
 
 /* ------------------------------------------------------------------------------------------------------------------------------
  *  Function to download config file
+ *
+ *  The ETag of the last received config is sent as If-None-Match, the server may then answer
+ *  304 Not Modified without a body. The clock is set from the Date header of any answer, so also
+ *  after a start from the config cache.
+ *
+ *  The config is parsed into received, tamBoxMqtt and tamBoxConfig are only replaced by a complete
+ *  config that differs from them.
+ *
+ *  Returns CONFIG_RECEIVED, CONFIG_NOT_MODIFIED, also for the same config with a new ETag, or CONFIG_FAILED
  * ------------------------------------------------------------------------------------------------------------------------------
  */
-bool getConfigFile() {
+uint8_t getConfigFile(uint16_t timeout) {
+
+  const char* headerKeys[] = {HTTP_ETAG, HTTP_DATE};
 
   http.useHTTP10(true);
+  http.setTimeout(timeout);
   http.begin(wifiClient, configPath);
-  http.GET();
+  http.collectHeaders(headerKeys, 2);
+  if (configEtag[0]) {
+    http.addHeader(HTTP_IF_NONE_MATCH, configEtag);
+  }
+
+  int code = http.GET();
+  uint32_t date = httpDate(http.header(HTTP_DATE).c_str());
+
+  if (date > 0) {                                                                               // Server time
+    epochTime = date - halMillis() / 1000;
+#ifdef DEBUG
+    Serial.printf("%-16s: %d Epoch: %d from the server\n", __func__, __LINE__, epochTime);
+#endif
+  }
+
+  if (code != HTTP_CODE_OK) {
+#ifdef DEBUG
+    Serial.printf("%-16s: %d Config server answered: %d\n", __func__, __LINE__, code);
+#endif
+    http.end();
+    return (code == HTTP_CODE_NOT_MODIFIED) ? CONFIG_NOT_MODIFIED : CONFIG_FAILED;
+  }
   /*
     Typical response is:
 {
@@ -2752,369 +3163,579 @@ bool getConfigFile() {
   }
 }
  */
-  // Allocate the JSON document
-  // Use arduinojson.org/v6/assistant to compute the capacity.
-//  const size_t capacity = JSON_OBJECT_SIZE(3) + JSON_ARRAY_SIZE(2) + 60;
-  DynamicJsonDocument doc(1024);                                                                // Create a json object
+  JsonDocument doc;                                                                             // Create a json object, grows as needed
 
   // Parse JSON object
   DeserializationError error = deserializeJson(doc, http.getStream());
+  String etag = http.header(HTTP_ETAG);
+  http.end();
 
   if (error) {
 #ifdef DEBUG
     Serial.printf("%-16s: %d deserializeJson() failed: %s\n", __func__, __LINE__, error.c_str());
 #endif
-    return false;
+    return CONFIG_FAILED;
   }
 
   else {
     if (String(doc[ID_T]) == clientID) {
-      for (uint8_t i = 0; i < DEST_BUTTONS; i++) {
-        tamBoxConfig[i][ID]             = NOT_USED_T;
-        tamBoxConfig[i][TOTTRACKS]      = "0";
+#ifdef DEBUG
+      Serial.printf("%-16s: %d Free heap: %d, largest free block: %d\n", __func__, __LINE__, ESP.getFreeHeap(), ESP.getMaxFreeBlockSize());
+#endif
+      memset(&received, 0, sizeof(received));                                                   // Padding too, see configHash
+      for (uint8_t i = 0; i < CONFIG_DEST; i++) {
+        strcpy(received.config[i].id, NOT_USED_T);
       }
 
       JsonObject mqtt = doc[MQTT_T];
-      tamBoxMqtt[SERVER]                = String(mqtt[SERVER_T]);                               // 25 characters in db
-      tamBoxMqtt[PORT]                  = String(mqtt[PORT_T]);                                 // 5 characters in db
-      tamBoxMqtt[USER]                  = String(mqtt[USER_T]);                                 // 10 characters in db
-      tamBoxMqtt[PASS]                  = String(mqtt[PASS_T]);                                 // 10 characters in db
-      tamBoxMqtt[SCALE]                 = String(mqtt[SCALE_T]);                                // 10 characters in db
-      epochTime                         = mqtt[EPOCH_T];
+      strlcpy(received.mqtt.server, mqtt[SERVER_T] | "", sizeof(received.mqtt.server));         // 25 characters in db
+      received.mqtt.port                = mqtt[PORT_T] | MQTT_DEFAULT_PORT;                     // 5 characters in db
+      strlcpy(received.mqtt.user, mqtt[USER_T] | "", sizeof(received.mqtt.user));               // 10 characters in db
+      strlcpy(received.mqtt.pass, mqtt[PASS_T] | "", sizeof(received.mqtt.pass));               // 10 characters in db
+      strlcpy(received.mqtt.scale, mqtt[SCALE_T] | "", sizeof(received.mqtt.scale));            // 10 characters in db
 
       JsonObject config = doc[CONFIG_T];
-      tamBoxConfig[OWN][ID]             = String(doc[ID_T]);                                    // 20 characters in db
-      tamBoxConfig[OWN][SIGN]           = String(config[SIGN_T]);                               // 4 characters in db
-      tamBoxConfig[OWN][NAME]           = String(config[NAME_T]);                               // 30 characters in db
-      tamBoxConfig[OWN][NUMOFDEST]      = String(config[DESTS_T]);                              // tinyint in db (0-255)
+      tamBoxConfiguration* own          = &received.config[OWN];
+      strlcpy(own->id, doc[ID_T] | "", sizeof(own->id));                                        // 20 characters in db
+      strlcpy(own->sign, config[SIGN_T] | "", sizeof(own->sign));                               // 4 characters in db
+      strlcpy(own->name, config[NAME_T] | "", sizeof(own->name));                               // 30 characters in db
+      own->numOfDest                    = config[DESTS_T] | 0;                                  // tinyint in db (0-255)
 
-      uint8_t i = 0;
       for (JsonPair dest : config[DEST_T].as<JsonObject>()) {                                   // Destinations
-        if (i + 1 > DEST_BUTTONS) { break; }
-        if (dest.key() == "B") { i=1; }
-        else if (dest.key() == "C") { i=2; }
-        else if (dest.key() == "D") { i=3; }
+        const char* key = dest.key().c_str();
+        if (key[0] < 'A' || key[0] >= 'A' + DEST_BUTTONS || key[1] != '\0') { continue; }       // A-D, A-F with six exits
+        uint8_t i = key[0] - 'A';
 
         if (dest.value()[TRACK_T] > 0) {
-          tamBoxConfig[i][TOTTRACKS]    = String(dest.value()[TRACK_T]);                        // tinyint in db (0-255)
-          tamBoxConfig[i][TYPE]         = String(dest.value()[TYPE_T]);                         // 6 characters in db
-#ifdef DEBUG
-          Serial.printf("%-16s: %d Dest: %s, Type: %s\n", __func__, __LINE__, destIDTxt[i], tamBoxConfig[i][TYPE].c_str());
-#endif
-          if (tamBoxConfig[i][TYPE] == TYPE_SPLIT_T) {                                          // Type split
-            JsonObject destLeft = dest.value()[TYPE_LEFT_T];                                    // Left track
-            tamBoxConfig[i][ID]         = String(destLeft[ID_T]);                               // 20 characters in db
-            tamBoxConfig[i][SIGN]       = String(destLeft[SIGN_T]);                             // 4 characters in db
-            tamBoxConfig[i][TRACKS]     = String(destLeft[TRACK_T]);                            // tinyint in db (0-255)
-            tamBoxConfig[i][EXIT]       = String(destLeft[EXIT_T]);                             // 1 characters in db
-            tamBoxConfig[i][EXIT].toLowerCase();
-
-            JsonObject destRight = dest.value()[TYPE_RIGHT_T];                                  // Right track
-            tamBoxConfig[i + 5][ID]     = String(destRight[ID_T]);                              // 20 characters in db
-            tamBoxConfig[i + 5][SIGN]   = String(destRight[SIGN_T]);                            // 4 characters in db
-            tamBoxConfig[i + 5][TRACKS] = String(destRight[TRACK_T]);                           // tinyint in db (0-255)
-            tamBoxConfig[i + 5][EXIT]   = String(destRight[EXIT_T]);                            // 1 characters in db
-            tamBoxConfig[i + 5][EXIT].toLowerCase();
+          const char* type              = dest.value()[TYPE_T] | TYPE_NONE_T;                   // 6 characters in db
+          received.config[i].totTracks  = dest.value()[TRACK_T];                                // tinyint in db (0-255)
+          received.config[i].type       = trackType(type);
+#ifdef DEBUG
+          Serial.printf("%-16s: %d Dest: %s, Type: %s\n", __func__, __LINE__, destIDTxt[i], type);
+#endif
+          if (received.config[i].type == TRACK_TYPE_SPLIT) {                                    // Type split
+            setConfigDest(received.config[i], dest.value()[TYPE_LEFT_T]);                       // Left track
+            setConfigDest(received.config[ports.splitSlot(i)], dest.value()[TYPE_RIGHT_T]);     // Right track
+            received.config[ports.splitSlot(i)].type = TRACK_TYPE_SPLIT;
           }
 
           else {                                                                                // Type single or double
-            JsonObject destType = dest.value()[tamBoxConfig[i][TYPE]];
-            tamBoxConfig[i][ID]         = String(destType[ID_T]);                               // 20 characters in db
-            tamBoxConfig[i][SIGN]       = String(destType[SIGN_T]);                             // 4 characters in db
-            tamBoxConfig[i][TRACKS]     = String(destType[TRACK_T]);                            // tinyint in db (0-255)
-            tamBoxConfig[i][EXIT]       = String(destType[EXIT_T]);                             // 1 characters in db
-            tamBoxConfig[i][EXIT].toLowerCase();
+            setConfigDest(received.config[i], dest.value()[type]);
           }
         }
       }
 
+      if (date == 0) {                                                                          // No Date header, the config has the time
+        epochTime                       = (unsigned int)(mqtt[EPOCH_T] | 0) - halMillis() / 1000;
 #ifdef DEBUG
-      Serial.printf("%-16s: %d Epoch: %d, Millis: %d\n", __func__, __LINE__, epochTime, millis());
+        Serial.printf("%-16s: %d Epoch: %d from the config\n", __func__, __LINE__, epochTime);
 #endif
-      unsigned int sec = millis()/1000;
-      epochTime -= sec;
+      }
+
+      strlcpy(configEtag, etag.c_str(), sizeof(configEtag));
+      if (memcmp(&received.mqtt, &tamBoxMqtt, sizeof(tamBoxMqtt)) == 0 &&
+          memcmp(received.config, tamBoxConfig, sizeof(tamBoxConfig)) == 0) {
+        return CONFIG_NOT_MODIFIED;                                                             // Same config, maybe a new ETag
+      }
+
 #ifdef DEBUG
-      Serial.printf("%-16s: %d Epoch: %d, reduced with %d seconds\n", __func__, __LINE__, epochTime, sec);
+      Serial.printf("%-16s: %d Config size: %d bytes\n", __func__, __LINE__, sizeof(tamBoxConfig) + sizeof(tamBoxMqtt));
 #endif
-      return true;
+      memcpy(&tamBoxMqtt, &received.mqtt, sizeof(tamBoxMqtt));
+      memcpy(tamBoxConfig, received.config, sizeof(tamBoxConfig));
+      return CONFIG_RECEIVED;
     }
 
-    return false;
+    return CONFIG_FAILED;
   }
 }
 
 
 /* ------------------------------------------------------------------------------------------------------------------------------
- *  Prepare MQTT broker and define function to handle callbacks
+ *  Check the config server after a start from the config cache
+ *
+ *  The first check is done while the own station is shown at start up, before the tambox is ready,
+ *  so the clock is set from the server before any message is stamped. A retry while running waits
+ *  at most TIME_CONFIG_RETRY_HTTP for the server.
+ *
+ *  A changed config is saved and the tambox restarts with it, the subscriptions and the LCD depend on it.
  * ------------------------------------------------------------------------------------------------------------------------------
  */
-void setupBroker() {
+void checkConfigFile() {
 
+  switch (getConfigFile(tamboxReady ? TIME_CONFIG_RETRY_HTTP : TIME_CONFIG_HTTP)) {
+    case CONFIG_RECEIVED:                                                                       // New config
 #ifdef DEBUG
-  Serial.printf("%-16s: %d \n", __func__, __LINE__);
-  Serial.printf("%-16s: %d Broker setup\n", __func__, __LINE__);
+      Serial.printf("%-16s: %d Config changed, restarting\n", __func__, __LINE__);
 #endif
-  tmpMqttServer = tamBoxMqtt[SERVER].c_str();
+      saveConfigCache();
+      needReset = true;
+    break;
+//----------------------------------------------------------------------------------------------
+    case CONFIG_NOT_MODIFIED:
 #ifdef DEBUG
-  Serial.printf("%-16s: %d Broker used: %s:%d\n", __func__, __LINE__, tmpMqttServer, tamBoxMqtt[PORT].toInt());
+      Serial.printf("%-16s: %d Config not modified\n", __func__, __LINE__);
 #endif
-
-  mqttClient.setServer(tmpMqttServer, tamBoxMqtt[PORT].toInt());
-  mqttClient.setCallback(mqttCallback);                                                         // Set function for received MQTT messages
-  if (mqttClient.getBufferSize() < 512) {
-    mqttClient.setBufferSize(512);                                                              // increase buffer to 512 byte because of JSON
+      if (strcmp(configEtag, configCache.etag) != 0) {                                          // Same config, new ETag
+        saveConfigCache();
+      }
+    break;
+//----------------------------------------------------------------------------------------------
+    case CONFIG_FAILED:                                                                         // Keep running on the cached config
+      setTimer(TIMER_CONFIG, OWN, LEFT_TRACK, TIME_CONFIG_RETRY);
+    break;
   }
-#ifdef DEBUG
-  Serial.printf("%-16s: %d Message buffer size set to: %d\n", __func__, __LINE__, mqttClient.getBufferSize());
-  Serial.printf("%-16s: %d Broker setup done!\n", __func__, __LINE__);
-#endif
 }
 
 
 /* ------------------------------------------------------------------------------------------------------------------------------
- *  Function to show client web start page
+ *  Read the config saved by saveConfigCache
+ *
+ *  Returns false if there is no cache, it is from another version or for another client id.
  * ------------------------------------------------------------------------------------------------------------------------------
  */
-void handleRoot() {
+bool loadConfigCache() {
 
-  // -- Let IotWebConf test and handle captive portal requests.
-  if (iotWebConf.handleCaptivePortal()) {
+  File file = LittleFS.open(CONFIG_CACHE_FILE, "r");
 
-    // -- Captive portal request were already served.
-    return;
+  if (!file) {
+    return false;
   }
 
-  char s[512];
+  bool valid = file.read((uint8_t*)&configCache, sizeof(configCache)) == sizeof(configCache) &&
+               configCache.magic == CONFIG_CACHE_MAGIC &&
+               configCache.version == CONFIG_CACHE_VER &&
+               configCache.size == sizeof(tamBoxMqtt) + sizeof(tamBoxConfig) &&
+               file.read((uint8_t*)&tamBoxMqtt, sizeof(tamBoxMqtt)) == sizeof(tamBoxMqtt) &&
+               file.read((uint8_t*)tamBoxConfig, sizeof(tamBoxConfig)) == sizeof(tamBoxConfig);
+  file.close();
 
-  // Assemble web page content
-  strcpy(s, "<!DOCTYPE html>\n<html lang=\"en\">\n<head><meta name=\"viewport\" content=\"width=device-width, initial-scale=1, user-scalable=no\"/>\n<title>Configuration</title></head>\n<body>\n<ul><li>mqttTamBox client: ");
-  strcat(s, iotWebConf.getThingName());
-  strcat(s, " running firmware: ");
-  strcat(s, SW_VERSION);
-  strcat(s, "</li></ul>\nGo to <a href='config'>configuration page</a> to change values.\n</body></html>\n");
+  if (!valid || configHash() != configCache.hash || strcmp(tamBoxConfig[OWN].id, clientID.c_str()) != 0) {
+#ifdef DEBUG
+    Serial.printf("%-16s: %d Config cache not valid\n", __func__, __LINE__);
+#endif
+    memset(&configCache, 0, sizeof(configCache));
+    memset(&tamBoxMqtt, 0, sizeof(tamBoxMqtt));
+    memset(tamBoxConfig, 0, sizeof(tamBoxConfig));
+    return false;
+  }
 
-  // Show web start page
-  server.send(200, "text/html", s);
+  strlcpy(configEtag, configCache.etag, sizeof(configEtag));
+  epochTime = configCache.epoch - halMillis() / 1000;                                           // Time when saved, until the server answers
+#ifdef DEBUG
+  Serial.printf("%-16s: %d Config cache loaded, ETag: %s\n", __func__, __LINE__, configEtag);
+#endif
+  return true;
 }
 
+
 /* ------------------------------------------------------------------------------------------------------------------------------
- *  Function beeing called when wifi connection is up and running
+ *  Save the received config in flash, written to CONFIG_CACHE_TMP and then renamed so a power loss
+ *  can't leave half a cache
  * ------------------------------------------------------------------------------------------------------------------------------
  */
-void wifiConnected() {
+bool saveConfigCache() {
 
-  long rssi     = WiFi.RSSI();                                                                  //  -30 dBm   Excelent wifi connection
-                                                                                                //  -67 dBm   Good wifi connection
-                                                                                                //  -70 dBm   Fair wifi connection
-                                                                                                //  -80 dBm   Week wifi connection
-                                                                                                //  -90 dBm   Not working wifi connection
-  lcd.home();
-  lcd.print(LCD_STARTING_UP + addBlanks(atoi(cfgLcdChar) - strlen(LCD_STARTING_UP)));
-  lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
-  lcd.print(SW_VERSION + addBlanks(atoi(cfgLcdChar) - strlen(SW_VERSION)));
-  delay(1000);
+  configCache.magic   = CONFIG_CACHE_MAGIC;
+  configCache.version = CONFIG_CACHE_VER;
+  configCache.size    = sizeof(tamBoxMqtt) + sizeof(tamBoxConfig);
+  configCache.hash    = configHash();
+  configCache.epoch   = epochTime + halMillis() / 1000;
+  strlcpy(configCache.etag, configEtag, sizeof(configCache.etag));
 
-  lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
-  lcd.print(LCD_WIFI_CONNECTED + addBlanks(atoi(cfgLcdChar) - strlen(LCD_WIFI_CONNECTED)));
-  delay(1000);
-#ifdef DEBUG
-  Serial.printf("%-16s: %d Signal strength (RSSI): %d dBm\n", __func__, __LINE__, rssi);
-#endif
-  lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
-  lcd.print(addBlanks(atoi(cfgLcdChar)));
-  lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
-  lcd.print(LCD_SIGNAL + String(rssi) + "dBm");
-  delay(1000);
+  File file = LittleFS.open(CONFIG_CACHE_TMP, "w");
 
-  String pathID = configHost + clientID;
-  configPath    = pathID.c_str();
-//  strcpy(configPath, configHost.c_str());
-//  strcat(configPath, clientID.c_str());
-#ifdef DEBUG
-  Serial.printf("%-16s: %d configPath = %s\n", __func__, __LINE__, configPath);
-#endif
-  lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
-  lcd.print(LCD_LOADING_CONF + addBlanks(atoi(cfgLcdChar) - strlen(LCD_LOADING_CONF)));
-  delay(1000);
+  if (!file) {
+    return false;
+  }
 
-  if (getConfigFile()) {
+  bool written = file.write((const uint8_t*)&configCache, sizeof(configCache)) == sizeof(configCache) &&
+                 file.write((const uint8_t*)&tamBoxMqtt, sizeof(tamBoxMqtt)) == sizeof(tamBoxMqtt) &&
+                 file.write((const uint8_t*)tamBoxConfig, sizeof(tamBoxConfig)) == sizeof(tamBoxConfig);
+  file.close();
+
+  if (written) {
+    LittleFS.remove(CONFIG_CACHE_FILE);
+    written = LittleFS.rename(CONFIG_CACHE_TMP, CONFIG_CACHE_FILE);
+  }
 #ifdef DEBUG
-    Serial.printf("%-16s: %d Config loaded!\n\n", __func__, __LINE__);
+  Serial.printf("%-16s: %d Config cache %s, %d bytes\n", __func__, __LINE__, written ? "saved" : "not saved", sizeof(configCache) + configCache.size);
 #endif
-    lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
-    lcd.print(LCD_LOADING_CONF_OK + addBlanks(atoi(cfgLcdChar) - strlen(LCD_LOADING_CONF_OK)));
-    notReceivedConfig = false;
-    setDefaults();
-    delay(1000);
+  return written;
+}
 
-    // We are ready to start the MQTT connection
-    needMqttConnect = true;
-  }
 
-  else {
-    lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
-    lcd.print(LCD_LOADING_CONF_NOK + addBlanks(atoi(cfgLcdChar) - strlen(LCD_LOADING_CONF_NOK)));
-    needReset = true;
-    delay(1000);
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  FNV-1a hash of the received config, used to find out if a config from the server is new
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+uint32_t configHash() {
+
+  uint32_t hash = FNV_OFFSET_BASIS;
+  const uint8_t* data = (const uint8_t*)&tamBoxMqtt;
+
+  for (size_t i = 0; i < sizeof(tamBoxMqtt); i++) {
+    hash = (hash ^ data[i]) * FNV_PRIME;
   }
-    
-  // We are ready to start the MQTT connection
-  //needMqttConnect = true;
+
+  data = (const uint8_t*)tamBoxConfig;
+  for (size_t i = 0; i < sizeof(tamBoxConfig); i++) {
+    hash = (hash ^ data[i]) * FNV_PRIME;
+  }
+
+  return hash;
 }
 
 
 /* ------------------------------------------------------------------------------------------------------------------------------
- *  Function that gets called when web page config has been saved
+ *  Store one destination node from the received config
  * ------------------------------------------------------------------------------------------------------------------------------
  */
-void configSaved() {
+void setConfigDest(tamBoxConfiguration& dest, JsonObject node) {
+
+  strlcpy(dest.id, node[ID_T] | NOT_USED_T, sizeof(dest.id));                                   // 20 characters in db
+  strlcpy(dest.sign, node[SIGN_T] | "", sizeof(dest.sign));                                     // 4 characters in db
+  strlcpy(dest.exit, node[EXIT_T] | "", sizeof(dest.exit));                                     // 1 characters in db
+  dest.exit[0]                = tolower(dest.exit[0]);
+  dest.tracks                 = node[TRACK_T] | 0;                                              // tinyint in db (0-255)
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Seconds since 1970 of an HTTP Date header, e.g. "Sun, 06 Nov 1994 08:49:37 GMT", 0 if it isn't one
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+uint32_t httpDate(const char* date) {
+
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char month[4];
+  int day, year, hour, minute, second;
+
+  if (sscanf(date, "%*[^,], %d %3s %d %d:%d:%d", &day, month, &year, &hour, &minute, &second) != 6 || year < 1970) {
+    return 0;
+  }
+
+  const char* m = strstr(months, month);
+  if (m == NULL || (m - months) % 3 != 0) {
+    return 0;
+  }
+
+  uint32_t mon  = (m - months) / 3 + 1;                                                         // Days from the civil date, March first
+  uint32_t y    = year - (mon <= 2);
+  uint32_t doy  = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+  uint32_t days = (y / 400) * 146097 + (y % 400) * 365 + (y % 400) / 4 - (y % 400) / 100 + doy - 719468;
+
+  return days * 86400UL + hour * 3600UL + minute * 60UL + second;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Convert a track type string from the received config
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+uint8_t trackType(const char* type) {
+
+  if (strcmp(type, TYPE_SINGLE_T) == 0) { return TRACK_TYPE_SINGLE; }
+  if (strcmp(type, TYPE_SPLIT_T) == 0)  { return TRACK_TYPE_SPLIT; }
+  if (strcmp(type, TYPE_DOUBLE_T) == 0) { return TRACK_TYPE_DOUBLE; }
+  return TRACK_TYPE_NONE;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Parse the device settings from the configuration web page
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void setDeviceSettings() {
+
+  lcdRows                           = atoi(cfgLcdRows);
+  lcdChars                          = atoi(cfgLcdChar);
+  lcdLanguage                       = atoi(cfgLanguage) < languages ? atoi(cfgLanguage) : 0;
+  tamTimeOut                        = atoi(cfgTamTimeOut) * 1000UL;                             // Seconds to ms
+  dtShowTime                        = atoi(cfgDtShowTime) * 1000UL;                             // Seconds to ms
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Prepare MQTT broker and define function to handle callbacks
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void setupBroker() {
 
 #ifdef DEBUG
   Serial.printf("%-16s: %d \n", __func__, __LINE__);
-  Serial.printf("%-16s: %d IotWebConf config saved\n", __func__, __LINE__);
+  Serial.printf("%-16s: %d Broker setup\n", __func__, __LINE__);
+#endif
+#ifdef DEBUG
+  Serial.printf("%-16s: %d Broker used: %s:%d\n", __func__, __LINE__, tamBoxMqtt.server, tamBoxMqtt.port);
 #endif
 
-  clientID                  = String(iotWebConf.getThingName());
-  clientID.toLowerCase();
-  lcdBackLight              = atoi(cfgBackLight);
-  strcpy(configHost, cfgConfServer);
-  strcat(configHost, cfgConfFile);
-  lcd.setBacklight(lcdBackLight);
+  mqttClient.setServer(tamBoxMqtt.server, tamBoxMqtt.port);
+  mqttClient.setSocketTimeout(TIME_MQTT_SOCKET);                                                // Don't let a dead broker block the loop
+  mqttClient.setCallback(mqttCallback);                                                         // Set function for received MQTT messages
+  if (mqttClient.getBufferSize() < MQTT_BUFFER_SIZE) {
+    mqttClient.setBufferSize(MQTT_BUFFER_SIZE);                                                 // increase buffer because of JSON
+  }
+#ifdef DEBUG
+  Serial.printf("%-16s: %d Message buffer size set to: %d\n", __func__, __LINE__, mqttClient.getBufferSize());
+  Serial.printf("%-16s: %d Broker setup done!\n", __func__, __LINE__);
+#endif
 }
 
 
 /* ------------------------------------------------------------------------------------------------------------------------------
- *  Function to replace characters missing in LCD HD44780 with own defined characters
- *  Å (\x85), Ä (\x84), Ö (\x96), É (\x89), Ü (\x9c),
- *  å (\xa5), ä (\xa4), ö (\xb6), é (\xa9),  ü (\xbc),
- *  << (\xab), >> (\xbb)
+ *  Function to show client web start page
  * ------------------------------------------------------------------------------------------------------------------------------
  */
-void fixSpecialChar(String text, uint8_t col, uint8_t row) {
+void handleRoot() {
 
-#ifdef DEBUG_ALL
-  Serial.printf("%-16s: %d \n", __func__, __LINE__);
-  Serial.printf("%-16s: %d Number of characters in String are %d\n", __func__, __LINE__, text.length());
-  Serial.printf("%-16s: %d String: %s\n", __func__, __LINE__, text);
-  Serial.printf("%-16s: %d String: ", __func__, __LINE__);
-  for (uint8_t i = 0; i < text.length(); i++) {
-    Serial.printf("%02x ", text.charAt(i));
+  // -- Let IotWebConf test and handle captive portal requests.
+  if (iotWebConf.handleCaptivePortal()) {
+
+    // -- Captive portal request were already served.
+    return;
   }
 
-  Serial.printf("\n");
-#endif
-  for (uint8_t i = 0; i < text.length(); i++) {
-    if (text.charAt(i) == '\x85') {                                                             // Å
-#ifdef DEBUG_ALL
-      Serial.printf("%-16s: %d Å found at pos %d\n", __func__, __LINE__, i + 1);
-#endif
-      lcd.setCursor(col + i, row);
-      printSpecialChar(SWE_CAP_Å);
-    }
+  char s[512];
 
-    else if (text.charAt(i) == '\x84') {                                                        // Ä
-#ifdef DEBUG_ALL
-      Serial.printf("%-16s: %d Ä found at pos %d\n", __func__, __LINE__, i + 1);
-#endif
-      lcd.setCursor(col + i, row);
-      printSpecialChar(SWE_CAP_Ä);
-    }
+  // Assemble web page content
+  strcpy(s, "<!DOCTYPE html>\n<html lang=\"en\">\n<head><meta name=\"viewport\" content=\"width=device-width, initial-scale=1, user-scalable=no\"/>\n<title>Configuration</title></head>\n<body>\n<ul><li>mqttTamBox client: ");
+  strcat(s, iotWebConf.getThingName());
+  strcat(s, " running firmware: ");
+  strcat(s, SW_VERSION);
+  strcat(s, "</li></ul>\nGo to <a href='config'>configuration page</a> to change values.\n</body></html>\n");
 
-    else if (text.charAt(i) == '\x96') {                                                        // Ö
-#ifdef DEBUG_ALL
-      Serial.printf("%-16s: %d Ö found at pos %d\n", __func__, __LINE__, i + 1);
-#endif
-      lcd.setCursor(col + i, row);
-      printSpecialChar(SWE_CAP_Ö);
-    }
+  // Show web start page
+  server.send(200, "text/html", s);
+}
 
-    else if (text.charAt(i) == '\x89') {                                                        // É
-#ifdef DEBUG_ALL
-      Serial.printf("%-16s: %d É found at pos %d\n", __func__, __LINE__, i + 1);
-#endif
-      lcd.setCursor(col + i, row);
-      lcd.print("E");
-    }
 
-    else if (text.charAt(i) == '\x9c') {                                                        // Ü
-#ifdef DEBUG_ALL
-      Serial.printf("%-16s: %d Ü found at pos %d\n", __func__, __LINE__, i + 1);
-#endif
-      lcd.setCursor(col + i, row);
-      lcd.print("U");
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Function to show the metrics in Prometheus text format
+ *  Sent line by line, the page is too big for one buffer.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void handleMetrics() {
+
+  char line[METRIC_LINE_LEN];
+  char value[16];
+  const char* id = tamBoxConfig[OWN].id;
+
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain; version=0.0.4", "");
+
+  for (uint8_t m = 0; m < METRICS; m++) {
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", metricName[m], metricHelp[m], metricName[m]);
+    server.sendContent(line);
+
+    uint32_t count = 0;
+    for (uint8_t b = 0; b < METRIC_BUCKETS; b++) {
+      count += metric[m].bucket[b];
+      if (b < METRIC_BUCKETS - 1) { metricSeconds(value, sizeof(value), metricBound[b]); }
+      else                        { strcpy(value, "+Inf"); }
+      snprintf(line, sizeof(line), "%s_bucket{node=\"%s\",le=\"%s\"} %u\n", metricName[m], id, value, count);
+      server.sendContent(line);
     }
 
-    else if (text.charAt(i) == '\xa5') {                                                        // å
-#ifdef DEBUG_ALL
-      Serial.printf("%-16s: %d å found at pos %d\n", __func__, __LINE__, i + 1);
-#endif
-      lcd.setCursor(col + i, row);
-      printSpecialChar(SWE_LOW_Å);
-    }
+    metricSeconds(value, sizeof(value), metric[m].sum);
+    snprintf(line, sizeof(line), "%s_sum{node=\"%s\"} %s\n", metricName[m], id, value);
+    server.sendContent(line);
+    snprintf(line, sizeof(line), "%s_count{node=\"%s\"} %u\n", metricName[m], id, metric[m].count);
+    server.sendContent(line);
+  }
 
-    else if (text.charAt(i) == '\xa4') {                                                        // ä
-#ifdef DEBUG_ALL
-      Serial.printf("%-16s: %d ä found at pos %d\n", __func__, __LINE__, i + 1);
-#endif
-      lcd.setCursor(col + i, row);
-      printSpecialChar(SWE_LOW_Ä);
-    }
+  uint32_t pubFailures = 0;
+  for (uint8_t dest = 0; dest < DEST_BUTTONS; dest++) {
+    pubFailures += pubStat[dest].failures;
+  }
 
-    else if (text.charAt(i) == '\xb6') {                                                        // ö
-#ifdef DEBUG_ALL
-      Serial.printf("%-16s: %d ö found at pos %d\n", __func__, __LINE__, i + 1);
-#endif
-      lcd.setCursor(col + i, row);
-      printSpecialChar(SWE_LOW_Ö);
-    }
+  snprintf(value, sizeof(value), "%u", ESP.getFreeHeap());
+  metricSend("tambox_heap_free_bytes", "gauge", "Free heap", value);
+  snprintf(value, sizeof(value), "%u", heapLow);
+  metricSend("tambox_heap_free_low_bytes", "gauge", "Lowest free heap seen by loop()", value);
+  snprintf(value, sizeof(value), "%u", ESP.getMaxFreeBlockSize());
+  metricSend("tambox_heap_max_block_bytes", "gauge", "Largest free heap block", value);
+  snprintf(value, sizeof(value), "%u", ESP.getHeapFragmentation());
+  metricSend("tambox_heap_fragmentation_percent", "gauge", "Heap fragmentation", value);
+  snprintf(value, sizeof(value), "%d", (int)WiFi.RSSI());
+  metricSend("tambox_wifi_rssi_dbm", "gauge", "WiFi signal strength", value);
+  snprintf(value, sizeof(value), "%u", mqttReconnects);
+  metricSend("tambox_mqtt_reconnects_total", "counter", "Lost broker connections", value);
+  snprintf(value, sizeof(value), "%u", mqttReceived);
+  metricSend("tambox_mqtt_received_total", "counter", "Messages received from the broker", value);
+  snprintf(value, sizeof(value), "%u", pubFailures);
+  metricSend("tambox_publish_failures_total", "counter", "Tam messages given up after the retries", value);
+  snprintf(value, sizeof(value), "%u", dtQueueDrops);
+  metricSend("tambox_dt_queue_drops_total", "counter", "Report texts dropped, the queue was full", value);
+  metricSeconds(value, sizeof(value), (uint64_t)resyncTime * 1000);
+  metricSend("tambox_resync_seconds", "gauge", "Subscribe to all retained snapshots received", value);
+  snprintf(value, sizeof(value), "%lu", lcdI2cBytes);
+  metricSend("tambox_lcd_i2c_bytes_total", "counter", "I2C bytes sent to the LCD", value);
+  snprintf(value, sizeof(value), "%lu", lcdUpdates);
+  metricSend("tambox_lcd_updates_total", "counter", "LCD updates", value);
+  metricSeconds(value, sizeof(value), lcdUpdateTime);
+  metricSend("tambox_lcd_update_seconds", "gauge", "Last LCD update", value);
+  snprintf(value, sizeof(value), "%lu", halMillis() / 1000);
+  metricSend("tambox_uptime_seconds", "counter", "Time since power on", value);
+  server.sendContent("");                                                                       // End of the chunked page
+}
 
-    else if (text.charAt(i) == '\xa9') {                                                        // é
-#ifdef DEBUG_ALL
-      Serial.printf("%-16s: %d é found at pos %d\n", __func__, __LINE__, i + 1);
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Send one gauge or counter with its help and type lines
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void metricSend(const char* name, const char* type, const char* help, const char* value) {
+
+  char line[METRIC_LINE_LEN];
+
+  snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+  server.sendContent(line);
+  snprintf(line, sizeof(line), "%s{node=\"%s\"} %s\n", name, tamBoxConfig[OWN].id, value);
+  server.sendContent(line);
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Latency metrics
+ *  metricBegin starts a measurement and metricEnd adds it to the histogram, a second metricEnd is
+ *  ignored. metricCancel drops a measurement that didn't reach its end, e.g. a key that didn't publish.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void metricBegin(uint8_t m) {
+
+  metric[m].start = halMicros();
+  metric[m].open  = true;
+}
+
+
+void metricEnd(uint8_t m) {
+
+  if (!metric[m].open) {
+    return;
+  }
+
+  unsigned long us = halMicros() - metric[m].start;
+  uint8_t b = 0;
+
+  while (b < METRIC_BUCKETS - 1 && us > metricBound[b]) { b++; }
+
+  metric[m].bucket[b]++;
+  metric[m].count++;
+  metric[m].sum  += us;
+  metric[m].open  = false;
+  if (us > metric[m].peak) { metric[m].peak = us; }
+}
+
+
+void metricCancel(uint8_t m) {
+
+  metric[m].open = false;
+}
+
+
+void metricSeconds(char* txt, size_t len, uint64_t us) {
+
+  snprintf(txt, len, "%lu.%06lu", (unsigned long)(us / 1000000), (unsigned long)(us % 1000000));
+}
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Function beeing called when wifi connection is up and running
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void wifiConnected() {
+
+  long rssi     = WiFi.RSSI();                                                                  //  -30 dBm   Excelent wifi connection
+                                                                                                //  -67 dBm   Good wifi connection
+                                                                                                //  -70 dBm   Fair wifi connection
+                                                                                                //  -80 dBm   Week wifi connection
+                                                                                                //  -90 dBm   Not working wifi connection
+  lcd.home();
+  lcd.print(LCD_STARTING_UP + addBlanks(lcdChars - strlen(LCD_STARTING_UP)));
+  lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
+  lcd.print(SW_VERSION + addBlanks(lcdChars - strlen(SW_VERSION)));
+  halDelay(1000);
+
+  lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
+  lcd.print(LCD_WIFI_CONNECTED + addBlanks(lcdChars - strlen(LCD_WIFI_CONNECTED)));
+  halDelay(1000);
+#ifdef DEBUG
+  Serial.printf("%-16s: %d Signal strength (RSSI): %d dBm\n", __func__, __LINE__, rssi);
 #endif
-      lcd.setCursor(col + i, row);
-      lcd.print("e");
-    }
+  lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
+  lcd.print(addBlanks(lcdChars));
+  lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
+  lcd.print(LCD_SIGNAL + String(rssi) + "dBm");
+  halDelay(1000);
 
-    else if (text.charAt(i) == '\xbc') {                                                        // ü
-#ifdef DEBUG_ALL
-      Serial.printf("%-16s: %d ü found at pos %d\n", __func__, __LINE__, i + 1);
+  snprintf(configPath, sizeof(configPath), "%s%s", configHost, clientID.c_str());
+#ifdef DEBUG
+  Serial.printf("%-16s: %d configPath = %s\n", __func__, __LINE__, configPath);
 #endif
-      lcd.setCursor(col + i, row);
-      lcd.print("u");
-    }
 
-    else if (text.charAt(i) == '\xab') {                                                        // >>
-#ifdef DEBUG_ALL
-      Serial.printf("%-16s: %d >> found at pos %d\n", __func__, __LINE__, i + 1);
+  if (loadConfigCache()) {                                                                      // Start at once, the server is checked when connected
+#ifdef DEBUG
+    Serial.printf("%-16s: %d Config loaded from cache!\n\n", __func__, __LINE__);
 #endif
-      lcd.setCursor(col + i, row);
-      printSpecialChar(TRAIN_MOVING_RIGHT);
-    }
+    lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
+    lcd.print(LCD_LOADING_CONF_OK + addBlanks(lcdChars - strlen(LCD_LOADING_CONF_OK)));
+    notReceivedConfig = false;
+    configFromCache = true;
+    setDefaults();
+    needMqttConnect = true;
+    return;
+  }
 
-    else if (text.charAt(i) == '\xbb') {                                                        // <<
-#ifdef DEBUG_ALL
-      Serial.printf("%-16s: %d << found at pos %d\n", __func__, __LINE__, i + 1);
+  lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
+  lcd.print(LCD_LOADING_CONF + addBlanks(lcdChars - strlen(LCD_LOADING_CONF)));
+  halDelay(1000);
+
+  if (getConfigFile() == CONFIG_RECEIVED) {
+#ifdef DEBUG
+    Serial.printf("%-16s: %d Config loaded!\n\n", __func__, __LINE__);
 #endif
-      lcd.setCursor(col + i, row);
-      printSpecialChar(TRAIN_MOVING_LEFT);
-    }
+    lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
+    lcd.print(LCD_LOADING_CONF_OK + addBlanks(lcdChars - strlen(LCD_LOADING_CONF_OK)));
+    notReceivedConfig = false;
+    configFromCache = false;
+    saveConfigCache();                                                                          // Next start won't wait for the server
+    setDefaults();
+    halDelay(1000);
+
+    // We are ready to start the MQTT connection
+    needMqttConnect = true;
   }
+
+  else {
+    lcd.setCursor(LCD_FIRST_COL, LCD_SECOND_ROW);
+    lcd.print(LCD_LOADING_CONF_NOK + addBlanks(lcdChars - strlen(LCD_LOADING_CONF_NOK)));
+    needReset = true;
+    halDelay(1000);
+  }
+    
+  // We are ready to start the MQTT connection
+  //needMqttConnect = true;
 }
 
 
 /* ------------------------------------------------------------------------------------------------------------------------------
- *  Function to remove escape character for the LCD
+ *  Function that gets called when web page config has been saved
  * ------------------------------------------------------------------------------------------------------------------------------
  */
-String removeEscapeChar(String text) {
+void configSaved() {
 
-#ifdef DEBUG_ALL
+#ifdef DEBUG
   Serial.printf("%-16s: %d \n", __func__, __LINE__);
-  Serial.printf("%-16s: %d Character %s removed\n", __func__, __LINE__, escapeChar);
+  Serial.printf("%-16s: %d IotWebConf config saved\n", __func__, __LINE__);
 #endif
-  text.replace(String(escapeChar), "");
-  return text;
+
+  clientID                  = String(iotWebConf.getThingName());
+  clientID.toLowerCase();
+  lcdBackLight              = atoi(cfgBackLight);
+  setDeviceSettings();
+  strcpy(configHost, cfgConfServer);
+  strcat(configHost, cfgConfFile);
+  lcd.setBacklight(lcdBackLight);
 }
 
 
@@ -3134,9 +3755,9 @@ void toggleTrack() {
 
   if (tamBoxIdle) {
     for (uint8_t dest = 0; dest < DEST_BUTTONS; dest++) {
-      if (tamBoxConfig[dest][ID] != NOT_USED_T) {
-        if (tamBoxConfig[dest][TOTTRACKS].toInt() == 2) {
- //         if (tamBoxConfig[dest][TYPE] == TYPE_DOUBLE_T) {
+      if (strcmp(tamBoxConfig[dest].id, NOT_USED_T) != 0) {
+        if (tamBoxConfig[dest].totTracks == 2) {
+ //         if (tamBoxConfig[dest].type == TRACK_TYPE_DOUBLE) {
             setDirString(dest, currentTrack);
             setNodeString(dest, currentTrack);
             updateLcd(dest);
@@ -3148,6 +3769,195 @@ void toggleTrack() {
 }
 
 
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Timer slot for a purpose, destination and track
+ *
+ *  Ping, toggle, show text, queue, publish retry and config check have one timer each, dest and track are ignored.
+ *  Tam timeout and beep have one timer per destination and track.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+uint8_t timerSlot(uint8_t purpose, uint8_t dest, uint8_t track) {
+
+  if (purpose < TIMER_SHARED) {
+    return purpose;
+  }
+
+  return TIMER_SHARED + ((purpose - TIMER_TAM) * DEST_BUTTONS + dest) * MAX_NUM_OF_TRACKS + track;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Start or restart a timer, due in wait ms
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void setTimer(uint8_t purpose, uint8_t dest, uint8_t track, unsigned long wait) {
+
+  uint8_t slot = timerSlot(purpose, dest, track);
+
+  timer[slot].deadline  = halMillis() + wait;
+  timer[slot].active    = true;
+
+  if ((long)(timer[slot].deadline - nextDeadline) < 0) {                                        // Due before the next wake up
+    nextDeadline = timer[slot].deadline;
+  }
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Stop a timer, nextDeadline is left as is and moved on in runTimers
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void clearTimer(uint8_t purpose, uint8_t dest, uint8_t track) {
+
+  timer[timerSlot(purpose, dest, track)].active = false;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Restart the show text timer, an information text is shown for dtShowTime
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void setShowTimer() {
+
+  setTimer(TIMER_SHOW_TEXT, OWN, LEFT_TRACK, dtShowTime);
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Fire the timers that are due, called from loop
+ *
+ *  Returns at once until the earliest deadline has passed. The timers are checked in slot order, so
+ *  the show text timer fires before the queue timer and a timer restarted by an earlier one is not due.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void runTimers() {
+
+  unsigned long now = halMillis();
+
+  if ((long)(now - nextDeadline) < 0) {                                                         // Nothing is due yet
+    return;
+  }
+
+  for (uint8_t slot = 0; slot < TIMER_SLOTS; slot++) {
+    if (timer[slot].active && (long)(now - timer[slot].deadline) >= 0) {
+      timer[slot].active = false;                                                               // One shot, restarted by timerFired
+
+      if (slot < TIMER_SHARED) {
+        timerFired(slot, OWN, LEFT_TRACK);
+      }
+
+      else {
+        uint8_t i = slot - TIMER_SHARED;
+        timerFired(TIMER_TAM + i / (DEST_BUTTONS * MAX_NUM_OF_TRACKS), (i / MAX_NUM_OF_TRACKS) % DEST_BUTTONS, i % MAX_NUM_OF_TRACKS);
+      }
+    }
+  }
+
+  nextDeadline = now + TIME_PING_INTERVAL;                                                      // The ping timer is always active
+
+  for (uint8_t slot = 0; slot < TIMER_SLOTS; slot++) {
+    if (timer[slot].active && (long)(timer[slot].deadline - nextDeadline) < 0) {
+      nextDeadline = timer[slot].deadline;
+    }
+  }
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Handle a timer that is due
+ *
+ *  timerFired({TIMER_PING, TIMER_TOGGLE, TIMER_SHOW_TEXT, TIMER_QUEUE, TIMER_PUB, TIMER_CONFIG, TIMER_TAM, TIMER_BEEP}, dest, track)
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void timerFired(uint8_t purpose, uint8_t dest, uint8_t track) {
+
+  switch (purpose) {
+    case TIMER_PING:                                                                            // Send Ping
+      setTimer(TIMER_PING, OWN, LEFT_TRACK, TIME_PING_INTERVAL);
+      sendPing();
+    break;
+//----------------------------------------------------------------------------------------------
+    case TIMER_TOGGLE:                                                                          // Toggle double track view
+      setTimer(TIMER_TOGGLE, OWN, LEFT_TRACK, TIME_TOGGLE_TRACK);
+      if (tamBoxIdle) {
+        toggleTrack();
+      }
+    break;
+//----------------------------------------------------------------------------------------------
+    case TIMER_SHOW_TEXT:                                                                       // Information text is shown
+      if (showText) {
+        tamBoxIdle = true;                                                                      // Set tambox idle
+#ifdef DEBUG
+        Serial.printf("%-16s: %d  - tamBoxIdle set to true\n", __func__, __LINE__);
+#endif
+        showText = false;
+        updateLcd(DEST_ALL_DEST);                                                               // Restore the LCD
+#ifdef DEBUG
+        Serial.printf("%-16s: %d  - ShowText set to false\n", __func__, __LINE__);
+#endif
+      }
+    break;
+//----------------------------------------------------------------------------------------------
+    case TIMER_QUEUE:                                                                           // Check the queue
+      if (tamBoxIdle && !showText) {                                                            // Display is free for the next text
+        dtEvent event;
+        if (dtQueuePop(event)) {
+#ifdef DEBUG
+          Serial.printf("%-16s: %d  Queue for dest %s shown (%d left)\n", __func__, __LINE__, destIDTxt[event.dest], dtQueueLen);
+#endif
+          showReport(event.dest, event.track, event.str);
+        }
+      }
+
+      if (dtQueueLen > 0) {
+        setTimer(TIMER_QUEUE, OWN, LEFT_TRACK, TIME_QUEUE_DRAIN);
+      }
+    break;
+//----------------------------------------------------------------------------------------------
+    case TIMER_PUB:                                                                             // Publish queued messages again
+      pubRetry();
+    break;
+//----------------------------------------------------------------------------------------------
+    case TIMER_CONFIG:                                                                          // Check the config server
+      if (tamBoxIdle && !showText) {                                                            // Not while the operator is busy
+        checkConfigFile();
+      }
+
+      else {
+        setTimer(TIMER_CONFIG, OWN, LEFT_TRACK, TIME_CONFIG_CHECK);
+      }
+    break;
+//----------------------------------------------------------------------------------------------
+    case TIMER_TAM:                                                                             // Tam request times out
+      if (ports.at(dest, track).state == _INREQUEST) {
+#ifdef DEBUG
+        Serial.printf("%-16s: %d  Request from %s on %s track timed out\n", __func__, __LINE__, destIDTxt[dest], useTrackTxt[track]);
+#endif
+        rejectRequest(dest, track);                                                             // Send reject when timed out
+        setNodeString(dest, track);
+        if (destination == dest) {                                                              // Request was selected
+          destination = DEST_NOT_SELECTED;
+          destBtnPushed = 0;
+        }
+
+        if (tamBoxIdle || destination == DEST_NOT_SELECTED) {                                   // Else the operator is busy with another destination
+          updateLcd(DEST_ALL_DEST);                                                             // Restore the LCD
+          setShowTimer();
+          setTimer(TIMER_TOGGLE, OWN, LEFT_TRACK, TIME_TOGGLE_TRACK);
+        }
+      }
+    break;
+//----------------------------------------------------------------------------------------------
+    case TIMER_BEEP:                                                                            // Remind about the request
+      if (ports.at(dest, track).state == _INREQUEST) {
+        setTimer(TIMER_BEEP, dest, track, TIME_BEEP_PAUS);
+        beep(TIME_BEEP_DURATION, BEEP_OK);
+      }
+    break;
+  }
+}
+
+
 /* ------------------------------------------------------------------------------------------------------------------------------
  *  mqtt-lcp function when cmd is received
  *  
@@ -3192,11 +4002,8 @@ void toggleTrack() {
  *    
  * ------------------------------------------------------------------------------------------------------------------------------
  */
-void jsonReceived(uint8_t order, char* body) {
+void jsonReceived(uint8_t order, uint8_t port, char* body) {
 
-#ifdef DEBUG
-  char db1Text[] = "jsonReceived    : ";
-#endif
 /*
 {"tam": {"version": "1.0", "timestamp": 1590520093, "session-id": "req:1590520093",
     "node-id": "tambox-2", "port-id": "a", "track": "left",
@@ -3239,235 +4046,357 @@ void jsonReceived(uint8_t order, char* body) {
     "state": {"desired": "reboot"}}
 }
 */
-  uint16_t train;
-  uint8_t track, orderCode, i;
-  char receiver[32];
-  uint8_t MyP = 0;
-  uint8_t MyI = 0;
-  uint8_t dest = 255;
-  String s, tpc, nodeId, portId;
-  StaticJsonDocument<384> doc;                                                                  // Create a json object
-  uint8_t maxSize = 384;
-  deserializeJson(doc, body);                                                                   // Read the json body
-//  JsonObject root = doc.to<JsonObject>();
+  TamMessage msg;
+  msg.body  = peekBodyType(body);                                                               // Cheap scans, no parsing yet
+  msg.node  = peekNodeId(body);
 
-  if (String(doc[TAM][VERSION]) == LCP_BODY_VER) {                                              // Type is tam
+  if (!tamMessageWanted(order, msg)) {                                                          // Not to me or not handled
 #ifdef DEBUG
-    Serial.printf("%-16s: %d version   : %s\n", __func__, __LINE__, String(doc[TAM][VERSION]));
-    Serial.printf("%-16s: %d session-id: ", __func__, __LINE__);
-    Serial.println(String(doc[TAM][SESSION_ID]));
-    Serial.printf("%-16s: %d timestamp : %d\n", __func__, __LINE__, doc[TAM][TIMESTAMP]);
-    Serial.printf("%-16s: %d respond-to: ", __func__, __LINE__);
-    Serial.println(String(doc[TAM][RESPOND_TO]));
-    Serial.printf("%-16s: %d node-id   : %s\n", __func__, __LINE__, String(doc[TAM][NODE_ID]));
-    Serial.printf("%-16s: %d port-id   : %s\n", __func__, __LINE__, String(doc[TAM][PORT_ID]));
-    Serial.printf("%-16s: %d track     : %s\n", __func__, __LINE__, String(doc[TAM][TRACK]));
-    Serial.printf("%-16s: %d train-id  : %s\n", __func__, __LINE__, String(doc[TAM][TRAIN_ID]));
-    Serial.printf("%-16s: %d desired   : %s\n", __func__, __LINE__, String(doc[TAM][STATE][DESIRED]));
-    Serial.printf("%-16s: %d reported  : %s\n", __func__, __LINE__, String(doc[TAM][STATE][REPORTED]));
+    Serial.printf("%-16s: %d Not to me or not handled, body: %d node: %d\n", __func__, __LINE__, msg.body, msg.node);
 #endif
+    return;
+  }
 
-    if (order == _REQUEST) {                                                                    // Tam request
-      if (String(doc[TAM][NODE_ID]) == tamBoxConfig[OWN][ID]) {
-        tpc = String(doc[TAM][RESPOND_TO]);
-
-        for (i = 0; i < NUM_OF_TOPICS; i++) {                                                   // Get sending node-id
-          MyI = tpc.indexOf("/", MyP);
-          s   = tpc.substring(MyP, MyI);
-          MyP = MyI + 1;
-          if (i == TOPIC_NODE_ID) {
-            nodeId = s;
-          }
+  if (msg.body == BODY_PING) {                                                                  // Type is Ping
+#ifdef DEBUG
+    Serial.printf("%-16s: %d Ping object received from: %s\n", __func__, __LINE__, tamBoxConfig[msg.node].id);
+#endif
+    return;
+  }
 
-          else if (i == TOPIC_PORT_ID) {
-            portId = s;
-          }
+  if (msg.body == BODY_TOWER) {                                                                 // Type is Tower
+    towerInventory(body);
+    return;
+  }
+
+  if (!decodeTamMessage(body, order, msg)) {
+    return;
+  }
+
+  if (msg.body == BODY_TAM) {                                                                   // Type is tam
+#ifdef DEBUG
+    Serial.printf("%-16s: %d session-id: %s\n", __func__, __LINE__, msg.sessionId);
+    Serial.printf("%-16s: %d respond-to: %s\n", __func__, __LINE__, msg.respondTo);
+    Serial.printf("%-16s: %d node-id   : %s\n", __func__, __LINE__, tamBoxConfig[msg.node].id);
+    Serial.printf("%-16s: %d track     : %d\n", __func__, __LINE__, msg.track);
+    Serial.printf("%-16s: %d train-id  : %d\n", __func__, __LINE__, msg.train);
+    Serial.printf("%-16s: %d desired   : %s\n", __func__, __LINE__, msg.desired);
+    Serial.printf("%-16s: %d order code: %d\n", __func__, __LINE__, msg.orderCode);
+#endif
+
+    if (order == _REQUEST) {                                                                    // Tam request
+      if (msg.sender < DEST_BUTTONS) {
+        uint8_t track = LEFT_TRACK;                                                             // Single track traffic
+        if (tamBoxConfig[msg.sender].tracks == DOUBLE_TRACK) {
+          track = msg.track;                                                                    // Named as the own track
         }
 
-        for (i = 0; i < NUM_OF_DEST_STRINGS; i++) {
-          if (tamBoxConfig[i][ID] == nodeId){
-            dest = i;                                                                           // Set corresponding destination
-            break;
-          }
+        tamBoxRequest& req = ports[msg.sender].req[track];
+        if (msg.sessionId[0] != '\0' && strcmp(req.sessionId, msg.sessionId) == 0 && strcmp(req.desired, msg.desired) == 0) {
+#ifdef DEBUG
+          Serial.printf("%-16s: %d Request %s sent again, answered with %s\n", __func__, __LINE__, msg.sessionId, req.reported ? req.reported : RECEIVED);
+#endif
+          respondRequest(msg.sender, track, req.reported ? req.reported : RECEIVED);            // The response or the request was lost
+          return;
         }
 
-        if (dest < 255) {
-          track                           = (String(doc[TAM][TRACK]) == LEFT) ? LEFT_TRACK : RIGHT_TRACK;
+        strlcpy(req.sessionId, msg.sessionId, sizeof(req.sessionId));
+        strlcpy(req.respondTo, msg.respondTo, sizeof(req.respondTo));
+        strlcpy(req.desired, msg.desired, sizeof(req.desired));
+        strlcpy(req.portId, msg.senderPort, sizeof(req.portId));
+        req.reported = NULL;                                                                    // Not answered yet
+        req.hasTrain = msg.hasTrain;
+        req.trainId  = msg.train;
 
-          if (String(doc[TAM][STATE][DESIRED]) == ACCEPT) {
-            orderCode                     = CODE_ACCEPT;
-          }
+        if (msg.hasTrain) {
+#ifdef DEBUG
+          Serial.printf("%-16s: %d TAM request received\n", __func__, __LINE__);
+#endif
+          handleTrain(msg.sender, msg.track, msg.orderCode, msg.train);                         // Call train handler routine
+        }
 
-          else if (String(doc[TAM][STATE][DESIRED]) == IN) {
-            orderCode                     = CODE_TRAFDIR_REQ_IN;
-          }
+        else {
+#ifdef DEBUG
+          Serial.printf("%-16s: %d Direction request received\n", __func__, __LINE__);
+#endif
+          handleDirection(msg.sender, msg.track, msg.orderCode);                                // Call traffic direction handler routine
+        }
+      }
 
-          else {
-            orderCode                     = CODE_CANCEL;
-          }
+      else {
+#ifdef DEBUG
+        Serial.printf("%-16s: %d respond-to is missing\n", __func__, __LINE__);
+#endif
+      }
+    }
 
-          reqCmd[dest][LCP_SESSION_ID]    = String(doc[TAM][SESSION_ID]);
-          reqCmd[dest][LCP_RESPOND_TO]    = String(doc[TAM][RESPOND_TO]);
-          reqCmd[dest][LCP_DESIRED_STATE] = String(doc[TAM][STATE][DESIRED]);
-          reqCmd[dest][LCP_NODE_ID]       = nodeId;
-          reqCmd[dest][LCP_PORT_ID]       = portId;
-          reqCmd[dest][LCP_TRACK]         = String(doc[TAM][TRACK]);
+    else if (order == _RESPONSE) {                                                              // Tam response
+      uint8_t dest = port;                                                                      // Own port in the topic is the destination
 
-          if (doc[TAM][TRAIN_ID]) {
-            train                         = doc[TAM][TRAIN_ID];
+      if (dest < DEST_BUTTONS && strcmp(ports[dest].resSessionId, msg.sessionId) == 0) {
+        pubResponded(dest, msg.sessionId);                                                      // Stop retrying the request
+        if (msg.orderCode == CODE_RECEIVED) {                                                   // Only delivered, the operator answers later
 #ifdef DEBUG
-            Serial.printf("%-16s: %d TAM request received\n", __func__, __LINE__);
+          Serial.printf("%-16s: %d TAM request %s received by %s\n", __func__, __LINE__, msg.sessionId, destIDTxt[dest]);
 #endif
-            handleTrain(dest, track, orderCode, train);                                         // Call train handler routine
-          }
+        }
 
-          else {
+        else if (msg.hasTrain) {
 #ifdef DEBUG
-            Serial.printf("%-16s: %d Direction request received\n", __func__, __LINE__);
+          Serial.printf("%-16s: %d TAM response received\n", __func__, __LINE__);
 #endif
-            handleDirection(dest, track, orderCode);                                            // Call traffic direction handler routine
-          }
+          handleTrain(dest, msg.track, msg.orderCode, msg.train);                               // Call train handler routine
         }
 
-        else {
-#ifdef DEBUG
-          Serial.printf("%-16s: %d respond-to is missing\n", __func__, __LINE__);
-#endif
-        }
-      }
+        else {
+#ifdef DEBUG
+          Serial.printf("%-16s: %d Direction response received\n", __func__, __LINE__);
+#endif
+          handleDirection(dest, msg.track, msg.orderCode);                                      // Call traffic direction handler routine
+        }
+      }
+    }
+
+    else if (order == _DATA) {                                                                  // message is data
+#ifdef DEBUG
+      Serial.printf("%-16s: %d Train report received\n", __func__, __LINE__);
+#endif
+      handleTrain(msg.node, msg.track, msg.orderCode, msg.train);                               // Call train handler routine
+    }
+  }
+
+  else if (msg.body == BODY_NODE) {                                                             // Type is Node
+#ifdef DEBUG
+    Serial.printf("%-16s: %d Node object received\n", __func__, __LINE__);
+#endif
+    if (strcmp(msg.desired, LCP_BODY_REBOOT) == 0) {                                            // Reboot the tambox
+      needReset = true;
+    }
+
+    else if (strcmp(msg.desired, LCP_BODY_SHUTDOWN) == 0) {                                     // Shutdown the tambox
+#ifdef DEBUG
+      Serial.printf("%-16s: %d Shuttingdown after 5 seconds.\n", __func__, __LINE__);
+#endif
+      lcd.clear();
+      lcd.home();
+      lcd.print(LCD_SHUTTINGDOWN);
+      halDelay(5000);
+      ESP.deepSleep(0);
+    }
+  }
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  mqtt-lcp body decoder
+ *  The body type and node-id are found by scanning the raw body, so messages not for this node are
+ *  dropped without parsing. Wanted bodies are parsed once through tamFilter, only keeping the fields
+ *  used, into a TamMessage.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void setTamFilter() {
+
+  JsonObject tam                    = tamFilter[TAM].to<JsonObject>();
+  tam[VERSION]                      = true;
+  tam[SESSION_ID]                   = true;
+  tam[RESPOND_TO]                   = true;
+  tam[TRACK]                        = true;
+  tam[TRAIN_ID]                     = true;
+  tam[STATE][DESIRED]               = true;
+  tam[STATE][REPORTED]              = true;
+
+  JsonObject node                   = tamFilter[NODE].to<JsonObject>();
+  node[VERSION]                     = true;
+  node[STATE][DESIRED]              = true;
+}
+
+
+uint8_t peekBodyType(const char* body) {
+
+  const char* c = body;
+  while (*c == '{' || *c == ' ' || *c == '\t' || *c == '\r' || *c == '\n') { c++; }
+  if (*c != '"') { return BODY_UNKNOWN; }
+
+  const char* key = ++c;
+  while (*c != '\0' && *c != '"') { c++; }
+  uint8_t len = c - key;
+
+  if (topicLevelIs(key, len, TAM))        { return BODY_TAM; }
+  if (topicLevelIs(key, len, NODE))       { return BODY_NODE; }
+  if (topicLevelIs(key, len, TOWER))      { return BODY_TOWER; }
+  if (topicLevelIs(key, len, PING))       { return BODY_PING; }
+  return BODY_UNKNOWN;
+}
+
+
+uint8_t peekNodeId(const char* body) {
+
+  uint8_t len, portLen;
+  const char* id   = peekString(body, "\"" NODE_ID "\"", len);
+  const char* port = peekString(body, "\"" PORT_ID "\"", portLen);                              // Senders port in a train report
+
+  if (id == NULL) { return TOPIC_NOT_FOUND; }
+  return findTopicDest(id, len, port ? port : "", port ? portLen : 0);
+}
+
+
+const char* peekString(const char* body, const char* key, uint8_t& len) {
+
+  const char* c = strstr(body, key);
+  if (c == NULL) { return NULL; }
+
+  c += strlen(key);
+  while (*c == ':' || *c == ' ' || *c == '\t' || *c == '\r' || *c == '\n') { c++; }
+  if (*c != '"') { return NULL; }
+
+  const char* text = ++c;
+  while (*c != '\0' && *c != '"') { c++; }
+  len = c - text;
 
-      else {
-#ifdef DEBUG
-        Serial.printf("%-16s: %d Not to me, sent to: %s\n", __func__, __LINE__, String(doc[TAM][NODE_ID]));
-#endif
-      }
-    }
+  return text;
+}
 
-    else if (order == _RESPONSE) {                                                              // Tam response
-      if (String(doc[TAM][NODE_ID]) == tamBoxConfig[OWN][ID]) {
-        for (dest = 0; dest < DEST_BUTTONS; dest++) {
-          if (resCmd[dest][LCP_SESSION_ID] == String(doc[TAM][SESSION_ID])) {
-            track                       = (String(doc[TAM][TRACK]) == LEFT) ? LEFT_TRACK : RIGHT_TRACK;
 
-            if (doc[TAM][TRAIN_ID]) {
-              train                     = doc[TAM][TRAIN_ID];
-              orderCode                 = (String(doc[TAM][STATE][REPORTED]) == ACCEPTED) ? CODE_ACCEPTED : CODE_REJECTED;
-#ifdef DEBUG
-              Serial.printf("%-16s: %d TAM response received\n", __func__, __LINE__);
-#endif
-              handleTrain(dest, track, orderCode, train);                                       // Call train handler routine
-            }
+bool tamMessageWanted(uint8_t order, TamMessage& msg) {
 
-            else {
-              orderCode                 = (String(doc[TAM][STATE][REPORTED]) == IN) ? CODE_TRAFDIR_RES_IN : CODE_TRAFDIR_RES_OUT;
+  switch (msg.body) {
+    case BODY_TAM:
+      if (order == _DATA) { return msg.node < DEST_BUTTONS; }                                   // Train report from a destination
+      return msg.node == OWN;                                                                   // Request or response to me
+//----------------------------------------------------------------------------------------------
+    case BODY_NODE:
+      return order == _REQUEST && msg.node == TOPIC_SUPERVISOR;
+//----------------------------------------------------------------------------------------------
+    case BODY_TOWER:
+      return msg.node == OWN;
+//----------------------------------------------------------------------------------------------
 #ifdef DEBUG
-              Serial.printf("%-16s: %d Direction response received\n", __func__, __LINE__);
+    case BODY_PING:                                                                             // Pings are only logged
+      return msg.node < DEST_BUTTONS;
 #endif
-              handleDirection(dest, track, orderCode);                                          // Call traffic direction handler routine
-            }
+//----------------------------------------------------------------------------------------------
+    default:
+      return false;
+  }
+}
 
-            break;
-          }
-        }
-      }
 
-      else {
-#ifdef DEBUG
-        Serial.printf("%-16s: %d Not to me, sent to: %s\n", __func__, __LINE__, String(doc[TAM][NODE_ID]));
-#endif
-      }
-    }
+bool decodeTamMessage(char* body, uint8_t order, TamMessage& msg) {
 
-    else if (order == _DATA) {                                                                  // message is data
-      for (uint8_t dest = 0; dest < DEST_BUTTONS; dest++) {
-        if (String(doc[TAM][NODE_ID]) == tamBoxConfig[dest][ID]) {
-          track                         = (String(doc[TAM][TRACK]) == LEFT) ? LEFT_TRACK : RIGHT_TRACK;
-          orderCode                     = (String(doc[TAM][STATE][REPORTED]) == IN) ? CODE_TRAIN_IN : CODE_TRAIN_OUT;
-          train                         = doc[TAM][TRAIN_ID];
+  JsonDocument doc;
+  metricBegin(METRIC_JSON);
+  DeserializationError error = deserializeJson(doc, body, DeserializationOption::Filter(tamFilter));
+  metricEnd(METRIC_JSON);
+
+  if (error) {
 #ifdef DEBUG
-          Serial.printf("%-16s: %d Train report received\n", __func__, __LINE__);
+    Serial.printf("%-16s: %d Body not decoded: %s\n", __func__, __LINE__, error.c_str());
 #endif
-          handleTrain(dest, track, orderCode, train);                                           // Call train handler routine
-          break;
-        }
-      }
-    }
+    return false;
   }
 
-  else if (String(doc[PING][VERSION]) == LCP_BODY_VER) {                                        // Type is Ping
-    for (uint8_t dest = 0; dest < DEST_BUTTONS; dest++) {
-      if (String(doc[TAM][NODE_ID]) == tamBoxConfig[dest][ID]) {
-#ifdef DEBUG
-        Serial.printf("%-16s: %d Ping object received from: %s\n", __func__, __LINE__, tamBoxConfig[dest][ID]);
-#endif
-      }
-    }
+  JsonObject obj = doc[(msg.body == BODY_NODE) ? NODE : TAM];
+  if (strcmp(obj[VERSION] | "", LCP_BODY_VER) != 0) {
+    return false;
   }
 
-  else if (String(doc[TOWER][VERSION]) == LCP_BODY_VER &&
-           String(doc[TOWER][PORT_ID]) == INVENTORY) {                                          // Type is Tower inventory
-    if (String(doc[TAM][NODE_ID]) == tamBoxConfig[OWN][ID]) {
-#ifdef DEBUG
-      Serial.printf("%-16s: %d Inventory object received\n", __func__, __LINE__);
-#endif
-      JsonObject tower = doc[TOWER];
-      char reportData[254];                                                                     // json body
+  const char* reported              = obj[STATE][REPORTED] | "";
+  strlcpy(msg.sessionId, obj[SESSION_ID] | "", sizeof(msg.sessionId));
+  strlcpy(msg.respondTo, obj[RESPOND_TO] | "", sizeof(msg.respondTo));
+  strlcpy(msg.desired, obj[STATE][DESIRED] | "", sizeof(msg.desired));
+  msg.track                         = (strcmp(obj[TRACK] | "", LEFT) == 0) ? LEFT_TRACK : RIGHT_TRACK;
+  msg.hasTrain                      = !obj[TRAIN_ID].isNull();
+  msg.train                         = obj[TRAIN_ID] | 0;
+  msg.sender                        = TOPIC_NOT_FOUND;
+  msg.senderPort[0]                 = '\0';
+
+  const char* level[NUM_OF_TOPICS] = {};                                                        // Get sending node-id and port-id
+  uint8_t levelLen[NUM_OF_TOPICS]   = {};
+  const char* c = msg.respondTo;
+
+  for (uint8_t t = 0; t <= TOPIC_PORT_ID && *c != '\0'; t++) {
+    level[t] = c;
+    while (*c != '\0' && *c != '/') { c++; }
+    levelLen[t] = c - level[t];
+    if (*c == '/') { c++; }
+  }
 
-      doc[TOWER][TIMESTAMP]               = epochTime + millis() / 1000;
-      doc[TOWER][STATE][REPORTED]         = String(doc[TOWER][STATE][DESIRED]);
-      doc[TOWER][NODE_ID]                 = tamBoxConfig[OWN][ID];
-      strcpy(receiver, doc[TOWER][RESPOND_TO]);
-      doc.remove(RESPOND_TO);                                                                   // Remove respond-to taggen
+  if (levelLen[TOPIC_NODE_ID] > 0) {
+    uint8_t slot = findTopicDest(level[TOPIC_NODE_ID], levelLen[TOPIC_NODE_ID], level[TOPIC_PORT_ID], levelLen[TOPIC_PORT_ID]);
+    msg.sender = (slot < CONFIG_DEST) ? ports.dest(slot) : TOPIC_NOT_FOUND;                     // Right track of a split destination too
+  }
 
-      size_t n = serializeJson(doc, reportData);                                                // Create a json body
-      uint8_t check = mqttClient.publish(receiver, reportData, NORETAIN);                       // Publish an inventory response
+  if (msg.sender != TOPIC_NOT_FOUND) {
+    uint8_t len = (levelLen[TOPIC_PORT_ID] > DB_DEST_LEN) ? DB_DEST_LEN : levelLen[TOPIC_PORT_ID];
+    strncpy(msg.senderPort, level[TOPIC_PORT_ID], len);
+    msg.senderPort[len] = '\0';
+  }
 
-#ifdef DEBUG
-      if (check == 1) {
-        Serial.printf("%-16s: %d Publish: %s with body size: %d (%d to max size)\n", __func__, __LINE__, receiver, n, maxSize - n);
+  switch (order) {
+    case _REQUEST:
+      if (strcmp(msg.desired, ACCEPT) == 0)       { msg.orderCode = CODE_ACCEPT; }
+      else if (strcmp(msg.desired, IN) == 0)      { msg.orderCode = CODE_TRAFDIR_REQ_IN; }
+      else                                        { msg.orderCode = CODE_CANCEL; }
+      break;
+//----------------------------------------------------------------------------------------------
+    case _RESPONSE:
+      if (strcmp(reported, RECEIVED) == 0) {
+        msg.orderCode = CODE_RECEIVED;
+      }
+      else if (msg.hasTrain) {
+        msg.orderCode = (strcmp(reported, ACCEPTED) == 0) ? CODE_ACCEPTED : CODE_REJECTED;
       }
-
       else {
-        Serial.printf("%-16s: %d Publish %s failed with code: %d\n", __func__, __LINE__, receiver, check);
+        msg.orderCode = (strcmp(reported, IN) == 0) ? CODE_TRAFDIR_RES_IN : CODE_TRAFDIR_RES_OUT;
       }
-#endif
-    }
-
-    else {
-#ifdef DEBUG
-      Serial.printf("%-16s: %d Not to me, sent to: %s\n", __func__, __LINE__, String(doc[TAM][NODE_ID]));
-#endif
-    }
+      break;
+//----------------------------------------------------------------------------------------------
+    case _DATA:
+      msg.orderCode = (strcmp(reported, IN) == 0) ? CODE_TRAIN_IN : CODE_TRAIN_OUT;
+      break;
   }
 
-  else if (String(doc[NODE][VERSION]) == LCP_BODY_VER) {                                        // Type is Node
-    if (order == _REQUEST) {
-      if (String(doc[TAM][NODE_ID]) == (tamBoxConfig[OWN][ID] + "-" + NODE_SUPERVISOR)) {
+  return true;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Answer a tower inventory request, the whole body is parsed since it is sent back
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void towerInventory(char* body) {
+
+  char receiver[LCP_TOPIC_LEN + 1];
+  JsonDocument doc;                                                                             // Create a json object
+  deserializeJson(doc, body);                                                                   // Read the json body
+
+  if (String(doc[TOWER][VERSION]) == LCP_BODY_VER &&
+      String(doc[TOWER][PORT_ID]) == INVENTORY) {                                               // Type is Tower inventory
 #ifdef DEBUG
-        Serial.printf("%-16s: %d Node object received\n", __func__, __LINE__);
+    Serial.printf("%-16s: %d Inventory object received\n", __func__, __LINE__);
 #endif
-        if (String(doc[NODE][STATE][DESIRED]) == LCP_BODY_REBOOT) {                             // Reboot the tambox
-          needReset = true;
-        }
+    JsonObject tower = doc[TOWER];
+    char reportData[254];                                                                       // json body
+
+    tower[TIMESTAMP]                  = epochTime + halMillis() / 1000;
+    tower[STATE][REPORTED]            = tower[STATE][DESIRED];
+    tower[NODE_ID]                    = tamBoxConfig[OWN].id;
+    strlcpy(receiver, tower[RESPOND_TO] | "", sizeof(receiver));
+    tower.remove(RESPOND_TO);                                                                   // Remove respond-to taggen
 
-        else if (String(doc[NODE][STATE][DESIRED]) == LCP_BODY_SHUTDOWN) {                      // Shutdown the tambox
+    serializeJson(doc, reportData);                                                             // Create a json body
+
+    if (!mqttPublish(receiver, reportData, NORETAIN)) {                                         // Publish an inventory response
 #ifdef DEBUG
-          Serial.printf("%-16s: %d Shuttingdown after 5 seconds.\n", __func__, __LINE__);
+      Serial.printf("%-16s: %d Publish %s failed\n", __func__, __LINE__, receiver);
 #endif
-          lcd.clear();
-          lcd.home();
-          lcd.print(LCD_SHUTTINGDOWN);
-          delay(5000);
-          ESP.deepSleep(0);
-        }
-      }
+      return;
+    }
 
-      else {
 #ifdef DEBUG
-        Serial.printf("%-16s: %d Not to me, sent to: %s\n", __func__, __LINE__, String(doc[TAM][NODE_ID]));
+    size_t n = strlen(reportData);
+    Serial.printf("%-16s: %d Publish: %s with body size: %d (%d to max size)\n", __func__, __LINE__, receiver, n, sizeof(reportData) - n);
 #endif
-      }
-    }
   }
 }
 
@@ -3490,18 +4419,12 @@ void sendPing() {
  */
 void mqttJson(char* action, char* bodyType) {
 
-//  const size_t capacity = JSON_OBJECT_SIZE(5) + JSON_ARRAY_SIZE(6) + 60;
-  StaticJsonDocument<255> doc;                                                                  // Create a json object
-  uint8_t maxSize = 255;
-  char body[254];
-  char receiver[32];
-
-  if (action == "send" && bodyType == PING) {
-  // Topic: dt/h0/ping/tambox-1
-  strcpy(receiver, DATA); strcat(receiver, "/");
-  strcat(receiver, tamBoxMqtt[SCALE].c_str()); strcat(receiver, "/");
-  strcat(receiver, PING); strcat(receiver, "/");
-  strcat(receiver, tamBoxConfig[OWN][ID].c_str());
+  JsonDocument doc;                                                                             // Create a json object
+  char body[MQTT_BUFFER_SIZE];
+  const char* receiver = pingTopic;                                                             // Topic: dt/h0/ping/tambox-1
+  size_t maxSize = MQTT_BUFFER_SIZE - MQTT_PUB_HEADER - strlen(receiver);                       // Largest body PubSubClient can send
+
+  if (strcmp(action, "send") == 0 && strcmp(bodyType, PING) == 0) {
 /*
   {
     "ping": {
@@ -3517,27 +4440,60 @@ void mqttJson(char* action, char* bodyType) {
     }
   }
 */
-    doc[PING][NODE_ID]          = tamBoxConfig[OWN][ID];
+    doc[PING][NODE_ID]          = tamBoxConfig[OWN].id;
     doc[PING][STATE][REPORTED]  = PING;
     doc[PING][VERSION]          = LCP_BODY_VER;
-    doc[PING][TIMESTAMP]        = epochTime + pingTime / 1000;
+    doc[PING][TIMESTAMP]        = epochTime + halMillis() / 1000;
     doc[PING][METADATA][M_TYPE] = SW_TYPE;
     doc[PING][METADATA][M_VER]  = SW_VERSION;
-    doc[PING][METADATA][M_NAME] = tamBoxConfig[OWN][NAME];
-    doc[PING][METADATA][M_SIGN] = tamBoxConfig[OWN][SIGN];
+    doc[PING][METADATA][M_NAME] = tamBoxConfig[OWN].name;
+    doc[PING][METADATA][M_SIGN] = tamBoxConfig[OWN].sign;
     doc[PING][METADATA][M_RSSI] = String(WiFi.RSSI()) + " dBm";
+    doc[PING][METADATA][M_RECONNECTS]   = mqttReconnects;
+    doc[PING][METADATA][M_RECONNECT_MS] = mqttReconnectTime;
+    doc[PING][METADATA][M_QUEUE_HIGH]   = dtQueueHigh;
+    doc[PING][METADATA][M_QUEUE_DROPS]  = dtQueueDrops;
+    doc[PING][METADATA][M_COLD_START]   = coldStartTime;
+    doc[PING][METADATA][M_CONFIG]       = configFromCache ? M_CONFIG_CACHE : M_CONFIG_SERVER;
+    doc[PING][METADATA][M_RESYNC_MS]    = resyncTime;
+
+    JsonArray pub = doc[PING][METADATA][M_PUB].to<JsonArray>();
+    for (uint8_t dest = 0; dest < DEST_BUTTONS; dest++) {
+      JsonArray stat = pub.add<JsonArray>();
+      stat.add(pubStat[dest].sent);
+      stat.add(pubStat[dest].retries);
+      stat.add(pubStat[dest].failures);
+      stat.add(pubStat[dest].latency);
+    }
+
+    JsonArray perf = doc[PING][METADATA][M_PERF].to<JsonArray>();                               // Peaks since the last ping
+    for (uint8_t m = 0; m < METRICS; m++) {
+      perf.add(metric[m].peak);
+      metric[m].peak = 0;
+    }
+    perf.add(heapLow);
+    perf.add(ESP.getHeapFragmentation());
 
-    size_t n = serializeJson(doc, body);                                                        // Create a json body
-    uint8_t check = mqttClient.publish(receiver, body, NORETAIN);                               // Publish a ping message
+    size_t n = measureJson(doc);
 
+    if (n >= maxSize) {                                                                         // Would be cut or refused by PubSubClient
 #ifdef DEBUG
-    if (check == 1) {
-      Serial.printf("%-16s: %d Publish: %s with body size: %d (%d to max size)\n", __func__, __LINE__, receiver, n, maxSize - n);
+      Serial.printf("%-16s: %d Ping body size: %d, max size: %d, not sent\n", __func__, __LINE__, n, maxSize);
+#endif
+      return;
     }
 
-    else {
-      Serial.printf("%-16s: %d Publish %s failed with code: %d\n", __func__, __LINE__, receiver, check);
+    serializeJson(doc, body, sizeof(body));                                                     // Create a json body
+
+    if (!mqttPublish(receiver, body, NORETAIN)) {                                               // Publish a ping message
+#ifdef DEBUG
+      Serial.printf("%-16s: %d Publish %s failed\n", __func__, __LINE__, receiver);
+#endif
+      return;
     }
+
+#ifdef DEBUG
+    Serial.printf("%-16s: %d Publish: %s with body size: %d (%d to max size)\n", __func__, __LINE__, receiver, n, maxSize - n);
 #endif
   }
 }
@@ -3566,24 +4522,330 @@ String addBlanks(uint8_t blanks) {
 
 
 /* ------------------------------------------------------------------------------------------------------------------------------
- *  Function to beep a buzzer
+ *  Hardware abstraction
+ *  All MQTT traffic and key input passes through these functions, so the TAM state machine
+ *  never talks to PubSubClient or Keypad_I2C directly
  * ------------------------------------------------------------------------------------------------------------------------------
  */
-void beep(unsigned char duration, unsigned int freq) {
+bool mqttPublish(const char* topic, const char* body, bool retain) {
 
-  tone(buzzerPin, freq, duration);
+  bool sent = mqttClient.publish(topic, body, retain);
+#ifdef RECORDER
+  uint16_t bodyLen = (topic == pingTopic) ? 0 : strlen(body);                                   // Pings would fill the log
+  recordEvent(sent ? RECORD_OUT : RECORD_OUT_FAILED, topic, body, bodyLen);
+#endif
+  return sent;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Publish a tam message to a destination
+ *
+ *  The body is serialized into pubBody. A message that can't be published is queued and retried
+ *  until it is published. A PUB_AWAIT message, a request, is also queued when published and sent
+ *  again with the same session-id until the response, or RECEIVED from the destination, see
+ *  respondRequest, is received. Both give up after tamTimeOut, when the destination rejects anyway.
+ *
+ *  publishTam(dest, topic, doc, {PUB_ONCE, PUB_AWAIT})
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+bool publishTam(uint8_t dest, const char* topic, JsonDocument& doc, uint8_t kind) {
+
+  serializeJson(doc, pubBody, sizeof(pubBody));                                                 // Create a json body
+  bool sent = mqttClient.connected() && mqttPublish(topic, pubBody, NORETAIN);
+
+#ifdef DEBUG
+  if (sent) {
+    size_t n = strlen(pubBody);
+    Serial.printf("%-16s: %d Publish with body size: %d (%d to max size)\n", __func__, __LINE__, n, PUB_BODY_LEN - n);
+    Serial.printf("%-16s: %d Publish: %s - %s\n", __func__, __LINE__, topic, pubBody);
+  }
+
+  else {
+    Serial.printf("%-16s: %d Publish %s failed, queued for retry\n", __func__, __LINE__, topic);
+  }
+#endif
+  if (sent) {
+    metricEnd(METRIC_KEY_PUB);                                                                  // Started by loop on a key press
+    pubStat[dest].sent++;
+  }
+
+  if (!sent || kind == PUB_AWAIT) {
+    pubQueuePush(dest, topic, pubBody, doc[TAM][SESSION_ID] | "", kind);
+  }
+
+  return sent;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Queue a message for publishTam
+ *
+ *  There is one request per destination, see tamBoxPort, so a new request replaces a queued one.
+ *  Returns false when the queue is full, the message is then counted as failed.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+bool pubQueuePush(uint8_t dest, const char* topic, const char* body, const char* sessionId, uint8_t kind) {
+
+  uint8_t slot = PUB_QUEUE_DEPTH;
+  unsigned long now = halMillis();
+
+  for (uint8_t i = 0; i < PUB_QUEUE_DEPTH; i++) {
+    if (pubQueue[i].active && kind == PUB_AWAIT && pubQueue[i].dest == dest && pubQueue[i].kind == PUB_AWAIT) {
+      pubQueue[i].active = false;                                                               // Replaced by the new request
+    }
+
+    if (!pubQueue[i].active && slot == PUB_QUEUE_DEPTH) {
+      slot = i;
+    }
+  }
+
+  if (slot == PUB_QUEUE_DEPTH) {                                                                // Queue is full
+    pubStat[dest].failures++;
+#ifdef DEBUG
+    Serial.printf("%-16s: %d Publish queue full, message to %s dropped\n", __func__, __LINE__, topic);
+#endif
+    return false;
+  }
+
+  pubMessage& msg = pubQueue[slot];
+  msg.firstTry    = now;
+  msg.nextTry     = now + TIME_PUB_RETRY;
+  msg.dest        = dest;
+  msg.kind        = kind;
+  msg.active      = true;
+  strlcpy(msg.topic, topic, sizeof(msg.topic));
+  strlcpy(msg.sessionId, sessionId, sizeof(msg.sessionId));
+  strlcpy(msg.body, body, sizeof(msg.body));
+
+  setTimer(TIMER_PUB, OWN, LEFT_TRACK, TIME_PUB_RETRY);
+  return true;
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  The response to a request, or RECEIVED, is received, stop retrying it and save the time from the
+ *  last try. An operator slower than TIME_PUB_RETRY is answered by RECEIVED to the next try, so it
+ *  is not counted.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void pubResponded(uint8_t dest, const char* sessionId) {
+
+  for (uint8_t i = 0; i < PUB_QUEUE_DEPTH; i++) {
+    if (pubQueue[i].active && pubQueue[i].kind == PUB_AWAIT && pubQueue[i].dest == dest && strcmp(pubQueue[i].sessionId, sessionId) == 0) {
+      pubQueue[i].active    = false;
+      pubStat[dest].latency = halMillis() - (pubQueue[i].nextTry - TIME_PUB_RETRY);             // From the last try
+#ifdef DEBUG
+      Serial.printf("%-16s: %d Response from %s after %lu ms\n", __func__, __LINE__, destIDTxt[dest], pubStat[dest].latency);
+#endif
+    }
+  }
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Publish the queued messages that are due again, drop the ones past the deadline
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void pubRetry() {
+
+  unsigned long now = halMillis();
+  bool waiting = false;
+
+  for (uint8_t i = 0; i < PUB_QUEUE_DEPTH; i++) {
+    pubMessage& msg = pubQueue[i];
+
+    if (!msg.active) {
+      continue;
+    }
+
+    if (now - msg.firstTry > tamTimeOut) {                                                      // Give up
+      msg.active = false;
+      pubStat[msg.dest].failures++;
+#ifdef DEBUG
+      Serial.printf("%-16s: %d Message to %s failed after %lu ms\n", __func__, __LINE__, msg.topic, tamTimeOut);
+#endif
+      continue;
+    }
+
+    if ((long)(now - msg.nextTry) >= 0 && mqttClient.connected()) {
+      pubStat[msg.dest].retries++;
+      msg.nextTry = now + TIME_PUB_RETRY;
+
+      if (mqttPublish(msg.topic, msg.body, NORETAIN)) {
+        pubStat[msg.dest].sent++;
+#ifdef DEBUG
+        Serial.printf("%-16s: %d Publish again: %s - %s\n", __func__, __LINE__, msg.topic, msg.body);
+#endif
+        if (msg.kind == PUB_ONCE) {
+          msg.active = false;                                                                   // Published, no response expected
+          continue;
+        }
+      }
+    }
+
+    waiting = true;
+  }
+
+  if (waiting) {
+    setTimer(TIMER_PUB, OWN, LEFT_TRACK, TIME_PUB_RETRY);
+  }
+}
+
+
+bool mqttSubscribe(const char* topic) {
+
+  return mqttClient.subscribe(topic);
+}
+
+
+char readKey() {
+
+  char key = Keypad.getKey();
+#ifdef RECORDER
+  if (key) {
+    recordEvent(RECORD_KEY, "", &key, 1);
+  }
+#endif
+  return key;
+}
+
+
+#ifdef RECORDER
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Traffic recorder
+ *  Every received and published MQTT message and every key press is appended to the current segment,
+ *  see RECORD_SEGMENTS. A restart continues with the next segment, so the log from before the
+ *  restart is kept.
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void recordBegin() {
+
+  uint16_t seq = 0;
+
+  for (uint8_t i = 0; i < RECORD_SEGMENTS; i++) {                                               // Find the newest segment
+    recordSegmentHeader head;
+    File file = LittleFS.open(recordPath[i], "r");
+
+    if (file) {
+      if (file.read((uint8_t*)&head, sizeof(head)) == sizeof(head) && head.magic == RECORD_MAGIC && head.seq >= seq) {
+        seq = head.seq + 1;
+      }
+      file.close();
+    }
+  }
+
+  memset(recordStates, 0xff, sizeof(recordStates));                                             // The first pass records the states
+  recordOpen(seq);
+}
+
+
+void recordOpen(uint16_t seq) {
+
+  recordSegmentHeader head = {RECORD_MAGIC, RECORD_VER, seq, (uint32_t)(epochTime ? epochTime + halMillis() / 1000 : 0), (uint32_t)halMillis()};
+
+  recordSeq   = seq;
+  recordSize  = 0;
+  recordFile  = LittleFS.open(recordPath[seq % RECORD_SEGMENTS], "w");                          // Overwrites the oldest segment
+
+  if (recordFile) {
+    recordSize = recordFile.write((const uint8_t*)&head, sizeof(head));
+  }
+#ifdef DEBUG
+  Serial.printf("%-16s: %d Recording to %s, segment %d\n", __func__, __LINE__, recordPath[seq % RECORD_SEGMENTS], seq);
+#endif
+}
+
+
+void recordEvent(uint8_t type, const char* topic, const char* body, uint16_t bodyLen) {
+
+  if (!recordFile) {
+    return;
+  }
+
+  size_t topicLen   = strlen(topic);
+  recordHeader head = {(uint32_t)halMillis(), type, (uint8_t)min(topicLen, (size_t)255), bodyLen};
+
+  if (recordSize + sizeof(head) + head.topicLen + bodyLen > RECORD_SEGMENT_SIZE) {              // Segment full
+    recordFile.close();
+    recordOpen(recordSeq + 1);
+    if (!recordFile) {
+      return;
+    }
+  }
+
+  recordSize += recordFile.write((const uint8_t*)&head, sizeof(head));
+  recordSize += recordFile.write((const uint8_t*)topic, head.topicLen);
+  recordSize += recordFile.write((const uint8_t*)body, bodyLen);
+
+  if (halMillis() - recordFlushTime >= TIME_RECORD_FLUSH) {
+    recordFile.flush();
+    recordFlushTime = halMillis();
+  }
 }
 
 
 /* ------------------------------------------------------------------------------------------------------------------------------
- *  Function to print special characters on LCD
+ *  Record the state of every track when one has changed, so a replay can be checked against it
  * ------------------------------------------------------------------------------------------------------------------------------
  */
-void printSpecialChar(uint8_t character) {
+void recordTrackStates() {
 
-   if (character < 8) {
-      lcd.write(character);
-   }
+  uint8_t states[DEST_BUTTONS * MAX_NUM_OF_TRACKS];
+
+  for (uint8_t dest = 0; dest < DEST_BUTTONS; dest++) {
+    for (uint8_t track = 0; track < MAX_NUM_OF_TRACKS; track++) {
+      states[dest * MAX_NUM_OF_TRACKS + track] = ports.at(dest, track).state;
+    }
+  }
+
+  if (memcmp(states, recordStates, sizeof(states)) != 0) {
+    memcpy(recordStates, states, sizeof(states));
+    recordEvent(RECORD_STATE, "", (const char*)states, sizeof(states));
+  }
+}
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Function to send the recorder log, oldest segment first
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void handleRecord() {
+
+  uint8_t buf[RECORD_STREAM_LEN];
+
+  if (recordFile) {
+    recordFile.flush();
+  }
+
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/octet-stream", "");
+
+  for (uint8_t i = 1; i <= RECORD_SEGMENTS; i++) {
+    File file = LittleFS.open(recordPath[(recordSeq + i) % RECORD_SEGMENTS], "r");
+    if (!file) {
+      continue;
+    }
+
+    size_t n;
+    while ((n = file.read(buf, sizeof(buf))) > 0) {
+      server.sendContent((const char*)buf, n);
+    }
+    file.close();
+  }
+
+  server.sendContent("");                                                                       // End of the chunked page
+}
+#endif
+
+
+/* ------------------------------------------------------------------------------------------------------------------------------
+ *  Function to beep a buzzer
+ * ------------------------------------------------------------------------------------------------------------------------------
+ */
+void beep(unsigned int duration, unsigned int freq) {
+
+  tone(buzzerPin, freq, duration);
 }
 
 
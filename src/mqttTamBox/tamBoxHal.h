@@ -0,0 +1,267 @@
+/**
+  * Hardware abstraction for the clock, the broker, the keypad, the LCD and the config server.
+  *
+  * The sketch only reaches them through the hal types and functions below. On the ESP8266 they are
+  * the libraries themselves and cost nothing. With TAMBOX_HOST they forward to a tamBoxHalOps table
+  * that the host fills in before setup(), see host/tamBoxModule.cpp, so the tam state machine can
+  * run on Linux against a simulated clock, broker, operator and config server.
+  */
+#ifndef TAMBOX_HAL_H
+#define TAMBOX_HAL_H
+
+#ifndef TAMBOX_HOST
+#include <ESP8266HTTPClient.h>                                // Library to handle HTTP download of config file
+#include <PubSubClient.h>                                     // Library to handle MQTT communication
+#include <Keypad_I2C.h>                                       // Library to handle i2c keypad
+#include <LiquidCrystal_PCF8574.h>                            // Library to handle i2c LCD
+
+typedef PubSubClient halMqtt;
+typedef LiquidCrystal_PCF8574 halLcd;
+typedef Keypad_I2C halKeypad;
+typedef HTTPClient halHttp;
+
+inline unsigned long halMillis() { return millis(); }
+inline unsigned long halMicros() { return micros(); }
+inline void halDelay(unsigned long ms) { delay(ms); }
+inline bool halResolve(const char* host, IPAddress& ip, unsigned long timeout) { return WiFi.hostByName(host, ip, timeout) == 1; }
+
+#else
+#include <ESP8266WiFi.h>
+
+//-----------------------------------------------------------------------------------------------------------------------------------------------------
+/**
+ * Host build, the calls go to the tamBoxHalOps table set by tamBoxAttach
+ */
+#define HTTP_CODE_OK                                200
+#define HTTP_CODE_NOT_MODIFIED                      304
+#define HAL_MQTT_HEADER                               5       // Largest MQTT fixed header, MQTT_MAX_HEADER_SIZE in PubSubClient
+#define HAL_MQTT_CONNECTION_TIMEOUT                  -4       // PubSubClient state values
+#define HAL_MQTT_CONNECT_FAILED                      -2
+#define HAL_MQTT_DISCONNECTED                        -1
+#define HAL_MQTT_CONNECTED                            0
+
+struct halHttpResult {                                        // Answer to tamBoxHalOps::httpGet, valid until the next call
+  int code;                                                   // HTTP status, or < 0 if the server didn't answer
+  const char* body;
+  size_t bodyLen;
+  const char* etag;                                           // ETag header or ""
+  const char* date;                                           // Date header or ""
+};
+
+struct tamBoxHalOps {                                         // Filled in by the host, ctx is passed back in every call
+  void* ctx;
+  const char* thingName;                                      // IotWebConf thing name, the node id
+  const char* fsRoot;                                         // Directory that holds the LittleFS files
+  const char* (*param)(void* ctx, const char* id);            // IotWebConf parameter value, nullptr keeps the default
+
+  // Clock, delay advances it
+  unsigned long (*millis)(void* ctx);
+  unsigned long (*micros)(void* ctx);
+  void (*delay)(void* ctx, unsigned long ms);
+
+  // Broker name lookup, blocks for up to timeout ms when the name can't be resolved
+  bool (*resolve)(void* ctx, const char* host, uint8_t ip[4], unsigned long timeout);
+
+  // Broker, connect blocks for up to timeout ms when the broker can't be reached
+  bool (*mqttConnect)(void* ctx, const char* host, uint16_t port, const char* id, const char* user, const char* pass,
+                      const char* willTopic, bool willRetain, const char* willMsg, unsigned long timeout);
+  bool (*mqttConnected)(void* ctx);
+  int (*mqttState)(void* ctx);
+  bool (*mqttPublish)(void* ctx, const char* topic, const char* payload, size_t len, bool retain);
+  bool (*mqttSubscribe)(void* ctx, const char* topic);
+  bool (*mqttPoll)(void* ctx, const char** topic, const char** payload, size_t* len);  // Next due message, if any
+
+  // Keypad, 0 when no key is pressed
+  char (*getKey)(void* ctx);
+
+  // LCD, cursor, blink, backlight and custom characters are not modelled
+  void (*lcdBegin)(void* ctx, uint8_t cols, uint8_t rows);
+  void (*lcdClear)(void* ctx);
+  void (*lcdSetCursor)(void* ctx, uint8_t col, uint8_t row);
+  void (*lcdWrite)(void* ctx, uint8_t c);
+
+  // Config server, blocks for up to timeout ms
+  void (*httpGet)(void* ctx, const char* url, const char* ifNoneMatch, unsigned long timeout, halHttpResult* res);
+};
+
+extern const tamBoxHalOps* halOps;
+
+inline unsigned long halMillis() { return halOps->millis(halOps->ctx); }
+inline unsigned long halMicros() { return halOps->micros(halOps->ctx); }
+inline void halDelay(unsigned long ms) { halOps->delay(halOps->ctx, ms); }
+
+inline bool halResolve(const char* host, IPAddress& ip, unsigned long timeout) {
+  uint8_t addr[4];
+  if (!halOps->resolve(halOps->ctx, host, addr, timeout)) { return false; }
+  ip = IPAddress(addr[0], addr[1], addr[2], addr[3]);
+  return true;
+}
+
+
+/**
+ * Same calls as PubSubClient, incoming messages are copied into the buffer like PubSubClient::loop does
+ */
+class halMqtt {
+ public:
+  typedef void (*callbackType)(char*, uint8_t*, unsigned int);
+
+  halMqtt(WiFiClient& client) : client(client) {}
+  ~halMqtt() { free(buffer); }
+
+  halMqtt& setServer(const char* domain, uint16_t port) { this->domain = domain; this->port = port; return *this; }
+  halMqtt& setServer(IPAddress ip, uint16_t port) { this->ip = ip.toString(); domain = nullptr; this->port = port; return *this; }
+  halMqtt& setCallback(callbackType callback) { this->callback = callback; return *this; }
+  halMqtt& setSocketTimeout(uint16_t timeout) { socketTimeout = timeout; return *this; }
+
+  bool setBufferSize(uint16_t size) {
+    uint8_t* newBuffer = (uint8_t*)realloc(buffer, size + 1);
+    if (newBuffer == nullptr) { return false; }
+    buffer = newBuffer;
+    bufferSize = size;
+    return true;
+  }
+
+  uint16_t getBufferSize() { return bufferSize; }
+
+  bool connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, bool willRetain,
+               const char* willMessage) {
+    (void)willQos;
+    return halOps->mqttConnect(halOps->ctx, domain ? domain : ip.c_str(), port, id, user, pass, willTopic, willRetain, willMessage,
+                               client.getTimeout());                                            // TCP connect, CONNACK is not modelled
+  }
+
+  bool connected() { return halOps->mqttConnected(halOps->ctx); }
+  int state() { return halOps->mqttState(halOps->ctx); }
+
+  bool publish(const char* topic, const char* payload, bool retain) {
+    size_t len = strlen(payload);
+    if (!connected() || HAL_MQTT_HEADER + 2 + strlen(topic) + len > bufferSize) { return false; }
+    return halOps->mqttPublish(halOps->ctx, topic, payload, len, retain);
+  }
+
+  bool subscribe(const char* topic) {
+    if (!connected() || HAL_MQTT_HEADER + 2 + 2 + strlen(topic) + 1 > bufferSize) { return false; }
+    return halOps->mqttSubscribe(halOps->ctx, topic);
+  }
+
+  bool loop() {
+    const char* topic;
+    const char* payload;
+    size_t len;
+
+    if (!connected()) { return false; }
+    if (halOps->mqttPoll(halOps->ctx, &topic, &payload, &len)) {
+      size_t topicLen = strlen(topic);
+      if (HAL_MQTT_HEADER + 2 + topicLen + len <= bufferSize && callback) {                   // Too long messages are dropped
+        memcpy(buffer, topic, topicLen + 1);
+        memcpy(buffer + topicLen + 1, payload, len);
+        callback((char*)buffer, buffer + topicLen + 1, len);
+      }
+    }
+    return true;
+  }
+
+ private:
+  WiFiClient& client;
+  const char* domain = nullptr;
+  String ip;                                                  // Used when domain is nullptr
+  uint16_t port = 0;
+  uint16_t socketTimeout = 15;
+  callbackType callback = nullptr;
+  uint8_t* buffer = nullptr;
+  uint16_t bufferSize = 0;
+};
+
+
+/**
+ * Same calls as LiquidCrystal_PCF8574, print comes from Print
+ */
+class halLcd : public Print {
+ public:
+  halLcd(uint8_t addr) { (void)addr; }
+
+  void begin(int cols, int rows) { halOps->lcdBegin(halOps->ctx, cols, rows); }
+  void clear() { halOps->lcdClear(halOps->ctx); }
+  void home() { halOps->lcdSetCursor(halOps->ctx, 0, 0); }
+  void setCursor(int col, int row) { halOps->lcdSetCursor(halOps->ctx, col, row); }
+  size_t write(uint8_t c) override { halOps->lcdWrite(halOps->ctx, c); return 1; }
+  using Print::write;
+  void setBacklight(int brightness) { (void)brightness; }
+  void createChar(int location, byte charmap[]) { (void)location; (void)charmap; }
+  void cursor() {}
+  void noCursor() {}
+  void blink() {}
+  void noBlink() {}
+  void noAutoscroll() {}
+};
+
+
+/**
+ * Same calls as Keypad_I2C
+ */
+#define makeKeymap(x) ((char*)x)
+
+class halKeypad {
+ public:
+  halKeypad(char* keymap, byte* rows, byte* cols, byte numRows, byte numCols, int addr) {}
+
+  void begin() {}
+  char getKey() { return halOps->getKey(halOps->ctx); }
+};
+
+
+/**
+ * Same calls as ESP8266HTTPClient for a GET with If-None-Match
+ */
+class halHttp {
+ public:
+  void useHTTP10(bool http10) { (void)http10; }
+  void setTimeout(uint16_t timeout) { this->timeout = timeout; }
+  void collectHeaders(const char* names[], size_t count) {
+    collected = "";
+    for (size_t i = 0; i < count; i++) { collected += String(names[i]) + "\n"; }
+  }
+
+  bool begin(WiFiClient& client, const char* url) {
+    (void)client;
+    this->url = url;
+    ifNoneMatch = "";
+    return true;
+  }
+
+  void addHeader(const String& name, const String& value) {
+    if (name == "If-None-Match") { ifNoneMatch = value; }
+  }
+
+  int GET() {
+    halHttpResult res = {-1, "", 0, "", ""};
+
+    halOps->httpGet(halOps->ctx, url.c_str(), ifNoneMatch.c_str(), timeout, &res);
+    stream.set(res.body, res.bodyLen);
+    etag = res.etag;
+    date = res.date;
+    return res.code;
+  }
+
+  Stream& getStream() { return stream; }
+
+  String header(const char* name) {                                                             // Only collected headers are kept
+    if (collected.indexOf(String(name) + "\n") < 0) { return String(); }
+    if (strcmp(name, "ETag") == 0) { return etag; }
+    if (strcmp(name, "Date") == 0) { return date; }
+    return String();
+  }
+
+  void end() { stream.set("", 0); }
+
+ private:
+  String url;
+  String ifNoneMatch;
+  String etag;
+  String date;
+  String collected;
+  unsigned long timeout = 5000;
+  StringStream stream;
+};
+#endif
+#endif